@@ -6,6 +6,7 @@
  * and comprehensive security protections against command injection and path traversal attacks
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,535 +17,8392 @@
 #include <errno.h>
 #include <libgen.h>
 #include <limits.h>
-#include <sys/wait.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "libtrimorph.h"
 
 // Define maximum path length
 #define MAX_PATH 1024
 
-// Execute command safely by parsing and using execve to avoid shell injection
-int execute_command(const char* cmd) {
-    printf("Executing: %s\n", cmd);
-    
-    // Create a safe copy of the command
-    char cmd_copy[MAX_PATH];
-    strncpy(cmd_copy, cmd, sizeof(cmd_copy) - 1);
-    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
-    
-    // For safety, we'll use fork/exec approach instead of system() to prevent shell injection
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process: execute command with shell
-        // Using bash with --noprofile --norc for consistency, but with safer approach
-        execl("/bin/bash", "bash", "--noprofile", "--norc", "-c", cmd_copy, NULL);
-        // If execl returns, it failed
-        perror("execl failed");
-        exit(127); // Standard exit code for command not found/exec error
-    } else if (pid > 0) {
-        // Parent process - wait for child
-        int status;
-        waitpid(pid, &status, 0);
-        
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
-        } else {
-            return -1; // Process terminated abnormally
-        }
-    } else {
-        perror("fork failed");
-        return -1;
-    }
+// Maximum number of --root directories accepted in one invocation
+#define MAX_ROOTS 256
+
+// Root directory the package managers act on (--root), NULL for the host system
+static const char* target_root = NULL;
+
+// Number of roots or worker threads run in parallel (--jobs), 0 for one per CPU
+static long parallel_jobs = 0;
+
+// Plan install and run operations without executing them (--dry-run)
+static int dry_run = 0;
+
+// Check whether a root has been selected that is not the host root
+static int has_target_root() {
+    return target_root != NULL && strcmp(target_root, "/") != 0;
 }
 
-// Package format definition structure
+// Prometheus textfile the metrics are merged into (--metrics-file or
+// TRIMORPH_METRICS_FILE), NULL when metrics are disabled
+static const char* metrics_file = NULL;
+
+// Metric families written to the textfile
 typedef struct {
-    const char* ext;
-    const char* install_cmd;
-    const char* verify_cmd;
-    const char* update_cmd;      // For auto dependency updates
-    const char* check_conflicts_cmd; // For conflict checking
-    int (*install_func)(const char* file);
-} pkg_format_t;
-
-// Forward declarations for install functions
-int install_deb(const char* file);
-int install_arch(const char* file);
-int install_rpm(const char* file);
-int install_apk(const char* file);
-int install_gentoo(const char* file);
-
-// Supported package formats with their handlers
-static pkg_format_t pkg_formats[] = {
-    {".deb", "dpkg -i '%s'", "dpkg --version", "apt update", "apt-get check", install_deb},
-    {".pkg.tar.zst", "pacman -U --noconfirm '%s'", "pacman --version", "pacman -Sy", "pacman -Q", install_arch},
-    {".pkg.tar.xz", "pacman -U --noconfirm '%s'", "pacman --version", "pacman -Sy", "pacman -Q", install_arch},
-    {".pkg.tar.gz", "pacman -U --noconfirm '%s'", "pacman --version", "pacman -Sy", "pacman -Q", install_arch},
-    {".rpm", "rpm -i '%s'", "rpm --version", "dnf check-update || yum check-update || true", "rpm -Va", install_rpm},
-    {".apk", "apk add '%s'", "apk --version", "apk update", "apk verify", install_apk},
-    {".tbz", "emerge '%s'", "emerge --version", "emerge --sync", "equery list '*'", install_gentoo},
-    {NULL, NULL, NULL, NULL, NULL, NULL}  // Sentinel
+    const char* name;
+    const char* type;
+    const char* help;
+} metric_def_t;
+
+static const metric_def_t metric_defs[] = {
+    {"trimorph_operations_total", "counter", "Operations run, by subcommand and package format"},
+    {"trimorph_installs_total", "counter", "Package installs, by format, result and exit code"},
+    {"trimorph_conflict_wait_seconds", "histogram", "Time spent checking for running package managers"},
+    {"trimorph_refresh_seconds", "histogram", "Time spent refreshing package lists before installs"},
+    {"trimorph_pkgmgr_runtime_seconds", "histogram", "Runtime of package manager commands, by manager"},
+    {"trimorph_refresh_skipped_total", "counter", "Package list refreshes skipped, by reason"},
+    {NULL, NULL, NULL}  // Sentinel
 };
 
-// Command availability checker that handles both command names and full paths
-int is_cmd_available(const char* cmd) {
-    // Validate the command name to prevent command injection
-    // Only allow alphanumeric characters, hyphens, underscores, and dots
-    const char* valid_cmd_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./";
-    for (const char* p = cmd; *p != '\0'; p++) {
-        if (strchr(valid_cmd_chars, *p) == NULL) {
-            return 0; // Invalid character found
-        }
-    }
-    
-    // Check if this is a full path (contains '/')
-    if (strchr(cmd, '/') != NULL) {
-        // This is a full path, check if the file exists and is executable
-        return access(cmd, X_OK) == 0;
-    } else {
-        // This is just a command name, use command -v
-        char check[256];
-        snprintf(check, sizeof(check), "command -v %s >/dev/null 2>&1", cmd);
-        return system(check) == 0;
-    }
+// Histogram bucket bounds in seconds
+static const double metric_buckets[] = {0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 900};
+#define METRIC_BUCKET_COUNT (sizeof(metric_buckets) / sizeof(metric_buckets[0]))
+
+// One series ("name{labels}") with the amount this process adds to it
+typedef struct {
+    char key[256];
+    double value;
+} metric_series_t;
+
+static metric_series_t* metric_deltas = NULL;
+static size_t metric_delta_count = 0;
+
+// Monotonic clock in seconds, for timing operations
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Check if any other package manager is currently running to prevent conflicts
-int is_package_manager_running() {
-    // Check if any of the common package managers are running
-    const char* pm_commands[] = {
-        "pgrep -x apt", "pgrep -x aptitude", "pgrep -x dpkg", "pgrep -x pacman", 
-        "pgrep -x dnf", "pgrep -x yum", "pgrep -x zypper", "pgrep -x emerge", 
-        "pgrep -x apk", "pgrep -x portage",
-        NULL
-    };
-    
-    for (int i = 0; pm_commands[i] != NULL; i++) {
-        if (system(pm_commands[i]) == 0) {
-            return 1; // Package manager is running
+// Add to a series in a list, creating it if needed
+static void add_series(metric_series_t** list, size_t* count, const char* key, double delta) {
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp((*list)[i].key, key) == 0) {
+            (*list)[i].value += delta;
+            return;
         }
     }
-    return 0; // No package manager running
+    metric_series_t* grown = realloc(*list, (*count + 1) * sizeof(metric_series_t));
+    if (grown == NULL) {
+        return;
+    }
+    *list = grown;
+    snprintf((*list)[*count].key, sizeof((*list)[*count].key), "%s", key);
+    (*list)[*count].value = delta;
+    (*count)++;
 }
 
-// Attempt to auto-update system dependencies
-int auto_update_dependencies(const char* pkg_format_ext) {
-    for (int i = 0; pkg_formats[i].ext != NULL; i++) {
-        if (strcmp(pkg_formats[i].ext, pkg_format_ext) == 0) {
-            if (pkg_formats[i].update_cmd != NULL) {
-                printf("Updating %s dependencies...\n", pkg_format_ext);
-                int result = execute_command(pkg_formats[i].update_cmd);
-                if (result != 0) {
-                    fprintf(stderr, "Warning: Failed to update dependencies for %s format\n", pkg_format_ext);
-                    return -1;
-                }
-                return 0;
-            }
-        }
+// Increment a counter; labels is a Prometheus label list without braces
+void metrics_count(const char* name, const char* labels, double delta) {
+    if (metrics_file == NULL) {
+        return;
     }
-    return -1; // No update command found for this format
+    char key[256];
+    snprintf(key, sizeof(key), labels[0] != '\0' ? "%s{%s}" : "%s%s", name, labels);
+    add_series(&metric_deltas, &metric_delta_count, key, delta);
 }
 
-// Validate file path to prevent directory traversal and other attacks
-int validate_file_path(const char* file_path) {
-    // Check for directory traversal attempts
-    if (strstr(file_path, "../") || strstr(file_path, "..\\")) {
-        fprintf(stderr, "Error: Invalid file path containing directory traversal\n");
-        return 0; // Invalid
-    }
-    
-    // Check path length to prevent buffer overflow
-    if (strlen(file_path) >= MAX_PATH) {
-        fprintf(stderr, "Error: File path too long\n");
-        return 0; // Invalid
+// Record one observation in a histogram
+void metrics_observe(const char* name, const char* labels, double seconds) {
+    if (metrics_file == NULL) {
+        return;
     }
-    
-    // Check for null bytes
-    if (strchr(file_path, '\0') != strrchr(file_path, '\0')) {
-        // More than one null terminator would indicate a problem
-        fprintf(stderr, "Error: Invalid file path\n");
-        return 0; // Invalid
+    char key[256];
+    const char* sep = labels[0] != '\0' ? "," : "";
+    for (size_t i = 0; i < METRIC_BUCKET_COUNT; i++) {
+        snprintf(key, sizeof(key), "%s_bucket{%s%sle=\"%g\"}", name, labels, sep, metric_buckets[i]);
+        add_series(&metric_deltas, &metric_delta_count, key, seconds <= metric_buckets[i] ? 1 : 0);
     }
-    
-    return 1; // Valid
+    snprintf(key, sizeof(key), "%s_bucket{%s%sle=\"+Inf\"}", name, labels, sep);
+    add_series(&metric_deltas, &metric_delta_count, key, 1);
+    snprintf(key, sizeof(key), labels[0] != '\0' ? "%s_sum{%s}" : "%s_sum%s", name, labels);
+    add_series(&metric_deltas, &metric_delta_count, key, seconds);
+    snprintf(key, sizeof(key), labels[0] != '\0' ? "%s_count{%s}" : "%s_count%s", name, labels);
+    add_series(&metric_deltas, &metric_delta_count, key, 1);
 }
 
-// Install .deb package
-int install_deb(const char* file) {
-    // Validate file path first
-    if (!validate_file_path(file)) {
-        return -1;
-    }
-    
-    // Check if another package manager is running
-    if (is_package_manager_running()) {
-        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
-        return -1;
+// Operation history: a fixed-size ring of binary records in a shared mapping. Writers
+// claim a slot by atomically advancing the header's sequence counter, so concurrent
+// trimorph processes never wait on each other. A slot's sequence number is cleared
+// while it is written and set last, and a checksum covers the rest of the record, so
+// a crash mid-append leaves a slot that readers skip rather than a corrupt entry.
+#define HISTORY_MAGIC "TMHIST01"
+#define HISTORY_CAPACITY 4096
+#define HISTORY_FILE "var/lib/trimorph/history"
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t capacity;
+    uint64_t next_seq;          // Last sequence number handed out
+    char reserved[40];
+} history_header_t;
+
+typedef struct {
+    uint64_t seq;               // 0 while the slot is being written
+    uint32_t checksum;          // FNV-1a of everything after this field
+    int32_t exit_code;
+    int64_t time;               // Start of the operation, seconds since the epoch
+    double wait_seconds;        // Checking for other running package managers
+    double refresh_seconds;     // Refreshing package lists
+    double runtime_seconds;     // Running the package manager itself
+    int32_t pid;
+    uint32_t uid;
+    char op[8];                 // "install" or "run"
+    char format[16];
+    char manager[16];
+    char root[96];
+    char args[320];
+} history_record_t;
+
+_Static_assert(sizeof(history_record_t) == 512, "history records are 512 bytes");
+
+static uint32_t history_checksum(const history_record_t* r) {
+    const unsigned char* p = (const unsigned char*)r + offsetof(history_record_t, exit_code);
+    const unsigned char* end = (const unsigned char*)r + sizeof(*r);
+    uint32_t h = 2166136261u;
+    while (p < end) {
+        h = (h ^ *p++) * 16777619u;
     }
-    
-    if (!is_cmd_available("dpkg") && !is_cmd_available("apt")) {
-        fprintf(stderr, "Error: Neither dpkg nor apt is available\n");
-        return -1;
+    return h;
+}
+
+// Path of the history file: TRIMORPH_HISTORY_FILE, or a fixed path inside the target root
+static void history_path(char* path, size_t len) {
+    const char* env = getenv("TRIMORPH_HISTORY_FILE");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(path, len, "%s", env);
+    } else {
+        snprintf(path, len, "%s/%s", has_target_root() ? target_root : "", HISTORY_FILE);
     }
-    
-    // Auto-update dependencies before installation
-    if (auto_update_dependencies(".deb") != 0) {
-        fprintf(stderr, "Warning: Could not update apt dependencies\n");
+}
+
+// Map the history file, creating and initializing it when writable is set. Returns the
+// mapping (header followed by the records) or NULL.
+static history_header_t* history_map(int writable) {
+    char path[MAX_PATH];
+    history_path(path, sizeof(path));
+    size_t size = sizeof(history_header_t) + (size_t)HISTORY_CAPACITY * sizeof(history_record_t);
+
+    int fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (fd < 0 && writable && errno == ENOENT) {
+        char dir[MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s", path);
+        mkdir(dirname(dir), 0755);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
     }
-    
-    char cmd[MAX_PATH];
-    if (is_cmd_available("apt")) {
-        snprintf(cmd, sizeof(cmd), "apt install -y '%s'", file);
-    } else {
-        snprintf(cmd, sizeof(cmd), "dpkg -i '%s'", file);
+    if (fd < 0) {
+        return NULL;
     }
-    
-    int result = execute_command(cmd);
-    
-    // Check if installation failed and provide specific error information
-    if (result != 0) {
-        fprintf(stderr, "Error: Installation failed with exit code %d\n", result);
-        if (is_cmd_available("apt")) {
-            fprintf(stderr, "Tip: Try running 'apt update' to refresh package lists, then try again\n");
+
+    // Only creation is serialized; appends are lock-free
+    history_header_t header;
+    struct stat st;
+    if (writable) {
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+            header.record_size = sizeof(history_record_t);
+            header.capacity = HISTORY_CAPACITY;
+            if (ftruncate(fd, (off_t)size) != 0 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+                flock(fd, LOCK_UN);
+                close(fd);
+                return NULL;
+            }
         }
-        return result;
+        flock(fd, LOCK_UN);
     }
-    
-    return 0;
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)size ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(history_record_t) || header.capacity != HISTORY_CAPACITY) {
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
 }
 
-// Install Arch Linux package
-int install_arch(const char* file) {
-    // Validate file path first
-    if (!validate_file_path(file)) {
-        return -1;
-    }
-    
-    // Check if another package manager is running
-    if (is_package_manager_running()) {
-        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
-        return -1;
-    }
-    
-    if (!is_cmd_available("pacman")) {
-        fprintf(stderr, "Error: pacman is not available\n");
-        return -1;
+static void history_unmap(history_header_t* header) {
+    munmap(header, sizeof(history_header_t) + (size_t)HISTORY_CAPACITY * sizeof(history_record_t));
+}
+
+// Append the operation in progress to the history. Recording is best effort: without
+// write access to the history file nothing is recorded.
+static void history_record(const char* op, const char* format, int argc, char* argv[], int exit_code, time_t start,
+                           const trimorph_result_t* timings) {
+    if (dry_run) {
+        return;
     }
-    
-    // Auto-update dependencies before installation
-    if (auto_update_dependencies(".pkg.tar.zst") != 0) {
-        fprintf(stderr, "Warning: Could not update pacman dependencies\n");
-        // Don't return -1 here as this is just a warning
+    history_header_t* header = history_map(1);
+    if (header == NULL) {
+        return;
     }
-    
-    char cmd[MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "pacman -U --noconfirm '%s'", file);
-    
-    int result = execute_command(cmd);
-    
-    // Check if installation failed and provide specific error information
-    if (result != 0) {
-        fprintf(stderr, "Error: Installation failed with exit code %d\n", result);
-        fprintf(stderr, "Tip: Try running 'pacman -Sy' to refresh package lists, then try again\n");
-        fprintf(stderr, "Tip: Check for package conflicts with 'pacman -Q' and resolve them first\n");
-        return result;
+
+    history_record_t r;
+    memset(&r, 0, sizeof(r));
+    r.exit_code = exit_code;
+    r.time = (int64_t)start;
+    r.wait_seconds = timings->wait_seconds;
+    r.refresh_seconds = timings->refresh_seconds;
+    r.runtime_seconds = timings->runtime_seconds;
+    r.pid = (int32_t)getpid();
+    r.uid = (uint32_t)getuid();
+    snprintf(r.op, sizeof(r.op), "%s", op);
+    snprintf(r.format, sizeof(r.format), "%s", format != NULL ? format : "");
+    snprintf(r.manager, sizeof(r.manager), "%s", timings->manager);
+    snprintf(r.root, sizeof(r.root), "%s", has_target_root() ? target_root : "");
+    size_t used = 0;
+    for (int i = 0; i < argc && used + 1 < sizeof(r.args); i++) {
+        used += snprintf(r.args + used, sizeof(r.args) - used, "%s%s", i > 0 ? " " : "", argv[i]);
     }
-    
-    return 0;
+    r.checksum = history_checksum(&r);
+
+    uint64_t seq = __atomic_add_fetch(&header->next_seq, 1, __ATOMIC_SEQ_CST);
+    history_record_t* slot = (history_record_t*)(header + 1) + (seq - 1) % HISTORY_CAPACITY;
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELEASE);
+    memcpy((char*)slot + sizeof(slot->seq), (char*)&r + sizeof(r.seq), sizeof(r) - sizeof(r.seq));
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    history_unmap(header);
 }
 
-// Install RPM package
-int install_rpm(const char* file) {
-    // Validate file path first
-    if (!validate_file_path(file)) {
-        return -1;
+static int history_seq_cmp(const void* a, const void* b) {
+    uint64_t sa = ((const history_record_t*)a)->seq;
+    uint64_t sb = ((const history_record_t*)b)->seq;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+// Copy the complete records out of the history, oldest first. Returns the number of
+// records (0 if there is no history yet) or -1 on error.
+static long history_load(history_record_t** out) {
+    *out = NULL;
+    history_header_t* header = history_map(0);
+    if (header == NULL) {
+        return 0;
     }
-    
-    // Check if another package manager is running
-    if (is_package_manager_running()) {
-        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
+    history_record_t* records = malloc((size_t)HISTORY_CAPACITY * sizeof(history_record_t));
+    if (records == NULL) {
+        history_unmap(header);
         return -1;
     }
-    
-    if (!is_cmd_available("rpm")) {
-        fprintf(stderr, "Error: rpm is not available\n");
-        return -1;
+
+    const history_record_t* slots = (const history_record_t*)(header + 1);
+    long count = 0;
+    for (size_t i = 0; i < HISTORY_CAPACITY; i++) {
+        uint64_t seq = __atomic_load_n(&slots[i].seq, __ATOMIC_ACQUIRE);
+        if (seq == 0 || (seq - 1) % HISTORY_CAPACITY != i) {
+            continue;
+        }
+        records[count] = slots[i];
+        // Skip slots rewritten while being copied, or left half-written by a crash
+        if (__atomic_load_n(&slots[i].seq, __ATOMIC_ACQUIRE) != seq ||
+            history_checksum(&records[count]) != records[count].checksum) {
+            continue;
+        }
+        records[count++].seq = seq;
     }
-    
-    // Auto-update dependencies before installation
-    if (auto_update_dependencies(".rpm") != 0) {
-        fprintf(stderr, "Warning: Could not update RPM dependencies\n");
-        // Don't return -1 here as this is just a warning
+    history_unmap(header);
+
+    if (count > 0) {
+        qsort(records, (size_t)count, sizeof(history_record_t), history_seq_cmp);
     }
-    
-    char cmd[MAX_PATH];
-    if (is_cmd_available("dnf")) {
-        snprintf(cmd, sizeof(cmd), "dnf install -y '%s'", file);
-    } else if (is_cmd_available("yum")) {
-        snprintf(cmd, sizeof(cmd), "yum install -y '%s'", file);
-    } else {
-        snprintf(cmd, sizeof(cmd), "rpm -i '%s'", file);
+    *out = records;
+    return count;
+}
+
+// Parse a history time filter: an age such as 30m, 12h or 7d, or a local date and time
+// such as "2026-03-14" or "2026-03-14 09:30". Returns -1 if invalid.
+static time_t parse_history_time(const char* text) {
+    char* end;
+    long value = strtol(text, &end, 10);
+    if (end != text && end[0] != '\0' && end[1] == '\0' && value >= 0) {
+        static const char units[] = "smhdw";
+        static const long seconds[] = {1, 60, 3600, 86400, 604800};
+        const char* unit = strchr(units, end[0]);
+        if (unit != NULL) {
+            return time(NULL) - value * seconds[unit - units];
+        }
     }
-    
-    int result = execute_command(cmd);
-    
-    // Check if installation failed and provide specific error information
-    if (result != 0) {
-        fprintf(stderr, "Error: Installation failed with exit code %d\n", result);
-        if (is_cmd_available("dnf")) {
-            fprintf(stderr, "Tip: Try running 'dnf check-update' to refresh package lists, then try again\n");
-        } else if (is_cmd_available("yum")) {
-            fprintf(stderr, "Tip: Try running 'yum check-update' to refresh package lists, then try again\n");
+
+    static const char* const formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL};
+    for (int i = 0; formats[i] != NULL; i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* rest = strptime(text, formats[i], &tm);
+        if (rest != NULL && *rest == '\0') {
+            tm.tm_isdst = -1;
+            return mktime(&tm);
         }
-        fprintf(stderr, "Tip: Check for package conflicts with 'rpm -Va', and resolve them first\n");
-        return result;
     }
-    
-    return 0;
+    return -1;
 }
 
-// Install Alpine package
-int install_apk(const char* file) {
-    // Validate file path first
-    if (!validate_file_path(file)) {
-        return -1;
-    }
-    
-    // Check if another package manager is running
-    if (is_package_manager_running()) {
-        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
+// Print recorded operations matching the filters, oldest first
+int show_history(time_t since, time_t until, const char* manager, int outcome, long limit) {
+    history_record_t* records;
+    long count = history_load(&records);
+    if (count < 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
         return -1;
     }
-    
-    if (!is_cmd_available("apk")) {
-        fprintf(stderr, "Error: apk is not available\n");
-        return -1;
+    if (count == 0) {
+        char path[MAX_PATH];
+        history_path(path, sizeof(path));
+        printf("No operations recorded in %s\n", path);
+        free(records);
+        return 0;
     }
-    
-    // Auto-update dependencies before installation
-    if (auto_update_dependencies(".apk") != 0) {
-        fprintf(stderr, "Warning: Could not update apk dependencies\n");
-        // Don't return -1 here as this is just a warning
+
+    // Apply the filters, then show only the newest limit matches
+    long matches = 0;
+    for (long i = 0; i < count; i++) {
+        history_record_t* r = &records[i];
+        if ((since >= 0 && r->time < since) || (until >= 0 && r->time > until) ||
+            (manager != NULL && strcmp(r->manager, manager) != 0) ||
+            (outcome > 0 && r->exit_code != 0) || (outcome < 0 && r->exit_code == 0)) {
+            continue;
+        }
+        records[matches++] = *r;
     }
-    
-    char cmd[MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "apk add '%s'", file);
-    int result = execute_command(cmd);
-    
-    // Check if installation failed and provide specific error information
-    if (result != 0) {
-        fprintf(stderr, "Error: Installation failed with exit code %d\n", result);
-        fprintf(stderr, "Tip: Try running 'apk update' to refresh package lists, then try again\n");
-        fprintf(stderr, "Tip: Check for package conflicts with 'apk verify', and resolve them first\n");
-        return result;
+    long first = limit > 0 && matches > limit ? matches - limit : 0;
+
+    printf("%-19s  %-7s  %-8s  %-12s  %4s  %7s  %7s  %8s  %s\n", "TIME", "OP", "MANAGER", "FORMAT", "EXIT",
+           "WAIT", "REFRESH", "RUNTIME", "ARGUMENTS");
+    for (long i = first; i < matches; i++) {
+        history_record_t* r = &records[i];
+        char when[32];
+        time_t t = (time_t)r->time;
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+        printf("%-19s  %-7s  %-8s  %-12s  %4d  %6.2fs  %6.2fs  %7.2fs  %s", when, r->op,
+               r->manager[0] ? r->manager : "-", r->format[0] ? r->format : "-", r->exit_code, r->wait_seconds,
+               r->refresh_seconds, r->runtime_seconds, r->args);
+        if (r->root[0]) {
+            printf("  (root %s)", r->root);
+        }
+        printf("\n");
     }
-    
+    printf("%ld of %ld recorded operations shown\n", matches - first, count);
+    free(records);
     return 0;
 }
 
-// Install Gentoo package (not typical binary packages)
-int install_gentoo(const char* file) {
-    // Validate file path first
-    if (!validate_file_path(file)) {
-        return -1;
-    }
-    
-    // Check if another package manager is running
-    if (is_package_manager_running()) {
-        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
-        return -1;
+// Totals of a --dry-run plan
+static struct {
+    double seconds;             // Sum of the estimates
+    int steps;
+    int unestimated;            // Steps without matching history
+    int blocked;                // Steps that would abort on a running package manager now
+} plan;
+
+// Records estimates are drawn from: the newest this many matching successful runs
+#define PLAN_SAMPLES 20
+
+static int double_cmp(const void* a, const void* b) {
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+// Estimate a step's duration as the median of recent successful runs with the same
+// operation and manager. A run prefers records with the same leading arguments (so
+// "apt update" and "apt upgrade" are told apart), an install the same format, and a
+// refresh uses the refresh time of installs of the same format. Returns the number of
+// samples, 0 if there is no history to go on.
+static int plan_estimate(const char* op, const char* manager, const char* args_prefix, const char* format,
+                         int refresh, double* estimate) {
+    static history_record_t* records = NULL;
+    static long count = -1;
+    if (count < 0) {
+        count = history_load(&records);
+        if (count < 0) count = 0;
     }
-    
-    if (!is_cmd_available("emerge")) {
-        fprintf(stderr, "Error: emerge is not available\n");
-        return -1;
+
+    double samples[PLAN_SAMPLES];
+    int n = 0;
+    for (int pass = 0; pass < 2 && n == 0; pass++) {
+        for (long i = count - 1; i >= 0 && n < PLAN_SAMPLES; i--) {
+            const history_record_t* r = &records[i];
+            if (r->exit_code != 0 || strcmp(r->op, op) != 0) {
+                continue;
+            }
+            if (refresh) {
+                if (r->refresh_seconds > 0 && strcmp(r->format, format) == 0) {
+                    samples[n++] = r->refresh_seconds;
+                }
+                continue;
+            }
+            if (strcmp(r->manager, manager) != 0) {
+                continue;
+            }
+            // First pass: same leading arguments or format; second: same manager only
+            if (pass == 0 && args_prefix != NULL &&
+                (strncmp(r->args, args_prefix, strlen(args_prefix)) != 0 ||
+                 (r->args[strlen(args_prefix)] != ' ' && r->args[strlen(args_prefix)] != '\0'))) {
+                continue;
+            }
+            if (pass == 0 && format != NULL && strcmp(r->format, format) != 0) {
+                continue;
+            }
+            samples[n++] = r->wait_seconds + r->runtime_seconds;
+        }
+        if (refresh) {
+            break;
+        }
     }
-    
-    // Auto-update dependencies before installation
-    if (auto_update_dependencies(".tbz") != 0) {
-        fprintf(stderr, "Warning: Could not update emerge dependencies\n");
-        // Don't return -1 here as this is just a warning
+    if (n == 0) {
+        return 0;
     }
-    
-    fprintf(stderr, "Note: Gentoo typically uses source-based packages (ebuilds)\n");
-    fprintf(stderr, "Installing binary package: %s\n", file);
-    
-    // In practice, Gentoo binary packages are handled differently
-    // This is just a placeholder for demonstration
-    char cmd[MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "emerge --usepkg '%s'", file);
-    int result = execute_command(cmd);
-    
-    // Check if installation failed and provide specific error information
-    if (result != 0) {
-        fprintf(stderr, "Error: Installation failed with exit code %d\n", result);
-        fprintf(stderr, "Tip: Try running 'emerge --sync' to refresh package lists, then try again\n");
-        fprintf(stderr, "Tip: Check for package conflicts with 'equery list \"*\"', and resolve them first\n");
-        return result;
+    qsort(samples, (size_t)n, sizeof(double), double_cmp);
+    *estimate = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    return n;
+}
+
+// Print one planned command with its estimate and add it to the plan total
+static void plan_command(const char* what, const char* command, const char* op, const char* manager,
+                         const char* args_prefix, const char* format, int refresh) {
+    double estimate = 0;
+    int samples = plan_estimate(op, manager, args_prefix, format, refresh, &estimate);
+    printf("  Would %s: %s\n", what, command);
+    if (samples > 0) {
+        printf("    Estimated %.1fs (median of %d past run%s)\n", estimate, samples, samples == 1 ? "" : "s");
+        plan.seconds += estimate;
+    } else {
+        printf("    No recorded runs of %s to estimate from\n", manager);
+        plan.unestimated++;
     }
-    
-    return 0;
+    plan.steps++;
 }
 
-// Command name validation function
-int validate_command_name(const char* cmd_name) {
-    // Validate the command name to prevent command injection
-    // Only allow alphanumeric characters, hyphens, underscores, and dots
-    if (cmd_name == NULL) {
-        return 0; // NULL command name is invalid
+// Print the plan total once the command has been planned
+static void plan_summary() {
+    if (plan.steps == 0) {
+        return;
     }
-    
-    // Check for null bytes that could indicate malicious intent
-    if (strlen(cmd_name) != strcspn(cmd_name, "\0")) {
-        return 0; // Contains null bytes
+    printf("Plan: %d step%s, estimated %.1fs", plan.steps, plan.steps == 1 ? "" : "s", plan.seconds);
+    if (plan.unestimated > 0) {
+        printf(" plus %d step%s without history", plan.unestimated, plan.unestimated == 1 ? "" : "s");
     }
-    
-    const char* valid_cmd_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./";
-    for (const char* p = cmd_name; *p != '\0'; p++) {
-        if (strchr(valid_cmd_chars, *p) == NULL) {
-            return 0; // Invalid character found
-        }
+    printf("\n");
+    if (plan.blocked) {
+        printf("Note: A package manager is running now; executing this plan would abort\n");
     }
-    
-    return 1; // Valid command name
 }
 
-// Execute a package manager command directly with proper PATH handling
-int run_pkg_manager(const char* pm_name, int argc, char *argv[]) {
-    // Validate command name to prevent injection
-    if (!validate_command_name(pm_name)) {
-        fprintf(stderr, "Error: Invalid package manager name: %s\n", pm_name);
-        return -1;
-    }
-    
-    // Check if another package manager is running
-    if (is_package_manager_running()) {
-        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
-        return -1;
+// Run package manager children with reduced priority (--low-impact)
+static int low_impact = 0;
+
+// Library context the CLI drives; configured from the global options in main
+static trimorph_t* tm = NULL;
+
+// Set by batch mode after checking for conflicts once for a block of mutating steps
+static int conflict_check_done = 0;
+
+// Set while installing a set whose disk space has been checked as a whole
+static int space_check_done = 0;
+
+// Skip the disk space preflight (--skip-space-check)
+static int skip_space_check = 0;
+
+// Commit window in seconds for merging concurrent installs (--group-commit <ms>), 0 when off
+static double group_window = 0;
+
+// Manager and first argument of the run being planned, to match history records
+static char plan_args_prefix[160];
+
+// Extension of trimorph's own delta packages, handled by the CLI before the library
+#define DELTA_EXT ".tmdelta"
+
+// Descriptor for newline-delimited JSON progress events (--events-fd), -1 for none
+static int events_fd = -1;
+static unsigned long events_dropped = 0;
+
+// Append a JSON string to an event line
+static void append_json_string(char* buf, size_t len, size_t* used, const char* s) {
+    if (*used < len) buf[(*used)++] = '"';
+    for (; *s != '\0' && *used + 7 < len; s++) {
+        if (*s == '"' || *s == '\\') {
+            buf[(*used)++] = '\\';
+            buf[(*used)++] = *s;
+        } else if ((unsigned char)*s < 0x20) {
+            *used += (size_t)snprintf(buf + *used, len - *used, "\\u%04x", (unsigned char)*s);
+        } else {
+            buf[(*used)++] = *s;
+        }
     }
-    
-    if (!is_cmd_available(pm_name)) {
-        fprintf(stderr, "Error: Package manager '%s' is not available\n", pm_name);
-        return -1;
+    if (*used < len) buf[(*used)++] = '"';
+}
+
+// Write one event line to --events-fd. A line fits in one atomic pipe write; when
+// the reader falls behind the line is dropped rather than stalling the package
+// manager, and the next line that gets through reports how many were lost.
+static void emit_event(const trimorph_event_t* ev, const char* type) {
+    char line[1024];
+    size_t used = (size_t)snprintf(line, sizeof(line), "{\"event\":\"%s\",\"time\":%lld,\"manager\":", type,
+                                   (long long)time(NULL));
+    append_json_string(line, sizeof(line) - 128, &used, ev->manager);
+    if (has_target_root()) {
+        used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"root\":");
+        append_json_string(line, sizeof(line) - 128, &used, target_root);
     }
-    
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process - prepare arguments for execvp (search in PATH)
-        // Create argument array for execvp
-        char** exec_args = malloc((argc + 2) * sizeof(char*));
-        if (!exec_args) {
-            fprintf(stderr, "Error: Memory allocation failed\n");
-            exit(1);
+    if (ev->type == TRIMORPH_EVENT_PROGRESS) {
+        used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"phase\":");
+        append_json_string(line, sizeof(line) - 128, &used, ev->phase);
+        if (ev->package != NULL) {
+            used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"package\":");
+            append_json_string(line, sizeof(line) - 128, &used, ev->package);
         }
-        
-        exec_args[0] = (char*)pm_name;
-        for (int i = 0; i < argc; i++) {
-            exec_args[i + 1] = argv[i];
+        if (ev->percent >= 0) {
+            used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"percent\":%.1f", ev->percent);
         }
-        exec_args[argc + 1] = NULL;
-        
-        // Execute the command (search in PATH)
-        execvp(pm_name, exec_args);
-        
-        // If execvp returns, it failed
-        perror("execvp failed");
-        free(exec_args);
-        exit(1);
-    } else if (pid > 0) {
-        // Parent process - wait for child
-        int status;
-        waitpid(pid, &status, 0);
-        
-        // Check if command failed and provide specific error information
-        if (WIFEXITED(status)) {
-            int exit_code = WEXITSTATUS(status);
-            if (exit_code != 0) {
-                fprintf(stderr, "Error: Command failed with exit code %d\n", exit_code);
-                fprintf(stderr, "Tip: Make sure no other package managers are running, then try again\n");
-                return exit_code;
-            }
-            return 0;
-        } else {
-            fprintf(stderr, "Error: Command terminated abnormally\n");
-            return -1;
+        if (ev->bytes >= 0) {
+            used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"bytes\":%lld", ev->bytes);
         }
+    } else if (ev->type == TRIMORPH_EVENT_COMMAND_START) {
+        used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"refresh\":%s,\"command\":",
+                                 ev->refresh ? "true" : "false");
+        append_json_string(line, sizeof(line) - 128, &used, ev->command);
     } else {
-        perror("fork failed");
-        return -1;
+        used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"exit_code\":%d,\"runtime_seconds\":%.3f",
+                                 ev->exit_code, ev->seconds);
     }
-}
+    if (events_dropped > 0) {
+        used += (size_t)snprintf(line + used, sizeof(line) - used, ",\"dropped\":%lu", events_dropped);
+    }
+    used += (size_t)snprintf(line + used, sizeof(line) - used, "}\n");
 
-// Install a local package file based on extension
-int install_local_package(const char* pkg_file) {
-    // Validate file path first
-    if (!validate_file_path(pkg_file)) {
-        return -1;
+    struct pollfd pfd = {events_fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT) && write(events_fd, line, used) == (ssize_t)used) {
+        events_dropped = 0;
+    } else {
+        events_dropped++;
     }
-    
-    struct stat st;
-    if (stat(pkg_file, &st) != 0) {
-        fprintf(stderr, "Error: Package file does not exist: %s\n", pkg_file);
-        return -1;
+}
+
+// Print library messages the way the CLI always has: problems on stderr with a
+// prefix, progress on stdout
+static void print_library_message(int level, const char* text, void* user) {
+    (void)user;
+    static const char* const prefixes[] = {NULL, "Error", "Warning", "Tip", "Note"};
+    if (level >= TRIMORPH_MSG_ERROR && level <= TRIMORPH_MSG_NOTE) {
+        fprintf(stderr, "%s: %s\n", prefixes[level], text);
+    } else {
+        printf("%s\n", text);
     }
-    
-    // Determine the file extension
-    const char* ext = strrchr(pkg_file, '.');
-    if (!ext) {
-        fprintf(stderr, "Error: Cannot determine package format for: %s\n", pkg_file);
-        return -1;
+}
+
+// Turn library progress events into metrics, command echoes and --dry-run plan steps
+static void handle_library_event(const trimorph_event_t* ev, void* user) {
+    (void)user;
+    char labels[96];
+    int is_run = ev->operation != NULL && strcmp(ev->operation, "run") == 0;
+    if (events_fd >= 0 && !ev->dry_run && ev->type >= TRIMORPH_EVENT_COMMAND_START) {
+        emit_event(ev, ev->type == TRIMORPH_EVENT_PROGRESS ? "progress" :
+                       ev->type == TRIMORPH_EVENT_COMMAND_START ? "start" : "finish");
     }
-    
-    // Check for compound extensions like .pkg.tar.zst
-    const char* compound_ext = NULL;
-    if (strlen(ext) > 4) {  // At least something like ".tar.xz"
-        char full_ext[16];
-        strncpy(full_ext, ext, sizeof(full_ext) - 1);
-        full_ext[sizeof(full_ext) - 1] = '\0';
-        
-        // Look for the package format
-        for (int i = 0; pkg_formats[i].ext != NULL; i++) {
-            if (strcmp(pkg_formats[i].ext, full_ext) == 0 && pkg_formats[i].install_func) {
-                return pkg_formats[i].install_func(pkg_file);
+    switch (ev->type) {
+    case TRIMORPH_EVENT_CONFLICT_CHECK:
+        metrics_observe("trimorph_conflict_wait_seconds", "", ev->seconds);
+        // A plan reports the lock state and carries on, so the whole plan is shown
+        if (ev->dry_run && ev->operation != NULL) {
+            if (ev->conflict) {
+                printf("  Conflict check: %s; this step would abort now\n", has_target_root() ?
+                       "package manager locks in the root are held" : "another package manager is running");
+                plan.blocked = 1;
+            } else {
+                printf("  Conflict check: no package manager running%s\n", has_target_root() ? " in the root" : "");
             }
         }
-    }
-    
-    // Look for the simple extension
-    for (int i = 0; pkg_formats[i].ext != NULL; i++) {
-        if (strcmp(pkg_formats[i].ext, ext) == 0 && pkg_formats[i].install_func) {
-            return pkg_formats[i].install_func(pkg_file);
+        break;
+    case TRIMORPH_EVENT_REFRESH_SKIPPED:
+        snprintf(labels, sizeof(labels), "reason=\"%s\"", ev->reason);
+        metrics_count("trimorph_refresh_skipped_total", labels, 1);
+        if (ev->dry_run && strcmp(ev->reason, "coalesced") == 0) {
+            printf("  Refresh: skipped, '%s' already runs earlier in this plan\n", ev->command);
+        } else if (ev->dry_run) {
+            printf("  Refresh: none for %s packages\n", ev->format);
+        }
+        break;
+    case TRIMORPH_EVENT_COMMAND_START:
+        if (ev->dry_run) {
+            plan_command(ev->refresh ? "refresh" : "run", ev->command, ev->operation, ev->manager,
+                         is_run ? plan_args_prefix : NULL, ev->format, ev->refresh);
+            if (is_run && low_impact) {
+                printf("    With --low-impact CPU, I/O and memory limits\n");
+            }
+        } else if (!is_run) {
+            printf("Executing: %s\n", ev->command);
+        }
+        break;
+    case TRIMORPH_EVENT_COMMAND_DONE:
+        snprintf(labels, sizeof(labels), "manager=\"%s\"", ev->manager);
+        metrics_observe("trimorph_pkgmgr_runtime_seconds", labels, ev->seconds);
+        if (ev->refresh) {
+            snprintf(labels, sizeof(labels), "format=\"%s\"", ev->format);
+            metrics_observe("trimorph_refresh_seconds", labels, ev->seconds);
         }
+        break;
     }
-    
-    fprintf(stderr, "Error: Unsupported package format: %s\n", ext);
-    return -1;
 }
 
-// Main function - handles command line arguments
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Trimorph - Enhanced Package Management System\n");
-        printf("Usage:\n");
-        printf("  %s install <package-file>        - Install a local package\n", argv[0]);
-        printf("  %s run <pkgmgr> [args...]        - Execute package manager command\n", argv[0]);
-        printf("  %s supported-formats            - List supported package formats\n", argv[0]);
-        printf("  %s check <pkgmgr>               - Check if package manager exists\n", argv[0]);
-        printf("  %s status                      - Check system status and conflicts\n", argv[0]);
-        printf("\nExamples:\n");
-        printf("  %s install package.deb\n", argv[0]);
+// Exit code the CLI reports for a library operation: the package manager's own exit
+// code when it failed, -1 for every other error
+static int operation_exit_code(int status, const trimorph_result_t* result) {
+    if (status == TRIMORPH_OK) {
+        return 0;
+    }
+    return status == TRIMORPH_ERR_FAILED && result->exit_code > 0 ? result->exit_code : -1;
+}
+
+// Command availability checker that handles both command names and full paths
+int is_cmd_available(const char* cmd) {
+    return trimorph_command_available(tm, cmd);
+}
+
+// Check if any other package manager is currently running to prevent conflicts
+int is_package_manager_running() {
+    // Inside a batch block the conflict check has already been done once
+    if (conflict_check_done) {
+        return 0;
+    }
+    return trimorph_conflict(tm);
+}
+
+// Validate file path to prevent directory traversal and other attacks
+int validate_file_path(const char* file_path) {
+    const char* problem;
+    if (trimorph_check_path(file_path, &problem) != TRIMORPH_OK) {
+        fprintf(stderr, "Error: %s\n", problem);
+        return 0; // Invalid
+    }
+    return 1; // Valid
+}
+
+// Package format of a file: trimorph deltas, or one of the library's formats
+static const char* package_format(const char* pkg_file) {
+    size_t len = strlen(pkg_file);
+    size_t ext_len = strlen(DELTA_EXT);
+    if (len > ext_len && strcmp(pkg_file + len - ext_len, DELTA_EXT) == 0) {
+        return DELTA_EXT;
+    }
+    return trimorph_detect_format(pkg_file);
+}
+
+int install_delta(const char* file, trimorph_result_t* result);
+static int space_preflight(int count, char* files[]);
+static void owners_refresh();
+
+// File scanning: reads of many files go through one layer, shared by the install
+// checks, package hashing and the ownership index. Files are opened and read through
+// io_uring, with up to the queue depth of files in flight, each read into its own
+// registered buffer. Where io_uring is unavailable (kernels before 5.6, seccomp
+// filters, kernel.io_uring_disabled) the same reads are made with pread by a pool of
+// that many threads. TRIMORPH_SCAN_DEPTH sets the depth and TRIMORPH_SCAN_BACKEND
+// ("io_uring" or "pread") forces a backend.
+#define SCAN_CHUNK (256 * 1024)
+#define SCAN_DEFAULT_DEPTH 32
+#define SCAN_MAX_DEPTH 256
+
+typedef enum { SCAN_AUTO, SCAN_IO_URING, SCAN_PREAD } scan_backend_t;
+
+typedef struct {
+    const char* path;
+    uint64_t limit;             // Read at most this many bytes, 0 for the whole file
+    void* data;                 // Consumer state
+    struct stat st;             // Valid once the file is open
+    uint64_t done;              // Bytes delivered so far
+    int error;                  // errno of a failed open or read, 0 otherwise
+} scan_file_t;
+
+// Receives a file's contents in order, one chunk at a time, then a final call with
+// len 0 (check file->error). Returning nonzero stops reading the file. Different files
+// may be delivered on different threads at once unless the scan is serial.
+typedef int (*scan_fn)(scan_file_t* file, const unsigned char* data, size_t len, void* ctx);
+
+typedef struct {
+    scan_file_t* files;
+    size_t count;
+    scan_fn fn;
+    void* ctx;
+    int serial;
+    size_t chunk;               // Size of each read buffer, at most SCAN_CHUNK
+    size_t next;                // Pool: next file to claim
+    pthread_mutex_t lock;       // Pool: serialises the callbacks of a serial scan
+} scan_job_t;
+
+// Why io_uring could not be used for the last scan, 0 if it was
+static int scan_uring_error = 0;
+
+static int scan_emit(scan_job_t* job, scan_file_t* file, const unsigned char* data, size_t len) {
+    if (job->fn == NULL) {
+        return 0;
+    }
+    if (job->serial) pthread_mutex_lock(&job->lock);
+    int stop = job->fn(file, data, len, job->ctx);
+    if (job->serial) pthread_mutex_unlock(&job->lock);
+    return stop;
+}
+
+// Size of the next read of a file, 0 once its limit is reached
+static size_t scan_want(const scan_file_t* file) {
+    if (file->limit == 0) {
+        return SCAN_CHUNK;
+    }
+    uint64_t left = file->limit > file->done ? file->limit - file->done : 0;
+    return left < SCAN_CHUNK ? (size_t)left : SCAN_CHUNK;
+}
+
+// Only regular files are read; anything else would block or never end
+static int scan_opened(scan_file_t* file, int fd) {
+    if (fstat(fd, &file->st) != 0) {
+        file->error = errno;
+    } else if (!S_ISREG(file->st.st_mode)) {
+        file->error = S_ISDIR(file->st.st_mode) ? EISDIR : EINVAL;
+    }
+    return file->error;
+}
+
+// Pool worker: claim files until none are left, reading each with pread
+static void* scan_pool_worker(void* arg) {
+    scan_job_t* job = arg;
+    unsigned char* buf = malloc(job->chunk);
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        scan_file_t* file = &job->files[i];
+        int fd = buf != NULL ? open(file->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK) : -1;
+        if (fd < 0) {
+            file->error = buf == NULL ? ENOMEM : errno;
+        }
+        size_t want;
+        while (fd >= 0 && scan_opened(file, fd) == 0 && (want = scan_want(file)) > 0) {
+            ssize_t n = pread(fd, buf, want, (off_t)file->done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                file->error = errno;
+            }
+            if (n <= 0) {
+                break;
+            }
+            file->done += (uint64_t)n;
+            if (scan_emit(job, file, buf, (size_t)n) != 0) {
+                break;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        scan_emit(job, file, NULL, 0);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void scan_pool(scan_job_t* job, int depth) {
+    int nthreads = (size_t)depth < job->count ? depth : (int)job->count;
+    pthread_t* threads = malloc((size_t)nthreads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; threads != NULL && t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, scan_pool_worker, job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        scan_pool_worker(job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+// io_uring through the raw system calls; the rings are shared with the kernel, which
+// consumes submissions up to the SQ tail and publishes completions up to the CQ tail
+typedef struct {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* rings[2];
+    size_t ring_sizes[2];
+    size_t sqes_size;
+    unsigned tail;              // Local SQ tail, published when submitting
+    unsigned pending;           // Queued but not yet submitted
+} scan_ring_t;
+
+static void scan_ring_close(scan_ring_t* ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->rings[1] != NULL && ring->rings[1] != MAP_FAILED && ring->rings[1] != ring->rings[0]) {
+        munmap(ring->rings[1], ring->ring_sizes[1]);
+    }
+    if (ring->rings[0] != NULL && ring->rings[0] != MAP_FAILED) munmap(ring->rings[0], ring->ring_sizes[0]);
+    close(ring->fd);
+}
+
+static int scan_ring_open(scan_ring_t* ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->ring_sizes[0] = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->ring_sizes[1] = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->ring_sizes[1] > ring->ring_sizes[0]) {
+        ring->ring_sizes[0] = ring->ring_sizes[1];
+    }
+    ring->rings[0] = mmap(NULL, ring->ring_sizes[0], PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    ring->rings[1] = single ? ring->rings[0] :
+                     mmap(NULL, ring->ring_sizes[1], PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_CQ_RING);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->rings[0] == MAP_FAILED || ring->rings[1] == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int saved = errno;
+        scan_ring_close(ring);
+        errno = saved;
+        return -1;
+    }
+    char* sq = ring->rings[0];
+    char* cq = ring->rings[1];
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+    return 0;
+}
+
+// Whether the kernel implements the operations a scan submits
+static int scan_ring_supports(const scan_ring_t* ring) {
+    static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_READ, -1};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    int ok = probe != NULL && syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; ok && ops[i] >= 0; i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static struct io_uring_sqe* scan_ring_sqe(scan_ring_t* ring, int opcode, uint64_t user_data) {
+    unsigned index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->pending++;
+    return sqe;
+}
+
+// A file in flight: fd is -1 while its open is pending
+typedef struct {
+    size_t file;
+    int fd;
+    int busy;
+} scan_slot_t;
+
+static void scan_ring_read(scan_ring_t* ring, int fixed, unsigned char* buffers, size_t chunk, scan_slot_t* slots,
+                           int s, const scan_file_t* file) {
+    struct io_uring_sqe* sqe = scan_ring_sqe(ring, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, (uint64_t)s);
+    sqe->fd = slots[s].fd;
+    sqe->addr = (uint64_t)(uintptr_t)(buffers + (size_t)s * chunk);
+    sqe->len = (uint32_t)scan_want(file);
+    sqe->off = file->done;
+    sqe->buf_index = fixed ? (uint16_t)s : 0;
+}
+
+// Scan through io_uring. Returns -1 with scan_uring_error set, before any file has been
+// touched, if io_uring cannot be used.
+static int scan_uring(scan_job_t* job, int depth) {
+    scan_ring_t ring;
+    if (scan_ring_open(&ring, (unsigned)depth) != 0) {
+        scan_uring_error = errno;
+        return -1;
+    }
+    if (!scan_ring_supports(&ring)) {
+        scan_ring_close(&ring);
+        scan_uring_error = EOPNOTSUPP;
+        return -1;
+    }
+    size_t area = (size_t)depth * job->chunk;
+    unsigned char* buffers = mmap(NULL, area, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    scan_slot_t* slots = calloc((size_t)depth, sizeof(scan_slot_t));
+    struct iovec* iov = calloc((size_t)depth, sizeof(struct iovec));
+    if (buffers == MAP_FAILED || slots == NULL || iov == NULL) {
+        scan_uring_error = ENOMEM;
+        if (buffers != MAP_FAILED) munmap(buffers, area);
+        free(slots);
+        free(iov);
+        scan_ring_close(&ring);
+        return -1;
+    }
+    // Registered buffers are pinned once instead of on every read. Kernels that charge
+    // them to RLIMIT_MEMLOCK may refuse; plain reads into the same buffers still work.
+    for (int s = 0; s < depth; s++) {
+        iov[s].iov_base = buffers + (size_t)s * job->chunk;
+        iov[s].iov_len = job->chunk;
+    }
+    int fixed = syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, depth) == 0;
+    free(iov);
+    scan_uring_error = 0;
+
+    size_t next = 0;
+    int active = 0;
+    int failed = 0;
+    for (;;) {
+        for (int s = 0; s < depth && next < job->count; s++) {
+            if (slots[s].busy) {
+                continue;
+            }
+            slots[s].file = next++;
+            slots[s].fd = -1;
+            slots[s].busy = 1;
+            active++;
+            struct io_uring_sqe* sqe = scan_ring_sqe(&ring, IORING_OP_OPENAT, (uint64_t)s);
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)job->files[slots[s].file].path;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+        }
+        if (active == 0) {
+            break;
+        }
+
+        __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+        long submitted = syscall(SYS_io_uring_enter, ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted < 0) {
+            failed = errno;
+            break;
+        }
+        ring.pending -= (unsigned)submitted;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            int s = (int)cqe->user_data;
+            int res = cqe->res;
+            scan_file_t* file = &job->files[slots[s].file];
+            int finished = 0;
+            if (slots[s].fd < 0) {
+                if (res < 0) {
+                    file->error = -res;
+                    finished = 1;
+                } else {
+                    slots[s].fd = res;
+                    finished = scan_opened(file, res) != 0;
+                }
+            } else if (res == -EINTR || res == -EAGAIN) {
+                // Interrupted, or refused by a nonblocking read, before any data: the
+                // same read is queued again
+            } else if (res < 0) {
+                file->error = -res;
+                finished = 1;
+            } else if (res == 0) {
+                finished = 1;
+            } else {
+                file->done += (uint64_t)res;
+                finished = scan_emit(job, file, buffers + (size_t)s * job->chunk, (size_t)res) != 0;
+            }
+            if (!finished && scan_want(file) == 0) {
+                finished = 1;
+            }
+            if (!finished) {
+                scan_ring_read(&ring, fixed, buffers, job->chunk, slots, s, file);
+                continue;
+            }
+            if (slots[s].fd >= 0) {
+                close(slots[s].fd);
+            }
+            scan_emit(job, file, NULL, 0);
+            slots[s].busy = 0;
+            active--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (failed) {
+        // Reads may still be in flight into the buffers, so they are left mapped
+        for (int s = 0; s < depth; s++) {
+            if (slots[s].busy) {
+                job->files[slots[s].file].error = failed;
+                scan_emit(job, &job->files[slots[s].file], NULL, 0);
+            }
+        }
+        for (; next < job->count; next++) {
+            job->files[next].error = failed;
+            scan_emit(job, &job->files[next], NULL, 0);
+        }
+        scan_ring_close(&ring);
+        for (int s = 0; s < depth; s++) {
+            if (slots[s].busy && slots[s].fd >= 0) close(slots[s].fd);
+        }
+    } else {
+        scan_ring_close(&ring);
+        munmap(buffers, area);
+    }
+    free(slots);
+    return 0;
+}
+
+// Read files through the scanning layer. SCAN_AUTO and a depth of 0 take the
+// TRIMORPH_SCAN_BACKEND and TRIMORPH_SCAN_DEPTH settings. Returns the backend used.
+static scan_backend_t scan_files(scan_backend_t backend, int depth, scan_file_t* files, size_t count, scan_fn fn,
+                                 void* ctx, int serial) {
+    const char* env = getenv("TRIMORPH_SCAN_BACKEND");
+    if (backend == SCAN_AUTO && env != NULL) {
+        backend = strcmp(env, "pread") == 0 ? SCAN_PREAD : strcmp(env, "io_uring") == 0 ? SCAN_IO_URING : SCAN_AUTO;
+    }
+    if (depth <= 0) {
+        env = getenv("TRIMORPH_SCAN_DEPTH");
+        depth = env != NULL ? (int)strtol(env, NULL, 10) : 0;
+        depth = depth > 0 ? depth : SCAN_DEFAULT_DEPTH;
+    }
+    depth = depth > SCAN_MAX_DEPTH ? SCAN_MAX_DEPTH : depth;
+    // No more slots than files, and no bigger buffers than the largest read: checking
+    // the first byte of a few packages should not map and pin depth * SCAN_CHUNK
+    depth = count > 0 && (size_t)depth > count ? (int)count : depth;
+    size_t chunk = 0;
+    for (size_t i = 0; i < count && chunk < SCAN_CHUNK; i++) {
+        uint64_t want = files[i].limit == 0 || files[i].limit > SCAN_CHUNK ? SCAN_CHUNK : files[i].limit;
+        chunk = want > chunk ? (size_t)want : chunk;
+    }
+    chunk = (chunk + 4095) & ~(size_t)4095;  // Whole pages, as registered buffers want
+
+    scan_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.files = files;
+    job.count = count;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.serial = serial;
+    job.chunk = chunk;
+    pthread_mutex_init(&job.lock, NULL);
+    for (size_t i = 0; i < count; i++) {
+        files[i].done = 0;
+        files[i].error = 0;
+    }
+    scan_backend_t used = SCAN_PREAD;
+    if (count > 0 && backend != SCAN_PREAD && scan_uring(&job, depth) == 0) {
+        used = SCAN_IO_URING;
+    } else if (count > 0) {
+        scan_pool(&job, depth);
+    }
+    pthread_mutex_destroy(&job.lock);
+    return used;
+}
+
+// Check that package files can be installed: safe paths of a known format, naming
+// readable, non-empty regular files. Returns 0, or -1 after reporting the first problem.
+static int check_install_files(int count, char* files[]) {
+    scan_file_t* scan = calloc(count > 0 ? (size_t)count : 1, sizeof(scan_file_t));
+    if (scan == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int nscan = 0;
+    for (int i = 0; i < count; i++) {
+        // Validate file path first
+        if (!validate_file_path(files[i])) {
+            free(scan);
+            return -1;
+        }
+
+        // Determine the package format from the longest matching extension
+        const char* format = package_format(files[i]);
+        if (format == NULL) {
+            const char* ext = strrchr(files[i], '.');
+            if (!ext) {
+                fprintf(stderr, "Error: Cannot determine package format for: %s\n", files[i]);
+            } else {
+                fprintf(stderr, "Error: Unsupported package format: %s\n", ext);
+            }
+            free(scan);
+            return -1;
+        }
+        if (count > 1 && strcmp(format, DELTA_EXT) == 0) {
+            fprintf(stderr, "Error: %s packages are installed one at a time\n", DELTA_EXT);
+            free(scan);
+            return -1;
+        }
+
+        // A plan may name packages that are only downloaded when it is executed
+        if (!(dry_run && strstr(files[i], "://") != NULL)) {
+            scan[nscan].path = files[i];
+            scan[nscan++].limit = 1;
+        }
+    }
+
+    // Open every file and read its first byte in one scan, instead of a stat per file
+    scan_files(SCAN_AUTO, 0, scan, (size_t)nscan, NULL, NULL, 0);
+    int result = 0;
+    for (int i = 0; result == 0 && i < nscan; i++) {
+        result = -1;
+        if (scan[i].error == ENOENT) {
+            fprintf(stderr, "Error: Package file does not exist: %s\n", scan[i].path);
+        } else if (scan[i].st.st_mode != 0 && !S_ISREG(scan[i].st.st_mode)) {
+            fprintf(stderr, "Error: Package file is not a regular file: %s\n", scan[i].path);
+        } else if (scan[i].error != 0) {
+            fprintf(stderr, "Error: Cannot read package file %s: %s\n", scan[i].path, strerror(scan[i].error));
+        } else if (scan[i].done == 0) {
+            fprintf(stderr, "Error: Package file is empty: %s\n", scan[i].path);
+        } else {
+            result = 0;
+        }
+    }
+    free(scan);
+    return result;
+}
+
+// Install local package files in one package manager transaction. Deltas are
+// rebuilt and installed one at a time. Every package counts in the metrics; the
+// transaction is recorded once in the history.
+int install_transaction(int count, char* files[]) {
+    if (check_install_files(count, files) != 0) {
+        return -1;
+    }
+
+    char labels[96];
+    for (int i = 0; i < count; i++) {
+        if (dry_run) {
+            printf("Install %s (%s package)\n", files[i], package_format(files[i]));
+        }
+        snprintf(labels, sizeof(labels), "subcommand=\"install\",format=\"%s\"", package_format(files[i]));
+        metrics_count("trimorph_operations_total", labels, 1);
+    }
+
+    // Fail before the package lists are refreshed if the set does not fit on disk
+    if (space_preflight(count, files) != 0) {
+        return -1;
+    }
+
+    const char* format = package_format(files[0]);
+    trimorph_result_t op;
+    time_t start = time(NULL);
+    int status = strcmp(format, DELTA_EXT) == 0 ? install_delta(files[0], &op) :
+                 trimorph_install_batch(tm, (const char* const*)files, count, &op);
+    int result = operation_exit_code(status, &op);
+    history_record("install", format, count, files, result, start, &op);
+    if (result == 0) {
+        owners_refresh();
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(labels, sizeof(labels), "format=\"%s\",result=\"%s\",exit_code=\"%d\"", package_format(files[i]),
+                 result == 0 ? "success" : "failure", result);
+        metrics_count("trimorph_installs_total", labels, 1);
+    }
+    return result;
+}
+
+// Install a local package file based on extension
+int install_local_package(const char* pkg_file) {
+    char* files[] = {(char*)pkg_file};
+    return install_transaction(1, files);
+}
+
+// SHA-256 context used for package checksums
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} sha256_ctx_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha256_block(sha256_ctx_t* ctx, const unsigned char* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t* ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(sha256_ctx_t* ctx, const void* data, size_t len) {
+    const unsigned char* p = data;
+    ctx->length += len;
+    while (len > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used == 64) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+// Finish the digest and write it as 64 lowercase hex characters
+void sha256_final_hex(sha256_ctx_t* ctx, char hex[65]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256_update(ctx, &pad, 1);
+    }
+    unsigned char len_be[8];
+    for (int i = 0; i < 8; i++) {
+        len_be[i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    sha256_update(ctx, len_be, 8);
+    for (int i = 0; i < 8; i++) {
+        snprintf(hex + i * 8, 9, "%08x", ctx->state[i]);
+    }
+}
+
+// Compute the SHA-256 of a whole file
+int sha256_file(const char* path, char hex[65]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    unsigned char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        sha256_update(&ctx, buf, (size_t)n);
+    }
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    sha256_final_hex(&ctx, hex);
+    return 0;
+}
+
+// Hash state of a file read by the scanner
+typedef struct {
+    sha256_ctx_t ctx;
+    char* hex;
+} sha256_scan_t;
+
+static int sha256_scan_chunk(scan_file_t* file, const unsigned char* data, size_t len, void* ctx) {
+    (void)ctx;
+    sha256_scan_t* hash = file->data;
+    if (len > 0) {
+        sha256_update(&hash->ctx, data, len);
+    } else if (file->error == 0) {
+        sha256_final_hex(&hash->ctx, hash->hex);
+    }
+    return 0;
+}
+
+// Compute the SHA-256 of many files in one scan, so their reads overlap. A file that
+// cannot be read gets an empty digest. Returns the number of such files, or -1.
+static long sha256_files(scan_backend_t backend, int depth, size_t count, const char* const paths[],
+                         char (*hex)[65]) {
+    scan_file_t* files = calloc(count ? count : 1, sizeof(scan_file_t));
+    sha256_scan_t* hashes = calloc(count ? count : 1, sizeof(sha256_scan_t));
+    if (files == NULL || hashes == NULL) {
+        free(files);
+        free(hashes);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        hex[i][0] = '\0';
+        sha256_init(&hashes[i].ctx);
+        hashes[i].hex = hex[i];
+        files[i].path = paths[i];
+        files[i].data = &hashes[i];
+    }
+    scan_files(backend, depth, files, count, sha256_scan_chunk, NULL, 0);
+    long failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        failed += files[i].error != 0;
+    }
+    free(files);
+    free(hashes);
+    return failed;
+}
+
+// Collect the regular files under a path for the scan benchmark; symlinks are not followed
+static int bench_collect(const char* path, char*** files, size_t* count, size_t* cap, uint64_t* bytes) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        fprintf(stderr, "Error: Cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        if (*count == *cap) {
+            size_t grown_cap = *cap ? *cap * 2 : 1024;
+            char** grown = realloc(*files, grown_cap * sizeof(char*));
+            if (grown == NULL) {
+                return -1;
+            }
+            *files = grown;
+            *cap = grown_cap;
+        }
+        if (((*files)[*count] = strdup(path)) == NULL) {
+            return -1;
+        }
+        (*count)++;
+        *bytes += (uint64_t)st.st_size;
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+    DIR* d = opendir(path);
+    if (d == NULL) {
+        return 0;
+    }
+    struct dirent* de;
+    int result = 0;
+    while (result == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) < (int)sizeof(child)) {
+            result = bench_collect(child, files, count, cap, bytes);
+        }
+    }
+    closedir(d);
+    return result;
+}
+
+// Hash every file under the given paths once per scan backend, each time from a cold
+// page cache, and compare the times and digests
+int scan_bench(int argc, char* argv[], int depth) {
+    char** files = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < argc; i++) {
+        if (bench_collect(argv[i], &files, &count, &cap, &bytes) != 0) {
+            for (size_t j = 0; j < count; j++) free(files[j]);
+            free(files);
+            return 1;
+        }
+    }
+    char (*digests[2])[65];
+    digests[0] = calloc(count ? count : 1, sizeof(*digests[0]));
+    digests[1] = calloc(count ? count : 1, sizeof(*digests[1]));
+    if (digests[0] == NULL || digests[1] == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        for (size_t j = 0; j < count; j++) free(files[j]);
+        free(files);
+        free(digests[0]);
+        free(digests[1]);
+        return 1;
+    }
+
+    printf("Hashing %zu files (%.1f MiB) from a cold page cache, queue depth %d\n", count, bytes / 1048576.0,
+           depth > 0 ? depth : SCAN_DEFAULT_DEPTH);
+    static const scan_backend_t backends[2] = {SCAN_PREAD, SCAN_IO_URING};
+    static const char* const names[2] = {"pread", "io_uring"};
+    double seconds[2] = {0, 0};
+    int ran[2] = {0, 0};
+    int result = 0;
+    for (int b = 0; b < 2; b++) {
+        // Clean pages are dropped; pages still waiting for writeback stay cached
+        for (size_t i = 0; i < count; i++) {
+            int fd = open(files[i], O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+        }
+        double start = now_seconds();
+        long failed = sha256_files(backends[b], depth, count, (const char* const*)files, digests[b]);
+        seconds[b] = now_seconds() - start;
+        if (backends[b] == SCAN_IO_URING && scan_uring_error != 0) {
+            printf("  %-9s unavailable: %s\n", names[b], strerror(scan_uring_error));
+            continue;
+        }
+        ran[b] = 1;
+        printf("  %-9s %7.2fs %9.1f MiB/s %9.0f files/s", names[b], seconds[b],
+               seconds[b] > 0 ? bytes / 1048576.0 / seconds[b] : 0.0, seconds[b] > 0 ? count / seconds[b] : 0.0);
+        if (failed != 0) {
+            printf("  (%ld unreadable)", failed);
+        }
+        printf("\n");
+    }
+    if (ran[0] && ran[1]) {
+        size_t differ = 0;
+        for (size_t i = 0; i < count; i++) {
+            differ += strcmp(digests[0][i], digests[1][i]) != 0;
+        }
+        if (differ != 0) {
+            fprintf(stderr, "Error: %zu file%s hashed differently by the two backends\n", differ,
+                    differ == 1 ? "" : "s");
+            result = 1;
+        } else {
+            printf("io_uring took %.2fx the pread time; digests agree\n",
+                   seconds[0] > 0 ? seconds[1] / seconds[0] : 1.0);
+        }
+    }
+    for (size_t j = 0; j < count; j++) free(files[j]);
+    free(files);
+    free(digests[0]);
+    free(digests[1]);
+    return result;
+}
+
+// SHA-1 of a buffer, needed for the apk index identity checksum
+static void sha1_buffer(const unsigned char* data, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint64_t bits = (uint64_t)len * 8;
+    size_t total = ((len + 8) / 64 + 1) * 64;
+
+    for (size_t off = 0; off < total; off += 64) {
+        unsigned char blk[64];
+        for (size_t i = 0; i < 64; i++) {
+            size_t pos = off + i;
+            if (pos < len) blk[i] = data[pos];
+            else if (pos == len) blk[i] = 0x80;
+            else if (pos >= total - 8) blk[i] = (unsigned char)(bits >> ((total - 1 - pos) * 8));
+            else blk[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)blk[i * 4] << 24 | (uint32_t)blk[i * 4 + 1] << 16 | (uint32_t)blk[i * 4 + 2] << 8 | blk[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = ROTL32(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROTL32(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) {
+        out[i] = (unsigned char)(h[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+// Standard base64 encoding into a NUL-terminated buffer
+static void base64_encode(const unsigned char* data, size_t len, char* out) {
+    static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) v |= data[i + 2];
+        out[o++] = tbl[(v >> 18) & 63];
+        out[o++] = tbl[(v >> 12) & 63];
+        out[o++] = i + 1 < len ? tbl[(v >> 6) & 63] : '=';
+        out[o++] = i + 2 < len ? tbl[v & 63] : '=';
+    }
+    out[o] = '\0';
+}
+
+// Start a decompressor reading a file from the given offset, returning a pipe with its
+// output. The decompressor stops at the end of its stream, so trailing archive members
+// after the offset are ignored.
+static int open_decompressor(const char* path, off_t offset, const char* tool, pid_t* pid_out) {
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    if (lseek(in, offset, SEEK_SET) < 0) {
+        close(in);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process: stdin is the file, stdout the pipe, diagnostics discarded
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(in, 0);
+        dup2(out[1], 1);
+        if (devnull >= 0) dup2(devnull, 2);
+        if (tool == NULL) {
+            execlp("cat", "cat", (char*)NULL);
+        } else {
+            execlp(tool, tool, "-dc", (char*)NULL);
+        }
+        _exit(127);
+    }
+    close(in);
+    close(out[1]);
+    if (pid < 0) {
+        close(out[0]);
+        return -1;
+    }
+    *pid_out = pid;
+    return out[0];
+}
+
+// Stop a decompressor early and reap it
+static void close_decompressor(int fd, pid_t pid) {
+    close(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// Read exactly len bytes from a pipe, returning 0 on success
+static int read_full(int fd, void* buf, size_t len) {
+    unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Scan a tar stream for the first member whose name matches, returning its contents
+// in a malloc'd NUL-terminated buffer. Members are skipped without being buffered.
+static char* tar_find_member(int fd, const char* const* names, size_t max_size) {
+    unsigned char hdr[512];
+    while (read_full(fd, hdr, sizeof(hdr)) == 0) {
+        if (hdr[0] == '\0') {
+            continue;  // Padding or end-of-archive blocks between concatenated segments
+        }
+        char name[101];
+        memcpy(name, hdr, 100);
+        name[100] = '\0';
+        char size_field[13];
+        memcpy(size_field, hdr + 124, 12);
+        size_field[12] = '\0';
+        size_t size = (size_t)strtoull(size_field, NULL, 8);
+        size_t padded = (size + 511) & ~(size_t)511;
+
+        int match = 0;
+        for (int i = 0; names[i] != NULL; i++) {
+            if (strcmp(name, names[i]) == 0) {
+                match = 1;
+            }
+        }
+        if (match && size <= max_size) {
+            char* data = malloc(padded + 1);
+            if (data == NULL || read_full(fd, data, padded) != 0) {
+                free(data);
+                return NULL;
+            }
+            data[size] = '\0';
+            return data;
+        }
+
+        // Skip this member's data
+        unsigned char skip[4096];
+        while (padded > 0) {
+            size_t take = padded < sizeof(skip) ? padded : sizeof(skip);
+            if (read_full(fd, skip, take) != 0) {
+                return NULL;
+            }
+            padded -= take;
+        }
+    }
+    return NULL;
+}
+
+// Decompressor for a compressed member, selected by its file name suffix
+static const char* decompressor_for(const char* name) {
+    size_t len = strlen(name);
+    if (len > 3 && strcmp(name + len - 3, ".gz") == 0) return "gzip";
+    if (len > 3 && strcmp(name + len - 3, ".xz") == 0) return "xz";
+    if (len > 4 && strcmp(name + len - 4, ".zst") == 0) return "zstd";
+    return NULL;
+}
+
+// Find a member of a .deb's ar archive by name prefix (control.tar, data.tar), giving
+// its full name and the offset of its contents. Returns 0 if found.
+static int deb_member(const char* path, const char* prefix, char member[17], off_t* offset_out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    char magic[8];
+    if (read_full(fd, magic, 8) != 0 || memcmp(magic, "!<arch>\n", 8) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    off_t offset = 8;
+    char hdr[60];
+    while (pread(fd, hdr, sizeof(hdr), offset) == (ssize_t)sizeof(hdr)) {
+        memcpy(member, hdr, 16);
+        member[16] = '\0';
+        for (int i = 15; i >= 0 && (member[i] == ' ' || member[i] == '/'); i--) {
+            member[i] = '\0';
+        }
+        char size_field[11];
+        memcpy(size_field, hdr + 48, 10);
+        size_field[10] = '\0';
+        off_t size = (off_t)strtoll(size_field, NULL, 10);
+        offset += sizeof(hdr);
+
+        if (strncmp(member, prefix, strlen(prefix)) == 0) {
+            close(fd);
+            *offset_out = offset;
+            return 0;
+        }
+        offset += size + (size & 1);
+    }
+    close(fd);
+    return -1;
+}
+
+// Read the control file of a .deb: find control.tar.* and stream it through the
+// matching decompressor
+static char* read_deb_control(const char* path) {
+    char member[17];
+    off_t offset;
+    if (deb_member(path, "control.tar", member, &offset) != 0) {
+        return NULL;
+    }
+    pid_t pid;
+    int pipe_fd = open_decompressor(path, offset, decompressor_for(member), &pid);
+    if (pipe_fd < 0) {
+        return NULL;
+    }
+    static const char* const names[] = {"./control", "control", NULL};
+    char* control = tar_find_member(pipe_fd, names, 1 << 20);
+    close_decompressor(pipe_fd, pid);
+    return control;
+}
+
+// Read the .PKGINFO of an Arch or Alpine package
+static char* read_pkginfo(const char* path, const char* tool) {
+    pid_t pid;
+    int pipe_fd = open_decompressor(path, 0, tool, &pid);
+    if (pipe_fd < 0) {
+        return NULL;
+    }
+    static const char* const names[] = {".PKGINFO", NULL};
+    char* info = tar_find_member(pipe_fd, names, 1 << 20);
+    close_decompressor(pipe_fd, pid);
+    return info;
+}
+
+// Check whether a byte range of a file is a complete, valid gzip stream
+static int is_gzip_range(int fd, off_t start, off_t end) {
+    int in[2];
+    if (pipe2(in, O_CLOEXEC) != 0) {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(in[0], 0);
+        if (devnull >= 0) {
+            dup2(devnull, 1);
+            dup2(devnull, 2);
+        }
+        execlp("gzip", "gzip", "-t", (char*)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    if (pid < 0) {
+        close(in[1]);
+        return 0;
+    }
+
+    unsigned char buf[65536];
+    off_t pos = start;
+    while (pos < end) {
+        size_t take = end - pos < (off_t)sizeof(buf) ? (size_t)(end - pos) : sizeof(buf);
+        ssize_t n = pread(fd, buf, take, pos);
+        if (n <= 0 || write(in[1], buf, (size_t)n) != n) {
+            break;
+        }
+        pos += n;
+    }
+    close(in[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    return pos == end && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Compute the apk index identity (C:Q1...), the SHA-1 of the control gzip stream.
+// An apk is a signature stream (optional), a control stream and a data stream glued
+// together, so stream boundaries are found by testing candidate gzip headers.
+static int apk_control_checksum(const char* path, off_t file_size, char* out, size_t out_len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    off_t limit = file_size < (4 << 20) ? file_size : (4 << 20);
+    unsigned char* head = malloc((size_t)limit);
+    if (head == NULL || pread(fd, head, (size_t)limit, 0) != limit) {
+        free(head);
+        close(fd);
+        return -1;
+    }
+
+    // Collect the first three stream boundaries
+    off_t bounds[3] = {0, -1, -1};
+    int found = 1;
+    for (off_t c = 18; c + 3 <= limit && found < 3; c++) {
+        if (head[c] == 0x1f && head[c + 1] == 0x8b && head[c + 2] == 0x08 &&
+            is_gzip_range(fd, bounds[found - 1], c)) {
+            bounds[found++] = c;
+        }
+    }
+    close(fd);
+
+    // With a signature stream the control stream is the second one
+    int has_signature = found == 3;
+    off_t start = has_signature ? bounds[1] : bounds[0];
+    off_t end = has_signature ? bounds[2] : bounds[1];
+    if (end <= start) {
+        free(head);
+        return -1;
+    }
+
+    unsigned char digest[20];
+    char b64[32];
+    sha1_buffer(head + start, (size_t)(end - start), digest);
+    base64_encode(digest, sizeof(digest), b64);
+    snprintf(out, out_len, "Q1%s", b64);
+    free(head);
+    return 0;
+}
+
+// Repository index formats understood by "repo index"
+typedef enum { REPO_DEB, REPO_ARCH, REPO_APK } repo_format_t;
+
+// One package file in a repository directory
+typedef struct {
+    char* name;                // File name inside the repository directory
+    off_t size;
+    struct timespec mtime;
+    char sha256[65];
+    char apk_checksum[40];     // C: field for APKINDEX, empty for other formats
+    char* meta;                // Raw control / .PKGINFO text
+    int cached;                // Nonzero if the metadata came from the sidecar cache
+} repo_entry_t;
+
+// Shared state of the indexer thread pool
+typedef struct {
+    const char* dir;
+    repo_format_t format;
+    repo_entry_t* entries;
+    size_t count;
+    repo_entry_t* cache;       // Sidecar cache sorted by name
+    size_t cache_count;
+    size_t next;               // Next entry to process, claimed atomically
+    size_t failed;
+} repo_index_job_t;
+
+static int repo_entry_cmp(const void* a, const void* b) {
+    return strcmp(((const repo_entry_t*)a)->name, ((const repo_entry_t*)b)->name);
+}
+
+// Check whether a file name belongs to the repository format
+static int repo_file_matches(const char* name, repo_format_t format) {
+    size_t len = strlen(name);
+    const char* suffixes[4] = {NULL, NULL, NULL, NULL};
+    if (format == REPO_DEB) {
+        suffixes[0] = ".deb";
+    } else if (format == REPO_ARCH) {
+        suffixes[0] = ".pkg.tar.zst";
+        suffixes[1] = ".pkg.tar.xz";
+        suffixes[2] = ".pkg.tar.gz";
+    } else {
+        suffixes[0] = ".apk";
+    }
+    for (int i = 0; suffixes[i] != NULL; i++) {
+        size_t slen = strlen(suffixes[i]);
+        if (len > slen && strcmp(name + len - slen, suffixes[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Escape newlines, tabs and backslashes so metadata fits on one cache line
+static void cache_escape(FILE* f, const char* s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '\n') fputs("\\n", f);
+        else if (*s == '\t') fputs("\\t", f);
+        else if (*s == '\\') fputs("\\\\", f);
+        else fputc(*s, f);
+    }
+}
+
+static void cache_unescape(char* s) {
+    char* o = s;
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+            *o++ = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o = '\0';
+}
+
+// Load the sidecar cache: one line per package with name, size, mtime, hash and metadata
+static repo_entry_t* load_repo_cache(const char* cache_path, size_t* count_out) {
+    *count_out = 0;
+    FILE* f = fopen(cache_path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    size_t cap = 0;
+    size_t count = 0;
+    repo_entry_t* cache = NULL;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, f)) > 0) {
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+        char* fields[6];
+        char* p = line;
+        int nf = 0;
+        for (; nf < 6; nf++) {
+            fields[nf] = p;
+            char* tab = strchr(p, '\t');
+            if (tab == NULL) {
+                nf++;
+                break;
+            }
+            *tab = '\0';
+            p = tab + 1;
+        }
+        if (nf != 6) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            repo_entry_t* grown = realloc(cache, cap * sizeof(*cache));
+            if (grown == NULL) break;
+            cache = grown;
+        }
+        repo_entry_t* e = &cache[count];
+        memset(e, 0, sizeof(*e));
+        e->name = strdup(fields[0]);
+        e->size = (off_t)strtoll(fields[1], NULL, 10);
+        e->mtime.tv_sec = (time_t)strtoll(fields[2], &p, 10);
+        e->mtime.tv_nsec = *p == '.' ? strtol(p + 1, NULL, 10) : 0;
+        snprintf(e->sha256, sizeof(e->sha256), "%s", fields[3]);
+        snprintf(e->apk_checksum, sizeof(e->apk_checksum), "%s", strcmp(fields[4], "-") == 0 ? "" : fields[4]);
+        cache_unescape(fields[5]);
+        e->meta = strdup(fields[5]);
+        count++;
+    }
+    free(line);
+    fclose(f);
+    qsort(cache, count, sizeof(*cache), repo_entry_cmp);
+    *count_out = count;
+    return cache;
+}
+
+// Cache record of a package, if the cache has one
+static repo_entry_t* repo_cache_find(const repo_index_job_t* job, const repo_entry_t* e) {
+    repo_entry_t key;
+    key.name = e->name;
+    return job->cache_count ? bsearch(&key, job->cache, job->cache_count, sizeof(key), repo_entry_cmp) : NULL;
+}
+
+// Whether a cache record still matches the file by size and mtime
+static int repo_cache_fresh(const repo_entry_t* hit, const repo_entry_t* e) {
+    return hit != NULL && hit->size == e->size && hit->mtime.tv_sec == e->mtime.tv_sec &&
+           hit->mtime.tv_nsec == e->mtime.tv_nsec;
+}
+
+// Extract the metadata of one package, reusing the cache when size and mtime match, or
+// when the content hash matches after a touch. Changed packages have been hashed.
+static int index_one_package(repo_index_job_t* job, repo_entry_t* e) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", job->dir, e->name);
+
+    repo_entry_t* hit = repo_cache_find(job, e);
+    if (repo_cache_fresh(hit, e)) {
+        memcpy(e->sha256, hit->sha256, sizeof(e->sha256));
+        memcpy(e->apk_checksum, hit->apk_checksum, sizeof(e->apk_checksum));
+        e->meta = hit->meta;
+        e->cached = 1;
+        return 0;
+    }
+
+    if (e->sha256[0] == '\0') {
+        return -1;
+    }
+    if (hit != NULL && hit->size == e->size && strcmp(hit->sha256, e->sha256) == 0) {
+        memcpy(e->apk_checksum, hit->apk_checksum, sizeof(e->apk_checksum));
+        e->meta = hit->meta;
+        e->cached = 1;
+        return 0;
+    }
+
+    if (job->format == REPO_DEB) {
+        e->meta = read_deb_control(path);
+    } else if (job->format == REPO_ARCH) {
+        e->meta = read_pkginfo(path, decompressor_for(e->name));
+    } else {
+        e->meta = read_pkginfo(path, "gzip");
+        if (e->meta != NULL && apk_control_checksum(path, e->size, e->apk_checksum, sizeof(e->apk_checksum)) != 0) {
+            free(e->meta);
+            e->meta = NULL;
+        }
+    }
+    return e->meta != NULL ? 0 : -1;
+}
+
+// Worker thread: claim packages until none are left
+static void* repo_index_worker(void* arg) {
+    repo_index_job_t* job = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        if (index_one_package(job, &job->entries[i]) != 0) {
+            fprintf(stderr, "Warning: Could not read package metadata from %s\n", job->entries[i].name);
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Collect the values of a key from .PKGINFO text ("key = value" lines), joined by sep
+static void pkginfo_values(const char* info, const char* key, const char* sep, char* out, size_t out_len) {
+    size_t used = 0;
+    size_t key_len = strlen(key);
+    out[0] = '\0';
+    for (const char* line = info; line != NULL && *line != '\0'; ) {
+        const char* eol = strchr(line, '\n');
+        size_t len = eol ? (size_t)(eol - line) : strlen(line);
+        if (len > key_len + 3 && strncmp(line, key, key_len) == 0 && strncmp(line + key_len, " = ", 3) == 0) {
+            int n = snprintf(out + used, out_len - used, "%s%.*s", used ? sep : "",
+                             (int)(len - key_len - 3), line + key_len + 3);
+            if (n < 0 || (size_t)n >= out_len - used) {
+                break;
+            }
+            used += (size_t)n;
+        }
+        line = eol ? eol + 1 : NULL;
+    }
+}
+
+// Append one member to a tar stream
+static void tar_append(FILE* f, const char* name, const char* data, size_t len, int is_dir) {
+    unsigned char hdr[512];
+    memset(hdr, 0, sizeof(hdr));
+    snprintf((char*)hdr, 100, "%s", name);
+    snprintf((char*)hdr + 100, 8, "%07o", is_dir ? 0755 : 0644);
+    snprintf((char*)hdr + 108, 8, "%07o", 0);
+    snprintf((char*)hdr + 116, 8, "%07o", 0);
+    snprintf((char*)hdr + 124, 12, "%011zo", len);
+    snprintf((char*)hdr + 136, 12, "%011llo", (unsigned long long)time(NULL));
+    hdr[156] = is_dir ? '5' : '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+    memset(hdr + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += hdr[i];
+    }
+    snprintf((char*)hdr + 148, 8, "%06o", sum);
+    fwrite(hdr, 1, sizeof(hdr), f);
+    if (len > 0) {
+        static const char zeros[512];
+        fwrite(data, 1, len, f);
+        fwrite(zeros, 1, (512 - len % 512) % 512, f);
+    }
+}
+
+// Open a temporary file next to the destination for an atomic replace
+static FILE* open_atomic(const char* dest, char* tmp_path, size_t tmp_len) {
+    snprintf(tmp_path, tmp_len, "%s.tmpXXXXXX", dest);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return NULL;
+    }
+    fchmod(fd, 0644);
+    FILE* f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp_path);
+    }
+    return f;
+}
+
+// Flush, sync and rename a temporary file over its destination
+static int commit_atomic(FILE* f, const char* tmp_path, const char* dest) {
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, dest) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Start a filter program (a compressor or decompressor) with space-separated
+// arguments, reading in_fd and writing out_fd. Returns the child pid or -1.
+static pid_t spawn_filter(const char* tool, const char* args, int in_fd, int out_fd) {
+    char arg_copy[256];
+    char* argv[16];
+    int argc = 0;
+    snprintf(arg_copy, sizeof(arg_copy), "%s", args ? args : "");
+    argv[argc++] = (char*)tool;
+    for (char* tok = strtok(arg_copy, " "); tok != NULL && argc < 15; tok = strtok(NULL, " ")) {
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(in_fd, 0);
+        dup2(out_fd, 1);
+        if (devnull >= 0) dup2(devnull, 2);
+        execvp(tool, argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Wait for a filter and report whether it succeeded
+static int wait_filter(pid_t pid) {
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Write a buffer to a file through "gzip -cn", atomically
+static int write_gzip_atomic(const char* dest, const char* data, size_t len) {
+    char tmp_path[MAX_PATH];
+    FILE* f = open_atomic(dest, tmp_path, sizeof(tmp_path));
+    if (f == NULL) {
+        return -1;
+    }
+    int in[2];
+    if (pipe2(in, O_CLOEXEC) != 0) {
+        fclose(f);
+        unlink(tmp_path);
+        return -1;
+    }
+    pid_t pid = spawn_filter("gzip", "-cn9", in[0], fileno(f));
+    close(in[0]);
+    size_t done = 0;
+    while (pid > 0 && done < len) {
+        ssize_t n = write(in[1], data + done, len - done);
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(in[1]);
+    if (wait_filter(pid) != 0 || done != len) {
+        fclose(f);
+        unlink(tmp_path);
+        return -1;
+    }
+    return commit_atomic(f, tmp_path, dest);
+}
+
+// Write the Debian Packages and Packages.gz files
+static int write_deb_index(const char* dir, repo_entry_t* entries, size_t count) {
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* mem = open_memstream(&buf, &len);
+    if (mem == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].meta == NULL) continue;
+        const char* control = entries[i].meta;
+        size_t clen = strlen(control);
+        while (clen > 0 && control[clen - 1] == '\n') clen--;
+        fprintf(mem, "%.*s\nFilename: ./%s\nSize: %lld\nSHA256: %s\n\n", (int)clen, control,
+                entries[i].name, (long long)entries[i].size, entries[i].sha256);
+    }
+    fclose(mem);
+
+    char dest[MAX_PATH];
+    char tmp_path[MAX_PATH];
+    snprintf(dest, sizeof(dest), "%s/Packages", dir);
+    FILE* f = open_atomic(dest, tmp_path, sizeof(tmp_path));
+    int result = -1;
+    if (f != NULL) {
+        fwrite(buf, 1, len, f);
+        result = commit_atomic(f, tmp_path, dest);
+    }
+    snprintf(dest, sizeof(dest), "%s/Packages.gz", dir);
+    if (result == 0) {
+        result = write_gzip_atomic(dest, buf, len);
+    }
+    free(buf);
+    return result;
+}
+
+// Write the pacman sync database (<name>.db.tar.gz plus the <name>.db link)
+static int write_arch_index(const char* dir, const char* repo_name, repo_entry_t* entries, size_t count) {
+    static const struct { const char* section; const char* key; } fields[] = {
+        {"NAME", "pkgname"}, {"BASE", "pkgbase"}, {"VERSION", "pkgver"}, {"DESC", "pkgdesc"},
+        {"GROUPS", "group"}, {"URL", "url"}, {"LICENSE", "license"}, {"ARCH", "arch"},
+        {"BUILDDATE", "builddate"}, {"PACKAGER", "packager"}, {"REPLACES", "replaces"},
+        {"CONFLICTS", "conflict"}, {"PROVIDES", "provides"}, {"DEPENDS", "depend"},
+        {"OPTDEPENDS", "optdepend"}, {"MAKEDEPENDS", "makedepend"}, {"CHECKDEPENDS", "checkdepend"},
+        {NULL, NULL}
+    };
+
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* tar = open_memstream(&buf, &len);
+    if (tar == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].meta == NULL) continue;
+        char name[256], version[256], isize[32], value[8192];
+        pkginfo_values(entries[i].meta, "pkgname", "", name, sizeof(name));
+        pkginfo_values(entries[i].meta, "pkgver", "", version, sizeof(version));
+        pkginfo_values(entries[i].meta, "size", "", isize, sizeof(isize));
+
+        char* desc = NULL;
+        size_t desc_len = 0;
+        FILE* d = open_memstream(&desc, &desc_len);
+        if (d == NULL) continue;
+        fprintf(d, "%%FILENAME%%\n%s\n\n", entries[i].name);
+        for (int f = 0; fields[f].section != NULL; f++) {
+            pkginfo_values(entries[i].meta, fields[f].key, "\n", value, sizeof(value));
+            if (value[0] != '\0') {
+                fprintf(d, "%%%s%%\n%s\n\n", fields[f].section, value);
+            }
+            if (strcmp(fields[f].section, "DESC") == 0) {
+                fprintf(d, "%%CSIZE%%\n%lld\n\n%%ISIZE%%\n%s\n\n%%SHA256SUM%%\n%s\n\n",
+                        (long long)entries[i].size, isize[0] ? isize : "0", entries[i].sha256);
+            }
+        }
+        fclose(d);
+
+        char entry_dir[600], entry_desc[620];
+        snprintf(entry_dir, sizeof(entry_dir), "%s-%s/", name, version);
+        snprintf(entry_desc, sizeof(entry_desc), "%s-%s/desc", name, version);
+        tar_append(tar, entry_dir, NULL, 0, 1);
+        tar_append(tar, entry_desc, desc, desc_len, 0);
+        free(desc);
+    }
+    static const char end_blocks[1024];
+    fwrite(end_blocks, 1, sizeof(end_blocks), tar);
+    fclose(tar);
+
+    char dest[MAX_PATH];
+    char link_path[MAX_PATH];
+    char link_target[MAX_PATH];
+    snprintf(dest, sizeof(dest), "%s/%s.db.tar.gz", dir, repo_name);
+    int result = write_gzip_atomic(dest, buf, len);
+    free(buf);
+    if (result != 0) {
+        return -1;
+    }
+
+    // Swap the .db link atomically too
+    snprintf(link_target, sizeof(link_target), "%s.db.tar.gz", repo_name);
+    snprintf(link_path, sizeof(link_path), "%s/%s.db.tmplink", dir, repo_name);
+    snprintf(dest, sizeof(dest), "%s/%s.db", dir, repo_name);
+    unlink(link_path);
+    if (symlink(link_target, link_path) != 0 || rename(link_path, dest) != 0) {
+        unlink(link_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Write the Alpine APKINDEX.tar.gz
+static int write_apk_index(const char* dir, const char* repo_name, repo_entry_t* entries, size_t count) {
+    static const struct { const char* field; const char* key; const char* sep; } fields[] = {
+        {"P", "pkgname", " "}, {"V", "pkgver", " "}, {"A", "arch", " "}, {"I", "size", " "},
+        {"T", "pkgdesc", " "}, {"U", "url", " "}, {"L", "license", " "}, {"o", "origin", " "},
+        {"m", "maintainer", " "}, {"t", "builddate", " "}, {"c", "commit", " "},
+        {"D", "depend", " "}, {"p", "provides", " "}, {"i", "install_if", " "},
+        {NULL, NULL, NULL}
+    };
+
+    char* index = NULL;
+    size_t index_len = 0;
+    FILE* idx = open_memstream(&index, &index_len);
+    if (idx == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].meta == NULL) continue;
+        char value[8192];
+        fprintf(idx, "C:%s\n", entries[i].apk_checksum);
+        for (int f = 0; fields[f].field != NULL; f++) {
+            pkginfo_values(entries[i].meta, fields[f].key, fields[f].sep, value, sizeof(value));
+            if (value[0] != '\0') {
+                fprintf(idx, "%s:%s\n", fields[f].field, value);
+            }
+            if (strcmp(fields[f].field, "A") == 0) {
+                fprintf(idx, "S:%lld\n", (long long)entries[i].size);
+            }
+        }
+        fputc('\n', idx);
+    }
+    fclose(idx);
+
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* tar = open_memstream(&buf, &len);
+    if (tar == NULL) {
+        free(index);
+        return -1;
+    }
+    tar_append(tar, "DESCRIPTION", repo_name, strlen(repo_name), 0);
+    tar_append(tar, "APKINDEX", index, index_len, 0);
+    static const char end_blocks[1024];
+    fwrite(end_blocks, 1, sizeof(end_blocks), tar);
+    fclose(tar);
+    free(index);
+
+    char dest[MAX_PATH];
+    snprintf(dest, sizeof(dest), "%s/APKINDEX.tar.gz", dir);
+    int result = write_gzip_atomic(dest, buf, len);
+    free(buf);
+    return result;
+}
+
+// Write the sidecar cache for the next run, atomically
+static int write_repo_cache(const char* cache_path, repo_entry_t* entries, size_t count) {
+    char tmp_path[MAX_PATH];
+    FILE* f = open_atomic(cache_path, tmp_path, sizeof(tmp_path));
+    if (f == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        repo_entry_t* e = &entries[i];
+        if (e->meta == NULL) continue;
+        fprintf(f, "%s\t%lld\t%lld.%09ld\t%s\t%s\t", e->name, (long long)e->size,
+                (long long)e->mtime.tv_sec, e->mtime.tv_nsec, e->sha256,
+                e->apk_checksum[0] ? e->apk_checksum : "-");
+        cache_escape(f, e->meta);
+        fputc('\n', f);
+    }
+    return commit_atomic(f, tmp_path, cache_path);
+}
+
+// Index a directory of package files for deb, arch or apk repositories
+int repo_index(const char* dir, const char* format_name, const char* repo_name) {
+    if (!validate_file_path(dir)) {
+        return -1;
+    }
+
+    repo_format_t format;
+    if (strcmp(format_name, "deb") == 0) {
+        format = REPO_DEB;
+    } else if (strcmp(format_name, "arch") == 0) {
+        format = REPO_ARCH;
+    } else if (strcmp(format_name, "apk") == 0) {
+        format = REPO_APK;
+    } else {
+        fprintf(stderr, "Error: Unsupported repository format: %s (expected deb, arch or apk)\n", format_name);
+        return -1;
+    }
+
+    char resolved[PATH_MAX];
+    if (realpath(dir, resolved) == NULL) {
+        fprintf(stderr, "Error: Repository directory does not exist: %s\n", dir);
+        return -1;
+    }
+    if (repo_name == NULL) {
+        repo_name = basename(resolved);
+    }
+
+    DIR* d = opendir(resolved);
+    if (d == NULL) {
+        fprintf(stderr, "Error: Cannot open repository directory: %s\n", dir);
+        return -1;
+    }
+
+    // Collect the package files with their size and mtime
+    repo_index_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.dir = resolved;
+    job.format = format;
+    size_t cap = 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || !repo_file_matches(de->d_name, format)) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (job.count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            repo_entry_t* grown = realloc(job.entries, cap * sizeof(*job.entries));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                closedir(d);
+                return -1;
+            }
+            job.entries = grown;
+        }
+        repo_entry_t* e = &job.entries[job.count++];
+        memset(e, 0, sizeof(*e));
+        e->name = strdup(de->d_name);
+        e->size = st.st_size;
+        e->mtime = st.st_mtim;
+    }
+    closedir(d);
+    if (job.count > 0) {
+        qsort(job.entries, job.count, sizeof(*job.entries), repo_entry_cmp);
+    }
+
+    char cache_path[PATH_MAX + 32];
+    snprintf(cache_path, sizeof(cache_path), "%s/.trimorph-index-%s.cache", resolved, format_name);
+    job.cache = load_repo_cache(cache_path, &job.cache_count);
+
+    // Hash the new and changed packages in one scan, so their reads overlap rather
+    // than each worker waiting on a file of its own
+    char** hash_paths = calloc(job.count ? job.count : 1, sizeof(char*));
+    char (*digests)[65] = calloc(job.count ? job.count : 1, sizeof(*digests));
+    size_t* hash_index = calloc(job.count ? job.count : 1, sizeof(size_t));
+    size_t nhash = 0;
+    for (size_t i = 0; hash_paths != NULL && digests != NULL && hash_index != NULL && i < job.count; i++) {
+        if (!repo_cache_fresh(repo_cache_find(&job, &job.entries[i]), &job.entries[i])) {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "%s/%s", resolved, job.entries[i].name);
+            if ((hash_paths[nhash] = strdup(path)) == NULL) {
+                break;
+            }
+            hash_index[nhash++] = i;
+        }
+    }
+    // A package left without a digest fails to index
+    if (hash_paths != NULL && digests != NULL && hash_index != NULL &&
+        sha256_files(SCAN_AUTO, 0, nhash, (const char* const*)hash_paths, digests) >= 0) {
+        for (size_t i = 0; i < nhash; i++) {
+            memcpy(job.entries[hash_index[i]].sha256, digests[i], sizeof(digests[i]));
+        }
+    }
+    for (size_t i = 0; i < nhash; i++) {
+        free(hash_paths[i]);
+    }
+    free(hash_paths);
+    free(digests);
+    free(hash_index);
+
+    // Extract metadata on a thread pool; decompressor pipes may close early
+    struct sigaction ignore_pipe, old_pipe;
+    memset(&ignore_pipe, 0, sizeof(ignore_pipe));
+    ignore_pipe.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore_pipe, &old_pipe);
+    int nthreads = parallel_jobs > 0 ? (int)parallel_jobs : 1;
+    if ((size_t)nthreads > job.count) {
+        nthreads = job.count > 0 ? (int)job.count : 1;
+    }
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; threads != NULL && t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, repo_index_worker, &job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        repo_index_worker(&job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    size_t reused = 0;
+    for (size_t i = 0; i < job.count; i++) {
+        reused += job.entries[i].cached;
+    }
+
+    int result;
+    if (format == REPO_DEB) {
+        result = write_deb_index(resolved, job.entries, job.count);
+    } else if (format == REPO_ARCH) {
+        result = write_arch_index(resolved, repo_name, job.entries, job.count);
+    } else {
+        result = write_apk_index(resolved, repo_name, job.entries, job.count);
+    }
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    if (result == 0 && write_repo_cache(cache_path, job.entries, job.count) != 0) {
+        fprintf(stderr, "Warning: Could not write index cache %s\n", cache_path);
+    }
+
+    if (result != 0) {
+        fprintf(stderr, "Error: Failed to write %s repository index in %s\n", format_name, dir);
+    } else {
+        printf("Indexed %zu packages (%zu read, %zu from cache, %zu failed)\n", job.count,
+               job.count - reused - job.failed, reused, job.failed);
+    }
+
+    for (size_t i = 0; i < job.count; i++) {
+        if (!job.entries[i].cached) free(job.entries[i].meta);
+        free(job.entries[i].name);
+    }
+    for (size_t i = 0; i < job.cache_count; i++) {
+        free(job.cache[i].meta);
+        free(job.cache[i].name);
+    }
+    free(job.entries);
+    free(job.cache);
+    return result;
+}
+
+// Delta files start with this magic line, followed by "key value" header lines, a blank
+// line and a stream of copy/literal operations. The whole file is gzip-compressed.
+#define DELTA_MAGIC "TRIMORPH-DELTA 1"
+
+// Content-defined chunking parameters: 8 KiB average, 2 KiB minimum, 64 KiB maximum
+#define CDC_MIN_CHUNK 2048
+#define CDC_MAX_CHUNK 65536
+#define CDC_MASK 0x1fffULL
+
+// Compressors whose output can be reproduced bit-for-bit from the payload, with the
+// settings tried when making a delta (distribution defaults first)
+static const struct {
+    const char* ext;
+    const char* tool;
+    const char* levels[5];
+} delta_codecs[] = {
+    {".pkg.tar.zst", "zstd", {"-q -c --ultra -20", "-q -c -19", "-q -c", NULL, NULL}},
+    {".pkg.tar.xz", "xz", {"-c -6", "-c -T0", "-c -9", "-c -9e", NULL}},
+    {".pkg.tar.gz", "gzip", {"-c -n -6", "-c -n -9", NULL, NULL, NULL}},
+    {NULL, NULL, {NULL, NULL, NULL, NULL, NULL}}  // Sentinel
+};
+
+// Copy and literal operations in the delta stream
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_END 'E'
+
+// Header of a delta file
+typedef struct {
+    char base_name[NAME_MAX + 1];
+    char target_name[NAME_MAX + 1];
+    char base_sha256[65];
+    char target_sha256[65];
+    char payload_sha256[65];   // Uncompressed payload of the target, payload mode only
+    char tool[16];             // Compressor, empty for raw mode
+    char level[64];            // Compressor arguments that reproduce the target
+} delta_header_t;
+
+// One chunk of the base file, stored in an open-addressing table keyed by fingerprint
+typedef struct {
+    uint64_t fingerprint;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t used;
+} delta_chunk_t;
+
+// Gear table for the rolling hash, filled deterministically from splitmix64
+static uint64_t gear_table[256];
+
+static void init_gear_table() {
+    uint64_t x = 0x5452494d4f525048ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the next content-defined chunk starting at data
+static size_t cdc_next_chunk(const unsigned char* data, size_t len) {
+    if (len <= CDC_MIN_CHUNK) {
+        return len;
+    }
+    size_t limit = len < CDC_MAX_CHUNK ? len : CDC_MAX_CHUNK;
+    uint64_t hash = 0;
+    for (size_t i = CDC_MIN_CHUNK; i < limit; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+        if ((hash & CDC_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+// 64-bit FNV-1a fingerprint of a chunk
+static uint64_t chunk_fingerprint(const unsigned char* data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Map a file read-only, returning NULL for empty files with *len set to 0
+static unsigned char* map_file(int fd, size_t* len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return MAP_FAILED;
+    }
+    *len = (size_t)st.st_size;
+    if (*len == 0) {
+        return NULL;
+    }
+    return mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+}
+
+// Create an unlinked temporary file for decompressed payloads
+static int open_scratch_file() {
+    const char* tmpdir = getenv("TMPDIR");
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/trimorph-XXXXXX", tmpdir ? tmpdir : "/var/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+// Run a filter from one file to another, both from their start
+static int filter_file(const char* tool, const char* args, int in_fd, int out_fd) {
+    if (lseek(in_fd, 0, SEEK_SET) < 0 || ftruncate(out_fd, 0) != 0 || lseek(out_fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+    return wait_filter(spawn_filter(tool, args, in_fd, out_fd));
+}
+
+// Compute the SHA-256 of an open file from its start
+static int sha256_fd(int fd, char hex[65]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    unsigned char buf[65536];
+    ssize_t n;
+    off_t pos = 0;
+    while ((n = pread(fd, buf, sizeof(buf), pos)) > 0) {
+        sha256_update(&ctx, buf, (size_t)n);
+        pos += n;
+    }
+    if (n < 0) {
+        return -1;
+    }
+    sha256_final_hex(&ctx, hex);
+    return 0;
+}
+
+// Find the codec for a package file name, -1 if its payload cannot be reproduced
+static int find_delta_codec(const char* name) {
+    size_t len = strlen(name);
+    for (int i = 0; delta_codecs[i].ext != NULL; i++) {
+        size_t ext_len = strlen(delta_codecs[i].ext);
+        if (len > ext_len && strcmp(name + len - ext_len, delta_codecs[i].ext) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Write the copy/literal operations turning base into target
+static int write_delta_ops(FILE* out, const unsigned char* base, size_t base_len,
+                           const unsigned char* target, size_t target_len, size_t* reused) {
+    // Index the base chunks; the table is kept at most half full
+    size_t slots = 1024;
+    while (slots < (base_len / 4096 + 1) * 2) {
+        slots *= 2;
+    }
+    delta_chunk_t* table = calloc(slots, sizeof(delta_chunk_t));
+    if (table == NULL) {
+        return -1;
+    }
+    for (size_t off = 0; off < base_len; ) {
+        size_t len = cdc_next_chunk(base + off, base_len - off);
+        uint64_t fp = chunk_fingerprint(base + off, len);
+        size_t slot = fp & (slots - 1);
+        while (table[slot].used && table[slot].fingerprint != fp) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (!table[slot].used) {
+            table[slot].fingerprint = fp;
+            table[slot].offset = off;
+            table[slot].length = (uint32_t)len;
+            table[slot].used = 1;
+        }
+        off += len;
+    }
+
+    // Emit target chunks as copies where the base has identical bytes
+    *reused = 0;
+    for (size_t off = 0; off < target_len; ) {
+        size_t len = cdc_next_chunk(target + off, target_len - off);
+        uint64_t fp = chunk_fingerprint(target + off, len);
+        size_t slot = fp & (slots - 1);
+        while (table[slot].used && table[slot].fingerprint != fp) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (table[slot].used && table[slot].length == len &&
+            memcmp(base + table[slot].offset, target + off, len) == 0) {
+            fprintf(out, "%c%llu %zu\n", DELTA_OP_COPY, (unsigned long long)table[slot].offset, len);
+            *reused += len;
+        } else {
+            fprintf(out, "%c%zu\n", DELTA_OP_LITERAL, len);
+            fwrite(target + off, 1, len, out);
+        }
+        off += len;
+    }
+    fprintf(out, "%c\n", DELTA_OP_END);
+    free(table);
+    return ferror(out) ? -1 : 0;
+}
+
+// Produce a delta that rebuilds new_file from old_file. Compressed Arch payloads are
+// chunked after decompression when recompressing reproduces the exact package bytes;
+// everything else is chunked as raw bytes.
+int delta_make(const char* old_file, const char* new_file, const char* out_file) {
+    if (!validate_file_path(old_file) || !validate_file_path(new_file) || !validate_file_path(out_file)) {
+        return -1;
+    }
+
+    int old_fd = open(old_file, O_RDONLY | O_CLOEXEC);
+    int new_fd = open(new_file, O_RDONLY | O_CLOEXEC);
+    if (old_fd < 0 || new_fd < 0) {
+        fprintf(stderr, "Error: Package file does not exist: %s\n", old_fd < 0 ? old_file : new_file);
+        if (old_fd >= 0) close(old_fd);
+        if (new_fd >= 0) close(new_fd);
+        return -1;
+    }
+
+    delta_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    char name_copy[MAX_PATH];
+    snprintf(name_copy, sizeof(name_copy), "%s", old_file);
+    snprintf(hdr.base_name, sizeof(hdr.base_name), "%s", basename(name_copy));
+    snprintf(name_copy, sizeof(name_copy), "%s", new_file);
+    snprintf(hdr.target_name, sizeof(hdr.target_name), "%s", basename(name_copy));
+    if (sha256_fd(old_fd, hdr.base_sha256) != 0 || sha256_fd(new_fd, hdr.target_sha256) != 0) {
+        fprintf(stderr, "Error: Could not read package files\n");
+        close(old_fd);
+        close(new_fd);
+        return -1;
+    }
+
+    // Try payload mode: decompress both and find the settings that rebuild the target
+    int base_src = old_fd;
+    int target_src = new_fd;
+    int old_payload = -1, new_payload = -1;
+    int codec = find_delta_codec(hdr.target_name);
+    if (codec >= 0 && codec == find_delta_codec(hdr.base_name) && is_cmd_available(delta_codecs[codec].tool)) {
+        const char* tool = delta_codecs[codec].tool;
+        old_payload = open_scratch_file();
+        new_payload = open_scratch_file();
+        int check = open_scratch_file();
+        if (old_payload >= 0 && new_payload >= 0 && check >= 0 &&
+            filter_file(tool, "-dc", old_fd, old_payload) == 0 &&
+            filter_file(tool, "-dc", new_fd, new_payload) == 0) {
+            for (int i = 0; delta_codecs[codec].levels[i] != NULL; i++) {
+                char check_sha[65];
+                if (filter_file(tool, delta_codecs[codec].levels[i], new_payload, check) == 0 &&
+                    sha256_fd(check, check_sha) == 0 && strcmp(check_sha, hdr.target_sha256) == 0) {
+                    snprintf(hdr.tool, sizeof(hdr.tool), "%s", tool);
+                    snprintf(hdr.level, sizeof(hdr.level), "%s", delta_codecs[codec].levels[i]);
+                    sha256_fd(new_payload, hdr.payload_sha256);
+                    base_src = old_payload;
+                    target_src = new_payload;
+                    break;
+                }
+            }
+        }
+        if (check >= 0) close(check);
+        if (hdr.tool[0] == '\0') {
+            printf("Note: %s payload cannot be recompressed bit-identically, using raw chunks\n", hdr.target_name);
+        }
+    }
+
+    size_t base_len = 0, target_len = 0;
+    unsigned char* base = map_file(base_src, &base_len);
+    unsigned char* target = map_file(target_src, &target_len);
+    int result = -1;
+    char tmp_path[MAX_PATH];
+    FILE* f = NULL;
+    if (base == MAP_FAILED || target == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map package contents\n");
+    } else if ((f = open_atomic(out_file, tmp_path, sizeof(tmp_path))) == NULL) {
+        fprintf(stderr, "Error: Cannot write delta file: %s\n", out_file);
+    } else {
+        // Stream the delta through gzip into the temporary file
+        int in[2];
+        size_t reused = 0;
+        if (pipe2(in, O_CLOEXEC) == 0) {
+            pid_t pid = spawn_filter("gzip", "-c -n -6", in[0], fileno(f));
+            close(in[0]);
+            FILE* out = fdopen(in[1], "w");
+            int write_ok = -1;
+            if (out != NULL) {
+                init_gear_table();
+                fprintf(out, "%s\nbase %s\ntarget %s\nbase-sha256 %s\ntarget-sha256 %s\n", DELTA_MAGIC,
+                        hdr.base_name, hdr.target_name, hdr.base_sha256, hdr.target_sha256);
+                if (hdr.tool[0] != '\0') {
+                    fprintf(out, "payload-sha256 %s\ncompressor %s\nlevel %s\n", hdr.payload_sha256, hdr.tool, hdr.level);
+                }
+                fputc('\n', out);
+                write_ok = write_delta_ops(out, base, base_len, target, target_len, &reused);
+                if (fclose(out) != 0) write_ok = -1;
+            } else {
+                close(in[1]);
+            }
+            if (wait_filter(pid) == 0 && write_ok == 0) {
+                result = commit_atomic(f, tmp_path, out_file);
+                f = NULL;
+            }
+        }
+        if (f != NULL) {
+            fclose(f);
+            unlink(tmp_path);
+        }
+        if (result == 0) {
+            struct stat st;
+            stat(out_file, &st);
+            printf("Delta written to %s: %lld bytes, %zu of %zu %s bytes reused (%s mode)\n", out_file,
+                   (long long)st.st_size, reused, target_len, hdr.tool[0] ? "payload" : "package",
+                   hdr.tool[0] ? "payload" : "raw");
+        } else {
+            fprintf(stderr, "Error: Failed to write delta file: %s\n", out_file);
+        }
+    }
+
+    if (base != NULL && base != MAP_FAILED) munmap(base, base_len);
+    if (target != NULL && target != MAP_FAILED) munmap(target, target_len);
+    if (old_payload >= 0) close(old_payload);
+    if (new_payload >= 0) close(new_payload);
+    close(old_fd);
+    close(new_fd);
+    return result;
+}
+
+// Read one header line from the delta stream, stripping the newline
+static int read_delta_line(FILE* in, char* line, size_t len) {
+    if (fgets(line, (int)len, in) == NULL) {
+        return -1;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return 0;
+}
+
+// Whether a name from a delta header is a file name without any directory part
+static int is_plain_name(const char* name) {
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+// Parse the header of a decompressed delta stream
+static int read_delta_header(FILE* in, delta_header_t* hdr) {
+    char line[512];
+    memset(hdr, 0, sizeof(*hdr));
+    if (read_delta_line(in, line, sizeof(line)) != 0 || strcmp(line, DELTA_MAGIC) != 0) {
+        return -1;
+    }
+    while (read_delta_line(in, line, sizeof(line)) == 0 && line[0] != '\0') {
+        char* value = strchr(line, ' ');
+        if (value == NULL) continue;
+        *value++ = '\0';
+        if (strcmp(line, "base") == 0) snprintf(hdr->base_name, sizeof(hdr->base_name), "%s", value);
+        else if (strcmp(line, "target") == 0) snprintf(hdr->target_name, sizeof(hdr->target_name), "%s", value);
+        else if (strcmp(line, "base-sha256") == 0) snprintf(hdr->base_sha256, sizeof(hdr->base_sha256), "%s", value);
+        else if (strcmp(line, "target-sha256") == 0) snprintf(hdr->target_sha256, sizeof(hdr->target_sha256), "%s", value);
+        else if (strcmp(line, "payload-sha256") == 0) snprintf(hdr->payload_sha256, sizeof(hdr->payload_sha256), "%s", value);
+        else if (strcmp(line, "compressor") == 0) snprintf(hdr->tool, sizeof(hdr->tool), "%s", value);
+        else if (strcmp(line, "level") == 0) snprintf(hdr->level, sizeof(hdr->level), "%s", value);
+    }
+    // Only the codecs and levels trimorph itself produces are accepted, since they end
+    // up on the recompressor's command line
+    if (hdr->tool[0] != '\0') {
+        int known = 0;
+        for (int i = 0; delta_codecs[i].ext != NULL; i++) {
+            for (int j = 0; j < 5 && delta_codecs[i].levels[j] != NULL; j++) {
+                known |= strcmp(delta_codecs[i].tool, hdr->tool) == 0 && strcmp(delta_codecs[i].levels[j], hdr->level) == 0;
+            }
+        }
+        if (!known) {
+            return -1;
+        }
+    }
+    // The names are joined to directories when the base is looked up and the target
+    // written, so they must be plain file names
+    return is_plain_name(hdr->base_name) && is_plain_name(hdr->target_name) && strlen(hdr->target_sha256) == 64 ? 0 : -1;
+}
+
+// Open a delta file and parse its header, returning the decompressed stream
+static FILE* open_delta(const char* delta_file, delta_header_t* hdr, pid_t* pid) {
+    int fd = open_decompressor(delta_file, 0, "gzip", pid);
+    if (fd < 0) {
+        return NULL;
+    }
+    FILE* in = fdopen(fd, "r");
+    if (in == NULL) {
+        close_decompressor(fd, *pid);
+        return NULL;
+    }
+    if (read_delta_header(in, hdr) != 0) {
+        fclose(in);
+        kill(*pid, SIGKILL);
+        waitpid(*pid, NULL, 0);
+        return NULL;
+    }
+    return in;
+}
+
+// Rebuild the target package of a delta from its base into out_file. The base and
+// the result are both checked against the SHA-256 sums recorded in the delta.
+int delta_apply(const char* old_file, const char* delta_file, const char* out_file) {
+    if (!validate_file_path(old_file) || !validate_file_path(delta_file) ||
+        (out_file != NULL && !validate_file_path(out_file))) {
+        return -1;
+    }
+
+    delta_header_t hdr;
+    pid_t delta_pid;
+    FILE* in = open_delta(delta_file, &hdr, &delta_pid);
+    if (in == NULL) {
+        fprintf(stderr, "Error: Not a valid trimorph delta: %s\n", delta_file);
+        return -1;
+    }
+
+    char default_out[MAX_PATH];
+    if (out_file == NULL) {
+        char dir_copy[MAX_PATH];
+        snprintf(dir_copy, sizeof(dir_copy), "%s", delta_file);
+        snprintf(default_out, sizeof(default_out), "%s/%s", dirname(dir_copy), hdr.target_name);
+        out_file = default_out;
+    }
+
+    int result = -1;
+    int old_fd = open(old_file, O_RDONLY | O_CLOEXEC);
+    int old_payload = -1;
+    int base_src = old_fd;
+    char sha[65];
+    unsigned char* base = MAP_FAILED;
+    size_t base_len = 0;
+    FILE* f = NULL;
+    char tmp_path[MAX_PATH];
+    pid_t comp_pid = -1;
+    int comp_in = -1;
+
+    if (old_fd < 0) {
+        fprintf(stderr, "Error: Package file does not exist: %s\n", old_file);
+        goto done;
+    }
+    if (sha256_fd(old_fd, sha) != 0 || strcmp(sha, hdr.base_sha256) != 0) {
+        fprintf(stderr, "Error: %s is not the base package this delta was made from (%s)\n", old_file, hdr.base_name);
+        goto done;
+    }
+    if (hdr.tool[0] != '\0') {
+        old_payload = open_scratch_file();
+        if (old_payload < 0 || filter_file(hdr.tool, "-dc", old_fd, old_payload) != 0) {
+            fprintf(stderr, "Error: Could not decompress base package with %s\n", hdr.tool);
+            goto done;
+        }
+        base_src = old_payload;
+    }
+    base = map_file(base_src, &base_len);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map base package\n");
+        goto done;
+    }
+
+    f = open_atomic(out_file, tmp_path, sizeof(tmp_path));
+    if (f == NULL) {
+        fprintf(stderr, "Error: Cannot write package file: %s\n", out_file);
+        goto done;
+    }
+
+    // Payload mode writes through the recorded compressor, raw mode writes directly
+    int out_fd = fileno(f);
+    if (hdr.tool[0] != '\0') {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) != 0) {
+            goto done;
+        }
+        comp_pid = spawn_filter(hdr.tool, hdr.level, pipefd[0], fileno(f));
+        close(pipefd[0]);
+        comp_in = pipefd[1];
+        out_fd = comp_in;
+    }
+
+    sha256_ctx_t payload_ctx;
+    sha256_init(&payload_ctx);
+    int ok = 0;
+    char op[64];
+    unsigned char* literal = malloc(CDC_MAX_CHUNK);
+    while (literal != NULL && read_delta_line(in, op, sizeof(op)) == 0) {
+        const unsigned char* data = NULL;
+        size_t len = 0;
+        if (op[0] == DELTA_OP_END) {
+            ok = 1;
+            break;
+        } else if (op[0] == DELTA_OP_COPY) {
+            unsigned long long off = 0;
+            if (sscanf(op + 1, "%llu %zu", &off, &len) != 2 || off > base_len || len > base_len - off) {
+                break;
+            }
+            data = base + off;
+        } else if (op[0] == DELTA_OP_LITERAL) {
+            len = (size_t)strtoull(op + 1, NULL, 10);
+            if (len > CDC_MAX_CHUNK || fread(literal, 1, len, in) != len) {
+                break;
+            }
+            data = literal;
+        } else {
+            break;
+        }
+        sha256_update(&payload_ctx, data, len);
+        size_t written = 0;
+        while (written < len) {
+            ssize_t n = write(out_fd, data + written, len - written);
+            if (n <= 0) break;
+            written += (size_t)n;
+        }
+        if (written != len) {
+            ok = 0;
+            break;
+        }
+    }
+    free(literal);
+    if (comp_in >= 0) {
+        close(comp_in);
+        comp_in = -1;
+        if (wait_filter(comp_pid) != 0) {
+            ok = 0;
+        }
+        comp_pid = -1;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Delta file is truncated or corrupt: %s\n", delta_file);
+        goto done;
+    }
+
+    // The checksum guards reconstruction: never leave a mismatching package behind
+    if (hdr.payload_sha256[0] != '\0') {
+        sha256_final_hex(&payload_ctx, sha);
+        if (strcmp(sha, hdr.payload_sha256) != 0) {
+            fprintf(stderr, "Error: Reconstructed payload checksum mismatch for %s\n", hdr.target_name);
+            goto done;
+        }
+    }
+    if (fflush(f) != 0 || sha256_fd(fileno(f), sha) != 0 || strcmp(sha, hdr.target_sha256) != 0) {
+        fprintf(stderr, "Error: Reconstructed package checksum mismatch for %s\n", hdr.target_name);
+        goto done;
+    }
+    result = commit_atomic(f, tmp_path, out_file);
+    f = NULL;
+    if (result == 0) {
+        printf("Reconstructed %s (sha256 %s)\n", out_file, hdr.target_sha256);
+    }
+
+done:
+    if (comp_in >= 0) close(comp_in);
+    if (comp_pid > 0) wait_filter(comp_pid);
+    if (f != NULL) {
+        fclose(f);
+        unlink(tmp_path);
+    }
+    if (base != MAP_FAILED && base != NULL) munmap(base, base_len);
+    if (old_payload >= 0) close(old_payload);
+    if (old_fd >= 0) close(old_fd);
+    fclose(in);
+    waitpid(delta_pid, NULL, 0);
+    return result;
+}
+
+// Package caches searched for the base package of a delta, relative to the root
+static const char* delta_cache_dirs[] = {
+    "var/cache/pacman/pkg", "var/cache/apt/archives", "var/cache/apk", "etc/apk/cache",
+    "var/cache/dnf", "var/cache/yum", "var/cache/binpkgs", NULL
+};
+
+// Install a delta: find its base in the delta's directory or the local package cache,
+// rebuild the target package in a scratch directory and install it with the library.
+// Returns a library status, with the inner install's timings in result.
+int install_delta(const char* file, trimorph_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    result->exit_code = -1;
+    if (!validate_file_path(file)) {
+        return TRIMORPH_ERR_INVALID;
+    }
+
+    delta_header_t hdr;
+    pid_t pid;
+    FILE* in = open_delta(file, &hdr, &pid);
+    if (in == NULL) {
+        fprintf(stderr, "Error: Not a valid trimorph delta: %s\n", file);
+        return TRIMORPH_ERR_INVALID;
+    }
+    fclose(in);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    // Candidate locations for the base package, nearest first
+    char base_path[MAX_PATH] = "";
+    char dir_copy[MAX_PATH];
+    snprintf(dir_copy, sizeof(dir_copy), "%s", file);
+    char candidate[MAX_PATH];
+    snprintf(candidate, sizeof(candidate), "%s/%s", dirname(dir_copy), hdr.base_name);
+    if (access(candidate, R_OK) == 0) {
+        snprintf(base_path, sizeof(base_path), "%s", candidate);
+    }
+    for (int i = 0; base_path[0] == '\0' && delta_cache_dirs[i] != NULL; i++) {
+        snprintf(candidate, sizeof(candidate), "%s/%s/%s", has_target_root() ? target_root : "",
+                 delta_cache_dirs[i], hdr.base_name);
+        if (access(candidate, R_OK) == 0) {
+            snprintf(base_path, sizeof(base_path), "%s", candidate);
+        }
+    }
+    if (base_path[0] == '\0') {
+        fprintf(stderr, "Error: Base package %s not found in the package cache\n", hdr.base_name);
+        fprintf(stderr, "Tip: Place %s next to the delta file, or install from the full package\n", hdr.base_name);
+        return TRIMORPH_ERR_NOT_FOUND;
+    }
+
+    const char* tmpdir = getenv("TMPDIR");
+    char work_dir[MAX_PATH];
+    snprintf(work_dir, sizeof(work_dir), "%s/trimorph-delta-XXXXXX", tmpdir ? tmpdir : "/var/tmp");
+    if (!dry_run && mkdtemp(work_dir) == NULL) {
+        fprintf(stderr, "Error: Cannot create scratch directory for delta reconstruction\n");
+        return TRIMORPH_ERR_SYSTEM;
+    }
+
+    char target_path[MAX_PATH];
+    snprintf(target_path, sizeof(target_path), "%s/%s", work_dir, hdr.target_name);
+    int status = TRIMORPH_ERR_UNSUPPORTED;
+    if (trimorph_detect_format(hdr.target_name) == NULL) {
+        fprintf(stderr, "Error: Unsupported package format: %s\n", hdr.target_name);
+    } else if (dry_run) {
+        printf("  Would rebuild %s from %s\n", hdr.target_name, base_path);
+        return trimorph_install(tm, target_path, result);
+    } else if (delta_apply(base_path, file, target_path) == 0) {
+        status = trimorph_install(tm, target_path, result);
+    } else {
+        status = TRIMORPH_ERR_INVALID;
+    }
+    unlink(target_path);
+    rmdir(work_dir);
+    return status;
+}
+
+// Directory for downloaded packages; TRIMORPH_DOWNLOAD_DIR overrides it
+#define DOWNLOAD_DIR "/var/cache/trimorph/downloads"
+
+// Maximum number of concurrent connections to one host (--max-per-host)
+static long max_per_host = 2;
+
+// Compressed files are tested in chunks of at least this size, so a multi-frame
+// zstd payload is spread over several workers without a process per tiny frame
+#define ARCHIVE_CHUNK_MIN (4 << 20)
+
+// One compressed file being tested
+typedef struct {
+    const char* path;
+    const char* tool;           // Decompressor, NULL when the file is skipped
+    const char* skip_reason;
+    off_t size;
+    uint64_t out_bytes;         // Decompressed bytes, summed over chunks
+    int chunks;
+    int chunks_done;
+    int failed;
+    off_t failed_offset;
+    double start;
+    double end;
+} archive_test_t;
+
+// A byte range of a file handed to one decompressor
+typedef struct {
+    archive_test_t* file;
+    off_t offset;
+    off_t length;
+} archive_chunk_t;
+
+typedef struct {
+    archive_chunk_t* chunks;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} archive_job_t;
+
+// Pick the decompressor from the file's magic bytes rather than its name
+static const char* archive_tool_for(const unsigned char* data, size_t len) {
+    if (len >= 4 && memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0) return "zstd";
+    if (len >= 6 && memcmp(data, "\xfd" "7zXZ\0", 6) == 0) return "xz";
+    if (len >= 2 && memcmp(data, "\x1f\x8b", 2) == 0) return "gzip";
+    if (len >= 3 && memcmp(data, "BZh", 3) == 0) return "bzip2";
+    return NULL;
+}
+
+static uint32_t read_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Length of the zstd (or skippable) frame starting at data, found by walking the block
+// headers without decompressing. Returns 0 if the frame is malformed or truncated.
+static size_t zstd_frame_length(const unsigned char* data, size_t len) {
+    if (len < 8) {
+        return 0;
+    }
+    uint32_t magic = read_le32(data);
+    if ((magic & 0xFFFFFFF0u) == 0x184D2A50u) {
+        size_t skippable = 8 + (size_t)read_le32(data + 4);
+        return skippable <= len ? skippable : 0;
+    }
+    if (magic != 0xFD2FB528u) {
+        return 0;
+    }
+
+    unsigned char fhd = data[4];
+    int single_segment = (fhd >> 5) & 1;
+    static const size_t did_sizes[] = {0, 1, 2, 4};
+    static const size_t fcs_sizes[] = {0, 2, 4, 8};
+    size_t fcs = fcs_sizes[fhd >> 6];
+    if ((fhd >> 6) == 0 && single_segment) {
+        fcs = 1;
+    }
+    size_t pos = 5 + (single_segment ? 0 : 1) + did_sizes[fhd & 3] + fcs;
+
+    for (;;) {
+        if (pos + 3 > len) {
+            return 0;
+        }
+        uint32_t header = (uint32_t)data[pos] | (uint32_t)data[pos + 1] << 8 | (uint32_t)data[pos + 2] << 16;
+        int last = header & 1;
+        int type = (header >> 1) & 3;
+        size_t block_size = header >> 3;
+        if (type == 3) {
+            return 0;  // Reserved block type
+        }
+        pos += 3 + (type == 1 ? 1 : block_size);
+        if (pos > len) {
+            return 0;
+        }
+        if (last) {
+            break;
+        }
+    }
+    pos += (fhd & 4) ? 4 : 0;  // Content checksum
+    return pos <= len ? pos : 0;
+}
+
+// Split a zstd file into chunks on frame boundaries. Falls back to one chunk when the
+// frames cannot be walked; zstd then reports the damage itself.
+static int split_zstd_file(archive_test_t* file, const unsigned char* data, size_t len,
+                           archive_chunk_t** chunks, size_t* count, size_t* cap) {
+    size_t start = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t frame = zstd_frame_length(data + pos, len - pos);
+        if (frame == 0) {
+            pos = len;  // Let the last chunk run to the end of the file
+            break;
+        }
+        pos += frame;
+        if (pos - start >= ARCHIVE_CHUNK_MIN && pos < len) {
+            if (*count == *cap) {
+                *cap = *cap ? *cap * 2 : 64;
+                archive_chunk_t* grown = realloc(*chunks, *cap * sizeof(archive_chunk_t));
+                if (grown == NULL) return -1;
+                *chunks = grown;
+            }
+            (*chunks)[(*count)++] = (archive_chunk_t){file, (off_t)start, (off_t)(pos - start)};
+            file->chunks++;
+            start = pos;
+        }
+    }
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        archive_chunk_t* grown = realloc(*chunks, *cap * sizeof(archive_chunk_t));
+        if (grown == NULL) return -1;
+        *chunks = grown;
+    }
+    (*chunks)[(*count)++] = (archive_chunk_t){file, (off_t)start, (off_t)(len - start)};
+    file->chunks++;
+    return 0;
+}
+
+// Feeds one byte range of a file into a decompressor's stdin
+typedef struct {
+    int file_fd;
+    int pipe_fd;
+    off_t offset;
+    off_t length;
+} range_feeder_t;
+
+static void* feed_range(void* arg) {
+    range_feeder_t* feeder = arg;
+    char buf[65536];
+    off_t pos = feeder->offset;
+    off_t end = feeder->offset + feeder->length;
+    while (pos < end) {
+        size_t want = end - pos < (off_t)sizeof(buf) ? (size_t)(end - pos) : sizeof(buf);
+        ssize_t n = pread(feeder->file_fd, buf, want, pos);
+        if (n <= 0 || write(feeder->pipe_fd, buf, (size_t)n) != n) {
+            break;  // The decompressor gave up; its exit status reports why
+        }
+        pos += n;
+    }
+    close(feeder->pipe_fd);
+    return NULL;
+}
+
+// Decompress one chunk, discarding the output. Chunks that run to the end of the file
+// read it directly; others are fed through a pipe by a helper thread.
+static int test_archive_chunk(archive_chunk_t* chunk, uint64_t* out_bytes) {
+    int file_fd = open(chunk->file->path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        return -1;
+    }
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        close(file_fd);
+        return -1;
+    }
+
+    int in_fd = file_fd;
+    range_feeder_t feeder = {file_fd, -1, chunk->offset, chunk->length};
+    pthread_t feeder_thread;
+    int feeding = 0;
+    if (chunk->offset + chunk->length < chunk->file->size) {
+        int in[2];
+        if (pipe2(in, O_CLOEXEC) == 0) {
+            feeder.pipe_fd = in[1];
+            in_fd = in[0];
+            feeding = pthread_create(&feeder_thread, NULL, feed_range, &feeder) == 0;
+            if (!feeding) {
+                close(in[0]);
+                close(in[1]);
+                in_fd = -1;
+            }
+        } else {
+            in_fd = -1;
+        }
+    } else if (lseek(file_fd, chunk->offset, SEEK_SET) < 0) {
+        in_fd = -1;
+    }
+
+    pid_t pid = -1;
+    if (in_fd >= 0) {
+        // xz decompresses the blocks of a multi-block file on several threads
+        const char* args = strcmp(chunk->file->tool, "xz") == 0 ? "-dc -T0" : "-dc";
+        pid = spawn_filter(chunk->file->tool, args, in_fd, out[1]);
+    }
+    close(out[1]);
+    if (in_fd != file_fd && in_fd >= 0) {
+        close(in_fd);
+    }
+
+    char buf[65536];
+    ssize_t n;
+    uint64_t total = 0;
+    while ((n = read(out[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        total += (uint64_t)n;
+    }
+    close(out[0]);
+    int result = wait_filter(pid);
+    if (feeding) {
+        pthread_join(feeder_thread, NULL);
+    }
+    close(file_fd);
+    *out_bytes = total;
+    return result;
+}
+
+static void* archive_test_worker(void* arg) {
+    archive_job_t* job = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        archive_chunk_t* chunk = &job->chunks[i];
+        double start = now_seconds();
+        uint64_t out_bytes = 0;
+        int result = test_archive_chunk(chunk, &out_bytes);
+        double end = now_seconds();
+
+        archive_test_t* file = chunk->file;
+        pthread_mutex_lock(&job->lock);
+        file->out_bytes += out_bytes;
+        if (file->chunks_done++ == 0 || start < file->start) file->start = start;
+        if (end > file->end) file->end = end;
+        if (result != 0 && (!file->failed || chunk->offset < file->failed_offset)) {
+            file->failed = 1;
+            file->failed_offset = chunk->offset;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// Largest chunks first, so one big file does not finish last on a single worker
+static int archive_chunk_cmp(const void* a, const void* b) {
+    off_t la = ((const archive_chunk_t*)a)->length;
+    off_t lb = ((const archive_chunk_t*)b)->length;
+    return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+// Stream-decompress each file and discard the output, testing files (and the frames
+// of multi-frame zstd files) on parallel_jobs threads. Files without a recognised
+// compressed payload are skipped. With quiet set only damaged files are reported.
+// Returns the number of damaged files, or -1 on error.
+int test_archives(int count, char* files[], int quiet) {
+    archive_test_t* tests = calloc((size_t)count, sizeof(archive_test_t));
+    if (tests == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    archive_job_t job;
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.lock, NULL);
+    size_t cap = 0;
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        archive_test_t* t = &tests[i];
+        t->path = files[i];
+        int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", files[i], strerror(errno));
+            result = -1;
+            break;
+        }
+        size_t len = 0;
+        unsigned char* data = map_file(fd, &len);
+        close(fd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Error: Cannot read %s\n", files[i]);
+            result = -1;
+            break;
+        }
+        t->size = (off_t)len;
+        t->tool = data != NULL ? archive_tool_for(data, len) : NULL;
+        if (t->tool == NULL) {
+            t->skip_reason = "no compressed payload";
+        } else if (!is_cmd_available(t->tool)) {
+            t->skip_reason = strcmp(t->tool, "zstd") == 0 ? "zstd is not installed" :
+                             strcmp(t->tool, "xz") == 0 ? "xz is not installed" :
+                             strcmp(t->tool, "gzip") == 0 ? "gzip is not installed" : "bzip2 is not installed";
+            t->tool = NULL;
+        } else if (strcmp(t->tool, "zstd") == 0) {
+            result = split_zstd_file(t, data, len, &job.chunks, &job.count, &cap);
+        } else {
+            if (job.count == cap) {
+                cap = cap ? cap * 2 : 64;
+                archive_chunk_t* grown = realloc(job.chunks, cap * sizeof(archive_chunk_t));
+                if (grown == NULL) {
+                    result = -1;
+                }
+                job.chunks = grown != NULL ? grown : job.chunks;
+            }
+            if (result == 0) {
+                job.chunks[job.count++] = (archive_chunk_t){t, 0, (off_t)len};
+                t->chunks = 1;
+            }
+        }
+        if (data != NULL) {
+            munmap(data, len);
+        }
+    }
+    if (result != 0) {
+        free(job.chunks);
+        free(tests);
+        pthread_mutex_destroy(&job.lock);
+        return -1;
+    }
+    if (job.count > 0) {
+        qsort(job.chunks, job.count, sizeof(*job.chunks), archive_chunk_cmp);
+    }
+
+    // Decompressors may exit early on damaged input while a feeder is still writing
+    struct sigaction ignore_pipe, old_pipe;
+    memset(&ignore_pipe, 0, sizeof(ignore_pipe));
+    ignore_pipe.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore_pipe, &old_pipe);
+    double start = now_seconds();
+    int nthreads = parallel_jobs > 0 ? (int)parallel_jobs : 1;
+    if ((size_t)nthreads > job.count) {
+        nthreads = job.count > 0 ? (int)job.count : 1;
+    }
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; threads != NULL && t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, archive_test_worker, &job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        archive_test_worker(&job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    double elapsed = now_seconds() - start;
+    sigaction(SIGPIPE, &old_pipe, NULL);
+
+    int ok = 0, bad = 0, skipped = 0;
+    uint64_t in_total = 0, out_total = 0;
+    for (int i = 0; i < count; i++) {
+        archive_test_t* t = &tests[i];
+        if (t->tool == NULL) {
+            skipped++;
+            if (!quiet) {
+                printf("  SKIP %s (%s)\n", t->path, t->skip_reason);
+            }
+            continue;
+        }
+        in_total += (uint64_t)t->size;
+        out_total += t->out_bytes;
+        if (t->failed) {
+            bad++;
+            fflush(stdout);
+            fprintf(stderr, "Error: Damaged %s payload in %s (decompression failed in the chunk at offset %lld)\n",
+                    t->tool, t->path, (long long)t->failed_offset);
+        } else {
+            ok++;
+            if (!quiet) {
+                double secs = t->end - t->start;
+                printf("  OK   %s (%.1f MiB -> %.1f MiB, %d chunk%s, %.2fs, %.1f MiB/s)\n", t->path,
+                       t->size / 1048576.0, t->out_bytes / 1048576.0, t->chunks, t->chunks == 1 ? "" : "s",
+                       secs, secs > 0 ? t->out_bytes / 1048576.0 / secs : 0.0);
+            }
+        }
+    }
+    if (!quiet || (bad == 0 && ok > 0)) {
+        printf("%s %d archive%s in %.2fs: %d ok, %d damaged, %d skipped (%.1f MiB/s compressed, %.1f MiB/s decompressed)\n",
+               quiet ? "Verified payloads of" : "Tested", count, count == 1 ? "" : "s", elapsed, ok, bad, skipped,
+               elapsed > 0 ? in_total / 1048576.0 / elapsed : 0.0,
+               elapsed > 0 ? out_total / 1048576.0 / elapsed : 0.0);
+    }
+
+    free(job.chunks);
+    free(tests);
+    pthread_mutex_destroy(&job.lock);
+    return bad;
+}
+
+// One remote package being fetched
+typedef struct {
+    char url[MAX_PATH];         // URL without the #sha256= fragment
+    char host[256];
+    char name[NAME_MAX + 1];    // File name taken from the URL path
+    char sha256[65];            // Expected checksum, empty if the URL did not give one
+    char part_path[MAX_PATH];   // Partial download, kept across runs for resuming
+    char path[MAX_PATH];        // Completed, verified download
+    int resume;                 // Whether to ask the server for the remaining range
+    int exit_code;              // curl exit code, -1 until fetched, -2 if curl reported none
+    int cached;                 // A verified earlier download is used, nothing is fetched
+} fetch_item_t;
+
+// A curl process fetching several URLs from one host over a reused connection
+typedef struct {
+    int items[256];
+    int count;
+    pid_t pid;
+    int report_fd;              // Scratch file receiving curl's per-transfer report
+} fetch_worker_t;
+
+// Check whether an install argument is a remote package URL
+int is_package_url(const char* arg) {
+    return strncmp(arg, "http://", 7) == 0 || strncmp(arg, "https://", 8) == 0;
+}
+
+// Split a package URL into host, file name and optional #sha256= checksum
+static int parse_package_url(const char* url, fetch_item_t* item) {
+    memset(item, 0, sizeof(*item));
+    item->exit_code = -1;
+    if (strlen(url) >= sizeof(item->url) || strpbrk(url, " \t\n\r'\"\\") != NULL) {
+        fprintf(stderr, "Error: Invalid package URL: %s\n", url);
+        return -1;
+    }
+    snprintf(item->url, sizeof(item->url), "%s", url);
+
+    char* fragment = strchr(item->url, '#');
+    if (fragment != NULL) {
+        if (strncmp(fragment, "#sha256=", 8) != 0 || strlen(fragment + 8) != 64) {
+            fprintf(stderr, "Error: Expected #sha256=<64 hex digits> in URL: %s\n", url);
+            return -1;
+        }
+        snprintf(item->sha256, sizeof(item->sha256), "%s", fragment + 8);
+        for (char* p = item->sha256; *p; p++) {
+            if (*p >= 'A' && *p <= 'F') *p = (char)(*p - 'A' + 'a');
+        }
+        *fragment = '\0';
+    }
+
+    const char* host = strstr(item->url, "://") + 3;
+    size_t host_len = strcspn(host, "/");
+    if (host_len == 0 || host_len >= sizeof(item->host)) {
+        fprintf(stderr, "Error: Invalid package URL: %s\n", url);
+        return -1;
+    }
+    memcpy(item->host, host, host_len);
+    item->host[host_len] = '\0';
+
+    // The file name is the last path segment, without any query string
+    const char* path_end = host + host_len + strcspn(host + host_len, "?");
+    const char* name = path_end;
+    while (name > host + host_len && name[-1] != '/') {
+        name--;
+    }
+    size_t name_len = (size_t)(path_end - name);
+    if (name_len == 0 || name_len >= sizeof(item->name) || name[0] == '.') {
+        fprintf(stderr, "Error: Cannot determine package file name from URL: %s\n", url);
+        return -1;
+    }
+    memcpy(item->name, name, name_len);
+    item->name[name_len] = '\0';
+    if (package_format(item->name) == NULL) {
+        fprintf(stderr, "Error: Unsupported package format: %s\n", item->name);
+        return -1;
+    }
+    return 0;
+}
+
+// Pick the download directory, falling back to a temporary one when the cache is
+// not writable (for example when running unprivileged)
+static int prepare_download_dir(char* dir, size_t len) {
+    const char* configured = getenv("TRIMORPH_DOWNLOAD_DIR");
+    if (configured != NULL && configured[0] != '\0') {
+        snprintf(dir, len, "%s", configured);
+        mkdir(dir, 0755);
+        return access(dir, W_OK) == 0 ? 0 : -1;
+    }
+
+    mkdir("/var/cache/trimorph", 0755);
+    mkdir(DOWNLOAD_DIR, 0755);
+    if (access(DOWNLOAD_DIR, W_OK) == 0) {
+        snprintf(dir, len, "%s", DOWNLOAD_DIR);
+        return 0;
+    }
+    const char* tmpdir = getenv("TMPDIR");
+    snprintf(dir, len, "%s/trimorph-downloads-%d", tmpdir ? tmpdir : "/var/tmp", (int)getuid());
+    mkdir(dir, 0700);
+    return access(dir, W_OK) == 0 ? 0 : -1;
+}
+
+// Whether curl can report each transfer's exit code (%{exitcode}, curl 7.75 and later).
+// Older versions fetch one URL per process, whose exit status is the transfer's.
+static int curl_reports_exit_codes(void) {
+    static int known = -1;
+    if (known < 0) {
+        int major = 0, minor = 0;
+        FILE* p = popen("curl --version 2>/dev/null", "r");
+        if (p != NULL) {
+            if (fscanf(p, "curl %d.%d", &major, &minor) != 2) {
+                major = 0;
+            }
+            pclose(p);
+        }
+        known = major > 7 || (major == 7 && minor >= 75);
+    }
+    return known;
+}
+
+// Options shared by every transfer; curl resets options at each --next
+static int add_curl_options(char** args, int n) {
+    static const char* const options[] = {
+        "--silent", "--show-error", "--location", "--fail", "--retry", "2", "--connect-timeout", "30", NULL
+    };
+    for (int i = 0; options[i] != NULL; i++) {
+        args[n++] = (char*)options[i];
+    }
+    // Without %{exitcode} the report says -1 and the process exit status is used
+    args[n++] = "--write-out";
+    args[n++] = curl_reports_exit_codes() ?
+        "%{exitcode} %{response_code} %{size_download} %{speed_download} %{filename_effective}\\n" :
+        "-1 %{response_code} %{size_download} %{speed_download} %{filename_effective}\\n";
+    return n;
+}
+
+// Start one curl process for a worker's URLs. curl keeps the connection alive between
+// them, resumes partial files with a Range request and reports each transfer.
+static pid_t start_fetch_worker(fetch_worker_t* w, fetch_item_t* items) {
+    char** args = malloc((size_t)(w->count * 16 + 2) * sizeof(char*));
+    if (args == NULL) {
+        return -1;
+    }
+    int n = 0;
+    args[n++] = "curl";
+    for (int i = 0; i < w->count; i++) {
+        fetch_item_t* item = &items[w->items[i]];
+        if (i > 0) {
+            args[n++] = "--next";
+        }
+        n = add_curl_options(args, n);
+        if (item->resume) {
+            args[n++] = "--continue-at";
+            args[n++] = "-";
+        }
+        args[n++] = item->url;
+        args[n++] = "--output";
+        args[n++] = item->part_path;
+    }
+    args[n] = NULL;
+
+    w->report_fd = open_scratch_file();
+    if (w->report_fd < 0) {
+        free(args);
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(w->report_fd, 1);
+        execvp("curl", args);
+        _exit(127);
+    }
+    free(args);
+    return pid;
+}
+
+// Record the per-transfer results a worker's curl printed
+static void read_fetch_report(fetch_worker_t* w, fetch_item_t* items) {
+    FILE* report = fdopen(w->report_fd, "r");
+    if (report == NULL) {
+        close(w->report_fd);
+        return;
+    }
+    rewind(report);
+    char line[MAX_PATH + 128];
+    while (fgets(line, sizeof(line), report) != NULL) {
+        int exit_code, response;
+        long long size;
+        double speed;
+        int consumed = 0;
+        if (sscanf(line, "%d %d %lld %lf %n", &exit_code, &response, &size, &speed, &consumed) < 4) {
+            continue;
+        }
+        char* file = line + consumed;
+        file[strcspn(file, "\n")] = '\0';
+        for (int i = 0; i < w->count; i++) {
+            fetch_item_t* item = &items[w->items[i]];
+            if (strcmp(item->part_path, file) == 0) {
+                item->exit_code = exit_code;
+                if (exit_code == 0 || (exit_code == -1 && response / 100 == 2)) {
+                    printf("Fetched %s (%lld bytes at %.1f KiB/s)\n", item->name, size, speed / 1024.0);
+                }
+            }
+        }
+    }
+    fclose(report);
+}
+
+// Settle the items a finished curl process did not report an exit code for. A single
+// transfer takes the process's exit status; otherwise a failed process fails them all.
+static void finish_fetch_worker(fetch_worker_t* w, fetch_item_t* items, int status) {
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : -2;
+    for (int i = 0; i < w->count; i++) {
+        fetch_item_t* item = &items[w->items[i]];
+        if (item->exit_code == -1) {
+            item->exit_code = code != 0 ? code : w->count == 1 ? 0 : -2;
+        }
+    }
+}
+
+// Fetch items whose exit code is still -1, grouped per host so that each host gets at
+// most max_per_host connections, with at most parallel_jobs curl processes. Returns the
+// number of items fetched; items that did not fit in a worker wait for the next round.
+static int run_fetch_round(fetch_item_t* items, int count) {
+    fetch_worker_t* workers = calloc((size_t)count, sizeof(fetch_worker_t));
+    int nworkers = 0;
+    int fetched = 0;
+    if (workers == NULL) {
+        return 0;
+    }
+    int capacity = curl_reports_exit_codes() ? (int)(sizeof(workers[0].items) / sizeof(workers[0].items[0])) : 1;
+
+    int* assigned = calloc((size_t)count, sizeof(int));
+    for (int i = 0; assigned != NULL && i < count; i++) {
+        if (assigned[i] || items[i].cached || items[i].exit_code != -1) {
+            continue;
+        }
+        // Spread this host's pending items over up to max_per_host workers
+        int first = nworkers;
+        int host_workers = 0;
+        for (int j = i; j < count; j++) {
+            if (assigned[j] || items[j].cached || items[j].exit_code != -1 ||
+                strcmp(items[j].host, items[i].host) != 0) {
+                continue;
+            }
+            fetch_worker_t* w = NULL;
+            if (host_workers < max_per_host) {
+                w = &workers[nworkers++];
+                host_workers++;
+            } else {
+                w = &workers[first];
+                for (int k = first; k < first + host_workers; k++) {
+                    if (workers[k].count < w->count) w = &workers[k];
+                }
+            }
+            if (w->count < capacity) {
+                w->items[w->count++] = j;
+                assigned[j] = 1;
+                fetched++;
+            }
+        }
+    }
+    free(assigned);
+
+    int next = 0, running = 0, done = 0;
+    while (done < nworkers) {
+        while (next < nworkers && running < parallel_jobs) {
+            workers[next].pid = start_fetch_worker(&workers[next], items);
+            if (workers[next].pid < 0) {
+                perror("fork failed");
+                finish_fetch_worker(&workers[next], items, -1);
+                done++;
+            } else {
+                running++;
+            }
+            next++;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i].pid == pid) {
+                read_fetch_report(&workers[i], items);
+                finish_fetch_worker(&workers[i], items, status);
+                workers[i].pid = 0;
+                running--;
+                done++;
+            }
+        }
+    }
+    free(workers);
+    return fetched;
+}
+
+// Download remote packages in parallel and verify them. On success each URL in
+// args is replaced by the local path of its download in paths.
+int fetch_packages(int count, char* args[], char paths[][MAX_PATH]) {
+    if (!is_cmd_available("curl")) {
+        fprintf(stderr, "Error: curl is required to install packages from URLs\n");
+        return -1;
+    }
+
+    char dir[MAX_PATH];
+    if (prepare_download_dir(dir, sizeof(dir)) != 0) {
+        fprintf(stderr, "Error: No writable download directory\n");
+        return -1;
+    }
+
+    fetch_item_t* items = calloc((size_t)count, sizeof(fetch_item_t));
+    if (items == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int nitems = 0;
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        if (!is_package_url(args[i])) {
+            continue;
+        }
+        fetch_item_t* item = &items[nitems];
+        if (parse_package_url(args[i], item) != 0) {
+            result = -1;
+            break;
+        }
+        // Downloads are named after the URL's file name, so two URLs must not share one
+        for (int j = 0; j < nitems; j++) {
+            if (strcmp(items[j].name, item->name) == 0) {
+                fprintf(stderr, "Error: %s and %s download to the same file name\n", items[j].url, item->url);
+                fprintf(stderr, "Tip: Install one of them in a separate run\n");
+                result = -1;
+                break;
+            }
+        }
+        if (result != 0) {
+            break;
+        }
+        snprintf(item->path, sizeof(item->path), "%s/%s", dir, item->name);
+        snprintf(item->part_path, sizeof(item->part_path), "%s/%s.part", dir, item->name);
+
+        // A previous verified download is reused as is
+        char existing[65];
+        if (item->sha256[0] != '\0' && sha256_file(item->path, existing) == 0 &&
+            strcmp(existing, item->sha256) == 0) {
+            item->cached = 1;
+            item->exit_code = 0;
+            unlink(item->part_path);  // Left over from an interrupted run
+            printf("Using cached %s\n", item->name);
+        }
+        item->resume = !item->cached && access(item->part_path, F_OK) == 0;
+        snprintf(paths[i], MAX_PATH, "%s", item->path);
+        nitems++;
+    }
+
+    if (result == 0) {
+        while (run_fetch_round(items, nitems) > 0) {
+        }
+
+        // Servers without Range support cannot resume: restart those from scratch
+        int retry = 0;
+        for (int i = 0; i < nitems; i++) {
+            if (!items[i].cached && (items[i].exit_code == 33 || (items[i].resume && items[i].exit_code != 0))) {
+                unlink(items[i].part_path);
+                items[i].resume = 0;
+                items[i].exit_code = -1;
+                retry = 1;
+            }
+        }
+        while (retry && run_fetch_round(items, nitems) > 0) {
+        }
+    }
+
+    for (int i = 0; result == 0 && i < nitems; i++) {
+        fetch_item_t* item = &items[i];
+        if (item->cached) {
+            continue;  // Already verified
+        }
+        if (item->exit_code != 0) {
+            if (item->exit_code == -2) {
+                fprintf(stderr, "Error: Failed to download %s (curl reported no result)\n", item->url);
+            } else {
+                fprintf(stderr, "Error: Failed to download %s (curl exit code %d)\n", item->url, item->exit_code);
+            }
+            if (access(item->part_path, F_OK) == 0) {
+                fprintf(stderr, "Tip: Rerun the install to resume the partial download\n");
+            }
+            result = -1;
+            break;
+        }
+        if (item->sha256[0] != '\0') {
+            char actual[65];
+            if (sha256_file(item->part_path, actual) != 0 || strcmp(actual, item->sha256) != 0) {
+                fprintf(stderr, "Error: Checksum mismatch for %s, discarding download\n", item->name);
+                unlink(item->part_path);
+                result = -1;
+                break;
+            }
+        }
+        if (rename(item->part_path, item->path) != 0) {
+            fprintf(stderr, "Error: Cannot move download into place: %s\n", item->path);
+            result = -1;
+        }
+    }
+    free(items);
+    return result;
+}
+
+// Group commit (--group-commit <ms>): install invocations that arrive together
+// are merged into one transaction per package manager, without a daemon. The first
+// invoker takes the spool lock and leads: for the commit window it lets the others
+// queue their package paths as request files in the spool directory, then claims the
+// requests, installs everything together and writes each request's exit status back.
+// Invokers that find the lock held queue a request and wait for its status. A request
+// still unclaimed when the lock is released (it arrived after the leader had claimed
+// its batch, or was started with other options) makes its invoker the leader of the
+// next group.
+#define SPOOL_DIR "var/lib/trimorph/spool"
+#define GROUP_MAX_WINDOW_MS 60000
+#define GROUP_MAX_REQUESTS 256
+#define GROUP_MAX_FILES 4096
+#define GROUP_STALE_SECONDS 3600    // Results nobody collected are removed after this
+
+typedef struct {
+    char id[64];                // Spool name of the request, empty for the leader's own
+    int first;                  // Its files in the merged list
+    int count;
+    int result;
+} group_request_t;
+
+static void spool_dir(char* path, size_t len) {
+    const char* env = getenv("TRIMORPH_SPOOL_DIR");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(path, len, "%s", env);
+    } else {
+        snprintf(path, len, "%s/%s", has_target_root() ? target_root : "", SPOOL_DIR);
+    }
+}
+
+// Open (creating) the spool directory and its lock file, -1 if unusable
+static int open_spool(char* dir, size_t len) {
+    spool_dir(dir, len);
+    char parent[MAX_PATH];
+    snprintf(parent, sizeof(parent), "%s", dir);
+    mkdir(dirname(parent), 0755);
+    mkdir(dir, 0700);
+    char lock_path[MAX_PATH + 16];
+    snprintf(lock_path, sizeof(lock_path), "%s/leader.lock", dir);
+    return open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// The options that change how an install runs, as the first line of a request. A
+// leader only merges requests whose line matches its own.
+static void group_options(char* line, size_t len) {
+    snprintf(line, len, "options dry-run=%d low-impact=%d skip-space-check=%d root=%s metrics=%s\n", dry_run,
+             low_impact, skip_space_check, has_target_root() ? target_root : "/",
+             metrics_file != NULL ? metrics_file : "-");
+}
+
+// Write a file in the spool atomically: readers only ever see complete files
+static int spool_write(const char* dir, const char* name, const char* data) {
+    char path[MAX_PATH + 80];
+    char tmp[MAX_PATH + 96];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    fputs(data, f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Whether a queued request was made with the given options line
+static int group_request_matches(const char* path, const char* options) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char line[MAX_PATH * 2 + 128];
+    int matches = fgets(line, sizeof(line), f) != NULL && strcmp(line, options) == 0;
+    fclose(f);
+    return matches;
+}
+
+// Read a claimed request's package paths (one per line, after its options) into the
+// merged list
+static int read_group_request(const char* path, char** files, int* nfiles) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[MAX_PATH * 2 + 128];
+    int first = *nfiles;
+    if (fgets(line, sizeof(line), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL && *nfiles < GROUP_MAX_FILES) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0' && (files[*nfiles] = strdup(line)) != NULL) {
+            (*nfiles)++;
+        }
+    }
+    fclose(f);
+    return *nfiles > first ? 0 : -1;
+}
+
+// Claim the queued requests made with our options, removing results and temporary
+// files left behind. Requests with other options stay queued for their own invokers.
+static int claim_group_requests(const char* dir, group_request_t* requests, int nrequests, char** files,
+                                int* nfiles) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return nrequests;
+    }
+    char options[MAX_PATH * 2 + 128];
+    group_options(options, sizeof(options));
+    struct dirent* entry;
+    time_t now = time(NULL);
+    while ((entry = readdir(d)) != NULL) {
+        const char* name = entry->d_name;
+        char path[MAX_PATH + 80];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        size_t len = strlen(name);
+        struct stat st;
+        if ((strncmp(name, "done-", 5) == 0 || (len > 4 && strcmp(name + len - 4, ".tmp") == 0)) &&
+            stat(path, &st) == 0 && now - st.st_mtime > GROUP_STALE_SECONDS) {
+            unlink(path);
+            continue;
+        }
+        if (strncmp(name, "req-", 4) != 0 || len >= sizeof(requests[0].id) + 4 ||
+            (len > 4 && strcmp(name + len - 4, ".tmp") == 0) || nrequests >= GROUP_MAX_REQUESTS) {
+            continue;
+        }
+        if (!group_request_matches(path, options)) {
+            printf("Group commit: not merging request %s, which was made with other options\n", name + 4);
+            continue;
+        }
+        group_request_t* r = &requests[nrequests];
+        snprintf(r->id, sizeof(r->id), "%s", name + 4);
+        char claimed[MAX_PATH + 80];
+        snprintf(claimed, sizeof(claimed), "%s/claimed-%s", dir, r->id);
+        if (rename(path, claimed) != 0) {
+            continue;  // Taken over by its own invoker
+        }
+        r->first = *nfiles;
+        r->result = 0;
+        if (read_group_request(claimed, files, nfiles) != 0) {
+            // An empty or unreadable request fails on its own
+            r->count = 0;
+            r->result = -1;
+        }
+        r->count = *nfiles - r->first;
+        nrequests++;
+    }
+    closedir(d);
+    return nrequests;
+}
+
+// Install the merged list: one transaction per manager across all requests, deltas
+// alone. When a merged transaction fails, each request in it is retried on its own,
+// so every invoker gets the status of its own packages rather than a neighbour's.
+static void run_group(group_request_t* requests, int nrequests, char** files, int nfiles) {
+    char** group = malloc((size_t)nfiles * sizeof(char*));
+    int* members = malloc((size_t)nfiles * sizeof(int));
+    int* owner = malloc((size_t)nfiles * sizeof(int));
+    char* done = calloc((size_t)nfiles, 1);
+    if (group == NULL || members == NULL || owner == NULL || done == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        for (int r = 0; r < nrequests; r++) requests[r].result = -1;
+        nfiles = 0;
+    }
+    for (int r = 0; r < nrequests && nfiles > 0; r++) {
+        for (int i = requests[r].first; i < requests[r].first + requests[r].count; i++) {
+            owner[i] = r;
+        }
+    }
+
+    int transactions = 0;
+    for (int i = 0; i < nfiles; i++) {
+        if (done[i]) {
+            continue;
+        }
+        const char* format = package_format(files[i]);
+        const char* manager = strcmp(format, DELTA_EXT) == 0 ? NULL : trimorph_format_manager(files[i]);
+        int n = 0, spans = 0;
+        for (int j = i; j < nfiles && (n == 0 || manager != NULL); j++) {
+            const char* other = trimorph_format_manager(files[j]);
+            if (!done[j] && (j == i || (other != NULL && strcmp(other, manager) == 0))) {
+                spans += n == 0 || owner[j] != owner[members[n - 1]];
+                group[n] = files[j];
+                members[n++] = j;
+                done[j] = 1;
+            }
+        }
+        int result = install_transaction(n, group);
+        transactions++;
+        if (result == 0 || spans == 1) {
+            for (int k = 0; k < n; k++) {
+                group_request_t* r = &requests[owner[members[k]]];
+                r->result = r->result != 0 ? r->result : result;
+            }
+            continue;
+        }
+
+        printf("Group commit: %s transaction failed; installing its requests one at a time\n", manager);
+        for (int r = 0; r < nrequests; r++) {
+            int m = 0;
+            for (int k = 0; k < n; k++) {
+                if (owner[members[k]] == r) {
+                    group[m++] = files[members[k]];
+                }
+            }
+            if (m > 0) {
+                int own = install_transaction(m, group);
+                transactions++;
+                requests[r].result = requests[r].result != 0 ? requests[r].result : own;
+            }
+        }
+    }
+    printf("Group commit: %d request%s, %d package%s in %d transaction%s\n", nrequests,
+           nrequests == 1 ? "" : "s", nfiles, nfiles == 1 ? "" : "s", transactions, transactions == 1 ? "" : "s");
+    free(group);
+    free(members);
+    free(owner);
+    free(done);
+}
+
+// Lead a group: wait out the commit window, claim the queued requests, install them
+// together with our own packages and hand every request its status
+static int lead_group(const char* dir, int count, char* paths[]) {
+    printf("Group commit: leading; collecting installs for %.1fs\n", group_window);
+    fflush(stdout);
+    struct timespec window = {(time_t)group_window, (long)((group_window - (time_t)group_window) * 1e9)};
+    while (nanosleep(&window, &window) != 0 && errno == EINTR) {
+    }
+
+    group_request_t* requests = calloc(GROUP_MAX_REQUESTS + 1, sizeof(group_request_t));
+    char** files = calloc(GROUP_MAX_FILES + (size_t)count, sizeof(char*));
+    if (requests == NULL || files == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(requests);
+        free(files);
+        return -1;
+    }
+    int nfiles = 0;
+    for (int i = 0; i < count; i++) {
+        files[nfiles++] = strdup(paths[i]);
+    }
+    requests[0].count = count;
+    int nrequests = claim_group_requests(dir, requests, 1, files, &nfiles);
+    for (int i = 0; i < nfiles; i++) {
+        if (files[i] == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            nrequests = -1;
+        }
+    }
+    if (nrequests > 0) {
+        run_group(requests, nrequests, files, nfiles);
+    }
+
+    for (int r = 1; r < nrequests; r++) {
+        char status[32];
+        char name[80];
+        snprintf(status, sizeof(status), "%d\n", requests[r].result);
+        snprintf(name, sizeof(name), "done-%s", requests[r].id);
+        if (spool_write(dir, name, status) != 0) {
+            fprintf(stderr, "Warning: Cannot hand the result back to request %s\n", requests[r].id);
+        }
+        char claimed[MAX_PATH + 80];
+        snprintf(claimed, sizeof(claimed), "%s/claimed-%s", dir, requests[r].id);
+        unlink(claimed);
+    }
+    int result = nrequests > 0 ? requests[0].result : -1;
+    for (int i = 0; i < nfiles; i++) free(files[i]);
+    free(files);
+    free(requests);
+    return result;
+}
+
+// Wait for a queued request's status. Returns 1 with *result set once the leader has
+// written it, or 0 when the spool lock became ours with the request not taken: then
+// the request has been withdrawn and the caller leads.
+static int wait_group_result(const char* dir, const char* id, int lock_fd, int* result) {
+    char done_path[MAX_PATH + 80];
+    snprintf(done_path, sizeof(done_path), "%s/done-%s", dir, id);
+    int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (ifd >= 0 && inotify_add_watch(ifd, dir, IN_MOVED_TO) < 0) {
+        close(ifd);
+        ifd = -1;
+    }
+    for (;;) {
+        int have_lock = flock(lock_fd, LOCK_EX | LOCK_NB) == 0;
+        FILE* f = fopen(done_path, "r");
+        if (f != NULL) {
+            int ok = fscanf(f, "%d", result) == 1;
+            fclose(f);
+            unlink(done_path);
+            if (have_lock) flock(lock_fd, LOCK_UN);
+            if (ifd >= 0) close(ifd);
+            if (!ok) *result = -1;
+            return 1;
+        }
+        if (have_lock) {
+            // The leader is gone and did not take our request (or died with it): lead
+            char path[MAX_PATH + 80];
+            snprintf(path, sizeof(path), "%s/req-%s", dir, id);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/claimed-%s", dir, id);
+            unlink(path);
+            if (ifd >= 0) close(ifd);
+            return 0;
+        }
+        // Results are renamed into place; the lock is rechecked every half second
+        struct pollfd pfd = {ifd, POLLIN, 0};
+        if (ifd >= 0 && poll(&pfd, 1, 500) > 0) {
+            char buf[4096];
+            while (read(ifd, buf, sizeof(buf)) > 0) {
+            }
+        } else if (ifd < 0) {
+            usleep(100000);
+        }
+    }
+}
+
+// Install through the group commit spool. The invoker either leads a group or queues
+// its packages with the current leader and returns the exit status of its own packages.
+static int group_install(int count, char* paths[]) {
+    for (int i = 0; i < count; i++) {
+        if (check_install_files(1, &paths[i]) != 0) {
+            return -1;
+        }
+    }
+    char dir[MAX_PATH];
+    int lock_fd = open_spool(dir, sizeof(dir));
+    if (lock_fd < 0) {
+        fprintf(stderr, "Warning: Cannot use the group commit spool %s: %s; installing alone\n", dir,
+                strerror(errno));
+        int result = 0;
+        for (int i = 0; result == 0 && i < count; i++) {
+            result = install_local_package(paths[i]);
+        }
+        return result;
+    }
+
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        // A leader is collecting: queue absolute paths, since its working directory differs
+        char id[64];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(id, sizeof(id), "%d-%lld%09ld", (int)getpid(), (long long)ts.tv_sec, ts.tv_nsec);
+        char options[MAX_PATH * 2 + 128];
+        group_options(options, sizeof(options));
+        size_t len = strlen(options) + (size_t)count * (PATH_MAX + 1) + 1;
+        char* list = malloc(len);
+        size_t used = list != NULL ? (size_t)snprintf(list, len, "%s", options) : 0;
+        for (int i = 0; list != NULL && i < count; i++) {
+            char resolved[PATH_MAX];
+            if (realpath(paths[i], resolved) == NULL) {
+                fprintf(stderr, "Error: Cannot resolve %s: %s\n", paths[i], strerror(errno));
+                free(list);
+                close(lock_fd);
+                return -1;
+            }
+            used += (size_t)snprintf(list + used, len - used, "%s\n", resolved);
+        }
+        char name[80];
+        snprintf(name, sizeof(name), "req-%s", id);
+        if (list == NULL || spool_write(dir, name, list) != 0) {
+            fprintf(stderr, "Error: Cannot queue the install in %s\n", dir);
+            free(list);
+            close(lock_fd);
+            return -1;
+        }
+        free(list);
+        printf("Group commit: queued %d package%s with the running leader\n", count, count == 1 ? "" : "s");
+        fflush(stdout);
+
+        int result;
+        if (wait_group_result(dir, id, lock_fd, &result)) {
+            close(lock_fd);
+            if (result != 0) {
+                fprintf(stderr, "Error: Group install of the queued packages failed with exit code %d\n", result);
+            } else {
+                printf("Group commit: queued packages %s\n", dry_run ? "planned by the leader" : "installed");
+            }
+            return result;
+        }
+    }
+
+    int result = lead_group(dir, count, paths);
+    close(lock_fd);  // Releases the lock; queued latecomers elect the next leader
+    return result;
+}
+
+// Install local package files and package URLs. URLs are all fetched up front, in
+// parallel, before the first package is handed to the format dispatch.
+int install_packages(int count, char* args[]) {
+    char (*paths)[MAX_PATH] = calloc((size_t)count, MAX_PATH);
+    if (paths == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    int has_urls = 0;
+    for (int i = 0; i < count; i++) {
+        has_urls |= is_package_url(args[i]);
+        snprintf(paths[i], MAX_PATH, "%s", args[i]);
+    }
+    int result = 0;
+    if (dry_run) {
+        // Plan against the URLs themselves; nothing is downloaded or tested
+        for (int i = 0; i < count; i++) {
+            if (is_package_url(args[i])) {
+                printf("Would fetch %s\n", args[i]);
+                paths[i][strcspn(paths[i], "#")] = '\0';
+            }
+        }
+        printf("Would test %d package payload%s before installing\n", count, count == 1 ? "" : "s");
+    } else if (has_urls) {
+        result = fetch_packages(count, args, paths);
+    }
+
+    // Test every payload before any package manager runs, so a damaged file does not
+    // fail the install midway after the refresh and lock work has been spent
+    if (result == 0 && !dry_run) {
+        char** local = malloc((size_t)count * sizeof(char*));
+        int damaged = -1;
+        if (local != NULL) {
+            for (int i = 0; i < count; i++) {
+                local[i] = paths[i];
+            }
+            damaged = test_archives(count, local, 1);
+            free(local);
+        }
+        if (damaged != 0) {
+            if (damaged > 0) {
+                fprintf(stderr, "Tip: Download the damaged package again; nothing was installed\n");
+            }
+            result = -1;
+        }
+    }
+
+    // Concurrent installs are merged into one transaction per manager by a leader
+    if (result == 0 && group_window > 0 && !conflict_check_done) {
+        char** local = malloc((size_t)count * sizeof(char*));
+        for (int i = 0; local != NULL && i < count; i++) {
+            local[i] = paths[i];
+        }
+        if (local == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+        }
+        result = local != NULL ? group_install(count, local) : -1;
+        free(local);
+        free(paths);
+        return result;
+    }
+
+    // The packages are installed one by one, so their disk space is checked together
+    int space_checked = space_check_done;
+    if (result == 0 && count > 1) {
+        char** local = malloc((size_t)count * sizeof(char*));
+        for (int i = 0; local != NULL && i < count; i++) {
+            local[i] = paths[i];
+        }
+        if (local == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+        }
+        result = local != NULL ? space_preflight(count, local) : -1;
+        free(local);
+        space_check_done = 1;
+    }
+
+    for (int i = 0; result == 0 && i < count; i++) {
+        result = install_local_package(paths[i]);
+    }
+    space_check_done = space_checked;
+    free(paths);
+    return result;
+}
+
+// Family a series belongs to: its name without labels or histogram suffixes
+static const metric_def_t* metric_family(const char* key) {
+    size_t name_len = strcspn(key, "{ ");
+    for (int i = 0; metric_defs[i].name != NULL; i++) {
+        size_t len = strlen(metric_defs[i].name);
+        if (name_len < len || strncmp(key, metric_defs[i].name, len) != 0) {
+            continue;
+        }
+        const char* rest = key + len;
+        size_t rest_len = name_len - len;
+        if (rest_len == 0 ||
+            (strcmp(metric_defs[i].type, "histogram") == 0 &&
+             ((rest_len == 7 && strncmp(rest, "_bucket", 7) == 0) ||
+              (rest_len == 4 && strncmp(rest, "_sum", 4) == 0) ||
+              (rest_len == 6 && strncmp(rest, "_count", 6) == 0)))) {
+            return &metric_defs[i];
+        }
+    }
+    return NULL;
+}
+
+static int series_cmp(const void* a, const void* b) {
+    return strcmp(((const metric_series_t*)a)->key, ((const metric_series_t*)b)->key);
+}
+
+// Merge this process's metrics into the textfile. Concurrent trimorph processes take
+// an exclusive lock on a sidecar lock file, re-read the current totals, add their own
+// and atomically replace the file, so no process overwrites another's counts.
+int metrics_flush() {
+    if (metrics_file == NULL || metric_delta_count == 0) {
+        return 0;
+    }
+
+    char lock_path[MAX_PATH];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", metrics_file);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        fprintf(stderr, "Warning: Cannot lock metrics file %s\n", metrics_file);
+        if (lock_fd >= 0) close(lock_fd);
+        return -1;
+    }
+
+    // Read the current totals; comments are regenerated on write
+    metric_series_t* series = NULL;
+    size_t count = 0;
+    FILE* in = fopen(metrics_file, "r");
+    if (in != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (line[0] == '#' || line[0] == '\n') {
+                continue;
+            }
+            char* space = strrchr(line, ' ');
+            if (space == NULL) {
+                continue;
+            }
+            *space = '\0';
+            if (metric_family(line) != NULL) {
+                add_series(&series, &count, line, strtod(space + 1, NULL));
+            }
+        }
+        fclose(in);
+    }
+    for (size_t i = 0; i < metric_delta_count; i++) {
+        add_series(&series, &count, metric_deltas[i].key, metric_deltas[i].value);
+    }
+    if (count > 0) {
+        qsort(series, count, sizeof(*series), series_cmp);
+    }
+
+    char tmp_path[MAX_PATH];
+    FILE* out = open_atomic(metrics_file, tmp_path, sizeof(tmp_path));
+    int result = -1;
+    if (out != NULL) {
+        for (int d = 0; metric_defs[d].name != NULL; d++) {
+            int header = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (metric_family(series[i].key) != &metric_defs[d]) {
+                    continue;
+                }
+                if (!header) {
+                    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric_defs[d].name, metric_defs[d].help,
+                            metric_defs[d].name, metric_defs[d].type);
+                    header = 1;
+                }
+                fprintf(out, "%s %.17g\n", series[i].key, series[i].value);
+            }
+        }
+        result = commit_atomic(out, tmp_path, metrics_file);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Warning: Cannot write metrics file %s\n", metrics_file);
+    }
+
+    free(series);
+    free(metric_deltas);
+    metric_deltas = NULL;
+    metric_delta_count = 0;
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    return result;
+}
+
+// Package cache layouts known to "cache gc"
+#define CACHE_DEB 0
+#define CACHE_ARCH 1
+#define CACHE_RPM 2
+#define CACHE_APK 3
+
+typedef struct {
+    const char* dir;            // Relative to the target root
+    int format;
+    int depth;                  // Directory levels below dir that hold packages
+} pkg_cache_t;
+
+static const pkg_cache_t pkg_caches[] = {
+    {"var/cache/apt/archives", CACHE_DEB, 0},
+    {"var/cache/pacman/pkg", CACHE_ARCH, 0},
+    {"var/cache/dnf", CACHE_RPM, 2},        // <repo>/packages/*.rpm
+    {"var/cache/yum", CACHE_RPM, 3},        // <arch>/<release>/<repo>/packages/*.rpm
+    {"var/cache/zypp/packages", CACHE_RPM, 3},
+    {"var/cache/apk", CACHE_APK, 0},
+    {NULL, 0, 0}  // Sentinel
+};
+
+// One package file found in a cache
+typedef struct {
+    char path[MAX_PATH];
+    char name[128];
+    char version[128];
+    off_t size;
+    time_t mtime;
+    int scan;                   // Index of the cache it was found in
+    int installed;
+    int remove;
+} cache_file_t;
+
+// Result of scanning one cache, filled in by its own thread
+typedef struct {
+    const pkg_cache_t* cache;
+    int index;
+    char dir[MAX_PATH];
+    cache_file_t* files;
+    size_t count;
+    char** installed;           // Sorted "name version" keys
+    size_t installed_count;
+    int installed_ok;
+    int with_epoch;             // Include rpm epochs ("E:V-R"), for version comparisons
+} cache_scan_t;
+
+// Parse a human size such as 2G, 512M or 100000 into bytes, -1 if invalid
+static long long parse_size(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    long long unit = 1;
+    switch (*end) {
+        case 'K': case 'k': unit = 1LL << 10; end++; break;
+        case 'M': case 'm': unit = 1LL << 20; end++; break;
+        case 'G': case 'g': unit = 1LL << 30; end++; break;
+        case 'T': case 't': unit = 1LL << 40; end++; break;
+    }
+    if (unit > 1 && *end == 'i') end++;
+    if (*end == 'B' || *end == 'b') end++;
+    return *end == '\0' ? (long long)(value * unit) : -1;
+}
+
+// Split "name-version-release[-arch]" from the right: after dropping skip_last trailing
+// fields, the last fields dash-separated fields are the version and the rest the name
+static int split_name_version(const char* base, int fields, int skip_last,
+                              char* name, size_t name_len, char* version, size_t version_len) {
+    const char* end = base + strlen(base);
+    const char* version_end = end;
+    const char* p = end;
+    for (int dashes = 0; dashes < fields + skip_last; dashes++) {
+        while (p > base && *(p - 1) != '-') p--;
+        if (p == base) {
+            return -1;
+        }
+        p--;
+        if (dashes == skip_last - 1) {
+            version_end = p;
+        }
+    }
+    if (p == base) {
+        return -1;
+    }
+    snprintf(name, name_len, "%.*s", (int)(p - base), base);
+    snprintf(version, version_len, "%.*s", (int)(version_end - p - 1), p + 1);
+    return 0;
+}
+
+// Parse the package name and version out of a cached file name
+static int parse_cache_name(int format, const char* file, char* name, size_t name_len,
+                            char* version, size_t version_len) {
+    char base[NAME_MAX + 1];
+    size_t len = strlen(file);
+    if (format == CACHE_DEB) {
+        // name_version_arch.deb, with the epoch colon encoded as %3a
+        const char* first = strchr(file, '_');
+        const char* second = first != NULL ? strchr(first + 1, '_') : NULL;
+        if (len < 5 || strcmp(file + len - 4, ".deb") != 0 || second == NULL) {
+            return -1;
+        }
+        snprintf(name, name_len, "%.*s", (int)(first - file), file);
+        size_t o = 0;
+        for (const char* p = first + 1; p < second && o + 1 < version_len; p++) {
+            if (strncasecmp(p, "%3a", 3) == 0) {
+                version[o++] = ':';
+                p += 2;
+            } else {
+                version[o++] = *p;
+            }
+        }
+        version[o] = '\0';
+        return 0;
+    }
+    if (format == CACHE_ARCH) {
+        // name-version-release-arch.pkg.tar.*, ignoring signatures and partial downloads
+        const char* ext = strstr(file, ".pkg.tar");
+        if (ext == NULL || strstr(ext, ".sig") != NULL || strstr(ext, ".part") != NULL) {
+            return -1;
+        }
+        snprintf(base, sizeof(base), "%.*s", (int)(ext - file), file);
+        return split_name_version(base, 2, 1, name, name_len, version, version_len);
+    }
+    if (format == CACHE_RPM) {
+        // name-version-release.arch.rpm
+        if (len < 5 || strcmp(file + len - 4, ".rpm") != 0) {
+            return -1;
+        }
+        snprintf(base, sizeof(base), "%.*s", (int)(len - 4), file);
+        char* arch = strrchr(base, '.');
+        if (arch == NULL) {
+            return -1;
+        }
+        *arch = '\0';
+        return split_name_version(base, 2, 0, name, name_len, version, version_len);
+    }
+    // Alpine: name-version-rN.apk, with a checksum before .apk in the apk cache
+    if (len < 5 || strcmp(file + len - 4, ".apk") != 0) {
+        return -1;
+    }
+    snprintf(base, sizeof(base), "%.*s", (int)(len - 4), file);
+    char* dot = strrchr(base, '.');
+    if (dot != NULL && strlen(dot + 1) == 8 && strspn(dot + 1, "0123456789abcdef") == 8) {
+        *dot = '\0';
+    }
+    return split_name_version(base, 2, 0, name, name_len, version, version_len);
+}
+
+static void add_installed(cache_scan_t* scan, size_t* cap, const char* name, const char* version) {
+    if (scan->installed_count == *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        char** grown = realloc(scan->installed, *cap * sizeof(char*));
+        if (grown == NULL) {
+            return;
+        }
+        scan->installed = grown;
+    }
+    char key[300];
+    snprintf(key, sizeof(key), "%s %s", name, version);
+    char* copy = strdup(key);
+    if (copy != NULL) {
+        scan->installed[scan->installed_count++] = copy;
+    }
+}
+
+static int string_ptr_cmp(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Load the installed name/version pairs for a cache's package manager. The package
+// databases are read directly where their format allows, so --root needs no tools.
+static int load_installed_versions(cache_scan_t* scan) {
+    const char* root = has_target_root() ? target_root : "";
+    char path[MAX_PATH];
+    char line[1024];
+    char name[128] = "";
+    char version[128] = "";
+    size_t cap = 0;
+    int format = scan->cache->format;
+
+    if (format == CACHE_DEB || format == CACHE_APK) {
+        // dpkg status and the apk database are both paragraphs of "Key: value" lines
+        snprintf(path, sizeof(path), "%s/%s", root, format == CACHE_DEB ? "var/lib/dpkg/status" : "lib/apk/db/installed");
+        FILE* f = fopen(path, "r");
+        if (f == NULL) {
+            return -1;
+        }
+        int installed = format == CACHE_APK;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] == '\0') {
+                if (installed && name[0] != '\0' && version[0] != '\0') {
+                    add_installed(scan, &cap, name, version);
+                }
+                name[0] = version[0] = '\0';
+                installed = format == CACHE_APK;
+            } else if (format == CACHE_DEB && strncmp(line, "Package: ", 9) == 0) {
+                snprintf(name, sizeof(name), "%s", line + 9);
+            } else if (format == CACHE_DEB && strncmp(line, "Version: ", 9) == 0) {
+                snprintf(version, sizeof(version), "%s", line + 9);
+            } else if (format == CACHE_DEB && strncmp(line, "Status: ", 8) == 0) {
+                installed = strstr(line, " installed") != NULL;
+            } else if (format == CACHE_APK && strncmp(line, "P:", 2) == 0) {
+                snprintf(name, sizeof(name), "%s", line + 2);
+            } else if (format == CACHE_APK && strncmp(line, "V:", 2) == 0) {
+                snprintf(version, sizeof(version), "%s", line + 2);
+            }
+        }
+        if (installed && name[0] != '\0' && version[0] != '\0') {
+            add_installed(scan, &cap, name, version);
+        }
+        fclose(f);
+    } else if (format == CACHE_ARCH) {
+        // One directory per installed package, named name-version-release
+        snprintf(path, sizeof(path), "%s/var/lib/pacman/local", root);
+        DIR* d = opendir(path);
+        if (d == NULL) {
+            return -1;
+        }
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] != '.' &&
+                split_name_version(de->d_name, 2, 0, name, sizeof(name), version, sizeof(version)) == 0) {
+                add_installed(scan, &cap, name, version);
+            }
+        }
+        closedir(d);
+    } else {
+        // The rpm database is not a plain file format, so ask rpm
+        char cmd[MAX_PATH * 2];
+        const char* query = scan->with_epoch ?
+            "rpm -qa --qf '%{NAME} %|EPOCH?{%{EPOCH}:}:{}|%{VERSION}-%{RELEASE}\\n' 2>/dev/null" :
+            "rpm -qa --qf '%{NAME} %{VERSION}-%{RELEASE}\\n' 2>/dev/null";
+        if (!is_cmd_available("rpm")) {
+            return -1;
+        }
+        if (has_target_root() ? trimorph_root_command(tm, query, cmd, sizeof(cmd)) != TRIMORPH_OK :
+            snprintf(cmd, sizeof(cmd), "%s", query) >= (int)sizeof(cmd)) {
+            return -1;
+        }
+        FILE* p = popen(cmd, "r");
+        if (p == NULL) {
+            return -1;
+        }
+        while (fgets(line, sizeof(line), p) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            char* space = strchr(line, ' ');
+            if (space != NULL) {
+                *space = '\0';
+                add_installed(scan, &cap, line, space + 1);
+            }
+        }
+        if (pclose(p) != 0) {
+            return -1;
+        }
+    }
+
+    if (scan->installed_count > 0) {
+        qsort(scan->installed, scan->installed_count, sizeof(char*), string_ptr_cmp);
+    }
+    return 0;
+}
+
+// Collect the package files of a cache directory, descending depth more levels
+static void scan_cache_dir(cache_scan_t* scan, size_t* cap, const char* dir, int depth) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (S_ISDIR(st.st_mode)) {
+            if (depth > 0) {
+                scan_cache_dir(scan, cap, path, depth - 1);
+            }
+            continue;
+        }
+        char name[128], version[128];
+        if (!S_ISREG(st.st_mode) ||
+            parse_cache_name(scan->cache->format, de->d_name, name, sizeof(name), version, sizeof(version)) != 0) {
+            continue;
+        }
+        if (scan->count == *cap) {
+            *cap = *cap ? *cap * 2 : 256;
+            cache_file_t* grown = realloc(scan->files, *cap * sizeof(cache_file_t));
+            if (grown == NULL) {
+                break;
+            }
+            scan->files = grown;
+        }
+        cache_file_t* f = &scan->files[scan->count++];
+        memset(f, 0, sizeof(*f));
+        snprintf(f->path, sizeof(f->path), "%s", path);
+        snprintf(f->name, sizeof(f->name), "%s", name);
+        snprintf(f->version, sizeof(f->version), "%s", version);
+        f->size = st.st_size;
+        f->mtime = st.st_mtime;
+        f->scan = scan->index;
+    }
+    closedir(d);
+}
+
+static void* cache_scan_worker(void* arg) {
+    cache_scan_t* scan = arg;
+    size_t cap = 0;
+    scan->installed_ok = load_installed_versions(scan) == 0;
+    scan_cache_dir(scan, &cap, scan->dir, scan->cache->depth);
+    for (size_t i = 0; scan->installed_ok && i < scan->count; i++) {
+        char key[300];
+        char* key_ptr = key;
+        snprintf(key, sizeof(key), "%s %s", scan->files[i].name, scan->files[i].version);
+        scan->files[i].installed = scan->installed_count > 0 &&
+            bsearch(&key_ptr, scan->installed, scan->installed_count, sizeof(char*), string_ptr_cmp) != NULL;
+    }
+    return NULL;
+}
+
+// Group versions of a package together, newest first
+static int cache_group_cmp(const void* a, const void* b) {
+    const cache_file_t* fa = *(cache_file_t* const*)a;
+    const cache_file_t* fb = *(cache_file_t* const*)b;
+    if (fa->scan != fb->scan) return fa->scan - fb->scan;
+    int c = strcmp(fa->name, fb->name);
+    if (c != 0) return c;
+    return fa->mtime < fb->mtime ? 1 : fa->mtime > fb->mtime ? -1 : 0;
+}
+
+static int cache_age_cmp(const void* a, const void* b) {
+    const cache_file_t* fa = *(cache_file_t* const*)a;
+    const cache_file_t* fb = *(cache_file_t* const*)b;
+    return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime ? 1 : 0;
+}
+
+// Remove cached packages: beyond the newest keep versions of each package, then oldest
+// first until the caches fit in budget bytes (-1 for no budget). Installed versions are
+// never removed, and a cache whose installed versions cannot be read is left alone.
+int cache_gc(long long budget, int keep, int dry_run) {
+    const char* root = has_target_root() ? target_root : "";
+    cache_scan_t scans[sizeof(pkg_caches) / sizeof(pkg_caches[0])];
+    int nscans = 0;
+    for (int i = 0; pkg_caches[i].dir != NULL; i++) {
+        cache_scan_t* scan = &scans[nscans];
+        memset(scan, 0, sizeof(*scan));
+        snprintf(scan->dir, sizeof(scan->dir), "%s/%s", root, pkg_caches[i].dir);
+        struct stat st;
+        if (stat(scan->dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+            scan->cache = &pkg_caches[i];
+            scan->index = nscans++;
+        }
+    }
+    if (nscans == 0) {
+        printf("No package caches found\n");
+        return 0;
+    }
+
+    // Scan every cache on its own thread
+    pthread_t threads[sizeof(pkg_caches) / sizeof(pkg_caches[0])];
+    int started[sizeof(pkg_caches) / sizeof(pkg_caches[0])];
+    for (int i = 0; i < nscans; i++) {
+        started[i] = pthread_create(&threads[i], NULL, cache_scan_worker, &scans[i]) == 0;
+        if (!started[i]) {
+            cache_scan_worker(&scans[i]);
+        }
+    }
+    for (int i = 0; i < nscans; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    size_t total_files = 0;
+    for (int i = 0; i < nscans; i++) {
+        total_files += scans[i].count;
+    }
+    cache_file_t** files = malloc((total_files + 1) * sizeof(cache_file_t*));
+    if (files == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    size_t nfiles = 0;
+    long long total = 0;
+    for (int i = 0; i < nscans; i++) {
+        for (size_t j = 0; j < scans[i].count; j++) {
+            total += scans[i].files[j].size;
+            if (scans[i].installed_ok) {
+                files[nfiles++] = &scans[i].files[j];
+            }
+        }
+        if (!scans[i].installed_ok && scans[i].count > 0) {
+            fprintf(stderr, "Warning: Cannot read installed packages for %s, leaving it untouched\n", scans[i].dir);
+        }
+    }
+
+    // Keep the newest versions of each package
+    long long remaining = total;
+    if (nfiles > 0) {
+        qsort(files, nfiles, sizeof(*files), cache_group_cmp);
+    }
+    for (size_t i = 0, rank = 0; keep > 0 && i < nfiles; i++) {
+        rank = (i > 0 && files[i]->scan == files[i - 1]->scan && strcmp(files[i]->name, files[i - 1]->name) == 0)
+               ? rank + 1 : 0;
+        if ((int)rank >= keep && !files[i]->installed) {
+            files[i]->remove = 1;
+            remaining -= files[i]->size;
+        }
+    }
+
+    // Then evict the oldest files until the budget is met
+    if (budget >= 0 && remaining > budget && nfiles > 0) {
+        qsort(files, nfiles, sizeof(*files), cache_age_cmp);
+        for (size_t i = 0; i < nfiles && remaining > budget; i++) {
+            if (!files[i]->remove && !files[i]->installed) {
+                files[i]->remove = 1;
+                remaining -= files[i]->size;
+            }
+        }
+    }
+
+    if (!dry_run && remaining < total && is_package_manager_running()) {
+        fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
+        free(files);
+        for (int i = 0; i < nscans; i++) {
+            for (size_t j = 0; j < scans[i].installed_count; j++) free(scans[i].installed[j]);
+            free(scans[i].installed);
+            free(scans[i].files);
+        }
+        return -1;
+    }
+
+    // Remove and report per cache
+    long long reclaimed = 0;
+    size_t removed = 0;
+    int result = 0;
+    for (int i = 0; i < nscans; i++) {
+        long long cache_size = 0, cache_reclaimed = 0;
+        size_t cache_removed = 0, cache_installed = 0;
+        for (size_t j = 0; j < scans[i].count; j++) {
+            cache_file_t* f = &scans[i].files[j];
+            cache_size += f->size;
+            cache_installed += f->installed;
+            if (!f->remove) {
+                continue;
+            }
+            if (dry_run) {
+                printf("  Would remove %s (%.1f MiB)\n", f->path, f->size / 1048576.0);
+            } else if (unlink(f->path) != 0) {
+                fprintf(stderr, "Warning: Cannot remove %s: %s\n", f->path, strerror(errno));
+                result = -1;
+                continue;
+            }
+            if (scans[i].cache->format == CACHE_ARCH && !dry_run) {
+                // Detached signatures go with their package
+                char sig[MAX_PATH + 8];
+                snprintf(sig, sizeof(sig), "%s.sig", f->path);
+                unlink(sig);
+            }
+            cache_reclaimed += f->size;
+            cache_removed++;
+        }
+        printf("%s: %zu packages (%.1f MiB, %zu installed), %s %zu (%.1f MiB)\n", scans[i].dir, scans[i].count,
+               cache_size / 1048576.0, cache_installed, dry_run ? "would remove" : "removed", cache_removed,
+               cache_reclaimed / 1048576.0);
+        reclaimed += cache_reclaimed;
+        removed += cache_removed;
+    }
+    printf("%s %.1f MiB from %zu packages; caches %s %.1f MiB", dry_run ? "Would reclaim" : "Reclaimed",
+           reclaimed / 1048576.0, removed, dry_run ? "would use" : "now use", (total - reclaimed) / 1048576.0);
+    if (budget >= 0) {
+        printf(" of a %.1f MiB budget", budget / 1048576.0);
+    }
+    printf("\n");
+    if (budget >= 0 && total - reclaimed > budget) {
+        printf("Tip: The budget cannot be met without removing installed versions\n");
+    }
+
+    free(files);
+    for (int i = 0; i < nscans; i++) {
+        for (size_t j = 0; j < scans[i].installed_count; j++) free(scans[i].installed[j]);
+        free(scans[i].installed);
+        free(scans[i].files);
+    }
+    return result;
+}
+
+// Disk space preflight: before any refresh or install, the bytes a set of packages will
+// write are summed per filesystem and compared with the free space there. Target paths
+// come from each payload's own file list (the tar headers of deb, Arch, Alpine and
+// Gentoo packages, the header of an rpm), every file rounded up to the filesystem's
+// block size. Where the list cannot be read, the installed size from the package
+// metadata is counted against the filesystem holding /usr. The package file itself
+// counts against the manager's package cache, where frontends may stage a copy.
+#define SPACE_MAX_FS 32
+
+typedef struct {
+    dev_t dev;
+    char mount[MAX_PATH];       // Topmost directory of the filesystem
+    unsigned long long need;    // Bytes the set writes here
+    unsigned long long avail;
+    unsigned long long files;   // Inodes the set creates here
+    unsigned long long files_avail;
+    unsigned long long block;
+} space_fs_t;
+
+typedef struct {
+    space_fs_t fs[SPACE_MAX_FS];
+    int count;
+    char dir[MAX_PATH];         // Last directory looked up, and its filesystem
+    int dir_fs;
+    char too_long[MAX_PATH];    // First path too long to look up, which fails the check
+} space_check_t;
+
+// Remember a path that could not be looked up; its files cannot be counted anywhere
+static void space_path_too_long(space_check_t* check, const char* path) {
+    if (check->too_long[0] == '\0') {
+        snprintf(check->too_long, sizeof(check->too_long), "%.*s", (int)sizeof(check->too_long) - 1, path);
+    }
+}
+
+// Filesystem a directory in the target root is on; new directories land on the
+// filesystem of their nearest existing parent. Returns an index into check->fs, or -1.
+static int space_filesystem(space_check_t* check, const char* dir) {
+    if (check->dir_fs >= 0 && strcmp(check->dir, dir) == 0) {
+        return check->dir_fs;
+    }
+    char path[MAX_PATH];
+    int len = snprintf(path, sizeof(path), "%s/%s", has_target_root() ? target_root : "", dir);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        space_path_too_long(check, dir);
+        return -1;
+    }
+    struct stat st;
+    while (stat(path, &st) != 0) {
+        char* slash = strrchr(path, '/');
+        if (slash == NULL) {
+            return -1;
+        }
+        slash[slash == path ? 1 : 0] = '\0';
+    }
+
+    int fs = 0;
+    while (fs < check->count && check->fs[fs].dev != st.st_dev) {
+        fs++;
+    }
+    if (fs == check->count) {
+        struct statvfs vfs;
+        if (fs == SPACE_MAX_FS || statvfs(path, &vfs) != 0) {
+            return -1;
+        }
+        space_fs_t* f = &check->fs[check->count++];
+        f->dev = st.st_dev;
+        f->block = vfs.f_frsize > 0 ? vfs.f_frsize : 4096;
+        // Package managers run as root and may use the blocks reserved for it
+        int privileged = geteuid() == 0;
+        f->avail = (unsigned long long)(privileged ? vfs.f_bfree : vfs.f_bavail) * f->block;
+        f->files_avail = vfs.f_files == 0 ? ULLONG_MAX :  // No fixed inode table (btrfs)
+                         (unsigned long long)(privileged ? vfs.f_ffree : vfs.f_favail);
+
+        // Walk up while the parent is on the same device to name the mount point
+        snprintf(f->mount, sizeof(f->mount), "%s", path);
+        while (strcmp(f->mount, "/") != 0) {
+            char parent[MAX_PATH];
+            snprintf(parent, sizeof(parent), "%s", f->mount);
+            char* slash = strrchr(parent, '/');
+            if (slash == NULL) {
+                break;
+            }
+            slash[slash == parent ? 1 : 0] = '\0';
+            struct stat pst;
+            if (stat(parent, &pst) != 0 || pst.st_dev != st.st_dev) {
+                break;
+            }
+            snprintf(f->mount, sizeof(f->mount), "%s", parent);
+        }
+    }
+    snprintf(check->dir, sizeof(check->dir), "%s", dir);
+    check->dir_fs = fs;
+    return fs;
+}
+
+// Count one file a package installs against the filesystem its directory is on
+static void space_charge(space_check_t* check, const char* path, unsigned long long size) {
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    while (path[0] == '/') path++;
+    const char* slash = strrchr(path, '/');
+    char dir[MAX_PATH];
+    int len = snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int)(slash - path) : 0, path);
+    if (len < 0 || (size_t)len >= sizeof(dir)) {
+        space_path_too_long(check, path);
+        return;
+    }
+    int fs = space_filesystem(check, dir);
+    if (fs >= 0) {
+        space_fs_t* f = &check->fs[fs];
+        f->need += (size + f->block - 1) / f->block * f->block;
+        f->files++;
+    }
+}
+
+// Count the files in a tar stream, returning how many were counted. Long names come
+// from GNU 'L' members and pax 'x' headers; dot files at the top level are package
+// metadata (.PKGINFO, .MTREE, .SIGN.*), not installed files.
+static long space_charge_tar(space_check_t* check, int fd) {
+    unsigned char hdr[512];
+    char long_name[MAX_PATH] = "";
+    long counted = 0;
+    while (read_full(fd, hdr, sizeof(hdr)) == 0) {
+        if (hdr[0] == '\0') {
+            continue;  // Padding or end-of-archive blocks between concatenated segments
+        }
+        unsigned long long size = 0;
+        if (hdr[124] & 0x80) {
+            for (int i = 125; i < 136; i++) size = size << 8 | hdr[i];  // GNU base-256 size
+        } else {
+            char size_field[13];
+            memcpy(size_field, hdr + 124, 12);
+            size_field[12] = '\0';
+            size = strtoull(size_field, NULL, 8);
+        }
+        unsigned long long padded = (size + 511) & ~511ULL;
+        char type = (char)hdr[156];
+
+        if ((type == 'L' || type == 'x') && size < 65536) {
+            char* data = malloc(padded + 1);
+            if (data == NULL || read_full(fd, data, padded) != 0) {
+                free(data);
+                return counted;
+            }
+            data[size] = '\0';
+            if (type == 'L') {
+                snprintf(long_name, sizeof(long_name), "%s", data);
+            } else {
+                // Records are "<length> <key>=<value>\n"
+                for (char* rec = data; rec < data + size; ) {
+                    char* end;
+                    unsigned long len = strtoul(rec, &end, 10);
+                    if (len == 0 || rec + len > data + size || *end != ' ') break;
+                    if (strncmp(end + 1, "path=", 5) == 0) {
+                        snprintf(long_name, sizeof(long_name), "%.*s", (int)(rec + len - end - 7), end + 6);
+                    }
+                    rec += len;
+                }
+            }
+            free(data);
+            continue;
+        }
+
+        char name[MAX_PATH];
+        if (long_name[0] != '\0') {
+            snprintf(name, sizeof(name), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345] != '\0') {
+            snprintf(name, sizeof(name), "%.155s/%.100s", (const char*)hdr + 345, (const char*)hdr);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", (const char*)hdr);
+        }
+        const char* rel = name;
+        while (rel[0] == '.' && rel[1] == '/') rel += 2;
+        int metadata = rel[0] == '.' && strchr(rel, '/') == NULL;
+
+        // Regular files take their size in blocks, symlinks an inode
+        if (!metadata && (type == '0' || type == '\0' || type == '7' || type == '2')) {
+            space_charge(check, rel, type == '2' ? 0 : size);
+            counted++;
+        }
+        unsigned char skip[4096];
+        while (padded > 0) {
+            size_t take = padded < sizeof(skip) ? (size_t)padded : sizeof(skip);
+            if (read_full(fd, skip, take) != 0) {
+                return counted;
+            }
+            padded -= take;
+        }
+    }
+    return counted;
+}
+
+static uint32_t read_be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+// rpm header tags read by the preflight
+#define RPMTAG_SIZE 1009
+#define RPMTAG_FILESIZES 1028
+#define RPMTAG_FILEMODES 1030
+#define RPMTAG_FILEFLAGS 1037
+#define RPMTAG_DIRINDEXES 1116
+#define RPMTAG_BASENAMES 1117
+#define RPMTAG_DIRNAMES 1118
+#define RPMTAG_LONGFILESIZES 5008
+#define RPMTAG_LONGSIZE 5009
+#define RPMFILE_GHOST (1 << 6)
+
+// Locate one tag of an rpm header: its data and element count, NULL if absent
+static const unsigned char* rpm_tag(const unsigned char* index, uint32_t il, const unsigned char* store,
+                                    uint32_t dl, uint32_t tag, uint32_t* count) {
+    for (uint32_t i = 0; i < il; i++) {
+        const unsigned char* e = index + i * 16;
+        if (read_be32(e) == tag && read_be32(e + 8) < dl) {
+            *count = read_be32(e + 12);
+            return store + read_be32(e + 8);
+        }
+    }
+    return NULL;
+}
+
+// Split a STRING_ARRAY of count strings into pointers, checking it stays in the store
+static const char** rpm_strings(const unsigned char* data, uint32_t count, const unsigned char* end) {
+    if (count > (size_t)(end - data)) {
+        return NULL;  // Every string takes at least its terminator
+    }
+    const char** list = malloc(((size_t)count + 1) * sizeof(char*));
+    for (uint32_t i = 0; list != NULL && i < count; i++) {
+        const unsigned char* nul = data < end ? memchr(data, '\0', (size_t)(end - data)) : NULL;
+        if (nul == NULL) {
+            free(list);
+            return NULL;
+        }
+        list[i] = (const char*)data;
+        data = nul + 1;
+    }
+    return list;
+}
+
+// Count the files in an rpm's header, which lists every path with its size and mode
+// without touching the payload. Returns how many were counted; *isize gets the
+// installed size from the header.
+static long space_charge_rpm(space_check_t* check, const char* path, unsigned long long* isize) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    // Lead, then the signature header padded to 8 bytes, then the main header
+    unsigned char intro[16];
+    off_t offset = 96;
+    uint32_t il = 0, dl = 0;
+    for (int header = 0; header < 2; header++) {
+        if (pread(fd, intro, sizeof(intro), offset) != (ssize_t)sizeof(intro) ||
+            memcmp(intro, "\x8e\xad\xe8\x01", 4) != 0) {
+            close(fd);
+            return 0;
+        }
+        il = read_be32(intro + 8);
+        dl = read_be32(intro + 12);
+        if (il > 1 << 20 || dl > 1 << 28) {
+            close(fd);
+            return 0;
+        }
+        if (header == 0) {
+            offset += (16 + (off_t)il * 16 + dl + 7) & ~(off_t)7;
+        }
+    }
+    size_t len = (size_t)il * 16 + dl;
+    unsigned char* buf = malloc(len);
+    if (buf == NULL || pread(fd, buf, len, offset + 16) != (ssize_t)len) {
+        free(buf);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    const unsigned char* store = buf + (size_t)il * 16;
+    const unsigned char* end = store + dl;
+    uint32_t n = 0, nsizes = 0, nlong = 0, nmodes = 0, nflags = 0, nindex = 0, ndirs = 0;
+    const unsigned char* data = rpm_tag(buf, il, store, dl, RPMTAG_LONGSIZE, &n);
+    if (data != NULL && data + 8 <= end) {
+        *isize = (unsigned long long)read_be32(data) << 32 | read_be32(data + 4);
+    } else if ((data = rpm_tag(buf, il, store, dl, RPMTAG_SIZE, &n)) != NULL && data + 4 <= end) {
+        *isize = read_be32(data);
+    }
+
+    const unsigned char* names = rpm_tag(buf, il, store, dl, RPMTAG_BASENAMES, &n);
+    const unsigned char* sizes = rpm_tag(buf, il, store, dl, RPMTAG_FILESIZES, &nsizes);
+    const unsigned char* long_sizes = rpm_tag(buf, il, store, dl, RPMTAG_LONGFILESIZES, &nlong);
+    const unsigned char* modes = rpm_tag(buf, il, store, dl, RPMTAG_FILEMODES, &nmodes);
+    const unsigned char* flags = rpm_tag(buf, il, store, dl, RPMTAG_FILEFLAGS, &nflags);
+    const unsigned char* index = rpm_tag(buf, il, store, dl, RPMTAG_DIRINDEXES, &nindex);
+    const unsigned char* dirs = rpm_tag(buf, il, store, dl, RPMTAG_DIRNAMES, &ndirs);
+    const char** base_list = names != NULL ? rpm_strings(names, n, end) : NULL;
+    const char** dir_list = dirs != NULL ? rpm_strings(dirs, ndirs, end) : NULL;
+    long counted = 0;
+    if (base_list != NULL && dir_list != NULL && index != NULL && nindex == n && index + 4 * (size_t)n <= end &&
+        ((long_sizes != NULL && nlong == n && long_sizes + 8 * (size_t)n <= end) ||
+         (sizes != NULL && nsizes == n && sizes + 4 * (size_t)n <= end)) &&
+        (modes == NULL || (nmodes == n && modes + 2 * (size_t)n <= end)) &&
+        (flags == NULL || (nflags == n && flags + 4 * (size_t)n <= end))) {
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t dir = read_be32(index + 4 * i);
+            // Ghost files belong to the package but are not in the payload
+            if (dir >= ndirs || (flags != NULL && (read_be32(flags + 4 * i) & RPMFILE_GHOST))) {
+                continue;
+            }
+            unsigned mode = modes != NULL ? (unsigned)(modes[2 * i] << 8 | modes[2 * i + 1]) : S_IFREG;
+            if (!S_ISREG(mode) && !S_ISLNK(mode)) {
+                continue;
+            }
+            unsigned long long size = long_sizes != NULL ?
+                (unsigned long long)read_be32(long_sizes + 8 * i) << 32 | read_be32(long_sizes + 8 * i + 4) :
+                read_be32(sizes + 4 * i);
+            char file[MAX_PATH];
+            snprintf(file, sizeof(file), "%s%s", dir_list[dir], base_list[i]);
+            space_charge(check, file, S_ISREG(mode) ? size : 0);
+            counted++;
+        }
+    }
+    free(base_list);
+    free(dir_list);
+    free(buf);
+    return counted;
+}
+
+// Count one package against the filesystems it installs to
+static void space_charge_package(space_check_t* check, const char* path, const char* manager) {
+    unsigned long long isize = 0;
+    long counted = 0;
+    if (strcmp(manager, "rpm") == 0) {
+        counted = space_charge_rpm(check, path, &isize);
+    } else {
+        // A .deb carries its files in the data.tar member; the other formats are one tar
+        off_t offset = 0;
+        char member[17] = "";
+        int ok = strcmp(manager, "dpkg") != 0 || deb_member(path, "data.tar", member, &offset) == 0;
+        const char* tool = NULL;
+        if (ok && member[0] != '\0') {
+            tool = decompressor_for(member);
+        } else if (ok) {
+            unsigned char magic[8];
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t got = fd >= 0 ? pread(fd, magic, sizeof(magic), 0) : -1;
+            if (fd >= 0) close(fd);
+            tool = archive_tool_for(magic, got > 0 ? (size_t)got : 0);
+        }
+        pid_t pid;
+        int pipe_fd = ok ? open_decompressor(path, offset, tool, &pid) : -1;
+        if (pipe_fd >= 0) {
+            counted = space_charge_tar(check, pipe_fd);
+            close_decompressor(pipe_fd, pid);
+        }
+
+        // Without a file list, fall back to the installed size in the metadata
+        if (counted == 0 && strcmp(manager, "dpkg") == 0) {
+            char* control = read_deb_control(path);
+            const char* field = control != NULL ? strstr(control, "Installed-Size:") : NULL;
+            if (field != NULL && (field == control || field[-1] == '\n')) {
+                isize = strtoull(field + 15, NULL, 10) * 1024;  // In KiB
+            }
+            free(control);
+        } else if (counted == 0 && tool != NULL) {
+            char* info = read_pkginfo(path, tool);
+            char value[32];
+            pkginfo_values(info, "size", "", value, sizeof(value));
+            isize = strtoull(value, NULL, 10);
+            free(info);
+        }
+    }
+    if (counted == 0 && isize > 0) {
+        space_charge(check, "usr/", isize);
+    }
+}
+
+// Check that a set of packages fits on the filesystems it installs to before any
+// package manager runs, summing the whole set. Returns 0 if it fits, -1 after a
+// per-filesystem shortfall report. A plan shows the report and carries on.
+static int space_preflight(int count, char* files[]) {
+    if (space_check_done || skip_space_check) {
+        return 0;
+    }
+    space_check_t* check = calloc(1, sizeof(*check));
+    if (check == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    check->dir_fs = -1;
+
+    static const struct { const char* manager; int cache; } caches[] = {
+        {"dpkg", CACHE_DEB}, {"pacman", CACHE_ARCH}, {"rpm", CACHE_RPM}, {"apk", CACHE_APK}, {NULL, 0}
+    };
+    int counted = 0;
+    for (int i = 0; i < count; i++) {
+        // Deltas are sized once rebuilt; a plan may name packages not yet downloaded
+        struct stat st;
+        const char* manager = trimorph_format_manager(files[i]);
+        if (manager == NULL || stat(files[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        space_charge_package(check, files[i], manager);
+        const char* base = strrchr(files[i], '/');
+        base = base != NULL ? base + 1 : files[i];
+        for (int c = 0; caches[c].manager != NULL; c++) {
+            for (int d = 0; strcmp(caches[c].manager, manager) == 0 && pkg_caches[d].dir != NULL; d++) {
+                if (pkg_caches[d].format == caches[c].cache) {
+                    char cached[MAX_PATH];
+                    int len = snprintf(cached, sizeof(cached), "%s/%s", pkg_caches[d].dir, base);
+                    if (len < 0 || (size_t)len >= sizeof(cached)) {
+                        space_path_too_long(check, base);
+                    } else {
+                        space_charge(check, cached, (unsigned long long)st.st_size);
+                    }
+                    break;
+                }
+            }
+        }
+        counted++;
+    }
+
+    int short_fs = 0;
+    for (int i = 0; i < check->count; i++) {
+        short_fs += check->fs[i].need > check->fs[i].avail || check->fs[i].files > check->fs[i].files_avail;
+    }
+    if (check->too_long[0] != '\0') {
+        // Space for files that were not counted cannot be vouched for
+        if (dry_run) {
+            printf("  Disk space: cannot check %s, the path is too long; this step would abort now\n",
+                   check->too_long);
+        } else {
+            fprintf(stderr, "Error: Cannot check disk space for %s: the path is too long\n", check->too_long);
+            fprintf(stderr, "Tip: Use --skip-space-check to install without the disk space check\n");
+            free(check);
+            return -1;
+        }
+    }
+    if (dry_run && counted > 0) {
+        for (int i = 0; i < check->count; i++) {
+            const space_fs_t* f = &check->fs[i];
+            printf("  Disk space: %s needs %.1f MiB of %.1f MiB free%s\n", f->mount, f->need / 1048576.0,
+                   f->avail / 1048576.0, f->need > f->avail || f->files > f->files_avail ? "; this step would abort now" : "");
+        }
+    } else if (short_fs > 0) {
+        fprintf(stderr, "Error: Not enough disk space to install %d package%s\n", counted, counted == 1 ? "" : "s");
+        for (int i = 0; i < check->count; i++) {
+            const space_fs_t* f = &check->fs[i];
+            if (f->need > f->avail) {
+                fprintf(stderr, "  %s: %.1f MiB needed, %.1f MiB free, %.1f MiB short\n", f->mount,
+                        f->need / 1048576.0, f->avail / 1048576.0, (f->need - f->avail) / 1048576.0);
+            }
+            if (f->files > f->files_avail) {
+                fprintf(stderr, "  %s: %llu inodes needed, %llu free\n", f->mount, f->files, f->files_avail);
+            }
+        }
+        fprintf(stderr, "Tip: Free space on the filesystems above, for example with 'cache gc', and retry\n");
+        fprintf(stderr, "Tip: Use --skip-space-check if the packages replace installed files of similar size\n");
+    }
+    free(check);
+    return short_fs > 0 && !dry_run ? -1 : 0;
+}
+
+// Path ownership index ("trimorph owns"): every path in the native file lists mapped to
+// the packages that own it. Entries are sorted by path and prefix-compressed: each one
+// stores only the bytes that differ from the previous path, with a full path every
+// OWNERS_RESTART entries. An open-addressing hash table points at the first entry of
+// each path, so a lookup hashes once and decodes at most one short run of entries.
+// The file is memory-mapped for queries and replaced atomically when the native lists
+// change; packages whose lists are unchanged are copied from the old index.
+#define OWNERS_MAGIC "TMOWNS01"
+#define OWNERS_FILE "var/lib/trimorph/owners"
+#define OWNERS_RESTART 16
+#define OWNERS_SOURCES 4
+
+typedef struct {
+    char magic[8];
+    uint32_t package_count;
+    uint32_t entry_count;
+    uint32_t bucket_count;      // Power of two
+    uint32_t restart_count;
+    uint64_t entries_size;      // Bytes of compressed entries, stored last
+    int64_t source_mtime[OWNERS_SOURCES];   // Of each native source when built, -1 if absent
+} owners_header_t;
+
+typedef struct {
+    char name[104];
+    uint32_t source;
+    uint32_t reserved;
+    int64_t mtime;              // Signature of the package's file list: mtime in ns and size
+    int64_t size;
+} owners_package_t;
+
+_Static_assert(sizeof(owners_header_t) == 64, "owners header is 64 bytes");
+_Static_assert(sizeof(owners_package_t) == 128, "owners packages are 128 bytes");
+
+// A mapped index
+typedef struct {
+    const owners_header_t* header;
+    const owners_package_t* packages;
+    const uint32_t* restarts;   // Offset of every OWNERS_RESTART-th entry
+    const uint32_t* buckets;    // Pairs of path hash and entry number + 1 (0 when empty)
+    const unsigned char* entries;
+    size_t size;
+} owners_map_t;
+
+// One path/package pair while building
+typedef struct {
+    char* path;
+    uint32_t package;
+} owner_entry_t;
+
+typedef struct {
+    owner_entry_t* entries;
+    size_t entry_count;
+    size_t entry_cap;
+    owners_package_t* packages;
+    size_t package_count;
+    size_t package_cap;
+    const owners_map_t* old;    // Previous index to copy unchanged packages from, or NULL
+    int32_t* kept;              // New package number of each old package, -1 if re-read
+} owners_build_t;
+
+typedef struct owner_source owner_source_t;
+
+// A native package database with file lists, relative to the target root
+struct owner_source {
+    const char* manager;
+    const char* path;           // Its modification time tells whether anything changed
+    int (*load)(owners_build_t* b, const owner_source_t* source, uint32_t id, const char* root);
+};
+
+static uint32_t owners_hash(const char* path) {
+    uint32_t h = 2166136261u;
+    while (*path != '\0') {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h;
+}
+
+static int64_t stat_mtime_ns(const struct stat* st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Add a package, returning its number or -1
+static int owners_add_package(owners_build_t* b, const char* name, uint32_t source, const struct stat* st) {
+    if (b->package_count == b->package_cap) {
+        size_t cap = b->package_cap ? b->package_cap * 2 : 1024;
+        owners_package_t* grown = realloc(b->packages, cap * sizeof(owners_package_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        b->packages = grown;
+        b->package_cap = cap;
+    }
+    owners_package_t* pkg = &b->packages[b->package_count];
+    memset(pkg, 0, sizeof(*pkg));
+    snprintf(pkg->name, sizeof(pkg->name), "%s", name);
+    pkg->source = source;
+    pkg->mtime = stat_mtime_ns(st);
+    pkg->size = (int64_t)st->st_size;
+    return (int)b->package_count++;
+}
+
+// Add a path owned by a package. Paths are stored absolute and without
+// a trailing slash, whichever way the native list writes them.
+static int owners_add_path(owners_build_t* b, int package, const char* path) {
+    char clean[MAX_PATH];
+    size_t len = (size_t)snprintf(clean, sizeof(clean), "%s%s", path[0] == '/' ? "" : "/", path);
+    if (len >= sizeof(clean)) {
+        return 0;  // Longer than any path trimorph can be asked about
+    }
+    while (len > 1 && clean[len - 1] == '/') {
+        clean[--len] = '\0';
+    }
+    if (strcmp(clean, "/.") == 0) {
+        return 0;
+    }
+    if (b->entry_count == b->entry_cap) {
+        size_t cap = b->entry_cap ? b->entry_cap * 2 : 65536;
+        owner_entry_t* grown = realloc(b->entries, cap * sizeof(owner_entry_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        b->entries = grown;
+        b->entry_cap = cap;
+    }
+    char* copy = strdup(clean);
+    if (copy == NULL) {
+        return -1;
+    }
+    b->entries[b->entry_count].path = copy;
+    b->entries[b->entry_count++].package = (uint32_t)package;
+    return 0;
+}
+
+// Keep a package from the old index if its file list has the same signature. Returns
+// 1 if kept, 0 if the list must be read, -1 on error.
+static int owners_reuse(owners_build_t* b, const char* name, uint32_t source, const struct stat* st) {
+    if (b->old == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < b->old->header->package_count; i++) {
+        const owners_package_t* pkg = &b->old->packages[i];
+        if (pkg->source == source && pkg->mtime == stat_mtime_ns(st) && pkg->size == (int64_t)st->st_size &&
+            b->kept[i] < 0 && strcmp(pkg->name, name) == 0) {
+            int id = owners_add_package(b, name, source, st);
+            if (id < 0) {
+                return -1;
+            }
+            b->kept[i] = id;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Keep every package of a source stored as a single database, if that is unchanged
+static int owners_reuse_source(owners_build_t* b, uint32_t source, const struct stat* st) {
+    int found = 0;
+    for (uint32_t i = 0; b->old != NULL && i < b->old->header->package_count; i++) {
+        const owners_package_t* pkg = &b->old->packages[i];
+        if (pkg->source == source) {
+            if (pkg->mtime != stat_mtime_ns(st) || pkg->size != (int64_t)st->st_size) {
+                return 0;
+            }
+            found = 1;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < b->old->header->package_count; i++) {
+        if (b->old->packages[i].source == source) {
+            int id = owners_add_package(b, b->old->packages[i].name, source, st);
+            if (id < 0) {
+                return -1;
+            }
+            b->kept[i] = id;
+        }
+    }
+    return 1;
+}
+
+// File lists that could not be reused, read together through the scanner. For pacman
+// only the lines after %FILES% are paths.
+typedef struct {
+    char name[104];
+    struct stat st;
+    int package;                // -1 until the list is first read
+    char* line;                 // Line carried between chunks, while the list is read
+    size_t used;
+    int in_files;
+} owners_list_t;
+
+typedef struct {
+    owners_build_t* b;
+    uint32_t source;
+    int pacman;
+    scan_file_t* files;
+    owners_list_t* lists;
+    size_t count;
+    size_t cap;
+    int result;
+} owners_lists_t;
+
+static int owners_queue_list(owners_lists_t* q, const char* path, const char* name, const struct stat* st) {
+    if (q->count == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 1024;
+        scan_file_t* files = realloc(q->files, cap * sizeof(scan_file_t));
+        if (files != NULL) {
+            q->files = files;
+        }
+        owners_list_t* lists = realloc(q->lists, cap * sizeof(owners_list_t));
+        if (lists != NULL) {
+            q->lists = lists;
+        }
+        if (files == NULL || lists == NULL) {
+            return -1;
+        }
+        q->cap = cap;
+    }
+    memset(&q->files[q->count], 0, sizeof(scan_file_t));
+    memset(&q->lists[q->count], 0, sizeof(owners_list_t));
+    q->files[q->count].path = strdup(path);
+    if (q->files[q->count].path == NULL) {
+        return -1;
+    }
+    snprintf(q->lists[q->count].name, sizeof(q->lists[q->count].name), "%s", name);
+    q->lists[q->count].st = *st;
+    q->lists[q->count].package = -1;
+    q->count++;
+    return 0;
+}
+
+static void owners_list_line(owners_lists_t* q, owners_list_t* list) {
+    list->line[list->used] = '\0';
+    list->used = 0;
+    if (q->pacman && list->line[0] == '%') {
+        list->in_files = strcmp(list->line, "%FILES%") == 0;
+    } else if ((!q->pacman || list->in_files) && list->line[0] != '\0' && q->result == 0) {
+        q->result = owners_add_path(q->b, list->package, list->line);
+    }
+}
+
+static int owners_list_chunk(scan_file_t* file, const unsigned char* data, size_t len, void* ctx) {
+    owners_lists_t* q = ctx;
+    owners_list_t* list = file->data;
+    if (list->package < 0) {
+        // A list that cannot be opened is skipped; an empty one still names a package
+        if (q->result != 0 || (len == 0 && file->error != 0)) {
+            return 1;
+        }
+        list->package = owners_add_package(q->b, list->name, q->source, &list->st);
+        list->line = malloc(MAX_PATH);
+        if (list->package < 0 || list->line == NULL) {
+            q->result = -1;
+            free(list->line);
+            list->line = NULL;
+            return 1;
+        }
+    }
+    if (list->line == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < len && q->result == 0;) {
+        const unsigned char* eol = memchr(data + i, '\n', len - i);
+        size_t n = eol != NULL ? (size_t)(eol - (data + i)) : len - i;
+        size_t room = MAX_PATH - 1 - list->used;
+        memcpy(list->line + list->used, data + i, n < room ? n : room);  // Longer lines are cut
+        list->used += n < room ? n : room;
+        i += n;
+        if (eol != NULL) {
+            owners_list_line(q, list);
+            i++;
+        }
+    }
+    if (len == 0 || q->result != 0) {
+        if (len == 0 && list->used > 0) {
+            owners_list_line(q, list);
+        }
+        free(list->line);
+        list->line = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Read the queued file lists in one serial scan and release the queue
+static int owners_read_lists(owners_lists_t* q) {
+    for (size_t i = 0; i < q->count; i++) {
+        q->files[i].data = &q->lists[i];
+    }
+    if (q->result == 0) {
+        scan_files(SCAN_AUTO, 0, q->files, q->count, owners_list_chunk, q, 1);
+    }
+    for (size_t i = 0; i < q->count; i++) {
+        free((char*)q->files[i].path);
+    }
+    free(q->files);
+    free(q->lists);
+    return q->result;
+}
+
+// dpkg: info/<package>.list holds one path per line
+static int load_dpkg_owners(owners_build_t* b, const owner_source_t* source, uint32_t id, const char* root) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s/%s", root, source->path);
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    owners_lists_t q = {b, id, 0, NULL, NULL, 0, 0, 0};
+    struct dirent* de;
+    while (q.result == 0 && (de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= 5 || strcmp(de->d_name + len - 5, ".list") != 0) {
+            continue;
+        }
+        char path[MAX_PATH];
+        char name[104];
+        struct stat st;
+        // A list whose path or package name does not fit is skipped like an unreadable one
+        int path_len = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (path_len < 0 || (size_t)path_len >= sizeof(path) || len - 5 >= sizeof(name)) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(len - 5), de->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        int reused = owners_reuse(b, name, id, &st);
+        if (reused == 0) {
+            q.result = owners_queue_list(&q, path, name, &st);
+        } else if (reused < 0) {
+            q.result = -1;
+        }
+    }
+    closedir(d);
+    return owners_read_lists(&q);
+}
+
+// pacman: local/<name>-<version>-<release>/files lists paths under %FILES%
+static int load_pacman_owners(owners_build_t* b, const owner_source_t* source, uint32_t id, const char* root) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s/%s", root, source->path);
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    owners_lists_t q = {b, id, 1, NULL, NULL, 0, 0, 0};
+    struct dirent* de;
+    while (q.result == 0 && (de = readdir(d)) != NULL) {
+        char path[MAX_PATH];
+        char name[104];
+        char version[128];
+        struct stat st;
+        if (de->d_name[0] == '.' ||
+            split_name_version(de->d_name, 2, 0, name, sizeof(name), version, sizeof(version)) != 0) {
+            continue;
+        }
+        int path_len = snprintf(path, sizeof(path), "%s/%s/files", dir, de->d_name);
+        if (path_len < 0 || (size_t)path_len >= sizeof(path) || stat(path, &st) != 0) {
+            continue;
+        }
+        int reused = owners_reuse(b, name, id, &st);
+        if (reused == 0) {
+            q.result = owners_queue_list(&q, path, name, &st);
+        } else if (reused < 0) {
+            q.result = -1;
+        }
+    }
+    closedir(d);
+    return owners_read_lists(&q);
+}
+
+// apk: one database of paragraphs; P: names the package, F: a directory and R: a file in it
+static int load_apk_owners(owners_build_t* b, const owner_source_t* source, uint32_t id, const char* root) {
+    char path[MAX_PATH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", root, source->path);
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    int result = owners_reuse_source(b, id, &st);
+    if (result != 0) {
+        return result < 0 ? -1 : 0;
+    }
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char line[MAX_PATH];
+    char dir[MAX_PATH] = "";
+    int package = -1;
+    while (result == 0 && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') {
+            package = -1;
+        } else if (strncmp(line, "P:", 2) == 0) {
+            package = owners_add_package(b, line + 2, id, &st);
+            result = package < 0 ? -1 : 0;
+            dir[0] = '\0';
+        } else if (package >= 0 && strncmp(line, "F:", 2) == 0) {
+            snprintf(dir, sizeof(dir), "%s", line + 2);
+            result = owners_add_path(b, package, dir);
+        } else if (package >= 0 && strncmp(line, "R:", 2) == 0) {
+            char file[MAX_PATH * 2];
+            snprintf(file, sizeof(file), "%s/%s", dir, line + 2);
+            result = owners_add_path(b, package, file);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+// rpm: the database is not a plain file format, so ask rpm for every package's files
+static int load_rpm_owners(owners_build_t* b, const owner_source_t* source, uint32_t id, const char* root) {
+    char path[MAX_PATH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", root, source->path);
+    if (stat(path, &st) != 0 || !is_cmd_available("rpm")) {
+        return 0;
+    }
+    int result = owners_reuse_source(b, id, &st);
+    if (result != 0) {
+        return result < 0 ? -1 : 0;
+    }
+    char cmd[MAX_PATH * 2];
+    const char* query = "rpm -qa --qf '[%{NAME}\\t%{FILENAMES}\\n]' 2>/dev/null";
+    if (has_target_root() ? trimorph_root_command(tm, query, cmd, sizeof(cmd)) != TRIMORPH_OK :
+        snprintf(cmd, sizeof(cmd), "%s", query) >= (int)sizeof(cmd)) {
+        return 0;
+    }
+    FILE* p = popen(cmd, "r");
+    if (p == NULL) {
+        return 0;
+    }
+    char line[MAX_PATH + 128];
+    char name[104] = "";
+    int package = -1;
+    while (result == 0 && fgets(line, sizeof(line), p) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char* tab = strchr(line, '\t');
+        if (tab == NULL) {
+            continue;
+        }
+        *tab = '\0';
+        // Output is grouped by package, so a new name starts a new package. Names too
+        // long to index are skipped rather than merged with another under a cut name.
+        size_t name_len = (size_t)(tab - line);
+        if (name_len >= sizeof(name)) {
+            continue;
+        }
+        if (strcmp(line, name) != 0) {
+            memcpy(name, line, name_len + 1);
+            package = owners_add_package(b, name, id, &st);
+            result = package < 0 ? -1 : 0;
+        }
+        if (result == 0) {
+            result = owners_add_path(b, package, tab + 1);
+        }
+    }
+    pclose(p);
+    return result;
+}
+
+static const owner_source_t owner_sources[] = {
+    {"dpkg", "var/lib/dpkg/info", load_dpkg_owners},
+    {"pacman", "var/lib/pacman/local", load_pacman_owners},
+    {"apk", "lib/apk/db/installed", load_apk_owners},
+    {"rpm", "var/lib/rpm", load_rpm_owners},
+    {NULL, NULL, NULL}  // Sentinel
+};
+
+_Static_assert(sizeof(owner_sources) / sizeof(owner_sources[0]) == OWNERS_SOURCES + 1,
+               "one header slot per ownership source");
+
+// Path of the index: TRIMORPH_OWNERS_FILE, or a fixed path inside the target root
+static void owners_path(char* path, size_t len) {
+    const char* env = getenv("TRIMORPH_OWNERS_FILE");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(path, len, "%s", env);
+    } else {
+        snprintf(path, len, "%s/%s", has_target_root() ? target_root : "", OWNERS_FILE);
+    }
+}
+
+// Modification time of each native source, -1 for sources that do not exist
+static void owners_source_mtimes(int64_t mtimes[OWNERS_SOURCES]) {
+    const char* root = has_target_root() ? target_root : "";
+    for (int i = 0; i < OWNERS_SOURCES; i++) {
+        char path[MAX_PATH];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", root, owner_sources[i].path);
+        mtimes[i] = stat(path, &st) == 0 ? stat_mtime_ns(&st) : -1;
+    }
+}
+
+static void owners_unmap(owners_map_t* map) {
+    if (map->header != NULL) {
+        munmap((void*)map->header, map->size);
+        map->header = NULL;
+    }
+}
+
+// Map an index file, checking that its sections fit. Returns 0 or -1.
+static int owners_map(const char* path, owners_map_t* map) {
+    memset(map, 0, sizeof(*map));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(owners_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    const owners_header_t* h = data;
+    map->header = h;
+    map->size = (size_t)st.st_size;
+    size_t expected = sizeof(*h) + (size_t)h->package_count * sizeof(owners_package_t) +
+                      (size_t)h->restart_count * sizeof(uint32_t) + (size_t)h->bucket_count * 2 * sizeof(uint32_t) +
+                      h->entries_size;
+    if (memcmp(h->magic, OWNERS_MAGIC, sizeof(h->magic)) != 0 || expected != map->size ||
+        h->restart_count != (h->entry_count + OWNERS_RESTART - 1) / OWNERS_RESTART ||
+        h->bucket_count == 0 || (h->bucket_count & (h->bucket_count - 1)) != 0) {
+        owners_unmap(map);
+        return -1;
+    }
+    map->packages = (const owners_package_t*)(h + 1);
+    map->restarts = (const uint32_t*)(map->packages + h->package_count);
+    map->buckets = map->restarts + h->restart_count;
+    map->entries = (const unsigned char*)(map->buckets + 2 * (size_t)h->bucket_count);
+    return 0;
+}
+
+static void put_varint(unsigned char* out, size_t* pos, uint32_t value) {
+    while (value >= 0x80) {
+        out[(*pos)++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[(*pos)++] = (unsigned char)value;
+}
+
+static int get_varint(const owners_map_t* map, size_t* pos, uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*pos >= map->header->entries_size) {
+            return -1;
+        }
+        unsigned char byte = map->entries[(*pos)++];
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Decode the entry at pos into path, which holds the previous entry's path
+static int owners_decode(const owners_map_t* map, size_t* pos, char path[MAX_PATH], uint32_t* package) {
+    uint32_t shared, suffix;
+    if (get_varint(map, pos, &shared) != 0 || get_varint(map, pos, &suffix) != 0 ||
+        shared > strlen(path) || (size_t)shared + suffix >= MAX_PATH || *pos + suffix > map->header->entries_size) {
+        return -1;
+    }
+    memcpy(path + shared, map->entries + *pos, suffix);
+    path[shared + suffix] = '\0';
+    *pos += suffix;
+    if (get_varint(map, pos, package) != 0 || *package >= map->header->package_count) {
+        return -1;
+    }
+    return 0;
+}
+
+// Find the first entry for a path. Returns its number and leaves pos after it, or -1.
+static long owners_find(const owners_map_t* map, const char* path, size_t* pos, uint32_t* package) {
+    uint32_t hash = owners_hash(path);
+    uint32_t mask = map->header->bucket_count - 1;
+    for (uint32_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        uint32_t entry = map->buckets[2 * i + 1];
+        if (entry == 0 || entry > map->header->entry_count) {
+            return -1;
+        }
+        if (map->buckets[2 * i] != hash) {
+            continue;
+        }
+        char decoded[MAX_PATH] = "";
+        uint32_t n = entry - 1;
+        *pos = map->restarts[n / OWNERS_RESTART];
+        for (uint32_t k = n - n % OWNERS_RESTART; k <= n; k++) {
+            if (owners_decode(map, pos, decoded, package) != 0) {
+                return -1;
+            }
+        }
+        if (strcmp(decoded, path) == 0) {
+            return (long)n;
+        }
+    }
+    return -1;
+}
+
+static int owner_entry_cmp(const void* a, const void* b) {
+    const owner_entry_t* ea = a;
+    const owner_entry_t* eb = b;
+    int c = strcmp(ea->path, eb->path);
+    return c != 0 ? c : (ea->package > eb->package) - (ea->package < eb->package);
+}
+
+// Write the index to a temporary file and rename it into place
+static int owners_write(owners_build_t* b, const char* path, const int64_t mtimes[OWNERS_SOURCES]) {
+    if (b->entry_count > 0) {
+        qsort(b->entries, b->entry_count, sizeof(owner_entry_t), owner_entry_cmp);
+    }
+    size_t distinct = 0;
+    size_t raw = 0;
+    for (size_t i = 0; i < b->entry_count; i++) {
+        distinct += i == 0 || strcmp(b->entries[i].path, b->entries[i - 1].path) != 0;
+        raw += strlen(b->entries[i].path) + 15;
+    }
+    owners_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OWNERS_MAGIC, sizeof(header.magic));
+    header.package_count = (uint32_t)b->package_count;
+    header.entry_count = (uint32_t)b->entry_count;
+    header.restart_count = (uint32_t)((b->entry_count + OWNERS_RESTART - 1) / OWNERS_RESTART);
+    header.bucket_count = 16;
+    while (header.bucket_count < distinct * 2) {
+        header.bucket_count *= 2;
+    }
+    memcpy(header.source_mtime, mtimes, sizeof(header.source_mtime));
+
+    unsigned char* entries = malloc(raw + 1);
+    uint32_t* restarts = malloc((header.restart_count + 1) * sizeof(uint32_t));
+    uint32_t* buckets = calloc((size_t)header.bucket_count * 2, sizeof(uint32_t));
+    int result = entries != NULL && restarts != NULL && buckets != NULL ? 0 : -1;
+    size_t pos = 0;
+    for (size_t i = 0; result == 0 && i < b->entry_count; i++) {
+        const char* cur = b->entries[i].path;
+        const char* prev = i % OWNERS_RESTART == 0 ? "" : b->entries[i - 1].path;
+        size_t shared = 0;
+        while (cur[shared] != '\0' && cur[shared] == prev[shared]) {
+            shared++;
+        }
+        if (i % OWNERS_RESTART == 0) {
+            restarts[i / OWNERS_RESTART] = (uint32_t)pos;
+        }
+        size_t suffix = strlen(cur) - shared;
+        put_varint(entries, &pos, (uint32_t)shared);
+        put_varint(entries, &pos, (uint32_t)suffix);
+        memcpy(entries + pos, cur + shared, suffix);
+        pos += suffix;
+        put_varint(entries, &pos, b->entries[i].package);
+
+        if (i == 0 || strcmp(cur, b->entries[i - 1].path) != 0) {
+            uint32_t hash = owners_hash(cur);
+            uint32_t slot = hash & (header.bucket_count - 1);
+            while (buckets[2 * slot + 1] != 0) {
+                slot = (slot + 1) & (header.bucket_count - 1);
+            }
+            buckets[2 * slot] = hash;
+            buckets[2 * slot + 1] = (uint32_t)i + 1;
+        }
+    }
+    header.entries_size = pos;
+
+    char tmp[MAX_PATH + 32];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    int fd = -1;
+    if (result == 0) {
+        char dir[MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s", path);
+        mkdir(dirname(dir), 0755);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        result = fd >= 0 ? 0 : -1;
+    }
+    FILE* out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (result == 0 && out == NULL) {
+        close(fd);
+        result = -1;
+    }
+    if (result == 0) {
+        fwrite(&header, sizeof(header), 1, out);
+        if (b->package_count > 0) {
+            fwrite(b->packages, sizeof(owners_package_t), b->package_count, out);
+        }
+        fwrite(restarts, sizeof(uint32_t), header.restart_count, out);
+        fwrite(buckets, 2 * sizeof(uint32_t), header.bucket_count, out);
+        fwrite(entries, 1, pos, out);
+        result = ferror(out) ? -1 : 0;
+        if (fclose(out) != 0) {
+            result = -1;
+        }
+        if (result == 0 && rename(tmp, path) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            unlink(tmp);
+        }
+    }
+    free(entries);
+    free(restarts);
+    free(buckets);
+    return result;
+}
+
+// Copy the entries of kept packages out of the old index
+static int owners_copy_kept(owners_build_t* b) {
+    const owners_map_t* old = b->old;
+    char path[MAX_PATH] = "";
+    size_t pos = 0;
+    for (uint32_t i = 0; i < old->header->entry_count; i++) {
+        uint32_t package;
+        if (i % OWNERS_RESTART == 0) {
+            path[0] = '\0';
+        }
+        if (owners_decode(old, &pos, path, &package) != 0) {
+            return -1;
+        }
+        if (b->kept[package] >= 0 && owners_add_path(b, b->kept[package], path) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void owners_build_free(owners_build_t* b) {
+    for (size_t i = 0; i < b->entry_count; i++) {
+        free(b->entries[i].path);
+    }
+    free(b->entries);
+    free(b->packages);
+    free(b->kept);
+}
+
+// Bring the index up to date with the native file lists and map it. Nothing is read
+// while no source has changed. If the index cannot be saved (no write access to the
+// root) a temporary copy answers this invocation. Returns 0 or -1.
+static int owners_open(owners_map_t* map) {
+    char path[MAX_PATH];
+    int64_t mtimes[OWNERS_SOURCES];
+    owners_path(path, sizeof(path));
+    owners_source_mtimes(mtimes);
+
+    owners_map_t old;
+    int have_old = owners_map(path, &old) == 0;
+    if (have_old && memcmp(old.header->source_mtime, mtimes, sizeof(mtimes)) == 0) {
+        *map = old;
+        return 0;
+    }
+
+    owners_build_t b;
+    memset(&b, 0, sizeof(b));
+    if (have_old) {
+        b.old = &old;
+        b.kept = malloc((old.header->package_count + 1) * sizeof(int32_t));
+        if (b.kept == NULL) {
+            owners_unmap(&old);
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        for (uint32_t i = 0; i < old.header->package_count; i++) {
+            b.kept[i] = -1;
+        }
+    }
+    const char* root = has_target_root() ? target_root : "";
+    int result = 0;
+    for (uint32_t i = 0; result == 0 && owner_sources[i].manager != NULL; i++) {
+        result = owner_sources[i].load(&b, &owner_sources[i], i, root);
+    }
+    if (result == 0 && have_old) {
+        result = owners_copy_kept(&b);
+    }
+    if (have_old) {
+        owners_unmap(&old);
+    }
+    if (result != 0) {
+        owners_build_free(&b);
+        fprintf(stderr, "Error: Cannot read the package file lists\n");
+        return -1;
+    }
+
+    if (owners_write(&b, path, mtimes) != 0) {
+        const char* tmpdir = getenv("TMPDIR");
+        fprintf(stderr, "Warning: Cannot save ownership index %s: %s\n", path, strerror(errno));
+        snprintf(path, sizeof(path), "%s/trimorph-owners.%d", tmpdir != NULL ? tmpdir : "/tmp", (int)getpid());
+        result = owners_write(&b, path, mtimes);
+        if (result == 0) {
+            result = owners_map(path, map);
+            unlink(path);
+        }
+    } else {
+        result = owners_map(path, map);
+    }
+    owners_build_free(&b);
+    if (result != 0) {
+        fprintf(stderr, "Error: Cannot write ownership index %s\n", path);
+    }
+    return result;
+}
+
+// Bring an existing index up to date after an install. Roots that have never been
+// queried get no index.
+static void owners_refresh() {
+    char path[MAX_PATH];
+    owners_map_t map;
+    owners_path(path, sizeof(path));
+    if (!dry_run && access(path, F_OK) == 0 && owners_open(&map) == 0) {
+        owners_unmap(&map);
+    }
+}
+
+// Normalize a queried path lexically: absolute (relative to the current directory, or
+// the root with --root), without "." and ".." components or repeated slashes
+static int normalize_query_path(const char* query, char* out, size_t len) {
+    char joined[MAX_PATH * 2];
+    char cwd[MAX_PATH];
+    if (query[0] != '/' && !has_target_root() && getcwd(cwd, sizeof(cwd)) != NULL) {
+        snprintf(joined, sizeof(joined), "%s/%s", cwd, query);
+    } else {
+        snprintf(joined, sizeof(joined), "/%s", query);
+    }
+    size_t used = 0;
+    char* save;
+    for (char* part = strtok_r(joined, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save)) {
+        if (strcmp(part, ".") == 0) {
+            continue;
+        }
+        if (strcmp(part, "..") == 0) {
+            while (used > 0 && out[--used] != '/') {
+            }
+            continue;
+        }
+        size_t part_len = strlen(part);
+        if (used + part_len + 2 > len) {
+            return -1;
+        }
+        out[used++] = '/';
+        memcpy(out + used, part, part_len);
+        used += part_len;
+    }
+    if (used == 0) {
+        out[used++] = '/';
+    }
+    out[used] = '\0';
+    return 0;
+}
+
+// Print the owners of one path as "pkg1, pkg2: path". Returns 1 if it has an owner.
+static int print_owners(const owners_map_t* map, const char* query) {
+    char path[MAX_PATH];
+    if (normalize_query_path(query, path, sizeof(path)) != 0) {
+        fprintf(stderr, "Error: Path too long: %s\n", query);
+        return 0;
+    }
+    size_t pos;
+    uint32_t package;
+    long n = owners_find(map, path, &pos, &package);
+    if (n < 0) {
+        fprintf(stderr, "%s: not owned by any package\n", path);
+        return 0;
+    }
+    fputs(map->packages[package].name, stdout);
+    char next[MAX_PATH];
+    snprintf(next, sizeof(next), "%s", path);
+    for (uint32_t i = (uint32_t)n + 1; i < map->header->entry_count; i++) {
+        if (i % OWNERS_RESTART == 0) {
+            next[0] = '\0';
+        }
+        if (owners_decode(map, &pos, next, &package) != 0 || strcmp(next, path) != 0) {
+            break;
+        }
+        printf(", %s", map->packages[package].name);
+    }
+    printf(": %s\n", path);
+    return 1;
+}
+
+// Report which packages own each path; "-" reads one path per line from stdin.
+// Returns 0 when every path has an owner, 1 otherwise.
+int owns_paths(int count, char* paths[]) {
+    owners_map_t map;
+    if (owners_open(&map) != 0) {
+        return -1;
+    }
+    int unowned = 0;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(paths[i], "-") != 0) {
+            unowned += !print_owners(&map, paths[i]);
+            continue;
+        }
+        char line[MAX_PATH];
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] != '\0') {
+                unowned += !print_owners(&map, line);
+            }
+        }
+    }
+    owners_unmap(&map);
+    return unowned == 0 ? 0 : 1;
+}
+
+// Package search ("trimorph search"): the repository metadata the package managers
+// have already synced, in one index with a trigram posting list per three-character
+// sequence of each package's name and summary. Characters are folded to letters,
+// digits and one separator class, so there are 37^3 trigrams and postings are built
+// with a counting sort. A query intersects the postings of its trigrams and checks the
+// few candidates left; fuzzy queries rank names by trigram similarity. The index is
+// rebuilt only when the set of metadata files or their sizes and mtimes change.
+#define SEARCH_MAGIC "TMSRCH01"
+#define SEARCH_FILE "var/lib/trimorph/search"
+#define SEARCH_SYMBOLS 37
+#define SEARCH_TRIGRAMS (SEARCH_SYMBOLS * SEARCH_SYMBOLS * SEARCH_SYMBOLS)
+#define SEARCH_FUZZY_LIMIT 20
+#define SEARCH_FUZZY_THRESHOLD 0.3
+
+typedef struct {
+    char magic[8];
+    uint32_t record_count;
+    uint32_t posting_count;
+    uint64_t strings_size;
+    uint64_t signature;         // Of the metadata files: paths, sizes and mtimes
+} search_header_t;
+
+typedef struct {
+    uint32_t name;              // Offsets into the string section
+    uint32_t version;
+    uint32_t summary;
+    uint32_t manager;           // Index into search_sources
+} search_record_t;
+
+_Static_assert(sizeof(search_header_t) == 32, "search header is 32 bytes");
+
+// A mapped index: header, records, the start of each trigram's postings (one more than
+// there are trigrams), postings and strings
+typedef struct {
+    const search_header_t* header;
+    const search_record_t* records;
+    const uint32_t* starts;
+    const uint32_t* postings;
+    const char* strings;
+    size_t size;
+} search_map_t;
+
+typedef struct {
+    search_record_t* records;
+    size_t count;
+    size_t cap;
+    char* strings;
+    size_t strings_size;
+    size_t strings_cap;
+} search_build_t;
+
+typedef struct search_source search_source_t;
+
+// Where one package manager keeps synced repository metadata, relative to the root.
+// The loader reads a decompressed file from fd and leaves it open.
+struct search_source {
+    const char* manager;
+    const char* dir;
+    const char* subdir;         // Per-repository subdirectory holding the files, or NULL
+    const char* prefix;         // File names start with this and contain contains
+    const char* contains;
+    int format;                 // Cache format of the installed packages it upgrades
+    int (*load)(search_build_t* b, uint32_t manager, int fd);
+};
+
+static int load_apt_search(search_build_t* b, uint32_t manager, int fd);
+static int load_pacman_search(search_build_t* b, uint32_t manager, int fd);
+static int load_apk_search(search_build_t* b, uint32_t manager, int fd);
+static int load_rpm_search(search_build_t* b, uint32_t manager, int fd);
+
+static const search_source_t search_sources[] = {
+    {"apt", "var/lib/apt/lists", NULL, "", "_Packages", CACHE_DEB, load_apt_search},
+    {"pacman", "var/lib/pacman/sync", NULL, "", ".db", CACHE_ARCH, load_pacman_search},
+    {"apk", "var/cache/apk", NULL, "APKINDEX.", ".tar.gz", CACHE_APK, load_apk_search},
+    {"dnf", "var/cache/dnf", "repodata", "", "primary.xml", CACHE_RPM, load_rpm_search},
+    {"dnf", "var/cache/libdnf5", "repodata", "", "primary.xml", CACHE_RPM, load_rpm_search},
+    {"zypper", "var/cache/zypp/raw", "repodata", "", "primary.xml", CACHE_RPM, load_rpm_search},
+    {NULL, NULL, NULL, NULL, NULL, 0, NULL}  // Sentinel
+};
+
+// A metadata file found for a source
+typedef struct {
+    char path[MAX_PATH];
+    uint32_t source;
+} search_file_t;
+
+static size_t search_add_string(search_build_t* b, const char* text) {
+    size_t len = strlen(text) + 1;
+    if (b->strings_size + len > b->strings_cap) {
+        size_t cap = b->strings_cap ? b->strings_cap * 2 : 1 << 20;
+        while (cap < b->strings_size + len) {
+            cap *= 2;
+        }
+        char* grown = realloc(b->strings, cap);
+        if (grown == NULL) {
+            return (size_t)-1;
+        }
+        b->strings = grown;
+        b->strings_cap = cap;
+    }
+    memcpy(b->strings + b->strings_size, text, len);
+    b->strings_size += len;
+    return b->strings_size - len;
+}
+
+// Add one package; packages without a name are ignored
+static int search_add(search_build_t* b, uint32_t manager, const char* name, const char* version,
+                      const char* summary) {
+    if (name[0] == '\0') {
+        return 0;
+    }
+    if (b->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        search_record_t* grown = realloc(b->records, cap * sizeof(search_record_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        b->records = grown;
+        b->cap = cap;
+    }
+    size_t n = search_add_string(b, name);
+    size_t v = search_add_string(b, version);
+    size_t s = search_add_string(b, summary);
+    if (n == (size_t)-1 || v == (size_t)-1 || s == (size_t)-1 || b->strings_size > UINT32_MAX) {
+        return -1;
+    }
+    search_record_t* r = &b->records[b->count++];
+    r->name = (uint32_t)n;
+    r->version = (uint32_t)v;
+    r->summary = (uint32_t)s;
+    r->manager = manager;
+    return 0;
+}
+
+// apt: paragraphs of "Key: value" lines; the first Description line is the summary
+static int load_apt_search(search_build_t* b, uint32_t manager, int fd) {
+    FILE* f = fdopen(dup(fd), "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[4096];
+    char name[256] = "", version[256] = "", summary[512] = "";
+    int result = 0;
+    int too_long = 0;  // A name or version that does not fit drops the package
+    while (result == 0) {
+        int more = fgets(line, sizeof(line), f) != NULL;
+        line[more ? strcspn(line, "\n") : 0] = '\0';
+        if (line[0] == '\0') {
+            if (!too_long) {
+                result = search_add(b, manager, name, version, summary);
+            }
+            name[0] = version[0] = summary[0] = '\0';
+            too_long = 0;
+            if (!more) break;
+        } else if (strncmp(line, "Package: ", 9) == 0) {
+            int len = snprintf(name, sizeof(name), "%s", line + 9);
+            too_long |= len < 0 || (size_t)len >= sizeof(name);
+        } else if (strncmp(line, "Version: ", 9) == 0) {
+            int len = snprintf(version, sizeof(version), "%s", line + 9);
+            too_long |= len < 0 || (size_t)len >= sizeof(version);
+        } else if (strncmp(line, "Description: ", 13) == 0) {
+            // Only the start of a long summary is kept
+            snprintf(summary, sizeof(summary), "%.*s", (int)sizeof(summary) - 1, line + 13);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+// Call fn with the contents of every member of a tar stream whose name ends with suffix
+static int tar_each_member(int fd, const char* suffix, int (*fn)(const char* data, void* ctx), void* ctx) {
+    unsigned char hdr[512];
+    size_t suffix_len = strlen(suffix);
+    while (read_full(fd, hdr, sizeof(hdr)) == 0) {
+        if (hdr[0] == '\0') {
+            continue;
+        }
+        char name[101];
+        memcpy(name, hdr, 100);
+        name[100] = '\0';
+        char size_field[13];
+        memcpy(size_field, hdr + 124, 12);
+        size_field[12] = '\0';
+        size_t size = (size_t)strtoull(size_field, NULL, 8);
+        size_t padded = (size + 511) & ~(size_t)511;
+        size_t len = strlen(name);
+
+        if (len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0 && size <= (1 << 24)) {
+            char* data = malloc(padded + 1);
+            if (data == NULL || read_full(fd, data, padded) != 0) {
+                free(data);
+                return -1;
+            }
+            data[size] = '\0';
+            int result = fn(data, ctx);
+            free(data);
+            if (result != 0) {
+                return result;
+            }
+            continue;
+        }
+        unsigned char skip[4096];
+        while (padded > 0) {
+            size_t take = padded < sizeof(skip) ? padded : sizeof(skip);
+            if (read_full(fd, skip, take) != 0) {
+                return -1;
+            }
+            padded -= take;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    search_build_t* b;
+    uint32_t manager;
+} search_tar_ctx_t;
+
+// pacman: one desc file per package, with %NAME%, %VERSION% and %DESC% sections
+static int add_pacman_desc(const char* data, void* arg) {
+    search_tar_ctx_t* ctx = arg;
+    char name[256] = "", version[256] = "", summary[512] = "";
+    const char* section = "";
+    for (const char* p = data; *p != '\0';) {
+        size_t len = strcspn(p, "\n");
+        if (len > 0 && p[0] == '%') {
+            section = p;
+        } else if (len > 0) {
+            char* field = strncmp(section, "%NAME%\n", 7) == 0 ? name :
+                          strncmp(section, "%VERSION%\n", 10) == 0 ? version :
+                          strncmp(section, "%DESC%\n", 7) == 0 ? summary : NULL;
+            size_t size = field == summary ? sizeof(summary) : sizeof(name);
+            if (field != NULL && field[0] == '\0') {
+                snprintf(field, size, "%.*s", (int)len, p);
+            }
+        }
+        p += len + (p[len] == '\n');
+    }
+    return search_add(ctx->b, ctx->manager, name, version, summary);
+}
+
+static int load_pacman_search(search_build_t* b, uint32_t manager, int fd) {
+    search_tar_ctx_t ctx = {b, manager};
+    return tar_each_member(fd, "/desc", add_pacman_desc, &ctx);
+}
+
+// apk: the APKINDEX member holds paragraphs with P: name, V: version and T: description
+static int add_apkindex(const char* data, void* arg) {
+    search_tar_ctx_t* ctx = arg;
+    char name[256] = "", version[256] = "", summary[512] = "";
+    for (const char* p = data;; p++) {
+        size_t len = strcspn(p, "\n");
+        if (len == 0) {
+            if (search_add(ctx->b, ctx->manager, name, version, summary) != 0) {
+                return -1;
+            }
+            name[0] = version[0] = summary[0] = '\0';
+        } else if (len > 2 && p[1] == ':' && (p[0] == 'P' || p[0] == 'V' || p[0] == 'T')) {
+            char* field = p[0] == 'P' ? name : p[0] == 'V' ? version : summary;
+            snprintf(field, p[0] == 'T' ? sizeof(summary) : sizeof(name), "%.*s", (int)len - 2, p + 2);
+        }
+        p += len;
+        if (*p == '\0') {
+            return search_add(ctx->b, ctx->manager, name, version, summary);
+        }
+    }
+}
+
+static int load_apk_search(search_build_t* b, uint32_t manager, int fd) {
+    search_tar_ctx_t ctx = {b, manager};
+    return tar_each_member(fd, "APKINDEX", add_apkindex, &ctx);
+}
+
+// Copy the text of an XML element on one line, decoding the predefined entities
+static void xml_text(const char* start, char* out, size_t len) {
+    static const char* const entities[][2] = {
+        {"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {NULL, NULL}
+    };
+    size_t used = 0;
+    for (const char* p = start; *p != '\0' && *p != '<' && used + 1 < len;) {
+        int decoded = 0;
+        for (int i = 0; *p == '&' && entities[i][0] != NULL; i++) {
+            size_t n = strlen(entities[i][0]);
+            if (strncmp(p, entities[i][0], n) == 0) {
+                out[used++] = entities[i][1][0];
+                p += n;
+                decoded = 1;
+                break;
+            }
+        }
+        if (!decoded) {
+            out[used++] = *p++;
+        }
+    }
+    out[used] = '\0';
+}
+
+// Value of an XML attribute in a line, or "" if absent
+static void xml_attr(const char* line, const char* attr, char* out, size_t len) {
+    char key[32];
+    snprintf(key, sizeof(key), " %s=\"", attr);
+    const char* p = strstr(line, key);
+    out[0] = '\0';
+    if (p != NULL) {
+        p += strlen(key);
+        snprintf(out, len, "%.*s", (int)strcspn(p, "\""), p);
+    }
+}
+
+// rpm-md primary.xml: one <package> element per package, written one child per line
+static int load_rpm_search(search_build_t* b, uint32_t manager, int fd) {
+    FILE* f = fdopen(dup(fd), "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[8192];
+    char name[256] = "", version[256] = "", summary[512] = "";
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), f) != NULL) {
+        const char* p = line + strspn(line, " \t");
+        if (strncmp(p, "<package ", 9) == 0) {
+            name[0] = version[0] = summary[0] = '\0';
+        } else if (strncmp(p, "<name>", 6) == 0) {
+            xml_text(p + 6, name, sizeof(name));
+        } else if (strncmp(p, "<summary>", 9) == 0) {
+            xml_text(p + 9, summary, sizeof(summary));
+        } else if (strncmp(p, "<version ", 9) == 0) {
+            char epoch[32], ver[128], rel[96];
+            xml_attr(p, "epoch", epoch, sizeof(epoch));
+            xml_attr(p, "ver", ver, sizeof(ver));
+            xml_attr(p, "rel", rel, sizeof(rel));
+            snprintf(version, sizeof(version), "%s%s%s-%s", strcmp(epoch, "0") == 0 || epoch[0] == '\0' ? "" : epoch,
+                     strcmp(epoch, "0") == 0 || epoch[0] == '\0' ? "" : ":", ver, rel);
+        } else if (strncmp(p, "</package>", 10) == 0) {
+            result = search_add(b, manager, name, version, summary);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+// Add the metadata files of a source that are in one directory
+static void collect_search_dir(const char* dir, uint32_t source, search_file_t** files, size_t* count, size_t* cap) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    const search_source_t* s = &search_sources[source];
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, s->prefix, strlen(s->prefix)) != 0 ||
+            strstr(de->d_name + strlen(s->prefix), s->contains) == NULL) {
+            continue;
+        }
+        // apt keeps diffs and partial downloads next to the lists; only whole lists count
+        size_t len = strlen(de->d_name);
+        size_t contains_len = strlen(s->contains);
+        if (s->subdir == NULL && strcmp(de->d_name + len - contains_len, s->contains) != 0) {
+            continue;
+        }
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            search_file_t* grown = realloc(*files, *cap * sizeof(search_file_t));
+            if (grown == NULL) {
+                break;
+            }
+            *files = grown;
+        }
+        snprintf((*files)[*count].path, MAX_PATH, "%s/%s", dir, de->d_name);
+        (*files)[(*count)++].source = source;
+    }
+    closedir(d);
+}
+
+static int search_file_cmp(const void* a, const void* b) {
+    return strcmp(((const search_file_t*)a)->path, ((const search_file_t*)b)->path);
+}
+
+// Find the synced metadata files and compute their signature
+static size_t find_search_files(search_file_t** files, uint64_t* signature) {
+    const char* root = has_target_root() ? target_root : "";
+    size_t count = 0, cap = 0;
+    *files = NULL;
+    for (uint32_t i = 0; search_sources[i].manager != NULL; i++) {
+        char dir[MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s/%s", root, search_sources[i].dir);
+        if (search_sources[i].subdir == NULL) {
+            collect_search_dir(dir, i, files, &count, &cap);
+            continue;
+        }
+        DIR* d = opendir(dir);
+        struct dirent* de;
+        while (d != NULL && (de = readdir(d)) != NULL) {
+            if (de->d_name[0] != '.') {
+                char sub[MAX_PATH];
+                snprintf(sub, sizeof(sub), "%s/%.200s/%s", dir, de->d_name, search_sources[i].subdir);
+                collect_search_dir(sub, i, files, &count, &cap);
+            }
+        }
+        if (d != NULL) closedir(d);
+    }
+    if (count > 0) {
+        qsort(*files, count, sizeof(search_file_t), search_file_cmp);
+    }
+
+    // FNV-1a over each file's path, size and mtime
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < count; i++) {
+        struct stat st;
+        int64_t fields[2] = {-1, -1};
+        if (stat((*files)[i].path, &st) == 0) {
+            fields[0] = (int64_t)st.st_size;
+            fields[1] = stat_mtime_ns(&st);
+        }
+        const unsigned char* parts[2] = {(const unsigned char*)(*files)[i].path, (const unsigned char*)fields};
+        size_t lens[2] = {strlen((*files)[i].path) + 1, sizeof(fields)};
+        for (int k = 0; k < 2; k++) {
+            for (size_t j = 0; j < lens[k]; j++) {
+                h = (h ^ parts[k][j]) * 1099511628211ull;
+            }
+        }
+    }
+    *signature = h;
+    return count;
+}
+
+// Fold a character to a trigram symbol: 1-26 letters, 27-36 digits, 0 anything else
+static int search_symbol(unsigned char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a' + 1;
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 1;
+    if (c >= '0' && c <= '9') return c - '0' + 27;
+    return 0;
+}
+
+// Trigrams of a text; returns how many were written (duplicates included)
+static size_t search_trigrams(const char* text, uint32_t* out, size_t max) {
+    size_t n = 0;
+    size_t len = strlen(text);
+    for (size_t i = 0; i + 2 < len && n < max; i++) {
+        out[n++] = (uint32_t)(search_symbol((unsigned char)text[i]) * SEARCH_SYMBOLS * SEARCH_SYMBOLS +
+                              search_symbol((unsigned char)text[i + 1]) * SEARCH_SYMBOLS +
+                              search_symbol((unsigned char)text[i + 2]));
+    }
+    return n;
+}
+
+// Call fn for each distinct trigram of a record's name and summary
+static void record_trigrams(const search_build_t* b, uint32_t id, uint32_t* stamp,
+                            void (*fn)(uint32_t trigram, uint32_t id, void* ctx), void* ctx) {
+    uint32_t trigrams[1024];
+    const search_record_t* r = &b->records[id];
+    const char* texts[2] = {b->strings + r->name, b->strings + r->summary};
+    for (int t = 0; t < 2; t++) {
+        size_t n = search_trigrams(texts[t], trigrams, sizeof(trigrams) / sizeof(trigrams[0]));
+        for (size_t i = 0; i < n; i++) {
+            if (stamp[trigrams[i]] != id + 1) {
+                stamp[trigrams[i]] = id + 1;
+                fn(trigrams[i], id, ctx);
+            }
+        }
+    }
+}
+
+static void count_trigram(uint32_t trigram, uint32_t id, void* ctx) {
+    (void)id;
+    ((uint32_t*)ctx)[trigram + 1]++;
+}
+
+typedef struct {
+    uint32_t* next;             // Next free posting of each trigram
+    uint32_t* postings;
+} search_fill_t;
+
+static void fill_trigram(uint32_t trigram, uint32_t id, void* ctx) {
+    search_fill_t* fill = ctx;
+    fill->postings[fill->next[trigram]++] = id;
+}
+
+// Build the postings with a counting sort and write the index atomically
+static int search_write(search_build_t* b, const char* path, uint64_t signature) {
+    uint32_t* starts = calloc(SEARCH_TRIGRAMS + 1, sizeof(uint32_t));
+    uint32_t* stamp = calloc(SEARCH_TRIGRAMS, sizeof(uint32_t));
+    uint32_t* next = malloc(SEARCH_TRIGRAMS * sizeof(uint32_t));
+    uint32_t* postings = NULL;
+    int result = starts != NULL && stamp != NULL && next != NULL ? 0 : -1;
+
+    for (uint32_t id = 0; result == 0 && id < b->count; id++) {
+        record_trigrams(b, id, stamp, count_trigram, starts);
+    }
+    for (size_t t = 0; result == 0 && t < SEARCH_TRIGRAMS; t++) {
+        starts[t + 1] += starts[t];
+    }
+    if (result == 0) {
+        postings = malloc(((size_t)starts[SEARCH_TRIGRAMS] + 1) * sizeof(uint32_t));
+        result = postings != NULL ? 0 : -1;
+    }
+    if (result == 0) {
+        search_fill_t fill = {next, postings};
+        memcpy(next, starts, SEARCH_TRIGRAMS * sizeof(uint32_t));
+        memset(stamp, 0, SEARCH_TRIGRAMS * sizeof(uint32_t));
+        for (uint32_t id = 0; id < b->count; id++) {
+            record_trigrams(b, id, stamp, fill_trigram, &fill);
+        }
+    }
+
+    search_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_MAGIC, sizeof(header.magic));
+    header.record_count = (uint32_t)b->count;
+    header.posting_count = starts != NULL ? starts[SEARCH_TRIGRAMS] : 0;
+    header.strings_size = b->strings_size;
+    header.signature = signature;
+
+    char tmp[MAX_PATH + 32];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE* out = NULL;
+    if (result == 0) {
+        char dir[MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s", path);
+        mkdir(dirname(dir), 0755);
+        out = fopen(tmp, "wbe");
+        result = out != NULL ? 0 : -1;
+    }
+    if (result == 0) {
+        fwrite(&header, sizeof(header), 1, out);
+        if (b->count > 0) {
+            fwrite(b->records, sizeof(search_record_t), b->count, out);
+        }
+        fwrite(starts, sizeof(uint32_t), SEARCH_TRIGRAMS + 1, out);
+        if (b->count > 0) {
+            fwrite(postings, sizeof(uint32_t), header.posting_count, out);
+            fwrite(b->strings, 1, b->strings_size, out);
+        }
+        result = ferror(out) ? -1 : 0;
+        if (fclose(out) != 0) {
+            result = -1;
+        }
+        if (result == 0 && rename(tmp, path) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            unlink(tmp);
+        }
+    }
+    free(starts);
+    free(stamp);
+    free(next);
+    free(postings);
+    return result;
+}
+
+static void search_unmap(search_map_t* map) {
+    if (map->header != NULL) {
+        munmap((void*)map->header, map->size);
+        map->header = NULL;
+    }
+}
+
+// Map an index file, checking that its sections fit. Returns 0 or -1.
+static int search_map(const char* path, search_map_t* map) {
+    memset(map, 0, sizeof(*map));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(search_header_t)) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    const search_header_t* h = data;
+    map->header = h;
+    map->size = (size_t)st.st_size;
+    size_t expected = sizeof(*h) + (size_t)h->record_count * sizeof(search_record_t) +
+                      (SEARCH_TRIGRAMS + 1 + (size_t)h->posting_count) * sizeof(uint32_t) + h->strings_size;
+    if (memcmp(h->magic, SEARCH_MAGIC, sizeof(h->magic)) != 0 || expected != map->size ||
+        (h->strings_size > 0 && ((const char*)data)[map->size - 1] != '\0')) {
+        search_unmap(map);
+        return -1;
+    }
+    map->records = (const search_record_t*)(h + 1);
+    map->starts = (const uint32_t*)(map->records + h->record_count);
+    map->postings = map->starts + SEARCH_TRIGRAMS + 1;
+    map->strings = (const char*)(map->postings + h->posting_count);
+    for (uint32_t i = 0; i < h->record_count; i++) {
+        const search_record_t* r = &map->records[i];
+        if (r->name >= h->strings_size || r->version >= h->strings_size || r->summary >= h->strings_size ||
+            r->manager >= sizeof(search_sources) / sizeof(search_sources[0]) - 1) {
+            search_unmap(map);
+            return -1;
+        }
+    }
+    if (map->starts[SEARCH_TRIGRAMS] != h->posting_count) {
+        search_unmap(map);
+        return -1;
+    }
+    return 0;
+}
+
+// Path of the index: TRIMORPH_SEARCH_FILE, or a fixed path inside the target root
+static void search_path(char* path, size_t len) {
+    const char* env = getenv("TRIMORPH_SEARCH_FILE");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(path, len, "%s", env);
+    } else {
+        snprintf(path, len, "%s/%s", has_target_root() ? target_root : "", SEARCH_FILE);
+    }
+}
+
+// Read every metadata file into a builder
+static int search_build(search_build_t* b, const search_file_t* files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        unsigned char magic[8];
+        int fd = open(files[i].path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd >= 0 ? pread(fd, magic, sizeof(magic), 0) : -1;
+        if (fd >= 0) close(fd);
+        if (n < 0) {
+            fprintf(stderr, "Warning: Cannot read %s\n", files[i].path);
+            continue;
+        }
+        pid_t pid;
+        int pipe_fd = open_decompressor(files[i].path, 0, archive_tool_for(magic, (size_t)n), &pid);
+        if (pipe_fd < 0) {
+            return -1;
+        }
+        size_t before = b->count;
+        int result = search_sources[files[i].source].load(b, files[i].source, pipe_fd);
+        close_decompressor(pipe_fd, pid);
+        if (result != 0) {
+            return -1;
+        }
+        if (b->count == before) {
+            fprintf(stderr, "Warning: No packages found in %s\n", files[i].path);
+        }
+    }
+    return 0;
+}
+
+// Bring the index up to date with the synced metadata and map it. If the index cannot
+// be saved a temporary copy answers this invocation. Returns 0 or -1.
+static int search_open(search_map_t* map) {
+    char path[MAX_PATH];
+    search_path(path, sizeof(path));
+    search_file_t* files;
+    uint64_t signature;
+    size_t count = find_search_files(&files, &signature);
+    if (search_map(path, map) == 0) {
+        if (map->header->signature == signature) {
+            free(files);
+            return 0;
+        }
+        search_unmap(map);
+    }
+
+    search_build_t b;
+    memset(&b, 0, sizeof(b));
+    int result = search_build(&b, files, count);
+    free(files);
+    if (result != 0) {
+        fprintf(stderr, "Error: Cannot read the repository metadata\n");
+    } else if (search_write(&b, path, signature) != 0) {
+        const char* tmpdir = getenv("TMPDIR");
+        fprintf(stderr, "Warning: Cannot save search index %s: %s\n", path, strerror(errno));
+        snprintf(path, sizeof(path), "%s/trimorph-search.%d", tmpdir != NULL ? tmpdir : "/tmp", (int)getpid());
+        result = search_write(&b, path, signature);
+        if (result == 0) {
+            result = search_map(path, map);
+            unlink(path);
+        }
+        if (result != 0) {
+            fprintf(stderr, "Error: Cannot write search index %s\n", path);
+        }
+    } else {
+        result = search_map(path, map);
+    }
+    free(b.records);
+    free(b.strings);
+    return result;
+}
+
+// A record matched by a query, with its rank
+typedef struct {
+    uint32_t id;
+    double score;
+} search_hit_t;
+
+static const search_map_t* search_sort_map;
+
+// Higher scores first, then by name, manager and version
+static int search_hit_cmp(const void* a, const void* b) {
+    const search_hit_t* ha = a;
+    const search_hit_t* hb = b;
+    if (ha->score != hb->score) {
+        return ha->score > hb->score ? -1 : 1;
+    }
+    const search_record_t* ra = &search_sort_map->records[ha->id];
+    const search_record_t* rb = &search_sort_map->records[hb->id];
+    int c = strcmp(search_sort_map->strings + ra->name, search_sort_map->strings + rb->name);
+    if (c == 0) c = (ra->manager > rb->manager) - (ra->manager < rb->manager);
+    if (c == 0) c = strcmp(search_sort_map->strings + ra->version, search_sort_map->strings + rb->version);
+    return c;
+}
+
+// Candidates for terms: records holding every trigram of every term, in id order.
+// Terms shorter than a trigram do not narrow the set. Returns the count or -1.
+static long search_candidates(const search_map_t* map, int count, char* terms[], uint32_t** out) {
+    uint32_t* set = NULL;
+    long size = -1;  // -1 while every record is still a candidate
+    for (int t = 0; t < count; t++) {
+        uint32_t trigrams[256];
+        size_t n = search_trigrams(terms[t], trigrams, sizeof(trigrams) / sizeof(trigrams[0]));
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t* list = map->postings + map->starts[trigrams[i]];
+            long len = (long)(map->starts[trigrams[i] + 1] - map->starts[trigrams[i]]);
+            if (size < 0) {
+                set = malloc(((size_t)len + 1) * sizeof(uint32_t));
+                if (set == NULL) {
+                    return -1;
+                }
+                memcpy(set, list, (size_t)len * sizeof(uint32_t));
+                size = len;
+                continue;
+            }
+            // Both lists are sorted by record id
+            long kept = 0;
+            for (long a = 0, b = 0; a < size && b < len;) {
+                if (set[a] < list[b]) a++;
+                else if (set[a] > list[b]) b++;
+                else { set[kept++] = set[a]; a++; b++; }
+            }
+            size = kept;
+        }
+    }
+    if (size < 0) {
+        size = map->header->record_count;
+        set = malloc(((size_t)size + 1) * sizeof(uint32_t));
+        if (set == NULL) {
+            return -1;
+        }
+        for (long i = 0; i < size; i++) {
+            set[i] = (uint32_t)i;
+        }
+    }
+    *out = set;
+    return size;
+}
+
+// Trigram similarity of two names: shared trigrams over all distinct trigrams, with
+// each name padded so that its start and end count too
+static double name_similarity(const char* a, const char* b) {
+    char pa[260], pb[260];
+    uint32_t ta[258], tb[258];
+    snprintf(pa, sizeof(pa), "  %.250s ", a);
+    snprintf(pb, sizeof(pb), "  %.250s ", b);
+    size_t na = search_trigrams(pa, ta, 258);
+    size_t nb = search_trigrams(pb, tb, 258);
+    size_t shared = 0, distinct_a = 0;
+    for (size_t i = 0; i < na; i++) {
+        int seen = 0;
+        for (size_t j = 0; j < i && !seen; j++) seen = ta[j] == ta[i];
+        if (seen) continue;
+        distinct_a++;
+        for (size_t j = 0; j < nb; j++) {
+            if (tb[j] == ta[i]) {
+                shared++;
+                break;
+            }
+        }
+    }
+    size_t distinct_b = 0;
+    for (size_t i = 0; i < nb; i++) {
+        int seen = 0;
+        for (size_t j = 0; j < i && !seen; j++) seen = tb[j] == tb[i];
+        distinct_b += !seen;
+    }
+    size_t all = distinct_a + distinct_b - shared;
+    return all > 0 ? (double)shared / (double)all : 0;
+}
+
+// Search the synced metadata of every package manager. Substring queries list the
+// packages whose name or summary contains every term, exact and name matches first;
+// fuzzy queries list the names most similar to the term. Returns 0 when something
+// matched, 1 otherwise.
+int search_packages(int count, char* terms[], int fuzzy, long limit) {
+    search_map_t map;
+    if (search_open(&map) != 0) {
+        return -1;
+    }
+    if (map.header->record_count == 0) {
+        fprintf(stderr, "Error: No synced repository metadata found\n");
+        fprintf(stderr, "Tip: Run 'trimorph run apt update' (or pacman -Sy, apk update, dnf makecache) first\n");
+        search_unmap(&map);
+        return 1;
+    }
+
+    search_hit_t* hits = NULL;
+    long hit_count = 0;
+    uint32_t* candidates = NULL;
+    long candidate_count;
+    if (fuzzy) {
+        // Candidates share at least one trigram with the term
+        candidate_count = 0;
+        uint32_t trigrams[256];
+        size_t n = search_trigrams(terms[0], trigrams, sizeof(trigrams) / sizeof(trigrams[0]));
+        unsigned char* seen = calloc(map.header->record_count, 1);
+        candidates = malloc((size_t)map.header->record_count * sizeof(uint32_t));
+        if (seen == NULL || candidates == NULL) {
+            candidate_count = -1;
+        }
+        for (size_t i = 0; candidate_count >= 0 && i < n; i++) {
+            for (uint32_t p = map.starts[trigrams[i]]; p < map.starts[trigrams[i] + 1]; p++) {
+                if (!seen[map.postings[p]]) {
+                    seen[map.postings[p]] = 1;
+                    candidates[candidate_count++] = map.postings[p];
+                }
+            }
+        }
+        free(seen);
+    } else {
+        candidate_count = search_candidates(&map, count, terms, &candidates);
+    }
+    if (candidate_count >= 0) {
+        hits = malloc(((size_t)candidate_count + 1) * sizeof(search_hit_t));
+    }
+    if (hits == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(candidates);
+        search_unmap(&map);
+        return -1;
+    }
+
+    for (long i = 0; i < candidate_count; i++) {
+        const search_record_t* r = &map.records[candidates[i]];
+        const char* name = map.strings + r->name;
+        double score;
+        if (fuzzy) {
+            score = name_similarity(terms[0], name);
+            if (score < SEARCH_FUZZY_THRESHOLD) {
+                continue;
+            }
+        } else {
+            // Exact names rank first, then names containing every term
+            int in_name = 1, matched = 1;
+            for (int t = 0; matched && t < count; t++) {
+                int name_match = strcasestr(name, terms[t]) != NULL;
+                in_name &= name_match;
+                matched = name_match || strcasestr(map.strings + r->summary, terms[t]) != NULL;
+            }
+            if (!matched) {
+                continue;
+            }
+            score = count == 1 && strcasecmp(name, terms[0]) == 0 ? 2 : in_name;
+        }
+        hits[hit_count].id = candidates[i];
+        hits[hit_count++].score = score;
+    }
+    free(candidates);
+
+    search_sort_map = &map;
+    qsort(hits, (size_t)hit_count, sizeof(search_hit_t), search_hit_cmp);
+    if (limit <= 0) {
+        limit = fuzzy ? SEARCH_FUZZY_LIMIT : hit_count;
+    }
+    if (hit_count > 0) {
+        printf("%-8s  %-32s  %-24s  %s\n", "MANAGER", "NAME", "VERSION", "SUMMARY");
+    }
+    for (long i = 0; i < hit_count && i < limit; i++) {
+        const search_record_t* r = &map.records[hits[i].id];
+        printf("%-8s  %-32s  %-24s  %s\n", search_sources[r->manager].manager, map.strings + r->name,
+               map.strings + r->version, map.strings + r->summary);
+    }
+    if (hit_count == 0) {
+        fprintf(stderr, "No packages match\n");
+    } else if (hit_count > limit) {
+        printf("%ld of %ld matches shown\n", limit, hit_count);
+    }
+    free(hits);
+    search_unmap(&map);
+    return hit_count > 0 ? 0 : 1;
+}
+
+// Version ordering of each package ecosystem, following dpkg, rpm, libalpm and
+// apk-tools. Each returns <0, 0 or >0 like strcmp.
+
+// dpkg: letters sort before non-letters, and '~' before everything, even the end
+static int dpkg_order(int c) {
+    if (isdigit(c)) return 0;
+    if (isalpha(c)) return c;
+    if (c == '~') return -1;
+    if (c) return c + 256;
+    return 0;
+}
+
+static int dpkg_verrevcmp(const char* a, const char* b) {
+    while (*a || *b) {
+        int first_diff = 0;
+        while ((*a && !isdigit((unsigned char)*a)) || (*b && !isdigit((unsigned char)*b))) {
+            int ac = dpkg_order((unsigned char)*a);
+            int bc = dpkg_order((unsigned char)*b);
+            if (ac != bc) return ac - bc;
+            a++;
+            b++;
+        }
+        while (*a == '0') a++;
+        while (*b == '0') b++;
+        while (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            if (!first_diff) first_diff = *a - *b;
+            a++;
+            b++;
+        }
+        if (isdigit((unsigned char)*a)) return 1;
+        if (isdigit((unsigned char)*b)) return -1;
+        if (first_diff) return first_diff;
+    }
+    return 0;
+}
+
+// Split [epoch:]upstream[-revision]; the revision follows the last hyphen
+static void split_evr(const char* version, long* epoch, char* upstream, size_t len, const char** revision,
+                      const char* no_revision) {
+    const char* colon = strchr(version, ':');
+    const char* digits_end = version + strspn(version, "0123456789");
+    *epoch = 0;
+    if (colon != NULL && colon == digits_end) {
+        *epoch = strtol(version, NULL, 10);
+        version = colon + 1;
+    }
+    snprintf(upstream, len, "%s", version);
+    char* hyphen = strrchr(upstream, '-');
+    *revision = no_revision;
+    if (hyphen != NULL) {
+        *hyphen = '\0';
+        *revision = version + (hyphen - upstream) + 1;
+    }
+}
+
+static int dpkg_vercmp(const char* a, const char* b) {
+    long epoch_a, epoch_b;
+    char up_a[256], up_b[256];
+    const char *rev_a, *rev_b;
+    split_evr(a, &epoch_a, up_a, sizeof(up_a), &rev_a, "");
+    split_evr(b, &epoch_b, up_b, sizeof(up_b), &rev_b, "");
+    if (epoch_a != epoch_b) return epoch_a > epoch_b ? 1 : -1;
+    int c = dpkg_verrevcmp(up_a, up_b);
+    return c != 0 ? c : dpkg_verrevcmp(rev_a, rev_b);
+}
+
+// rpm's rpmvercmp: alternating numeric and alphabetic segments; '~' sorts before
+// everything and '^' after the end but before anything else
+static int rpm_segcmp(const char* one, const char* two) {
+    if (strcmp(one, two) == 0) return 0;
+    while (*one || *two) {
+        while (*one && !isalnum((unsigned char)*one) && *one != '~' && *one != '^') one++;
+        while (*two && !isalnum((unsigned char)*two) && *two != '~' && *two != '^') two++;
+        if (*one == '~' || *two == '~') {
+            if (*one != '~') return 1;
+            if (*two != '~') return -1;
+            one++;
+            two++;
+            continue;
+        }
+        if (*one == '^' || *two == '^') {
+            if (!*one) return -1;
+            if (!*two) return 1;
+            if (*one != '^') return 1;
+            if (*two != '^') return -1;
+            one++;
+            two++;
+            continue;
+        }
+        if (!(*one && *two)) break;
+
+        const char* end1 = one;
+        const char* end2 = two;
+        int isnum = isdigit((unsigned char)*one);
+        if (isnum) {
+            while (isdigit((unsigned char)*end1)) end1++;
+            while (isdigit((unsigned char)*end2)) end2++;
+        } else {
+            while (isalpha((unsigned char)*end1)) end1++;
+            while (isalpha((unsigned char)*end2)) end2++;
+        }
+        if (two == end2) return isnum ? 1 : -1;   // Numeric segments beat alphabetic ones
+        if (isnum) {
+            while (*one == '0' && one < end1) one++;
+            while (*two == '0' && two < end2) two++;
+            if (end1 - one != end2 - two) return end1 - one > end2 - two ? 1 : -1;
+        }
+        size_t len1 = (size_t)(end1 - one), len2 = (size_t)(end2 - two);
+        int rc = memcmp(one, two, len1 < len2 ? len1 : len2);
+        if (rc == 0 && len1 != len2) rc = len1 < len2 ? -1 : 1;
+        if (rc) return rc < 0 ? -1 : 1;
+        one = end1;
+        two = end2;
+    }
+    if (!*one && !*two) return 0;
+    return !*one ? -1 : 1;
+}
+
+static int rpm_vercmp(const char* a, const char* b) {
+    long epoch_a, epoch_b;
+    char ver_a[256], ver_b[256];
+    const char *rel_a, *rel_b;
+    split_evr(a, &epoch_a, ver_a, sizeof(ver_a), &rel_a, "");
+    split_evr(b, &epoch_b, ver_b, sizeof(ver_b), &rel_b, "");
+    if (epoch_a != epoch_b) return epoch_a > epoch_b ? 1 : -1;
+    int c = rpm_segcmp(ver_a, ver_b);
+    return c != 0 ? c : rpm_segcmp(rel_a, rel_b);
+}
+
+// libalpm's rpmvercmp: like rpm's before '~' and '^', but longer separators win and a
+// trailing alphabetic segment never beats the end of a version
+static int alpm_segcmp(const char* a, const char* b) {
+    if (strcmp(a, b) == 0) return 0;
+    const char* one = a;
+    const char* two = b;
+    const char* ptr1 = a;
+    const char* ptr2 = b;
+    while (*one && *two) {
+        while (*one && !isalnum((unsigned char)*one)) one++;
+        while (*two && !isalnum((unsigned char)*two)) two++;
+        if (!(*one && *two)) break;
+        if (one - ptr1 != two - ptr2) return one - ptr1 < two - ptr2 ? -1 : 1;
+
+        ptr1 = one;
+        ptr2 = two;
+        int isnum = isdigit((unsigned char)*ptr1);
+        if (isnum) {
+            while (isdigit((unsigned char)*ptr1)) ptr1++;
+            while (isdigit((unsigned char)*ptr2)) ptr2++;
+        } else {
+            while (isalpha((unsigned char)*ptr1)) ptr1++;
+            while (isalpha((unsigned char)*ptr2)) ptr2++;
+        }
+        if (two == ptr2) return isnum ? 1 : -1;
+        if (isnum) {
+            while (*one == '0' && one < ptr1) one++;
+            while (*two == '0' && two < ptr2) two++;
+            if (ptr1 - one != ptr2 - two) return ptr1 - one > ptr2 - two ? 1 : -1;
+        }
+        size_t len1 = (size_t)(ptr1 - one), len2 = (size_t)(ptr2 - two);
+        int rc = memcmp(one, two, len1 < len2 ? len1 : len2);
+        if (rc == 0 && len1 != len2) rc = len1 < len2 ? -1 : 1;
+        if (rc) return rc < 0 ? -1 : 1;
+        one = ptr1;
+        two = ptr2;
+    }
+    if (!*one && !*two) return 0;
+    return (!*one && !isalpha((unsigned char)*two)) || isalpha((unsigned char)*one) ? -1 : 1;
+}
+
+static int alpm_vercmp(const char* a, const char* b) {
+    long epoch_a, epoch_b;
+    char ver_a[256], ver_b[256];
+    const char *rel_a, *rel_b;
+    if (strcmp(a, b) == 0) return 0;
+    split_evr(a, &epoch_a, ver_a, sizeof(ver_a), &rel_a, NULL);
+    split_evr(b, &epoch_b, ver_b, sizeof(ver_b), &rel_b, NULL);
+    if (epoch_a != epoch_b) return epoch_a > epoch_b ? 1 : -1;
+    int c = alpm_segcmp(ver_a, ver_b);
+    // The release only counts when both versions have one
+    return c != 0 || rel_a == NULL || rel_b == NULL ? c : alpm_segcmp(rel_a, rel_b);
+}
+
+// apk-tools: a token stream of numbers, a letter, _suffixes and the -rN revision
+enum {
+    APKV_INVALID = -1, APKV_DIGIT_OR_ZERO, APKV_DIGIT, APKV_LETTER, APKV_SUFFIX, APKV_SUFFIX_NO,
+    APKV_REVISION_NO, APKV_END
+};
+
+static void apk_next_token(int* type, const char** p) {
+    int n = APKV_INVALID;
+    if (**p == '\0') {
+        n = APKV_END;
+    } else if ((*type == APKV_DIGIT || *type == APKV_DIGIT_OR_ZERO) && islower((unsigned char)**p)) {
+        n = APKV_LETTER;
+    } else if (*type == APKV_LETTER && isdigit((unsigned char)**p)) {
+        n = APKV_DIGIT;
+    } else if (*type == APKV_SUFFIX && isdigit((unsigned char)**p)) {
+        n = APKV_SUFFIX_NO;
+    } else {
+        if (**p == '.') {
+            n = APKV_DIGIT_OR_ZERO;
+        } else if (**p == '_') {
+            n = APKV_SUFFIX;
+        } else if (**p == '-' && (*p)[1] == 'r') {
+            n = APKV_REVISION_NO;
+            (*p)++;
+        }
+        (*p)++;
+    }
+    if (n < *type && !((n == APKV_DIGIT_OR_ZERO && *type == APKV_DIGIT) ||
+                       (n == APKV_SUFFIX && *type == APKV_SUFFIX_NO) ||
+                       (n == APKV_DIGIT && *type == APKV_LETTER))) {
+        n = APKV_INVALID;
+    }
+    *type = n;
+}
+
+static long apk_get_token(int* type, const char** p) {
+    static const char* const pre_suffixes[] = {"alpha", "beta", "pre", "rc", NULL};
+    static const char* const post_suffixes[] = {"cvs", "svn", "git", "hg", "p", NULL};
+    long v = 0;
+    int next = APKV_INVALID;
+    const char* s = *p;
+    if (*s == '\0') {
+        *type = APKV_END;
+        return 0;
+    }
+    switch (*type) {
+    case APKV_DIGIT_OR_ZERO:
+        // Leading zeros: more of them sort earlier. Digits after them are the next
+        // token; anything else starts the next component, so "1.0_rc1" < "1.0".
+        if (*s == '0') {
+            while (*s == '0') s++;
+            next = isdigit((unsigned char)*s) ? APKV_DIGIT : APKV_INVALID;
+            v = -(long)(s - *p);
+            break;
+        }
+        // fallthrough
+    case APKV_DIGIT:
+    case APKV_SUFFIX_NO:
+    case APKV_REVISION_NO:
+        while (isdigit((unsigned char)*s) && v < 100000000000L) {
+            v = v * 10 + (*s++ - '0');
+        }
+        break;
+    case APKV_LETTER:
+        v = (unsigned char)*s++;
+        break;
+    case APKV_SUFFIX: {
+        int found = 0;
+        for (int i = 0; !found && pre_suffixes[i] != NULL; i++) {
+            if (strncmp(s, pre_suffixes[i], strlen(pre_suffixes[i])) == 0) {
+                v = i - 4;
+                s += strlen(pre_suffixes[i]);
+                found = 1;
+            }
+        }
+        for (int i = 0; !found && post_suffixes[i] != NULL; i++) {
+            if (strncmp(s, post_suffixes[i], strlen(post_suffixes[i])) == 0) {
+                v = i;
+                s += strlen(post_suffixes[i]);
+                found = 1;
+            }
+        }
+        if (found) {
+            break;
+        }
+    }
+        // fallthrough
+    default:
+        *type = APKV_INVALID;
+        return -1;
+    }
+    *p = s;
+    if (*s == '\0') {
+        *type = APKV_END;
+    } else if (next != APKV_INVALID) {
+        *type = next;
+    } else {
+        apk_next_token(type, p);
+    }
+    return v;
+}
+
+static int apk_vercmp(const char* a, const char* b) {
+    int at = APKV_DIGIT, bt = APKV_DIGIT;
+    long av = 0, bv = 0;
+    while (at == bt && at != APKV_END && at != APKV_INVALID && av == bv) {
+        av = apk_get_token(&at, &a);
+        bv = apk_get_token(&bt, &b);
+    }
+    if (av != bv) return av < bv ? -1 : 1;
+    if (at == bt) return 0;
+    // Equal so far: the longer version is newer, unless it continues with a pre-release
+    if (at == APKV_SUFFIX && apk_get_token(&at, &a) < 0) return -1;
+    if (bt == APKV_SUFFIX && apk_get_token(&bt, &b) < 0) return 1;
+    if (at > bt) return -1;
+    if (bt > at) return 1;
+    return 0;
+}
+
+// Comparison for the versions of one cache format
+static int (*version_compare(int format))(const char*, const char*) {
+    switch (format) {
+    case CACHE_DEB: return dpkg_vercmp;
+    case CACHE_ARCH: return alpm_vercmp;
+    case CACHE_APK: return apk_vercmp;
+    default: return rpm_vercmp;
+    }
+}
+
+// A package version: installed, or the newest a repository offers
+typedef struct {
+    const char* name;
+    const char* version;
+    uint32_t manager;           // Index into search_sources, for available versions
+} pkg_version_t;
+
+static int pkg_version_name_cmp(const void* a, const void* b) {
+    return strcmp(((const pkg_version_t*)a)->name, ((const pkg_version_t*)b)->name);
+}
+
+// Print a JSON string; package names and versions only need quotes and backslashes
+// escaped, but control characters are escaped too
+static void print_json_string(const char* s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", (unsigned char)*s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+// Keep the newest version of each name in a name-sorted list
+static size_t newest_versions(pkg_version_t* list, size_t count, int (*cmp)(const char*, const char*)) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept > 0 && strcmp(list[kept - 1].name, list[i].name) == 0) {
+            if (cmp(list[i].version, list[kept - 1].version) > 0) {
+                list[kept - 1] = list[i];
+            }
+        } else {
+            list[kept++] = list[i];
+        }
+    }
+    return kept;
+}
+
+// List installed packages with newer versions in the synced repository metadata, one
+// JSON object per line. Installed and available versions are each sorted by name and
+// merged in one pass, for every package manager whose database is present.
+int list_outdated() {
+    search_map_t map;
+    if (search_open(&map) != 0) {
+        return -1;
+    }
+    static const int formats[] = {CACHE_DEB, CACHE_ARCH, CACHE_APK, CACHE_RPM, -1};
+    pkg_version_t* available = malloc(((size_t)map.header->record_count + 1) * sizeof(pkg_version_t));
+    if (available == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        search_unmap(&map);
+        return -1;
+    }
+
+    int checked = 0;
+    for (int f = 0; formats[f] >= 0; f++) {
+        size_t avail_count = 0;
+        for (uint32_t i = 0; i < map.header->record_count; i++) {
+            const search_record_t* r = &map.records[i];
+            if (search_sources[r->manager].format == formats[f]) {
+                available[avail_count].name = map.strings + r->name;
+                available[avail_count].version = map.strings + r->version;
+                available[avail_count++].manager = r->manager;
+            }
+        }
+        if (avail_count == 0) {
+            continue;
+        }
+
+        // The installed database of this format, read like "cache gc" does
+        cache_scan_t scan;
+        memset(&scan, 0, sizeof(scan));
+        for (size_t c = 0; pkg_caches[c].dir != NULL && scan.cache == NULL; c++) {
+            if (pkg_caches[c].format == formats[f]) {
+                scan.cache = &pkg_caches[c];
+            }
+        }
+        scan.with_epoch = 1;
+        if (load_installed_versions(&scan) != 0) {
+            continue;
+        }
+        checked++;
+
+        int (*cmp)(const char*, const char*) = version_compare(formats[f]);
+        qsort(available, avail_count, sizeof(pkg_version_t), pkg_version_name_cmp);
+        avail_count = newest_versions(available, avail_count, cmp);
+
+        // Installed keys are sorted "name version" strings; split them in place
+        pkg_version_t* installed = malloc((scan.installed_count + 1) * sizeof(pkg_version_t));
+        size_t installed_count = 0;
+        for (size_t i = 0; installed != NULL && i < scan.installed_count; i++) {
+            char* space = strchr(scan.installed[i], ' ');
+            if (space != NULL) {
+                *space = '\0';
+                installed[installed_count].name = scan.installed[i];
+                installed[installed_count++].version = space + 1;
+            }
+        }
+        if (installed != NULL) {
+            qsort(installed, installed_count, sizeof(pkg_version_t), pkg_version_name_cmp);
+            installed_count = newest_versions(installed, installed_count, cmp);
+        }
+
+        for (size_t i = 0, a = 0; installed != NULL && i < installed_count && a < avail_count;) {
+            int c = strcmp(installed[i].name, available[a].name);
+            if (c < 0) {
+                i++;
+            } else if (c > 0) {
+                a++;
+            } else {
+                if (cmp(available[a].version, installed[i].version) > 0) {
+                    printf("{\"manager\":\"%s\",\"name\":", search_sources[available[a].manager].manager);
+                    print_json_string(installed[i].name);
+                    printf(",\"installed\":");
+                    print_json_string(installed[i].version);
+                    printf(",\"available\":");
+                    print_json_string(available[a].version);
+                    printf("}\n");
+                }
+                i++;
+                a++;
+            }
+        }
+        free(installed);
+        for (size_t i = 0; i < scan.installed_count; i++) free(scan.installed[i]);
+        free(scan.installed);
+    }
+    free(available);
+    search_unmap(&map);
+
+    if (checked == 0) {
+        fprintf(stderr, "Error: No installed package database with synced repository metadata found\n");
+        fprintf(stderr, "Tip: Run 'trimorph run apt update' (or pacman -Sy, apk update, dnf makecache) first\n");
+        return 1;
+    }
+    return 0;
+}
+
+// A package manager process seen by "status --watch"
+typedef struct {
+    pid_t pid;
+    int pidfd;                 // Used to wait for the exit in inotify mode, -1 otherwise
+    char name[16];
+    double start;              // Start time in seconds since boot
+} watched_pm_t;
+
+#define MAX_WATCHED_PMS 64
+
+// Whether "status --watch" prints JSON events instead of text lines
+static int watch_json = 0;
+
+// Seconds since boot, the clock /proc/PID/stat start times are based on
+static double boot_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read a process's command name and start time, returning 0 if it is a package manager
+static int read_pm_process(pid_t pid, char* name, size_t name_len, double* start) {
+    char path[64];
+    char stat_line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, stat_line, sizeof(stat_line) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    stat_line[n] = '\0';
+
+    // Format: pid (comm) state ... with starttime as field 22
+    char* open_paren = strchr(stat_line, '(');
+    char* close_paren = strrchr(stat_line, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren) {
+        return -1;
+    }
+    snprintf(name, name_len, "%.*s", (int)(close_paren - open_paren - 1), open_paren + 1);
+
+    if (!trimorph_is_manager_process(name)) {
+        return -1;
+    }
+
+    char* field = close_paren + 2;
+    for (int i = 3; i < 22 && field != NULL; i++) {
+        field = strchr(field, ' ');
+        if (field != NULL) field++;
+    }
+    *start = field != NULL ? strtoull(field, NULL, 10) / (double)sysconf(_SC_CLK_TCK) : boot_seconds();
+    return 0;
+}
+
+// Print a package manager start or finish event
+static void emit_pm_event(const watched_pm_t* pm, int finished, int exit_code, int have_exit_code) {
+    double runtime = boot_seconds() - pm->start;
+    if (watch_json) {
+        printf("{\"event\":\"%s\",\"manager\":\"%s\",\"pid\":%d,\"time\":%lld", finished ? "finish" : "start",
+               pm->name, (int)pm->pid, (long long)time(NULL));
+        if (finished) {
+            printf(",\"runtime_seconds\":%.3f", runtime);
+            if (have_exit_code) {
+                printf(",\"exit_code\":%d", exit_code);
+            } else {
+                printf(",\"exit_code\":null");
+            }
+        }
+        printf("}\n");
+    } else if (finished) {
+        printf("Finished: %s (pid %d) after %.1fs", pm->name, (int)pm->pid, runtime);
+        if (have_exit_code) {
+            printf(", exit code %d", exit_code);
+        }
+        printf("\n");
+    } else {
+        printf("Started: %s (pid %d)\n", pm->name, (int)pm->pid);
+    }
+    fflush(stdout);
+}
+
+// Start tracking a package manager process if it is not tracked yet
+static void track_pm(watched_pm_t* pms, int* count, pid_t pid, int use_pidfd) {
+    char name[16];
+    double start;
+    for (int i = 0; i < *count; i++) {
+        if (pms[i].pid == pid) {
+            return;
+        }
+    }
+    if (*count >= MAX_WATCHED_PMS || read_pm_process(pid, name, sizeof(name), &start) != 0) {
+        return;
+    }
+
+    watched_pm_t* pm = &pms[*count];
+    pm->pid = pid;
+    pm->pidfd = -1;
+    pm->start = start;
+    snprintf(pm->name, sizeof(pm->name), "%s", name);
+    if (use_pidfd) {
+        pm->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        if (pm->pidfd < 0) {
+            return;  // Exited before we could watch it
+        }
+    }
+    (*count)++;
+    emit_pm_event(pm, 0, 0, 0);
+}
+
+// Stop tracking a process, reporting its finish
+static void untrack_pm(watched_pm_t* pms, int* count, int index, int exit_code, int have_exit_code) {
+    emit_pm_event(&pms[index], 1, exit_code, have_exit_code);
+    if (pms[index].pidfd >= 0) {
+        close(pms[index].pidfd);
+    }
+    pms[index] = pms[--(*count)];
+}
+
+// Scan /proc for package manager processes
+static void scan_pm_processes(watched_pm_t* pms, int* count, int use_pidfd) {
+    DIR* d = opendir("/proc");
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] >= '1' && de->d_name[0] <= '9') {
+            track_pm(pms, count, (pid_t)atoi(de->d_name), use_pidfd);
+        }
+    }
+    closedir(d);
+}
+
+// Subscribe to process exec/exit events from the kernel's proc connector. This needs
+// CAP_NET_ADMIN; -1 is returned when it is not available.
+static int open_proc_connector() {
+    int sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (sock < 0) {
+        return -1;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    addr.nl_pid = (uint32_t)getpid();
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    struct __attribute__((packed)) {
+        struct nlmsghdr nl;
+        struct cn_msg cn;
+        enum proc_cn_mcast_op op;
+    } msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.nl.nlmsg_len = sizeof(msg);
+    msg.nl.nlmsg_type = NLMSG_DONE;
+    msg.nl.nlmsg_pid = (uint32_t)getpid();
+    msg.cn.id.idx = CN_IDX_PROC;
+    msg.cn.id.val = CN_VAL_PROC;
+    msg.cn.len = sizeof(enum proc_cn_mcast_op);
+    msg.op = PROC_CN_MCAST_LISTEN;
+    if (send(sock, &msg, sizeof(msg), 0) != (ssize_t)sizeof(msg)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Handle the proc connector events in one datagram
+static void handle_proc_events(int sock, watched_pm_t* pms, int* count) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t len = recv(sock, buf, sizeof(buf), 0);
+    if (len < 0) {
+        // Events were dropped under load: resynchronize from /proc
+        if (errno == ENOBUFS) {
+            for (int i = *count - 1; i >= 0; i--) {
+                if (kill(pms[i].pid, 0) != 0 && errno == ESRCH) {
+                    untrack_pm(pms, count, i, 0, 0);
+                }
+            }
+            scan_pm_processes(pms, count, 0);
+        }
+        return;
+    }
+
+    for (struct nlmsghdr* nl = (struct nlmsghdr*)buf; NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+        struct cn_msg* cn = NLMSG_DATA(nl);
+        if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) {
+            continue;
+        }
+        struct proc_event* ev = (struct proc_event*)cn->data;
+        if (ev->what == PROC_EVENT_EXEC) {
+            track_pm(pms, count, ev->event_data.exec.process_pid, 0);
+        } else if (ev->what == PROC_EVENT_EXIT &&
+                   ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid) {
+            for (int i = 0; i < *count; i++) {
+                if (pms[i].pid == ev->event_data.exit.process_pid) {
+                    int status = (int)ev->event_data.exit.exit_code;
+                    untrack_pm(pms, count, i, WIFEXITED(status) ? WEXITSTATUS(status) : -1, 1);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Watch the directories holding package manager lock files. Lock activity wakes the
+// watcher, which then looks for new package manager processes.
+static int open_lock_watch(const char* root) {
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    int watches = 0;
+    const char* lock_file;
+    for (size_t i = 0; (lock_file = trimorph_lock_file(i)) != NULL; i++) {
+        char dir[MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s/%s", root, lock_file);
+        *strrchr(dir, '/') = '\0';
+        if (inotify_add_watch(fd, dir, IN_OPEN | IN_CREATE | IN_DELETE | IN_CLOSE) >= 0) {
+            watches++;
+        }
+    }
+    if (watches == 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Report package managers starting and finishing until interrupted. The proc connector
+// delivers exec/exit events directly; without privileges lock file activity is watched
+// with inotify and each package manager found is followed with a pidfd. Both ways the
+// watcher sleeps in poll() while nothing happens.
+int watch_status() {
+    watched_pm_t pms[MAX_WATCHED_PMS];
+    int count = 0;
+    const char* root = has_target_root() ? target_root : "/";
+
+    int sock = has_target_root() ? -1 : open_proc_connector();
+    int inotify_fd = -1;
+    if (sock < 0) {
+        inotify_fd = open_lock_watch(root);
+        if (inotify_fd < 0) {
+            fprintf(stderr, "Error: Cannot watch package manager activity in %s\n", root);
+            fprintf(stderr, "Tip: Run as root to use the kernel process connector\n");
+            return -1;
+        }
+    }
+    int use_pidfd = sock < 0;
+    if (!watch_json) {
+        printf("Watching package managers in %s (%s)...\n", root,
+               use_pidfd ? "lock files and pidfds" : "process connector");
+        fflush(stdout);
+    }
+
+    // Report package managers that were already running
+    scan_pm_processes(pms, &count, use_pidfd);
+
+    for (;;) {
+        struct pollfd fds[MAX_WATCHED_PMS + 1];
+        int nfds = 0;
+        fds[nfds].fd = sock >= 0 ? sock : inotify_fd;
+        fds[nfds++].events = POLLIN;
+        for (int i = 0; use_pidfd && i < count; i++) {
+            fds[nfds].fd = pms[i].pidfd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        if (poll(fds, (nfds_t)nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+
+        // Exits first, so a pid reused by a new process is not mistaken for the old one
+        for (int i = nfds - 1; i >= 1; i--) {
+            if (fds[i].revents != 0) {
+                untrack_pm(pms, &count, i - 1, 0, 0);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            if (sock >= 0) {
+                handle_proc_events(sock, pms, &count);
+            } else {
+                char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                while (read(inotify_fd, events, sizeof(events)) > 0) {
+                    // Drain; the events only signal that something may have started
+                }
+                scan_pm_processes(pms, &count, 1);
+            }
+        }
+    }
+
+    if (sock >= 0) close(sock);
+    if (inotify_fd >= 0) close(inotify_fd);
+    return -1;
+}
+
+// Seconds "watch DIR" waits after the last arrival before installing a batch, and
+// the longest a file waits while arrivals keep coming
+#define DROP_DEBOUNCE_DEFAULT 2.0
+#define DROP_MAX_DELAY 30.0
+#define MAX_DROP_BATCH 256
+// Shortest wait before retrying a batch held back by a running package manager
+#define DROP_RETRY_DELAY 1.0
+
+// Set by SIGINT/SIGTERM to stop "watch DIR" between batches
+static volatile sig_atomic_t drop_watch_stop = 0;
+
+static void stop_drop_watch(int sig) {
+    (void)sig;
+    drop_watch_stop = 1;
+}
+
+// A completed package file waiting in the drop directory
+typedef struct {
+    char name[256];
+    int result;  // 1 pending, 0 installed, -1 failed
+} drop_file_t;
+
+// Whether a drop directory entry is a package to install. Hidden names are the usual
+// convention for copies still in progress, so they are left alone.
+static int is_drop_package(const char* dir, const char* name) {
+    if (name[0] == '.' || strlen(name) >= sizeof(((drop_file_t*)0)->name) || package_format(name) == NULL) {
+        return 0;
+    }
+    char path[MAX_PATH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Add a file to the pending batch; a file written again is only queued once
+static void queue_drop_file(drop_file_t* pending, int* count, const char* name) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(pending[i].name, name) == 0) {
+            return;
+        }
+    }
+    snprintf(pending[*count].name, sizeof(pending[*count].name), "%s", name);
+    pending[*count].result = 1;
+    (*count)++;
+}
+
+// Queue the packages already in the drop directory
+static void scan_drop_dir(const char* dir, drop_file_t* pending, int* count) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while (*count < MAX_DROP_BATCH && (entry = readdir(d)) != NULL) {
+        if (is_drop_package(dir, entry->d_name)) {
+            queue_drop_file(pending, count, entry->d_name);
+        }
+    }
+    closedir(d);
+}
+
+// Install one batch. Damaged payloads fail on their own; the rest are installed in one
+// transaction per package manager (deltas one at a time). Each file then moves to
+// done/ or failed/ by the outcome of its transaction; a dry run leaves them in place.
+static void install_drop_batch(const char* dir, drop_file_t* files, int count) {
+    char (*paths)[MAX_PATH] = malloc((size_t)count * MAX_PATH);
+    char** group = malloc((size_t)count * sizeof(char*));
+    int* members = malloc((size_t)count * sizeof(int));
+    if (paths == NULL || group == NULL || members == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(paths);
+        free(group);
+        free(members);
+        return;
+    }
+
+    // Package lists may have changed since the previous batch
+    trimorph_forget_refreshes(tm);
+    double start = now_seconds();
+    printf("Installing batch of %d package%s from %s\n", count, count == 1 ? "" : "s", dir);
+    for (int i = 0; i < count; i++) {
+        snprintf(paths[i], MAX_PATH, "%s/%s", dir, files[i].name);
+        char* path = paths[i];
+        if (test_archives(1, &path, 1) > 0) {
+            files[i].result = -1;
+        }
+    }
+
+    // The batch is installed in several transactions but must fit on disk as a whole
+    int ready = 0;
+    for (int i = 0; i < count; i++) {
+        if (files[i].result == 1) {
+            group[ready++] = paths[i];
+        }
+    }
+    if (space_preflight(ready, group) != 0) {
+        for (int i = 0; i < count; i++) {
+            files[i].result = files[i].result == 1 ? -1 : files[i].result;
+        }
+    }
+    space_check_done = 1;
+
+    for (int i = 0; i < count; i++) {
+        if (files[i].result != 1) {
+            continue;
+        }
+        const char* format = package_format(files[i].name);
+        const char* manager = strcmp(format, DELTA_EXT) == 0 ? NULL : trimorph_format_manager(files[i].name);
+        int n = 0;
+        for (int j = i; j < count && (n == 0 || manager != NULL); j++) {
+            const char* other = trimorph_format_manager(files[j].name);
+            if (files[j].result == 1 && (j == i || (other != NULL && strcmp(other, manager) == 0))) {
+                group[n] = paths[j];
+                members[n++] = j;
+            }
+        }
+        int result = install_transaction(n, group);
+        for (int k = 0; k < n; k++) {
+            files[members[k]].result = result == 0 ? 0 : -1;
+        }
+    }
+    space_check_done = 0;
+
+    int installed = 0;
+    for (int i = 0; i < count; i++) {
+        installed += files[i].result == 0;
+        if (dry_run) {
+            continue;
+        }
+        char to[MAX_PATH + 16];
+        snprintf(to, sizeof(to), "%s/%s/%s", dir, files[i].result == 0 ? "done" : "failed", files[i].name);
+        if (rename(paths[i], to) != 0) {
+            fprintf(stderr, "Warning: Cannot move %s to %s: %s\n", paths[i], to, strerror(errno));
+        }
+    }
+    printf("Batch finished: %d installed, %d failed in %.1fs\n", installed, count - installed,
+           now_seconds() - start);
+    fflush(stdout);
+    metrics_flush();
+    free(paths);
+    free(group);
+    free(members);
+}
+
+// Install packages as they are dropped into a directory until interrupted. inotify
+// reports files once they are complete (closed after writing, or moved in); arrivals
+// are collected until the directory has been quiet for the debounce interval, then
+// installed as a batch. Files present at startup form the first batch. Arrivals that
+// did not fit in a full batch, or whose events the kernel dropped, are found by
+// scanning the directory again once the batch is done.
+int watch_drop_dir(const char* dir, double debounce) {
+    struct stat st;
+    if (!validate_file_path(dir)) {
+        return -1;
+    }
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: Drop directory does not exist: %s\n", dir);
+        return -1;
+    }
+    const char* const outcomes[] = {"done", "failed"};
+    for (size_t i = 0; !dry_run && i < sizeof(outcomes) / sizeof(outcomes[0]); i++) {
+        char sub[MAX_PATH];
+        snprintf(sub, sizeof(sub), "%s/%s", dir, outcomes[i]);
+        if (mkdir(sub, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", sub, strerror(errno));
+            return -1;
+        }
+    }
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        fprintf(stderr, "Error: Cannot watch %s: %s\n", dir, strerror(errno));
+        fprintf(stderr, "Tip: Raise fs.inotify.max_user_instances or max_user_watches if the limits are reached\n");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    drop_file_t* pending = malloc(MAX_DROP_BATCH * sizeof(drop_file_t));
+    if (pending == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        close(fd);
+        return -1;
+    }
+
+    // No SA_RESTART, so a signal interrupts poll() and the loop ends between batches
+    struct sigaction stop, old_int, old_term;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stop_drop_watch;
+    sigemptyset(&stop.sa_mask);
+    drop_watch_stop = 0;
+    sigaction(SIGINT, &stop, &old_int);
+    sigaction(SIGTERM, &stop, &old_term);
+
+    int count = 0;
+    scan_drop_dir(dir, pending, &count);
+    int missed = count >= MAX_DROP_BATCH;  // Packages may be in the directory without being queued
+    double first = now_seconds(), last = count > 0 ? first - debounce : first;
+    printf("Watching %s for packages (installing after %.1fs without new arrivals)...\n", dir, debounce);
+    fflush(stdout);
+
+    int result = 0;
+    while (!drop_watch_stop) {
+        int timeout = -1;
+        if (count > 0) {
+            double due = last + debounce < first + DROP_MAX_DELAY ? last + debounce : first + DROP_MAX_DELAY;
+            double wait = due - now_seconds();
+            timeout = count >= MAX_DROP_BATCH || wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            result = -1;
+            break;
+        }
+
+        if (ready > 0) {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(fd, events, sizeof(events))) > 0) {
+                for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+                    const struct inotify_event* ev = (const struct inotify_event*)p;
+                    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                        fprintf(stderr, "Error: Drop directory %s was removed or moved\n", dir);
+                        drop_watch_stop = 1;
+                        result = -1;
+                    } else if (ev->mask & IN_Q_OVERFLOW) {
+                        if (count == 0) {
+                            first = now_seconds();
+                        }
+                        scan_drop_dir(dir, pending, &count);  // Events were lost; look again
+                        missed |= count >= MAX_DROP_BATCH;
+                    } else if (ev->len > 0 && count >= MAX_DROP_BATCH) {
+                        missed = 1;
+                    } else if (ev->len > 0 && is_drop_package(dir, ev->name)) {
+                        if (count == 0) {
+                            first = now_seconds();
+                        }
+                        queue_drop_file(pending, &count, ev->name);
+                    }
+                    last = now_seconds();
+                }
+            }
+            continue;
+        }
+
+        // Quiet long enough (or waited too long): install the batch, unless another
+        // package manager holds the locks, in which case the batch waits
+        if (!dry_run && is_package_manager_running()) {
+            double retry = debounce > DROP_RETRY_DELAY ? debounce : DROP_RETRY_DELAY;
+            printf("Another package manager is running; retrying in %.1fs\n", retry);
+            fflush(stdout);
+            first = now_seconds();
+            last = first + retry - debounce;
+            continue;
+        }
+        conflict_check_done = 1;
+        trimorph_set_option(tm, TRIMORPH_OPT_SKIP_CONFLICT_CHECK, 1);
+        install_drop_batch(dir, pending, count);
+        trimorph_set_option(tm, TRIMORPH_OPT_SKIP_CONFLICT_CHECK, 0);
+        conflict_check_done = 0;
+        count = 0;
+
+        // Installed and failed files have moved out, so a scan finds only the missed ones
+        if (missed && !dry_run) {
+            scan_drop_dir(dir, pending, &count);
+            missed = count >= MAX_DROP_BATCH;
+            first = last = now_seconds();
+        }
+    }
+
+    // Files still pending are picked up by the startup scan next time
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    free(pending);
+    close(fd);
+    printf("Stopped watching %s\n", dir);
+    return result;
+}
+
+// Run one subcommand against the currently selected root
+int run_batch(const char* file, const char* program, int keep_going);
+
+static int dispatch_command(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Trimorph - Enhanced Package Management System\n");
+        printf("Usage:\n");
+        printf("  %s install <package-file|url>... - Install local packages or http(s) URLs\n", argv[0]);
+        printf("  %s run <pkgmgr> [args...]        - Execute package manager command\n", argv[0]);
+        printf("  %s supported-formats            - List supported package formats\n", argv[0]);
+        printf("  %s check <pkgmgr>               - Check if package manager exists\n", argv[0]);
+        printf("  %s status                      - Check system status and conflicts\n", argv[0]);
+        printf("  %s status --watch [--json]     - Report package managers as they start and finish\n", argv[0]);
+        printf("  %s repo index <dir> --format <deb|arch|apk> [--name <repo>]\n", argv[0]);
+        printf("                                 - Index a directory of package files\n");
+        printf("  %s delta make <old> <new> [-o <delta>] - Create a binary delta between packages\n", argv[0]);
+        printf("  %s delta apply <old> <delta> [-o <pkg>] - Rebuild a package from base and delta\n", argv[0]);
+        printf("  %s test-archive <file>...       - Check that package payloads decompress cleanly\n", argv[0]);
+        printf("  %s cache gc [--budget <size>] [--keep <n>] [--dry-run]\n", argv[0]);
+        printf("                                 - Prune package caches, never removing installed versions\n");
+        printf("  %s history [--since <when>] [--until <when>] [--manager <pm>] [--outcome ok|failed] [--limit <n>]\n", argv[0]);
+        printf("                                 - Show recorded install and run operations\n");
+        printf("  %s batch [--keep-going] <file|->  - Run one operation per line in a single process\n", argv[0]);
+        printf("  %s watch [--debounce <seconds>] <dir> - Install packages dropped into a directory\n", argv[0]);
+        printf("  %s owns <path|->...             - Show the packages that own paths (- reads stdin)\n", argv[0]);
+        printf("  %s search [--fuzzy] [--limit <n>] <term>...\n", argv[0]);
+        printf("                                 - Search the synced repository metadata of every manager\n");
+        printf("  %s outdated                    - List installed packages with newer versions (JSON lines)\n", argv[0]);
+        printf("  %s scan-bench [--depth <n>] <path>...\n", argv[0]);
+        printf("                                 - Compare the io_uring and pread file scanners on a cold cache\n");
+        printf("\nOptions (before the command):\n");
+        printf("  --root <dir>                   - Act on an image rootfs instead of / (repeatable)\n");
+        printf("  --jobs <n>                     - Number of roots or worker threads run in parallel\n");
+        printf("  --max-per-host <n>             - Concurrent downloads per host (default 2)\n");
+        printf("  --metrics-file <file>          - Merge Prometheus metrics into a node_exporter textfile\n");
+        printf("  --low-impact                   - Run package managers with low CPU, I/O and memory priority\n");
+        printf("  --dry-run                      - Show what install and run would execute, with time estimates\n");
+        printf("  --skip-space-check             - Install without checking for free disk space first\n");
+        printf("  --group-commit <ms>            - Merge installs started within this window into one transaction\n");
+        printf("  --events-fd <n>                - Write JSON progress events for package manager runs to fd n\n");
+        printf("\nExamples:\n");
+        printf("  %s install package.deb\n", argv[0]);
         printf("  %s run apt update\n", argv[0]);
         printf("  %s run pacman -Syu\n", argv[0]);
         printf("  %s check emerge\n", argv[0]);
         printf("  %s status\n", argv[0]);
+        printf("  %s --root /srv/img1 --root /srv/img2 --jobs 2 install package.deb\n", argv[0]);
         return 1;
     }
     
     // Process command
     if (strcmp(argv[1], "install") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage: %s install <package-file>\n", argv[0]);
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s install <package-file|url>...\n", argv[0]);
             return 1;
         }
-        return install_local_package(argv[2]);
+        return install_packages(argc - 2, &argv[2]);
     }
     else if (strcmp(argv[1], "run") == 0) {
         if (argc < 4) {
@@ -552,27 +8410,21 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         
-        // Calculate remaining arguments
-        int remaining_args = argc - 3;
-        char** pm_args = malloc(remaining_args * sizeof(char*));
-        if (!pm_args) {
-            fprintf(stderr, "Error: Memory allocation failed\n");
-            return -1;
-        }
-        
-        for (int i = 0; i < remaining_args; i++) {
-            pm_args[i] = argv[i + 3];
-        }
-        
-        int result = run_pkg_manager(argv[2], remaining_args, pm_args);
-        free(pm_args);
+        trimorph_result_t op;
+        snprintf(plan_args_prefix, sizeof(plan_args_prefix), "%s%s%s", argv[2], argc > 3 ? " " : "",
+                 argc > 3 ? argv[3] : "");
+        time_t start = time(NULL);
+        int status = trimorph_run(tm, argv[2], argc - 3, &argv[3], &op);
+        int result = operation_exit_code(status, &op);
+        history_record("run", NULL, argc - 2, &argv[2], result, start, &op);
         return result;
     }
     else if (strcmp(argv[1], "supported-formats") == 0) {
         printf("Supported package formats:\n");
-        for (int i = 0; pkg_formats[i].ext != NULL; i++) {
-            printf("  %s\n", pkg_formats[i].ext);
+        for (size_t i = 0; trimorph_format_at(i) != NULL; i++) {
+            printf("  %s\n", trimorph_format_at(i));
         }
+        printf("  %s\n", DELTA_EXT);
         return 0;
     }
     else if (strcmp(argv[1], "check") == 0) {
@@ -590,7 +8442,19 @@ int main(int argc, char *argv[]) {
         }
     }
     else if (strcmp(argv[1], "status") == 0) {
-        printf("Checking system status...\n");
+        if (argc >= 3 && strcmp(argv[2], "--watch") == 0) {
+            watch_json = argc == 4 && strcmp(argv[3], "--json") == 0;
+            if (argc > 4 || (argc == 4 && !watch_json)) {
+                fprintf(stderr, "Usage: %s status [--watch [--json]]\n", argv[0]);
+                return 1;
+            }
+            return watch_status();
+        }
+        if (has_target_root()) {
+            printf("Checking status of root %s...\n", target_root);
+        } else {
+            printf("Checking system status...\n");
+        }
         if (is_package_manager_running()) {
             printf("Status: Another package manager is currently running\n");
         } else {
@@ -598,10 +8462,764 @@ int main(int argc, char *argv[]) {
         }
         return 0;
     }
+    else if (strcmp(argv[1], "repo") == 0) {
+        const char* format_name = NULL;
+        const char* repo_name = NULL;
+        for (int i = 4; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--format") == 0) {
+                format_name = argv[i + 1];
+            } else if (strcmp(argv[i], "--name") == 0) {
+                repo_name = argv[i + 1];
+            }
+        }
+        if (argc < 6 || strcmp(argv[2], "index") != 0 || format_name == NULL || argc % 2 != 0) {
+            fprintf(stderr, "Usage: %s repo index <dir> --format <deb|arch|apk> [--name <repo>]\n", argv[0]);
+            return 1;
+        }
+        return repo_index(argv[3], format_name, repo_name);
+    }
+    else if (strcmp(argv[1], "delta") == 0) {
+        const char* out_file = NULL;
+        if (argc == 7 && strcmp(argv[5], "-o") == 0) {
+            out_file = argv[6];
+        } else if (argc != 5) {
+            out_file = "";
+        }
+        if (out_file != NULL && out_file[0] == '\0') {
+            fprintf(stderr, "Usage: %s delta make <old> <new> [-o <delta>]\n", argv[0]);
+            fprintf(stderr, "       %s delta apply <old> <delta> [-o <pkg>]\n", argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[2], "make") == 0) {
+            char default_out[MAX_PATH];
+            if (out_file == NULL) {
+                snprintf(default_out, sizeof(default_out), "%s.tmdelta", argv[4]);
+                out_file = default_out;
+            }
+            return delta_make(argv[3], argv[4], out_file);
+        } else if (strcmp(argv[2], "apply") == 0) {
+            return delta_apply(argv[3], argv[4], out_file);
+        }
+        fprintf(stderr, "Error: Unknown delta command '%s'\n", argv[2]);
+        return 1;
+    }
+    else if (strcmp(argv[1], "test-archive") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s test-archive <file>...\n", argv[0]);
+            return 1;
+        }
+        int damaged = test_archives(argc - 2, &argv[2], 0);
+        return damaged == 0 ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "cache") == 0) {
+        long long budget = -1;
+        int keep = 0;
+        int gc_dry_run = 0;
+        int valid = argc >= 3 && strcmp(argv[2], "gc") == 0;
+        for (int i = 3; valid && i < argc; i++) {
+            if (strcmp(argv[i], "--dry-run") == 0) {
+                gc_dry_run = 1;
+            } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+                budget = parse_size(argv[++i]);
+                valid = budget >= 0;
+            } else if (strcmp(argv[i], "--keep") == 0 && i + 1 < argc) {
+                keep = atoi(argv[++i]);
+                valid = keep >= 1;
+            } else {
+                valid = 0;
+            }
+        }
+        if (!valid || (budget < 0 && keep == 0)) {
+            fprintf(stderr, "Usage: %s cache gc [--budget <size>] [--keep <n>] [--dry-run]\n", argv[0]);
+            fprintf(stderr, "Tip: Give a budget such as 2G, a number of versions to keep, or both\n");
+            return 1;
+        }
+        return cache_gc(budget, keep, dry_run || gc_dry_run);
+    }
+    else if (strcmp(argv[1], "history") == 0) {
+        time_t since = -1, until = -1;
+        const char* manager = NULL;
+        int outcome = 0;
+        long limit = 0;
+        int valid = 1;
+        for (int i = 2; valid && i < argc; i++) {
+            if (i + 1 >= argc) {
+                valid = 0;
+            } else if (strcmp(argv[i], "--since") == 0) {
+                valid = (since = parse_history_time(argv[++i])) >= 0;
+            } else if (strcmp(argv[i], "--until") == 0) {
+                valid = (until = parse_history_time(argv[++i])) >= 0;
+            } else if (strcmp(argv[i], "--manager") == 0) {
+                manager = argv[++i];
+            } else if (strcmp(argv[i], "--outcome") == 0) {
+                i++;
+                outcome = strcmp(argv[i], "ok") == 0 ? 1 : strcmp(argv[i], "failed") == 0 ? -1 : 0;
+                valid = outcome != 0;
+            } else if (strcmp(argv[i], "--limit") == 0) {
+                valid = (limit = strtol(argv[++i], NULL, 10)) > 0;
+            } else {
+                valid = 0;
+            }
+        }
+        if (!valid) {
+            fprintf(stderr, "Usage: %s history [--since <when>] [--until <when>] [--manager <pm>] [--outcome ok|failed] [--limit <n>]\n", argv[0]);
+            fprintf(stderr, "Tip: Times are ages such as 12h or 7d, or dates such as \"2026-03-14 09:30\"\n");
+            return 1;
+        }
+        return show_history(since, until, manager, outcome, limit);
+    }
+    else if (strcmp(argv[1], "batch") == 0) {
+        int keep_going = argc == 4 && strcmp(argv[2], "--keep-going") == 0;
+        if (argc != 3 + keep_going) {
+            fprintf(stderr, "Usage: %s batch [--keep-going] <file|->\n", argv[0]);
+            return 1;
+        }
+        return run_batch(argv[2 + keep_going], argv[0], keep_going);
+    }
+    else if (strcmp(argv[1], "owns") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s owns <path|->...\n", argv[0]);
+            return 1;
+        }
+        return owns_paths(argc - 2, &argv[2]);
+    }
+    else if (strcmp(argv[1], "search") == 0) {
+        int fuzzy = 0;
+        long limit = 0;
+        int i = 2;
+        for (; i < argc && argv[i][0] == '-'; i++) {
+            if (strcmp(argv[i], "--fuzzy") == 0) {
+                fuzzy = 1;
+            } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc && (limit = strtol(argv[i + 1], NULL, 10)) > 0) {
+                i++;
+            } else {
+                break;
+            }
+        }
+        if (i >= argc || argv[i][0] == '-' || (fuzzy && argc - i != 1)) {
+            fprintf(stderr, "Usage: %s search [--fuzzy] [--limit <n>] <term>...\n", argv[0]);
+            fprintf(stderr, "Tip: Fuzzy searches take a single term and match similar package names\n");
+            return 1;
+        }
+        return search_packages(argc - i, &argv[i], fuzzy, limit);
+    }
+    else if (strcmp(argv[1], "outdated") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: %s outdated\n", argv[0]);
+            return 1;
+        }
+        return list_outdated();
+    }
+    else if (strcmp(argv[1], "scan-bench") == 0) {
+        int depth = 0;
+        int i = 2;
+        if (i + 1 < argc && strcmp(argv[i], "--depth") == 0) {
+            depth = (int)strtol(argv[i + 1], NULL, 10);
+            i += 2;
+        }
+        if (i >= argc || depth < 0 || depth > SCAN_MAX_DEPTH || (i == 4 && depth == 0)) {
+            fprintf(stderr, "Usage: %s scan-bench [--depth <1-%d>] <path>...\n", argv[0], SCAN_MAX_DEPTH);
+            return 1;
+        }
+        return scan_bench(argc - i, &argv[i], depth);
+    }
+    else if (strcmp(argv[1], "watch") == 0) {
+        double debounce = DROP_DEBOUNCE_DEFAULT;
+        int has_debounce = argc == 5 && strcmp(argv[2], "--debounce") == 0;
+        if (has_debounce) {
+            char* end;
+            debounce = strtod(argv[3], &end);
+            has_debounce = *end == '\0' && debounce >= 0 && debounce <= DROP_MAX_DELAY;
+        }
+        if (argc != 3 && !has_debounce) {
+            fprintf(stderr, "Usage: %s watch [--debounce <seconds>] <dir>\n", argv[0]);
+            fprintf(stderr, "Tip: The debounce interval is at most %.0f seconds\n", DROP_MAX_DELAY);
+            return 1;
+        }
+        return watch_drop_dir(argv[argc - 1], debounce);
+    }
     else {
         fprintf(stderr, "Error: Unknown command '%s'\n", argv[1]);
         return 1;
     }
     
     return 0;
-}
\ No newline at end of file
+}
+
+// Subcommands that get their own metric label; anything else is counted as
+// "other" so typos cannot add series or break the exposition format
+static const char* metric_subcommands[] = {
+    "run", "supported-formats", "check", "status", "repo", "delta",
+    "test-archive", "cache", "history", "batch", "owns", "search",
+    "outdated", "scan-bench", "watch", NULL
+};
+
+// Count a subcommand in the operations metric; installs are counted per package
+static void count_operation(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "install") != 0) {
+        const char* subcommand = "other";
+        for (int i = 0; metric_subcommands[i] != NULL; i++) {
+            if (strcmp(argv[1], metric_subcommands[i]) == 0) {
+                subcommand = metric_subcommands[i];
+                break;
+            }
+        }
+        char labels[96];
+        snprintf(labels, sizeof(labels), "subcommand=\"%s\",format=\"none\"", subcommand);
+        metrics_count("trimorph_operations_total", labels, 1);
+    }
+}
+
+// Run one subcommand and merge its metrics into the textfile
+static int run_command(int argc, char *argv[]) {
+    trimorph_set_root(tm, target_root);
+    count_operation(argc, argv);
+    int result = dispatch_command(argc, argv);
+    metrics_flush();
+    if (dry_run) {
+        plan_summary();
+    }
+    return result;
+}
+
+// Batch scripts: one operation per line, in CLI syntax without the program name
+#define MAX_BATCH_ARGS 64
+#define MAX_BATCH_LINE 4096
+
+typedef struct {
+    int line_no;
+    int argc;
+    char* argv[MAX_BATCH_ARGS + 2];   // argv[0] is the program name, NULL terminated
+    char text[MAX_BATCH_LINE];        // The line as written, for the summary
+    char words[MAX_BATCH_LINE];       // Storage the arguments point into
+    int ran;
+    int result;
+    double seconds;
+} batch_step_t;
+
+// Split a batch line into arguments. Single and double quotes group words; a
+// backslash escapes the next character outside single quotes.
+static int parse_batch_line(batch_step_t* step, const char* line, const char* program) {
+    char* out = step->words;
+    const char* p = line;
+    step->argc = 0;
+    step->argv[step->argc++] = (char*)program;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '#') {
+            break;
+        }
+        if (step->argc > MAX_BATCH_ARGS) {
+            fprintf(stderr, "Error: Too many arguments on batch line %d\n", step->line_no);
+            return -1;
+        }
+        step->argv[step->argc++] = out;
+        char quote = '\0';
+        while (*p != '\0' && (quote != '\0' || (*p != ' ' && *p != '\t'))) {
+            if (quote == '\0' && (*p == '\'' || *p == '"')) {
+                quote = *p++;
+            } else if (quote != '\0' && *p == quote) {
+                quote = '\0';
+                p++;
+            } else if (*p == '\\' && quote != '\'' && p[1] != '\0') {
+                *out++ = p[1];
+                p += 2;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (quote != '\0') {
+            fprintf(stderr, "Error: Unterminated quote on batch line %d\n", step->line_no);
+            return -1;
+        }
+        *out++ = '\0';
+    }
+    step->argv[step->argc] = NULL;
+    return 0;
+}
+
+// Read-only steps can run concurrently with each other
+static int is_read_only_step(const batch_step_t* step) {
+    const char* cmd = step->argv[1];
+    return strcmp(cmd, "check") == 0 || strcmp(cmd, "supported-formats") == 0 ||
+           strcmp(cmd, "status") == 0;
+}
+
+// Read and parse a whole batch script, so syntax errors are reported before anything runs
+static batch_step_t* read_batch_file(const char* file, const char* program, int* count) {
+    FILE* in = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Error: Cannot open batch file %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    batch_step_t* steps = NULL;
+    int n = 0;
+    int line_no = 0;
+    int failed = 0;
+    char line[MAX_BATCH_LINE];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        batch_step_t* grown = realloc(steps, (n + 1) * sizeof(batch_step_t));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            failed = 1;
+            break;
+        }
+        steps = grown;
+        batch_step_t* step = &steps[n];
+        memset(step, 0, sizeof(*step));
+        step->line_no = line_no;
+        if (parse_batch_line(step, line, program) != 0) {
+            failed = 1;
+            continue;
+        }
+        if (step->argc < 2) {
+            continue;  // Blank line or comment
+        }
+        if (strcmp(step->argv[1], "batch") == 0 || strcmp(step->argv[1], "watch") == 0 ||
+            (strcmp(step->argv[1], "status") == 0 && step->argc >= 3 && strcmp(step->argv[2], "--watch") == 0)) {
+            fprintf(stderr, "Error: '%s' cannot be used in a batch (line %d)\n", line, line_no);
+            failed = 1;
+            continue;
+        }
+        snprintf(step->text, sizeof(step->text), "%s", line + strspn(line, " \t"));
+        n++;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (failed) {
+        free(steps);
+        return NULL;
+    }
+    *count = n;
+    return steps;
+}
+
+// Arguments point into the step's own storage; fix them up after the array has moved
+static void rebase_batch_steps(batch_step_t* steps, int count) {
+    for (int i = 0; i < count; i++) {
+        char* p = steps[i].words;
+        for (int a = 1; a < steps[i].argc; a++) {
+            steps[i].argv[a] = p;
+            p += strlen(p) + 1;
+        }
+    }
+}
+
+// Print a captured output file to a stream
+static void replay_output(int fd, FILE* stream) {
+    char buf[8192];
+    ssize_t n;
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, (size_t)n, stream);
+    }
+    fflush(stream);
+}
+
+// Run a group of consecutive read-only steps in child processes, up to parallel_jobs
+// at a time. Their output is captured and printed in step order once all are done.
+static void run_read_only_group(batch_step_t* steps, int count) {
+    pid_t pids[count];
+    int out_fds[count];
+    int err_fds[count];
+    double starts[count];
+    int running = 0;
+    int next = 0;
+    int done = 0;
+
+    // Children inherit pending metrics, so write them out before forking
+    metrics_flush();
+    fflush(stdout);
+    fflush(stderr);
+
+    while (done < count) {
+        while (next < count && running < parallel_jobs) {
+            batch_step_t* step = &steps[next];
+            out_fds[next] = open_scratch_file();
+            err_fds[next] = open_scratch_file();
+            starts[next] = now_seconds();
+            pid_t pid = (out_fds[next] >= 0 && err_fds[next] >= 0) ? fork() : -1;
+            if (pid == 0) {
+                dup2(out_fds[next], STDOUT_FILENO);
+                dup2(err_fds[next], STDERR_FILENO);
+                count_operation(step->argc, step->argv);
+                int result = dispatch_command(step->argc, step->argv);
+                metrics_flush();
+                exit(result & 0xff);
+            }
+            step->ran = 1;
+            if (pid < 0) {
+                perror("fork failed");
+                step->result = -1;
+                done++;
+            } else {
+                running++;
+            }
+            pids[next++] = pid;
+        }
+
+        if (running == 0) {
+            continue;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid failed");
+            break;
+        }
+        for (int i = 0; i < next; i++) {
+            if (pids[i] == pid) {
+                steps[i].result = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                steps[i].seconds = now_seconds() - starts[i];
+                pids[i] = -1;
+                running--;
+                done++;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        printf("==> [%d] %s\n", steps[i].line_no, steps[i].text);
+        if (out_fds[i] >= 0) {
+            replay_output(out_fds[i], stdout);
+            close(out_fds[i]);
+        }
+        if (err_fds[i] >= 0) {
+            replay_output(err_fds[i], stderr);
+            close(err_fds[i]);
+        }
+    }
+}
+
+// Check the disk space of every local package the install steps of a block name, as
+// one set. URLs are downloaded by their step and not counted.
+static int batch_space_preflight(const batch_step_t* steps, int count) {
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        if (steps[i].argc > 2 && strcmp(steps[i].argv[1], "install") == 0) {
+            total += steps[i].argc - 2;
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
+    char** files = malloc((size_t)total * sizeof(char*));
+    if (files == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 2; steps[i].argc > 2 && strcmp(steps[i].argv[1], "install") == 0 && j < steps[i].argc; j++) {
+            if (!is_package_url(steps[i].argv[j])) {
+                files[n++] = steps[i].argv[j];
+            }
+        }
+    }
+    int result = space_preflight(n, files);
+    free(files);
+    return result;
+}
+
+// Run a batch script in this process. Package manager probes are cached across
+// read-only steps and forgotten after each mutating one, which may install or remove
+// a tool. Each block of consecutive mutating steps checks for a running package
+// manager once, and consecutive read-only steps run concurrently. The first failure
+// stops the batch unless keep_going is set.
+int run_batch(const char* file, const char* program, int keep_going) {
+    int count = 0;
+    batch_step_t* steps = read_batch_file(file, program, &count);
+    if (steps == NULL) {
+        return 1;
+    }
+    rebase_batch_steps(steps, count);
+
+    double batch_start = now_seconds();
+    int failed = 0;
+    int i = 0;
+    while (i < count && (!failed || keep_going)) {
+        int end = i;
+        int read_only = is_read_only_step(&steps[i]);
+        while (end < count && is_read_only_step(&steps[end]) == read_only) {
+            end++;
+        }
+
+        if (read_only) {
+            run_read_only_group(&steps[i], end - i);
+            for (int j = i; j < end; j++) {
+                failed |= steps[j].result != 0;
+            }
+            i = end;
+            continue;
+        }
+
+        // One conflict check covers the whole block of mutating steps
+        if (is_package_manager_running()) {
+            fprintf(stderr, "Error: Another package manager is currently running, aborting to prevent conflicts\n");
+            steps[i].ran = 1;
+            steps[i].result = -1;
+            failed = 1;
+            i = end;
+            continue;
+        }
+        // Nor does the block start if its packages together do not fit on disk
+        if (batch_space_preflight(&steps[i], end - i) != 0) {
+            steps[i].ran = 1;
+            steps[i].result = -1;
+            failed = 1;
+            i = end;
+            continue;
+        }
+        conflict_check_done = 1;
+        space_check_done = 1;
+        trimorph_set_option(tm, TRIMORPH_OPT_SKIP_CONFLICT_CHECK, 1);
+        for (; i < end && (!failed || keep_going); i++) {
+            printf("==> [%d] %s\n", steps[i].line_no, steps[i].text);
+            fflush(stdout);
+            double start = now_seconds();
+            count_operation(steps[i].argc, steps[i].argv);
+            steps[i].result = dispatch_command(steps[i].argc, steps[i].argv);
+            steps[i].seconds = now_seconds() - start;
+            steps[i].ran = 1;
+            failed |= steps[i].result != 0;
+            trimorph_forget_commands(tm);
+        }
+        conflict_check_done = 0;
+        space_check_done = 0;
+        trimorph_set_option(tm, TRIMORPH_OPT_SKIP_CONFLICT_CHECK, 0);
+        i = end;
+    }
+
+    // Per-step summary
+    int ok = 0, errors = 0, skipped = 0;
+    printf("Batch summary:\n");
+    for (int j = 0; j < count; j++) {
+        if (!steps[j].ran) {
+            printf("  [%d] %-40.40s skipped\n", steps[j].line_no, steps[j].text);
+            skipped++;
+        } else if (steps[j].result == 0) {
+            printf("  [%d] %-40.40s ok      %.2fs\n", steps[j].line_no, steps[j].text, steps[j].seconds);
+            ok++;
+        } else {
+            printf("  [%d] %-40.40s failed  %.2fs (exit code %d)\n", steps[j].line_no, steps[j].text,
+                   steps[j].seconds, steps[j].result);
+            errors++;
+        }
+    }
+    printf("%d ok, %d failed, %d skipped in %.2fs\n", ok, errors, skipped, now_seconds() - batch_start);
+
+    free(steps);
+    return failed ? 1 : 0;
+}
+
+// Validate a --root argument: it must be an existing directory that is safe to quote
+static int validate_root_dir(const char* root) {
+    if (!validate_file_path(root)) {
+        return 0;
+    }
+    if (strchr(root, '\'') != NULL) {
+        fprintf(stderr, "Error: Root directory must not contain quotes: %s\n", root);
+        return 0;
+    }
+    struct stat st;
+    if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: Root directory does not exist: %s\n", root);
+        return 0;
+    }
+    return 1;
+}
+
+// Run the subcommand once per root, keeping up to jobs roots in flight. Each root
+// is handled in its own child process since roots share no locks with each other.
+static int run_across_roots(const char** roots, int nroots, int jobs, int argc, char *argv[]) {
+    pid_t pids[MAX_ROOTS];
+    int results[MAX_ROOTS];
+    int running = 0;
+    int next = 0;
+    int done = 0;
+
+    for (int i = 0; i < nroots; i++) {
+        pids[i] = -1;
+        results[i] = -1;
+    }
+
+    while (done < nroots) {
+        // Start roots until the job limit is reached
+        while (next < nroots && running < jobs) {
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid == 0) {
+                target_root = roots[next];
+                exit(run_command(argc, argv) & 0xff);
+            } else if (pid < 0) {
+                perror("fork failed");
+                results[next] = -1;
+                done++;
+            } else {
+                pids[next] = pid;
+                running++;
+            }
+            next++;
+        }
+
+        if (running == 0) {
+            continue;
+        }
+
+        // Reap whichever root finishes first
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid failed");
+            break;
+        }
+        for (int i = 0; i < nroots; i++) {
+            if (pids[i] == pid) {
+                results[i] = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                pids[i] = -1;
+                running--;
+                done++;
+                break;
+            }
+        }
+    }
+
+    // Summarize per-root results, returning the first failure
+    int result = 0;
+    printf("Root summary:\n");
+    for (int i = 0; i < nroots; i++) {
+        printf("  %s: %s (exit code %d)\n", roots[i], results[i] == 0 ? "ok" : "failed", results[i]);
+        if (results[i] != 0 && result == 0) {
+            result = results[i];
+        }
+    }
+    return result;
+}
+
+// Main function - parses global options and handles command line arguments
+int main(int argc, char *argv[]) {
+    const char* roots[MAX_ROOTS];
+    int nroots = 0;
+    int i = 1;
+
+    const char* env_metrics = getenv("TRIMORPH_METRICS_FILE");
+    if (env_metrics != NULL && env_metrics[0] != '\0') {
+        metrics_file = env_metrics;
+    }
+
+    // Global options come before the subcommand
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+            if (nroots >= MAX_ROOTS) {
+                fprintf(stderr, "Error: Too many --root directories (maximum %d)\n", MAX_ROOTS);
+                return 1;
+            }
+            if (!validate_root_dir(argv[i + 1])) {
+                return 1;
+            }
+            roots[nroots++] = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "--max-per-host") == 0 && i + 1 < argc) {
+            max_per_host = strtol(argv[i + 1], NULL, 10);
+            if (max_per_host < 1) {
+                fprintf(stderr, "Error: --max-per-host must be at least 1\n");
+                return 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "--low-impact") == 0) {
+            low_impact = 1;
+            i++;
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+            i++;
+        } else if (strcmp(argv[i], "--skip-space-check") == 0) {
+            skip_space_check = 1;
+            i++;
+        } else if (strcmp(argv[i], "--group-commit") == 0 && i + 1 < argc) {
+            char* end;
+            long window_ms = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || end == argv[i + 1] || window_ms < 1 || window_ms > GROUP_MAX_WINDOW_MS) {
+                fprintf(stderr, "Error: --group-commit must be a window of 1 to %d milliseconds\n", GROUP_MAX_WINDOW_MS);
+                return 1;
+            }
+            group_window = window_ms / 1000.0;
+            i += 2;
+        } else if (strcmp(argv[i], "--events-fd") == 0 && i + 1 < argc) {
+            char* end;
+            events_fd = (int)strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || end == argv[i + 1] || events_fd < 0 || fcntl(events_fd, F_GETFD) < 0) {
+                fprintf(stderr, "Error: --events-fd must name an open file descriptor\n");
+                return 1;
+            }
+            // Package managers must not inherit it, but stdin, stdout and stderr they
+            // must; for those the events go to a private close-on-exec duplicate
+            if (events_fd <= STDERR_FILENO) {
+                events_fd = fcntl(events_fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+                if (events_fd < 0) {
+                    fprintf(stderr, "Error: Cannot duplicate --events-fd: %s\n", strerror(errno));
+                    return 1;
+                }
+            } else {
+                fcntl(events_fd, F_SETFD, FD_CLOEXEC);
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metrics_file = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            parallel_jobs = strtol(argv[i + 1], NULL, 10);
+            if (parallel_jobs < 1) {
+                fprintf(stderr, "Error: --jobs must be at least 1\n");
+                return 1;
+            }
+            i += 2;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    if (dry_run) {
+        metrics_file = NULL;  // A plan is not an operation
+    }
+
+    tm = trimorph_new();
+    if (tm == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    trimorph_set_message_callback(tm, print_library_message, NULL);
+    trimorph_set_event_callback(tm, handle_library_event, NULL);
+    trimorph_set_option(tm, TRIMORPH_OPT_DRY_RUN, dry_run);
+    trimorph_set_option(tm, TRIMORPH_OPT_LOW_IMPACT, low_impact);
+    trimorph_set_option(tm, TRIMORPH_OPT_PROGRESS, events_fd >= 0);
+    if (parallel_jobs < 1) {
+        parallel_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (parallel_jobs < 1) {
+            parallel_jobs = 1;
+        }
+    }
+
+    // Keep the program name in argv[0] for usage messages
+    int cmd_argc = argc - i + 1;
+    char** cmd_argv = &argv[i - 1];
+    cmd_argv[0] = argv[0];
+
+    if (nroots == 1) {
+        target_root = roots[0];
+    }
+    if (nroots <= 1) {
+        return run_command(cmd_argc, cmd_argv);
+    }
+    return run_across_roots(roots, nroots, (int)parallel_jobs, cmd_argc, cmd_argv);
+}
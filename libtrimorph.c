@@ -0,0 +1,1760 @@
+/*
+ * libtrimorph - the package management core of Trimorph
+ * Format detection, command resolution, conflict detection, install and run as a
+ * reentrant library: every piece of mutable state is kept in the trimorph_t context,
+ * and output goes to the caller's callbacks instead of stdio
+ */
+
+#define _GNU_SOURCE
+#include "libtrimorph.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+// Define maximum path length
+#define MAX_PATH 1024
+
+// Sizes of the per-context caches
+#define MAX_CACHED_COMMANDS 64
+#define MAX_REFRESHED 16
+
+extern char** environ;
+
+struct trimorph {
+    char root[MAX_PATH];        // Root directory the package managers act on, empty for the host
+    int dry_run;
+    int low_impact;
+    int skip_conflict_check;
+    int progress;               // Parse package manager status into PROGRESS events
+
+    trimorph_message_cb message_cb;
+    void* message_user;
+    trimorph_event_cb event_cb;
+    void* event_user;
+    trimorph_output_cb output_cb;
+    void* output_user;
+
+    // Refresh commands already run, so each runs at most once per context
+    const char* refreshed[MAX_REFRESHED];
+    int refreshed_count;
+
+    // Command availability, cached since install and run probe the same tools
+    // repeatedly; guarded so worker threads may share it
+    pthread_mutex_t cache_lock;
+    struct { char name[64]; int available; } cache[MAX_CACHED_COMMANDS];
+    int cache_count;
+
+    unsigned low_impact_runs;   // Numbers this context's low-impact cgroups
+
+    // The operation in progress
+    const char* operation;
+    const char* format;
+    trimorph_result_t* result;
+    int refreshing;             // Package manager runtime currently counts as refresh time
+};
+
+// Per-manager options used to point a package manager at an image rootfs
+typedef struct {
+    const char* pm;
+    const char* root_flag;      // Option naming the root, NULL if the manager uses the ROOT env var
+    int joined;                 // Nonzero if the flag is written as flag=DIR rather than flag DIR
+    const char* lock_files[3];  // Lock files relative to the root, checked for per-root conflicts
+} pm_root_t;
+
+static const pm_root_t pm_roots[] = {
+    {"dpkg", "--root", 1, {"var/lib/dpkg/lock-frontend", "var/lib/dpkg/lock", NULL}},
+    {"apt", "-oRootDir", 1, {"var/lib/dpkg/lock-frontend", "var/lib/apt/lists/lock", NULL}},
+    {"apt-get", "-oRootDir", 1, {"var/lib/dpkg/lock-frontend", "var/lib/apt/lists/lock", NULL}},
+    {"pacman", "--root", 0, {"var/lib/pacman/db.lck", NULL, NULL}},
+    {"rpm", "--root", 0, {"var/lib/rpm/.rpm.lock", NULL, NULL}},
+    {"dnf", "--installroot", 1, {"var/lib/rpm/.rpm.lock", "var/cache/dnf/metadata_lock.pid", NULL}},
+    {"yum", "--installroot", 1, {"var/lib/rpm/.rpm.lock", "var/run/yum.pid", NULL}},
+    {"zypper", "--root", 0, {"run/zypp.pid", NULL, NULL}},
+    {"apk", "--root", 0, {"lib/apk/db/lock", NULL, NULL}},
+    {"emerge", NULL, 0, {"var/lib/portage/.lock", NULL, NULL}},
+    {NULL, NULL, 0, {NULL, NULL, NULL}}  // Sentinel
+};
+
+// Process names of the package managers checked for conflicts
+static const char* const pm_process_names[] = {
+    "apt", "aptitude", "dpkg", "pacman", "dnf", "yum", "zypper", "emerge", "apk", "portage",
+    NULL
+};
+
+// Package format definition structure
+typedef struct pkg_format pkg_format_t;
+struct pkg_format {
+    const char* ext;
+    const char* manager;        // Package manager family; one transaction never mixes two
+    const char* install_cmd;    // Install command; %s is the quoted list of package files
+    const char* verify_cmd;
+    const char* update_cmd;      // For auto dependency updates
+    const char* check_conflicts_cmd; // For conflict checking
+    const char* label;          // Names the package lists in warnings
+    const char* note;           // Shown before installing, NULL for none
+    int (*resolve)(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len);
+    void (*tips)(trimorph_t* tm, const pkg_format_t* format);
+};
+
+static int resolve_deb(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len);
+static int resolve_rpm(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len);
+static int resolve_default(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len);
+static void tips_deb(trimorph_t* tm, const pkg_format_t* format);
+static void tips_rpm(trimorph_t* tm, const pkg_format_t* format);
+static void tips_default(trimorph_t* tm, const pkg_format_t* format);
+
+// Supported package formats with their handlers
+static const pkg_format_t pkg_formats[] = {
+    {".deb", "dpkg", "dpkg -i %s", "dpkg --version", "apt update", "apt-get check", "apt", NULL,
+     resolve_deb, tips_deb},
+    {".pkg.tar.zst", "pacman", "pacman -U --noconfirm %s", "pacman --version", "pacman -Sy", "pacman -Q", "pacman", NULL,
+     resolve_default, tips_default},
+    {".pkg.tar.xz", "pacman", "pacman -U --noconfirm %s", "pacman --version", "pacman -Sy", "pacman -Q", "pacman", NULL,
+     resolve_default, tips_default},
+    {".pkg.tar.gz", "pacman", "pacman -U --noconfirm %s", "pacman --version", "pacman -Sy", "pacman -Q", "pacman", NULL,
+     resolve_default, tips_default},
+    {".rpm", "rpm", "rpm -i %s", "rpm --version", "dnf check-update || yum check-update || true", "rpm -Va", "RPM", NULL,
+     resolve_rpm, tips_rpm},
+    {".apk", "apk", "apk add %s", "apk --version", "apk update", "apk verify", "apk", NULL,
+     resolve_default, tips_default},
+    {".tbz", "emerge", "emerge --usepkg %s", "emerge --version", "emerge --sync", "equery list '*'", "emerge",
+     "Gentoo typically uses source-based packages (ebuilds)", resolve_default, tips_default},
+    {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}  // Sentinel
+};
+
+// Monotonic clock in seconds, for timing operations
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Pass a message to the caller; errors are also kept in the result
+static void tm_message(trimorph_t* tm, int level, const char* fmt, ...) {
+    char text[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (level == TRIMORPH_MSG_ERROR && tm->result != NULL) {
+        snprintf(tm->result->message, sizeof(tm->result->message), "%.255s", text);
+    }
+    if (tm->message_cb != NULL) {
+        tm->message_cb(level, text, tm->message_user);
+    }
+}
+
+static void tm_event(trimorph_t* tm, const trimorph_event_t* event) {
+    if (tm->event_cb != NULL) {
+        tm->event_cb(event, tm->event_user);
+    }
+}
+
+static int has_root(const trimorph_t* tm) {
+    return tm->root[0] != '\0';
+}
+
+// Look up the root handling for a package manager, NULL if unknown
+static const pm_root_t* find_pm_root(const char* pm_name) {
+    for (int i = 0; pm_roots[i].pm != NULL; i++) {
+        if (strcmp(pm_roots[i].pm, pm_name) == 0) {
+            return &pm_roots[i];
+        }
+    }
+    return NULL;
+}
+
+trimorph_t* trimorph_new(void) {
+    trimorph_t* tm = calloc(1, sizeof(trimorph_t));
+    if (tm != NULL) {
+        pthread_mutex_init(&tm->cache_lock, NULL);
+    }
+    return tm;
+}
+
+void trimorph_free(trimorph_t* tm) {
+    if (tm != NULL) {
+        pthread_mutex_destroy(&tm->cache_lock);
+        free(tm);
+    }
+}
+
+int trimorph_set_root(trimorph_t* tm, const char* root) {
+    if (root == NULL || strcmp(root, "/") == 0 || root[0] == '\0') {
+        tm->root[0] = '\0';
+        return TRIMORPH_OK;
+    }
+    if (strlen(root) >= sizeof(tm->root)) {
+        return TRIMORPH_ERR_INVALID;
+    }
+    snprintf(tm->root, sizeof(tm->root), "%s", root);
+    return TRIMORPH_OK;
+}
+
+int trimorph_set_option(trimorph_t* tm, int option, int value) {
+    switch (option) {
+    case TRIMORPH_OPT_DRY_RUN:
+        tm->dry_run = value != 0;
+        return TRIMORPH_OK;
+    case TRIMORPH_OPT_LOW_IMPACT:
+        tm->low_impact = value != 0;
+        return TRIMORPH_OK;
+    case TRIMORPH_OPT_SKIP_CONFLICT_CHECK:
+        tm->skip_conflict_check = value != 0;
+        return TRIMORPH_OK;
+    case TRIMORPH_OPT_PROGRESS:
+        tm->progress = value != 0;
+        return TRIMORPH_OK;
+    default:
+        return TRIMORPH_ERR_INVALID;
+    }
+}
+
+void trimorph_forget_refreshes(trimorph_t* tm) {
+    tm->refreshed_count = 0;
+}
+
+void trimorph_forget_commands(trimorph_t* tm) {
+    pthread_mutex_lock(&tm->cache_lock);
+    tm->cache_count = 0;
+    pthread_mutex_unlock(&tm->cache_lock);
+}
+
+void trimorph_set_message_callback(trimorph_t* tm, trimorph_message_cb cb, void* user) {
+    tm->message_cb = cb;
+    tm->message_user = user;
+}
+
+void trimorph_set_event_callback(trimorph_t* tm, trimorph_event_cb cb, void* user) {
+    tm->event_cb = cb;
+    tm->event_user = user;
+}
+
+void trimorph_set_output_callback(trimorph_t* tm, trimorph_output_cb cb, void* user) {
+    tm->output_cb = cb;
+    tm->output_user = user;
+}
+
+const char* trimorph_strerror(int error) {
+    switch (error) {
+    case TRIMORPH_OK: return "Success";
+    case TRIMORPH_ERR_INVALID: return "Invalid argument";
+    case TRIMORPH_ERR_NOT_FOUND: return "Package file not found";
+    case TRIMORPH_ERR_UNSUPPORTED: return "Unsupported package format";
+    case TRIMORPH_ERR_UNAVAILABLE: return "Package manager not available";
+    case TRIMORPH_ERR_CONFLICT: return "Another package manager is running";
+    case TRIMORPH_ERR_FAILED: return "Package manager command failed";
+    case TRIMORPH_ERR_SYSTEM: return "System error";
+    default: return "Unknown error";
+    }
+}
+
+// Limits applied to low-impact runs: cgroup v2 weights range from 1 to 10000 with a
+// default of 100, and memory.high is set to this percentage of physical memory
+#define LOW_IMPACT_CPU_WEIGHT 20
+#define LOW_IMPACT_IO_WEIGHT 10
+#define LOW_IMPACT_MEMORY_PERCENT 50
+#define LOW_IMPACT_NICE 19
+#define LOW_IMPACT_CGROUP "/sys/fs/cgroup/trimorph-low-impact"
+
+// How a low-impact child is being limited
+#define LOW_IMPACT_OFF 0
+#define LOW_IMPACT_CGROUP_MODE 1
+#define LOW_IMPACT_PRIORITY_MODE 2
+
+// State of one low-impact child run
+typedef struct {
+    int mode;
+    char cgroup[MAX_PATH];
+    char limits[256];          // Limits actually applied, for the report
+    int sync[2];               // The child waits on this until it has been placed
+} low_impact_t;
+
+// Write a value to a cgroup control file
+static int write_cgroup_file(const char* dir, const char* file, const char* value) {
+    char path[MAX_PATH + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+    return n == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+// Read a "key value" entry (or the whole value when key is NULL) from a cgroup file
+static long long read_cgroup_value(const char* dir, const char* file, const char* key) {
+    char path[MAX_PATH + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE* f = fopen(path, "re");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[256];
+    long long value = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (key == NULL) {
+            value = strtoll(line, NULL, 10);
+            break;
+        }
+        size_t key_len = strlen(key);
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ') {
+            value = strtoll(line + key_len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Prepare a transient cgroup for the next child, or fall back to I/O and CPU priority
+// when cgroup v2 is not writable (no root, read-only /sys/fs/cgroup, cgroup v1)
+static void low_impact_before_fork(trimorph_t* tm, low_impact_t* li) {
+    memset(li, 0, sizeof(*li));
+    li->sync[0] = li->sync[1] = -1;
+    if (!tm->low_impact) {
+        return;
+    }
+    li->mode = LOW_IMPACT_PRIORITY_MODE;
+    if (pipe2(li->sync, O_CLOEXEC) != 0) {
+        li->sync[0] = li->sync[1] = -1;
+    }
+
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) != 0 ||
+        (mkdir(LOW_IMPACT_CGROUP, 0755) != 0 && errno != EEXIST)) {
+        return;
+    }
+    static const char* const controllers[] = {"+cpu", "+io", "+memory", NULL};
+    for (int i = 0; controllers[i] != NULL; i++) {
+        write_cgroup_file("/sys/fs/cgroup", "cgroup.subtree_control", controllers[i]);
+        write_cgroup_file(LOW_IMPACT_CGROUP, "cgroup.subtree_control", controllers[i]);
+    }
+
+    // The thread id keeps names unique across contexts used in one process
+    snprintf(li->cgroup, sizeof(li->cgroup), "%s/run-%d-%ld-%u", LOW_IMPACT_CGROUP, (int)getpid(),
+             (long)syscall(SYS_gettid), tm->low_impact_runs++);
+    if (mkdir(li->cgroup, 0755) != 0) {
+        li->cgroup[0] = '\0';
+        return;
+    }
+    li->mode = LOW_IMPACT_CGROUP_MODE;
+
+    // Apply each limit the kernel offers, recording which ones took effect
+    char value[64];
+    size_t used = 0;
+    snprintf(value, sizeof(value), "%d", LOW_IMPACT_CPU_WEIGHT);
+    if (write_cgroup_file(li->cgroup, "cpu.weight", value) == 0) {
+        used += snprintf(li->limits + used, sizeof(li->limits) - used, "cpu.weight=%s ", value);
+    }
+    snprintf(value, sizeof(value), "default %d", LOW_IMPACT_IO_WEIGHT);
+    if (write_cgroup_file(li->cgroup, "io.weight", value) == 0) {
+        used += snprintf(li->limits + used, sizeof(li->limits) - used, "io.weight=%d ", LOW_IMPACT_IO_WEIGHT);
+    }
+    long long mem_high = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 100 * LOW_IMPACT_MEMORY_PERCENT;
+    snprintf(value, sizeof(value), "%lld", mem_high);
+    if (mem_high > 0 && write_cgroup_file(li->cgroup, "memory.high", value) == 0) {
+        used += snprintf(li->limits + used, sizeof(li->limits) - used, "memory.high=%lldMiB ", mem_high >> 20);
+    }
+    if (used > 0) {
+        li->limits[used - 1] = '\0';
+    } else {
+        snprintf(li->limits, sizeof(li->limits), "no controllers available");
+    }
+}
+
+// In the child: wait to be placed in the cgroup, or lower our own priority instead.
+// Only async-signal-safe calls are made, as the caller may be multithreaded.
+static void low_impact_in_child(low_impact_t* li) {
+    if (li->mode == LOW_IMPACT_OFF) {
+        return;
+    }
+    char placed = 'n';
+    if (li->sync[0] >= 0) {
+        close(li->sync[1]);
+        if (read(li->sync[0], &placed, 1) != 1) {
+            placed = 'n';
+        }
+        close(li->sync[0]);
+    }
+    if (placed != 'y') {
+        syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+        setpriority(PRIO_PROCESS, 0, LOW_IMPACT_NICE);
+    }
+}
+
+// In the parent: move the child into its cgroup and let it continue
+static void low_impact_after_fork(low_impact_t* li, pid_t pid) {
+    if (li->mode == LOW_IMPACT_OFF) {
+        return;
+    }
+    char placed = 'n';
+    if (li->mode == LOW_IMPACT_CGROUP_MODE) {
+        char pid_str[32];
+        snprintf(pid_str, sizeof(pid_str), "%d", (int)pid);
+        if (pid > 0 && write_cgroup_file(li->cgroup, "cgroup.procs", pid_str) == 0) {
+            placed = 'y';
+        } else {
+            rmdir(li->cgroup);
+            li->mode = LOW_IMPACT_PRIORITY_MODE;
+        }
+    }
+    if (li->sync[0] >= 0) {
+        close(li->sync[0]);
+        if (write(li->sync[1], &placed, 1) != 1) {
+            // The child treats a closed pipe like 'n'
+        }
+        close(li->sync[1]);
+    }
+}
+
+// Wait for the child, then report the limits it ran under and its peak usage
+static pid_t low_impact_wait(trimorph_t* tm, low_impact_t* li, pid_t pid, int* status) {
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    pid_t result;
+    do {
+        result = wait4(pid, status, 0, &ru);
+    } while (result < 0 && errno == EINTR);
+    if (li->mode == LOW_IMPACT_OFF) {
+        return result;
+    }
+
+    double cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    double peak_mib = ru.ru_maxrss / 1024.0;
+    if (li->mode == LOW_IMPACT_CGROUP_MODE) {
+        // The cgroup also accounts for the child's own children and the page cache
+        long long peak = read_cgroup_value(li->cgroup, "memory.peak", NULL);
+        long long usage = read_cgroup_value(li->cgroup, "cpu.stat", "usage_usec");
+        if (peak >= 0) peak_mib = peak / 1048576.0;
+        if (usage >= 0) cpu = usage / 1e6;
+        tm_message(tm, TRIMORPH_MSG_INFO, "Low-impact: cgroup %s (%s); peak memory %.1f MiB, CPU %.2fs",
+                   li->cgroup, li->limits, peak_mib, cpu);
+        rmdir(li->cgroup);
+    } else {
+        tm_message(tm, TRIMORPH_MSG_INFO,
+                   "Low-impact: idle I/O priority, nice %d (cgroup v2 not writable); peak RSS %.1f MiB, CPU %.2fs",
+                   LOW_IMPACT_NICE, peak_mib, cpu);
+    }
+    return result;
+}
+
+// Progress parsers, chosen by the package manager a command starts with. apt and dpkg
+// write machine-readable status lines to a descriptor of their own; pacman, dnf and rpm
+// only have their stdout, which they print without terminal progress bars when it is
+// a pipe.
+#define PROGRESS_NONE 0
+#define PROGRESS_APT 1          // APT::Status-Fd: dlstatus, pmstatus, pmerror, pmconffile
+#define PROGRESS_DPKG 2         // dpkg --status-fd: processing and status lines
+#define PROGRESS_PACMAN 3
+#define PROGRESS_DNF 4          // dnf and yum transaction lines, dnf5 [n/m] lines
+#define PROGRESS_RPM 5          // Hash mark lines and --percent lines
+#define PROGRESS_STATUS_FD 3    // Descriptor apt and dpkg write status lines to in the child
+
+typedef struct {
+    int kind;
+    const char* manager;
+    char line[512];             // Line being assembled; the rest of a longer line is dropped
+    size_t len;
+    int done;                   // Packages processed, for managers that announce a total
+    int total;
+    int removing;               // rpm is in its erase phase
+} progress_t;
+
+static const struct { const char* manager; int kind; } progress_managers[] = {
+    {"apt", PROGRESS_APT},
+    {"apt-get", PROGRESS_APT},
+    {"dpkg", PROGRESS_DPKG},
+    {"pacman", PROGRESS_PACMAN},
+    {"dnf", PROGRESS_DNF},
+    {"dnf5", PROGRESS_DNF},
+    {"yum", PROGRESS_DNF},
+    {"rpm", PROGRESS_RPM},
+    {NULL, 0}  // Sentinel
+};
+
+// Set up progress parsing for a manager; returns NULL when there is none
+static progress_t* progress_start(trimorph_t* tm, progress_t* progress, const char* manager) {
+    if (!tm->progress) {
+        return NULL;
+    }
+    for (int i = 0; progress_managers[i].manager != NULL; i++) {
+        if (strcmp(progress_managers[i].manager, manager) == 0) {
+            memset(progress, 0, sizeof(*progress));
+            progress->kind = progress_managers[i].kind;
+            progress->manager = progress_managers[i].manager;
+            return progress;
+        }
+    }
+    return NULL;
+}
+
+// Options that make apt or dpkg write status lines to PROGRESS_STATUS_FD
+static const char* const* progress_status_args(const progress_t* progress) {
+    static const char* const apt_args[] = {"-o", "APT::Status-Fd=3", NULL};
+    static const char* const dpkg_args[] = {"--status-fd", "3", NULL};
+    if (progress == NULL) {
+        return NULL;
+    }
+    return progress->kind == PROGRESS_APT ? apt_args : progress->kind == PROGRESS_DPKG ? dpkg_args : NULL;
+}
+
+static void progress_event(trimorph_t* tm, const progress_t* progress, const char* phase, const char* package,
+                           double percent, long long bytes) {
+    trimorph_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = TRIMORPH_EVENT_PROGRESS;
+    event.operation = tm->operation;
+    event.format = tm->format;
+    event.manager = progress->manager;
+    event.refresh = tm->refreshing;
+    event.phase = phase;
+    event.package = package != NULL && package[0] != '\0' ? package : NULL;
+    event.percent = percent;
+    event.bytes = bytes;
+    tm_event(tm, &event);
+}
+
+// Phase of a message, by prefix; the first match wins
+typedef struct {
+    const char* prefix;
+    const char* phase;
+} progress_phase_t;
+
+static const char* progress_phase(const progress_phase_t* phases, const char* text) {
+    for (int i = 0; phases[i].prefix != NULL; i++) {
+        if (strncmp(text, phases[i].prefix, strlen(phases[i].prefix)) == 0) {
+            return phases[i].phase;
+        }
+    }
+    return NULL;
+}
+
+// "<type>:<item>:<percent>:<message>"; the item is a package name, which may itself
+// contain ':' (foo:amd64), or a download number
+static void parse_apt_status(trimorph_t* tm, progress_t* progress, char* line) {
+    static const progress_phase_t phases[] = {
+        {"Preparing for removal", "remove"}, {"Preparing to completely remove", "purge"},
+        {"Preparing to configure", "configure"}, {"Preparing", "prepare"}, {"Unpacking", "unpack"},
+        {"Configuring", "configure"}, {"Installing", "install"}, {"Installed", "installed"},
+        {"Removing", "remove"}, {"Removed", "removed"}, {"Completely removed", "purged"},
+        {"Running post-installation trigger", "trigger"}, {"Processing triggers", "trigger"},
+        {"Running dpkg", "dpkg"}, {NULL, NULL}
+    };
+    char* item = strchr(line, ':');
+    if (item == NULL) {
+        return;
+    }
+    *item++ = '\0';
+    char* sep = strchr(item, ':');
+    double percent = -1;
+    const char* message = "";
+    while (sep != NULL) {
+        char* end;
+        double value = strtod(sep + 1, &end);
+        if (end > sep + 1 && *end == ':') {
+            *sep = '\0';
+            percent = value;
+            message = end + 1;
+            break;
+        }
+        sep = strchr(sep + 1, ':');
+    }
+    if (sep == NULL) {
+        return;
+    }
+
+    if (strcmp(line, "dlstatus") == 0) {
+        progress_event(tm, progress, "download", NULL, percent, -1);
+    } else if (strcmp(line, "pmstatus") == 0) {
+        const char* phase = progress_phase(phases, message);
+        progress_event(tm, progress, phase != NULL ? phase : "status",
+                       strcmp(item, "dpkg-exec") == 0 ? NULL : item, percent, -1);
+    } else if (strcmp(line, "pmerror") == 0) {
+        progress_event(tm, progress, "error", item, percent, -1);
+    } else if (strcmp(line, "pmconffile") == 0) {
+        progress_event(tm, progress, "conffile", item, percent, -1);
+    }
+}
+
+// "processing: <action>: <package>" and "status: <package>: <state>", where the state
+// may be "error : <message>" and the package a conffile path
+static void parse_dpkg_status(trimorph_t* tm, progress_t* progress, char* line) {
+    if (strncmp(line, "processing: ", 12) == 0) {
+        char* action = line + 12;
+        char* package = strstr(action, ": ");
+        if (package != NULL) {
+            *package = '\0';
+            progress_event(tm, progress, action, package + 2, -1, -1);
+        }
+    } else if (strncmp(line, "status: ", 8) == 0) {
+        char* package = line + 8;
+        char* sep = strchr(package, ':');
+        if (sep == NULL) {
+            return;
+        }
+        char* state = sep + 1;
+        while (sep > package && sep[-1] == ' ') sep--;
+        *sep = '\0';
+        state += strspn(state, " ");
+        state[strcspn(state, " :")] = '\0';
+        progress_event(tm, progress, state, package, -1, -1);
+    }
+}
+
+// A "(n/m) " counter at the start of a line, as a percentage; advances *text past it
+static double progress_counter(char** text, char open, char close) {
+    int n, m, used = 0;
+    char format[16];
+    snprintf(format, sizeof(format), "%c%%d/%%d%c%%n", open, close);
+    if (sscanf(*text, format, &n, &m, &used) == 2 && used > 0 && m > 0) {
+        *text += used;
+        *text += strspn(*text, ": ");
+        return 100.0 * n / m;
+    }
+    return -1;
+}
+
+// A download size such as "| 345 kB" or "345.0 KiB"; rates ("1.2 MB/s") are skipped
+static long long progress_bytes(const char* text) {
+    static const struct { const char* unit; double scale; } units[] = {
+        {"B", 1}, {"k", 1e3}, {"kB", 1e3}, {"KiB", 1024}, {"M", 1e6}, {"MB", 1e6}, {"MiB", 1048576},
+        {"G", 1e9}, {"GB", 1e9}, {"GiB", 1073741824}, {NULL, 0}
+    };
+    for (const char* p = text; *p != '\0'; p++) {
+        if (!isdigit((unsigned char)*p) || (p > text && p[-1] != ' ')) {
+            continue;
+        }
+        char* end;
+        double value = strtod(p, &end);
+        if (*end != ' ') {
+            continue;
+        }
+        const char* unit = end + strspn(end, " ");
+        size_t unit_len = strcspn(unit, " ");
+        for (int i = 0; units[i].unit != NULL; i++) {
+            if (unit_len == strlen(units[i].unit) && strncmp(unit, units[i].unit, unit_len) == 0) {
+                return (long long)(value * units[i].scale);
+            }
+        }
+    }
+    return -1;
+}
+
+// pacman prints one line per step without a terminal: "Packages (N) ...",
+// "installing foo...", " foo-1.0 downloading...", "(1/2) <hook>" and so on
+static void parse_pacman(trimorph_t* tm, progress_t* progress, char* line) {
+    static const progress_phase_t steps[] = {
+        {"resolving dependencies", "resolve"}, {"looking for conflicting", "conflicts"},
+        {":: Retrieving packages", "download"}, {"checking keyring", "keyring"},
+        {"checking package integrity", "verify"}, {"loading package files", "load"},
+        {"checking for file conflicts", "conflicts"}, {"checking available disk space", "diskspace"},
+        {":: Processing package changes", "install"}, {":: Running pre-transaction hooks", "hooks"},
+        {":: Running post-transaction hooks", "hooks"}, {NULL, NULL}
+    };
+    static const progress_phase_t verbs[] = {
+        {"installing ", "install"}, {"upgrading ", "upgrade"}, {"reinstalling ", "reinstall"},
+        {"downgrading ", "downgrade"}, {"removing ", "remove"}, {NULL, NULL}
+    };
+    int total;
+    if (sscanf(line, "Packages (%d)", &total) == 1) {
+        progress->total = total;
+        return;
+    }
+    char* text = line;
+    double counter = progress_counter(&text, '(', ')');
+    const char* phase = progress_phase(verbs, text);
+    size_t len = strlen(text);
+    if (phase != NULL) {
+        char* package = strchr(text, ' ') + 1;
+        package[strcspn(package, ". ")] = '\0';
+        if (len > 3 && strcmp(text + len - 3, "...") == 0) {
+            package[strcspn(package, " ")] = '\0';
+        }
+        progress->done++;
+        double percent = counter >= 0 ? counter :
+                         progress->total > 0 ? 100.0 * progress->done / progress->total : -1;
+        progress_event(tm, progress, phase, package, percent, -1);
+    } else if ((phase = progress_phase(steps, text)) != NULL) {
+        progress_event(tm, progress, phase, NULL, counter, -1);
+    } else if (len > 15 && strcmp(text + len - 15, " downloading...") == 0) {
+        text[len - 15] = '\0';
+        progress_event(tm, progress, "download", text + strspn(text, " "), -1, -1);
+    } else if (counter >= 0) {
+        progress_event(tm, progress, "hooks", NULL, counter, -1);
+    }
+}
+
+// dnf and yum: "  Installing  : foo-1.0-1.x86_64  1/3" in the transaction and
+// "(1/3): foo-1.0-1.x86_64.rpm  1.2 MB/s | 345 kB  00:00" per download. dnf5:
+// "[1/3] foo-0:1.0-1.x86_64  100% | 1.2 MiB/s | 345.0 KiB | 00m00s" and
+// "[3/5] Installing foo-0:1.0-1.x86_64  100% | ..."
+static void parse_dnf(trimorph_t* tm, progress_t* progress, char* line) {
+    static const progress_phase_t actions[] = {
+        {"Installing", "install"}, {"Upgrading", "upgrade"}, {"Reinstalling", "reinstall"},
+        {"Downgrading", "downgrade"}, {"Removing", "remove"}, {"Erasing", "remove"},
+        {"Obsoleting", "obsolete"}, {"Cleanup", "cleanup"}, {"Running scriptlet", "scriptlet"},
+        {"Verifying", "verify"}, {"Verify", "verify"}, {"Preparing", "prepare"}, {"Prepare", "prepare"},
+        {NULL, NULL}
+    };
+    char* text = line + strspn(line, " ");
+    double counter = progress_counter(&text, '(', ')');
+    if (counter >= 0) {
+        size_t len = strcspn(text, " ");
+        long long bytes = progress_bytes(text + len);
+        text[len] = '\0';
+        progress_event(tm, progress, "download", text, counter, bytes);
+        return;
+    }
+
+    counter = progress_counter(&text, '[', ']');
+    const char* phase = progress_phase(actions, text);
+    if (counter >= 0) {
+        // dnf5 reports the percentage of each item; downloads name the package first
+        char* percent_at = strchr(text, '%');
+        double percent = counter;
+        if (percent_at != NULL) {
+            char* start = percent_at;
+            while (start > text && (isdigit((unsigned char)start[-1]) || start[-1] == '.')) start--;
+            percent = start < percent_at ? strtod(start, NULL) : counter;
+        }
+        long long bytes = phase == NULL ? progress_bytes(text) : -1;
+        char* package = phase != NULL ? strchr(text, ' ') : text;
+        if (package != NULL) {
+            package += strspn(package, " ");
+            package[strcspn(package, " ")] = '\0';
+        }
+        progress_event(tm, progress, phase != NULL ? phase : "download", package, percent, bytes);
+        return;
+    }
+
+    char* colon = strchr(text, ':');
+    if (phase != NULL && colon != NULL) {
+        size_t end = strlen(colon);
+        while (end > 0 && colon[end - 1] == ' ') colon[--end] = '\0';
+        char* last = strrchr(colon, ' ');
+        int n, m;
+        double percent = last != NULL && sscanf(last + 1, "%d/%d", &n, &m) == 2 && m > 0 ? 100.0 * n / m : -1;
+        char* package = colon + 1 + strspn(colon + 1, " ");
+        if (last != NULL && package >= last + 1) {
+            package = NULL;  // Only the counter follows, as for "Preparing"
+        } else {
+            package[strcspn(package, " ")] = '\0';
+        }
+        progress_event(tm, progress, phase, package, percent, -1);
+    }
+}
+
+// rpm -h: "Preparing...  ###### [100%]", then "   1:foo-1.0-1  ###### [100%]" per
+// package; rpm --percent: "%% 12.500000"
+static void parse_rpm(trimorph_t* tm, progress_t* progress, char* line) {
+    static const progress_phase_t steps[] = {
+        {"Verifying...", "verify"}, {"Preparing...", "prepare"}, {"Updating / installing...", "install"},
+        {"Cleaning up / removing...", "remove"}, {NULL, NULL}
+    };
+    if (strncmp(line, "%% ", 3) == 0) {
+        progress_event(tm, progress, "install", NULL, strtod(line + 3, NULL), -1);
+        return;
+    }
+    char* bracket = strrchr(line, '[');
+    const char* value = bracket != NULL ? bracket + 1 + strspn(bracket + 1, " ") : NULL;
+    double percent = value != NULL && isdigit((unsigned char)*value) ? strtod(value, NULL) : -1;
+    const char* phase = progress_phase(steps, line);
+    if (phase != NULL) {
+        progress->removing = strcmp(phase, "remove") == 0;
+        progress_event(tm, progress, phase, NULL, percent, -1);
+        return;
+    }
+    char* text = line + strspn(line, " ");
+    char* colon = strchr(text, ':');
+    if (colon != NULL && colon > text && strspn(text, "0123456789") == (size_t)(colon - text) && percent >= 0) {
+        char* package = colon + 1;
+        package[strcspn(package, " ")] = '\0';
+        progress_event(tm, progress, progress->removing ? "remove" : "install", package, percent, -1);
+    }
+}
+
+// Feed bytes from the child to the parser. Lines end at '\n' or '\r' (progress bars
+// redraw with '\r'); at most sizeof(line) bytes of each are kept.
+static void progress_feed(trimorph_t* tm, progress_t* progress, const char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n' && data[i] != '\r') {
+            if (progress->len < sizeof(progress->line) - 1) {
+                progress->line[progress->len++] = data[i];
+            }
+            continue;
+        }
+        if (progress->len == 0) {
+            continue;
+        }
+        progress->line[progress->len] = '\0';
+        progress->len = 0;
+        switch (progress->kind) {
+        case PROGRESS_APT:
+            parse_apt_status(tm, progress, progress->line);
+            break;
+        case PROGRESS_DPKG:
+            parse_dpkg_status(tm, progress, progress->line);
+            break;
+        case PROGRESS_PACMAN:
+            parse_pacman(tm, progress, progress->line);
+            break;
+        case PROGRESS_DNF:
+            parse_dnf(tm, progress, progress->line);
+            break;
+        case PROGRESS_RPM:
+            parse_rpm(tm, progress, progress->line);
+            break;
+        }
+    }
+}
+
+// Write all of a buffer, for passing a child's output through
+static void write_through(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Relay a child's pipes until they close. Captured stdout and stderr go to the output
+// callback. With progress parsing, stdout is also parsed (and written straight through
+// first when there is no output callback), and so is the status pipe. The status pipe
+// is closed once the child exits, even if a daemon it started still holds it open.
+static void relay_child(trimorph_t* tm, pid_t pid, int out_fd, int err_fd, int status_fd, progress_t* progress) {
+    struct pollfd fds[3] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}, {status_fd, POLLIN, 0}};
+    int open_fds = (out_fd >= 0) + (err_fd >= 0) + (status_fd >= 0);
+    char buf[4096];
+    while (open_fds > 0) {
+        int ready = poll(fds, 3, fds[2].fd >= 0 ? 200 : -1);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[2].fd >= 0 && ready == 0) {
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) {
+                // Parse what is left without waiting for other holders to close it
+                fcntl(fds[2].fd, F_SETFL, O_NONBLOCK);
+                ssize_t n;
+                while ((n = read(fds[2].fd, buf, sizeof(buf))) > 0) {
+                    progress_feed(tm, progress, buf, (size_t)n);
+                }
+                close(fds[2].fd);
+                fds[2].fd = -1;
+                open_fds--;
+            }
+        }
+        for (int i = 0; ready > 0 && i < 3; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                if (i < 2 && tm->output_cb != NULL) {
+                    tm->output_cb(i + 1, buf, (size_t)n, tm->output_user);
+                } else if (i == 0) {
+                    write_through(STDOUT_FILENO, buf, (size_t)n);
+                }
+                if (progress != NULL && (i == 2 || (i == 0 && progress_status_args(progress) == NULL))) {
+                    progress_feed(tm, progress, buf, (size_t)n);
+                }
+            } else if (n == 0 || errno != EINTR) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_fds--;
+            }
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    }
+    if (progress != NULL) {
+        progress_feed(tm, progress, "\n", 1);  // A last line without a newline
+    }
+}
+
+// Fork and exec a package manager (searching PATH) and wait for it. envp replaces the
+// environment when not NULL; progress, when not NULL, parses its status descriptor or
+// stdout. Sets *exit_code to the exit code, or -1 if the child terminated abnormally.
+static int spawn(trimorph_t* tm, const char* file, char* const args[], char* const envp[], progress_t* progress,
+                 int* exit_code) {
+    *exit_code = -1;
+    int out[2] = {-1, -1};
+    int err[2] = {-1, -1};
+    int status_pipe[2] = {-1, -1};
+    int parse_stdout = progress != NULL && progress_status_args(progress) == NULL;
+    if (((tm->output_cb != NULL || parse_stdout) && pipe2(out, O_CLOEXEC) != 0) ||
+        (tm->output_cb != NULL && pipe2(err, O_CLOEXEC) != 0) ||
+        (progress != NULL && !parse_stdout && pipe2(status_pipe, O_CLOEXEC) != 0)) {
+        // strerror() shares one buffer between threads; with _GNU_SOURCE strerror_r returns the text
+        char reason[128];
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Cannot create output pipes: %s", strerror_r(errno, reason, sizeof(reason)));
+        for (int i = 0; i < 2; i++) {
+            if (out[i] >= 0) close(out[i]);
+            if (err[i] >= 0) close(err[i]);
+            if (status_pipe[i] >= 0) close(status_pipe[i]);
+        }
+        return TRIMORPH_ERR_SYSTEM;
+    }
+
+    // Everything the child needs is prepared here: after fork() in a multithreaded
+    // caller only async-signal-safe calls are allowed
+    char exec_error[128];
+    int exec_error_len = snprintf(exec_error, sizeof(exec_error), "Error: Cannot execute %s\n", file);
+    if (exec_error_len >= (int)sizeof(exec_error)) exec_error_len = sizeof(exec_error) - 1;
+
+    low_impact_t li;
+    low_impact_before_fork(tm, &li);
+    if (tm->output_cb == NULL) {
+        fflush(stdout);  // The child shares our stdout; keep the caller's output in order
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        low_impact_in_child(&li);
+        if (out[1] >= 0) {
+            dup2(out[1], STDOUT_FILENO);
+        }
+        if (err[1] >= 0) {
+            dup2(err[1], STDERR_FILENO);
+        }
+        if (status_pipe[1] == PROGRESS_STATUS_FD) {
+            fcntl(status_pipe[1], F_SETFD, 0);
+        } else if (status_pipe[1] >= 0) {
+            dup2(status_pipe[1], PROGRESS_STATUS_FD);
+        }
+        if (envp != NULL) {
+            execvpe(file, args, envp);
+        } else {
+            execvp(file, args);
+        }
+        if (write(STDERR_FILENO, exec_error, (size_t)exec_error_len) < 0) {
+            // Nothing more can be reported
+        }
+        _exit(127); // Standard exit code for command not found/exec error
+    }
+
+    int saved_errno = errno;
+    if (out[1] >= 0) close(out[1]);
+    if (err[1] >= 0) close(err[1]);
+    if (status_pipe[1] >= 0) close(status_pipe[1]);
+    low_impact_after_fork(&li, pid);
+    if (pid < 0) {
+        if (out[0] >= 0) close(out[0]);
+        if (err[0] >= 0) close(err[0]);
+        if (status_pipe[0] >= 0) close(status_pipe[0]);
+        char reason[128];
+        tm_message(tm, TRIMORPH_MSG_ERROR, "fork failed: %s", strerror_r(saved_errno, reason, sizeof(reason)));
+        return TRIMORPH_ERR_SYSTEM;
+    }
+    if (out[0] >= 0 || err[0] >= 0 || status_pipe[0] >= 0) {
+        relay_child(tm, pid, out[0], err[0], status_pipe[0], progress);
+    }
+
+    int status;
+    if (low_impact_wait(tm, &li, pid, &status) < 0) {
+        return TRIMORPH_ERR_SYSTEM;
+    }
+    if (WIFEXITED(status)) {
+        *exit_code = WEXITSTATUS(status);
+    }
+    return TRIMORPH_OK;
+}
+
+// Account package manager runtime to the operation in progress
+static void note_runtime(trimorph_t* tm, const char* manager, const char* command, double seconds) {
+    trimorph_result_t* r = tm->result;
+    if (r == NULL || tm->refreshing) {
+        return;
+    }
+    r->runtime_seconds += seconds;
+    if (r->manager[0] == '\0') {
+        snprintf(r->manager, sizeof(r->manager), "%s", manager);
+        snprintf(r->command, sizeof(r->command), "%s", command);
+    }
+}
+
+// Insert the --root option of the package manager that starts each "||"/"&&" segment
+// of a shell command, so table commands like "apt update" act on the target root
+int trimorph_root_command(trimorph_t* tm, const char* cmd, char* out, size_t out_len) {
+    size_t used = 0;
+    const char* p = cmd;
+    out[0] = '\0';
+    if (!has_root(tm)) {
+        return snprintf(out, out_len, "%s", cmd) < (int)out_len ? TRIMORPH_OK : TRIMORPH_ERR_INVALID;
+    }
+
+    while (*p != '\0') {
+        // Copy leading whitespace and find the first word of the segment
+        while (*p == ' ') {
+            if (used + 1 >= out_len) return TRIMORPH_ERR_INVALID;
+            out[used++] = *p++;
+        }
+        size_t word_len = strcspn(p, " ");
+        char word[64];
+        if (word_len >= sizeof(word)) word_len = sizeof(word) - 1;
+        memcpy(word, p, word_len);
+        word[word_len] = '\0';
+
+        // Segment ends at the next shell list operator
+        const char* end = p;
+        while (*end != '\0' && strncmp(end, "||", 2) != 0 && strncmp(end, "&&", 2) != 0) {
+            end++;
+        }
+        if (*end != '\0') end += 2;
+
+        const pm_root_t* r = find_pm_root(word);
+        int n;
+        if (r != NULL && r->root_flag != NULL) {
+            n = snprintf(out + used, out_len - used, "%s %s%s'%s'%.*s", word, r->root_flag,
+                         r->joined ? "=" : " ", tm->root, (int)(end - p - word_len), p + word_len);
+        } else if (r != NULL) {
+            n = snprintf(out + used, out_len - used, "ROOT='%s' %.*s", tm->root, (int)(end - p), p);
+        } else {
+            n = snprintf(out + used, out_len - used, "%.*s", (int)(end - p), p);
+        }
+        if (n < 0 || (size_t)n >= out_len - used) {
+            return TRIMORPH_ERR_INVALID;
+        }
+        used += n;
+        p = end;
+    }
+    return TRIMORPH_OK;
+}
+
+// Execute a package manager shell command against the selected root. Returns its exit
+// code, or -1 if it could not be run or terminated abnormally.
+static int run_shell_command(trimorph_t* tm, const char* cmd) {
+    char rooted[MAX_PATH * 10];
+    if (trimorph_root_command(tm, cmd, rooted, sizeof(rooted)) != TRIMORPH_OK) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Command too long after applying root %s", tm->root);
+        return -1;
+    }
+
+    char manager[16];
+    snprintf(manager, sizeof(manager), "%.*s", (int)strcspn(cmd, " "), cmd);
+    trimorph_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = TRIMORPH_EVENT_COMMAND_START;
+    event.operation = tm->operation;
+    event.format = tm->format;
+    event.manager = manager;
+    event.command = rooted;
+    event.refresh = tm->refreshing;
+    event.dry_run = tm->dry_run;
+    tm_event(tm, &event);
+    if (tm->dry_run) {
+        return 0;
+    }
+
+    // apt and dpkg get their status descriptor option after the command word
+    progress_t progress_state;
+    progress_t* progress = progress_start(tm, &progress_state, manager);
+    const char* const* status_args = progress_status_args(progress);
+    char with_status[sizeof(rooted) + 32];
+    if (status_args != NULL) {
+        int word = (int)strcspn(rooted, " ");
+        snprintf(with_status, sizeof(with_status), "%.*s %s %s%s", word, rooted, status_args[0], status_args[1],
+                 rooted + word);
+    }
+
+    // Shell commands come from the format table, so "||" fallbacks work; bash runs
+    // without profile or rc files so the user's shell setup cannot change them
+    char* const args[] = {"bash", "--noprofile", "--norc", "-c", status_args != NULL ? with_status : rooted, NULL};
+    double start = now_seconds();
+    int exit_code;
+    spawn(tm, "/bin/bash", args, NULL, progress, &exit_code);
+    double elapsed = now_seconds() - start;
+
+    event.type = TRIMORPH_EVENT_COMMAND_DONE;
+    event.exit_code = exit_code;
+    event.seconds = elapsed;
+    tm_event(tm, &event);
+    note_runtime(tm, manager, rooted, elapsed);
+    return exit_code;
+}
+
+// Command availability checker that handles both command names and full paths
+int trimorph_command_available(trimorph_t* tm, const char* cmd) {
+    if (cmd[0] == '\0' || trimorph_check_command_name(cmd) != TRIMORPH_OK) {
+        return 0;
+    }
+
+    // Check if this is a full path (contains '/')
+    if (strchr(cmd, '/') != NULL) {
+        return access(cmd, X_OK) == 0;
+    }
+
+    pthread_mutex_lock(&tm->cache_lock);
+    for (int i = 0; i < tm->cache_count; i++) {
+        if (strcmp(tm->cache[i].name, cmd) == 0) {
+            int available = tm->cache[i].available;
+            pthread_mutex_unlock(&tm->cache_lock);
+            return available;
+        }
+    }
+    pthread_mutex_unlock(&tm->cache_lock);
+
+    // Search PATH like the shell's "command -v", without starting a shell
+    const char* path = getenv("PATH");
+    if (path == NULL || path[0] == '\0') {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    int available = 0;
+    while (!available && *path != '\0') {
+        size_t dir_len = strcspn(path, ":");
+        char candidate[MAX_PATH];
+        struct stat st;
+        if (snprintf(candidate, sizeof(candidate), "%.*s/%s", dir_len > 0 ? (int)dir_len : 1,
+                     dir_len > 0 ? path : ".", cmd) < (int)sizeof(candidate)) {
+            available = stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0;
+        }
+        path += dir_len;
+        if (*path == ':') path++;
+    }
+
+    pthread_mutex_lock(&tm->cache_lock);
+    if (tm->cache_count < MAX_CACHED_COMMANDS && strlen(cmd) < sizeof(tm->cache[0].name)) {
+        snprintf(tm->cache[tm->cache_count].name, sizeof(tm->cache[0].name), "%s", cmd);
+        tm->cache[tm->cache_count++].available = available;
+    }
+    pthread_mutex_unlock(&tm->cache_lock);
+    return available;
+}
+
+// Check whether a lock file is held. pacman's db.lck exists only while held, pid files
+// name their owner, and the remaining lock files are probed for an fcntl write lock
+static int is_lock_file_held(const char* path) {
+    const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    if (strcmp(name, "db.lck") == 0) {
+        return access(path, F_OK) == 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    int held = 0;
+    if (strstr(name, ".pid") != NULL) {
+        char buf[32];
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        if (n > 0) {
+            buf[n] = '\0';
+            pid_t owner = (pid_t)atoi(buf);
+            held = owner > 0 && (kill(owner, 0) == 0 || errno == EPERM);
+        }
+    } else {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        held = fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+    }
+    close(fd);
+    return held;
+}
+
+// Check the lock files of every known package manager inside the target root. A lock
+// path that does not fit cannot be checked, so the root counts as locked.
+static int is_root_locked(const char* root) {
+    for (int i = 0; pm_roots[i].pm != NULL; i++) {
+        for (int j = 0; j < 3 && pm_roots[i].lock_files[j] != NULL; j++) {
+            char path[MAX_PATH];
+            int len = snprintf(path, sizeof(path), "%s/%s", root, pm_roots[i].lock_files[j]);
+            if (len < 0 || (size_t)len >= sizeof(path) || is_lock_file_held(path)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+const char* trimorph_lock_file(size_t index) {
+    for (int i = 0; pm_roots[i].pm != NULL; i++) {
+        for (int j = 0; j < 3 && pm_roots[i].lock_files[j] != NULL; j++) {
+            if (index-- == 0) {
+                return pm_roots[i].lock_files[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+int trimorph_is_manager_process(const char* name) {
+    for (int i = 0; pm_process_names[i] != NULL; i++) {
+        if (strcmp(name, pm_process_names[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Look for a running package manager on the host, or for held locks in the target root
+static int detect_running_package_manager(const trimorph_t* tm) {
+    // Image roots are independent of the host, so only their own locks matter
+    if (has_root(tm)) {
+        return is_root_locked(tm->root);
+    }
+
+    // Match process names the way "pgrep -x" does, reading /proc directly
+    DIR* d = opendir("/proc");
+    if (d == NULL) {
+        return 0;
+    }
+    int running = 0;
+    struct dirent* de;
+    while (!running && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] < '1' || de->d_name[0] > '9') {
+            continue;
+        }
+        char path[300];
+        char name[32];
+        snprintf(path, sizeof(path), "/proc/%s/comm", de->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t n = read(fd, name, sizeof(name) - 1);
+        close(fd);
+        if (n > 0) {
+            name[n] = '\0';
+            name[strcspn(name, "\n")] = '\0';
+            running = trimorph_is_manager_process(name);
+        }
+    }
+    closedir(d);
+    return running;
+}
+
+// Check if any other package manager is currently running to prevent conflicts
+int trimorph_conflict(trimorph_t* tm) {
+    double start = now_seconds();
+    int running = detect_running_package_manager(tm);
+    double elapsed = now_seconds() - start;
+    if (tm->result != NULL) {
+        tm->result->wait_seconds += elapsed;
+    }
+
+    trimorph_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = TRIMORPH_EVENT_CONFLICT_CHECK;
+    event.operation = tm->operation;
+    event.format = tm->format;
+    event.conflict = running;
+    event.dry_run = tm->dry_run;
+    event.seconds = elapsed;
+    tm_event(tm, &event);
+    return running;
+}
+
+// Abort an operation while another package manager is running. A dry run only reports
+// the lock state and carries on, so the whole plan is shown.
+static int check_conflicts(trimorph_t* tm) {
+    if (tm->skip_conflict_check) {
+        return TRIMORPH_OK;
+    }
+    if (trimorph_conflict(tm) && !tm->dry_run) {
+        tm_message(tm, TRIMORPH_MSG_ERROR,
+                   "Another package manager is currently running, aborting to prevent conflicts");
+        return TRIMORPH_ERR_CONFLICT;
+    }
+    return TRIMORPH_OK;
+}
+
+// Refresh the package lists of a format before installing. Each refresh command runs
+// at most once per context, so installing several packages of one format refreshes once.
+static int refresh_package_lists(trimorph_t* tm, const pkg_format_t* format) {
+    trimorph_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = TRIMORPH_EVENT_REFRESH_SKIPPED;
+    event.operation = tm->operation;
+    event.format = format->ext;
+    event.command = format->update_cmd;
+    event.dry_run = tm->dry_run;
+
+    if (format->update_cmd == NULL) {
+        event.reason = "unsupported";
+        tm_event(tm, &event);
+        return -1;
+    }
+    for (int i = 0; i < tm->refreshed_count; i++) {
+        if (strcmp(tm->refreshed[i], format->update_cmd) == 0) {
+            event.reason = "coalesced";
+            tm_event(tm, &event);
+            tm->result->refresh = TRIMORPH_REFRESH_COALESCED;
+            return 0;
+        }
+    }
+
+    if (!tm->dry_run) {
+        tm_message(tm, TRIMORPH_MSG_INFO, "Updating %s dependencies...", format->ext);
+    }
+    double start = now_seconds();
+    tm->refreshing = 1;
+    int result = run_shell_command(tm, format->update_cmd);
+    tm->refreshing = 0;
+    tm->result->refresh_seconds += now_seconds() - start;
+    if (result != 0) {
+        tm_message(tm, TRIMORPH_MSG_WARNING, "Failed to update dependencies for %s format", format->ext);
+        tm->result->refresh = TRIMORPH_REFRESH_FAILED;
+        return -1;
+    }
+    if (tm->refreshed_count < MAX_REFRESHED) {
+        tm->refreshed[tm->refreshed_count++] = format->update_cmd;
+    }
+    tm->result->refresh = TRIMORPH_REFRESH_RAN;
+    return 0;
+}
+
+// Validate file path to prevent directory traversal and other attacks
+int trimorph_check_path(const char* path, const char** problem) {
+    const char* reason = NULL;
+    if (path == NULL || path[0] == '\0') {
+        reason = "Invalid file path";
+    } else if (strstr(path, "../") || strstr(path, "..\\")) {
+        reason = "Invalid file path containing directory traversal";
+    } else if (strlen(path) >= MAX_PATH) {
+        reason = "File path too long";
+    }
+    if (problem != NULL) {
+        *problem = reason;
+    }
+    return reason == NULL ? TRIMORPH_OK : TRIMORPH_ERR_INVALID;
+}
+
+// Command name validation: only alphanumeric characters, hyphens, underscores, dots
+// and slashes, so the name cannot inject shell syntax
+int trimorph_check_command_name(const char* name) {
+    if (name == NULL) {
+        return TRIMORPH_ERR_INVALID;
+    }
+    const char* valid_cmd_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./";
+    for (const char* p = name; *p != '\0'; p++) {
+        if (strchr(valid_cmd_chars, *p) == NULL) {
+            return TRIMORPH_ERR_INVALID;
+        }
+    }
+    return TRIMORPH_OK;
+}
+
+// Find the package format whose extension ends the file name, preferring compound
+// extensions like .pkg.tar.zst
+static const pkg_format_t* find_pkg_format(const char* pkg_file) {
+    const pkg_format_t* best = NULL;
+    size_t len = strlen(pkg_file);
+    for (int i = 0; pkg_formats[i].ext != NULL; i++) {
+        size_t ext_len = strlen(pkg_formats[i].ext);
+        if (len > ext_len && strcmp(pkg_file + len - ext_len, pkg_formats[i].ext) == 0 &&
+            (best == NULL || ext_len > strlen(best->ext))) {
+            best = &pkg_formats[i];
+        }
+    }
+    return best;
+}
+
+const char* trimorph_detect_format(const char* file) {
+    const pkg_format_t* format = file != NULL ? find_pkg_format(file) : NULL;
+    return format != NULL ? format->ext : NULL;
+}
+
+const char* trimorph_format_at(size_t index) {
+    for (size_t i = 0; pkg_formats[i].ext != NULL; i++) {
+        if (i == index) {
+            return pkg_formats[i].ext;
+        }
+    }
+    return NULL;
+}
+
+// Install .deb packages with apt so dependencies are pulled in; dpkg --root is the
+// reliable way to install a local .deb into an image root
+static int resolve_deb(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len) {
+    if (!trimorph_command_available(tm, "dpkg") && !trimorph_command_available(tm, "apt")) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Neither dpkg nor apt is available");
+        return TRIMORPH_ERR_UNAVAILABLE;
+    }
+    if (trimorph_command_available(tm, "apt") && !has_root(tm)) {
+        snprintf(cmd, len, "apt install -y %s", files);
+    } else {
+        snprintf(cmd, len, format->install_cmd, files);
+    }
+    return TRIMORPH_OK;
+}
+
+// Prefer dnf, then yum, so dependencies are resolved; plain rpm -i otherwise
+static int resolve_rpm(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len) {
+    if (!trimorph_command_available(tm, "rpm")) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "rpm is not available");
+        return TRIMORPH_ERR_UNAVAILABLE;
+    }
+    if (trimorph_command_available(tm, "dnf")) {
+        snprintf(cmd, len, "dnf install -y %s", files);
+    } else if (trimorph_command_available(tm, "yum")) {
+        snprintf(cmd, len, "yum install -y %s", files);
+    } else {
+        snprintf(cmd, len, format->install_cmd, files);
+    }
+    return TRIMORPH_OK;
+}
+
+// Formats with a single package manager use the table's install command
+static int resolve_default(trimorph_t* tm, const pkg_format_t* format, const char* files, char* cmd, size_t len) {
+    if (!trimorph_command_available(tm, format->manager)) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "%s is not available", format->manager);
+        return TRIMORPH_ERR_UNAVAILABLE;
+    }
+    snprintf(cmd, len, format->install_cmd, files);
+    return TRIMORPH_OK;
+}
+
+static void tips_deb(trimorph_t* tm, const pkg_format_t* format) {
+    if (trimorph_command_available(tm, "apt")) {
+        tm_message(tm, TRIMORPH_MSG_TIP, "Try running '%s' to refresh package lists, then try again", format->update_cmd);
+    }
+}
+
+static void tips_rpm(trimorph_t* tm, const pkg_format_t* format) {
+    if (trimorph_command_available(tm, "dnf")) {
+        tm_message(tm, TRIMORPH_MSG_TIP, "Try running 'dnf check-update' to refresh package lists, then try again");
+    } else if (trimorph_command_available(tm, "yum")) {
+        tm_message(tm, TRIMORPH_MSG_TIP, "Try running 'yum check-update' to refresh package lists, then try again");
+    }
+    tm_message(tm, TRIMORPH_MSG_TIP, "Check for package conflicts with '%s', and resolve them first",
+               format->check_conflicts_cmd);
+}
+
+static void tips_default(trimorph_t* tm, const pkg_format_t* format) {
+    tm_message(tm, TRIMORPH_MSG_TIP, "Try running '%s' to refresh package lists, then try again", format->update_cmd);
+    tm_message(tm, TRIMORPH_MSG_TIP, "Check for package conflicts with '%s', and resolve them first",
+               format->check_conflicts_cmd);
+}
+
+// Quote package files as shell words. Names without a slash get a "./" prefix, as
+// apt only treats arguments containing one as local files.
+static int quote_files(const char* const files[], int count, char* out, size_t len) {
+    size_t used = 0;
+    out[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        const char* prefix = strchr(files[i], '/') == NULL ? "./" : "";
+        if (used + strlen(prefix) + 4 >= len) {
+            return TRIMORPH_ERR_INVALID;
+        }
+        used += snprintf(out + used, len - used, "%s'%s", i > 0 ? " " : "", prefix);
+        for (const char* p = files[i]; *p != '\0'; p++) {
+            // A quote ends the quoted word, adds an escaped quote and reopens it
+            const char* piece = *p == '\'' ? "'\\''" : NULL;
+            size_t piece_len = piece != NULL ? strlen(piece) : 1;
+            if (used + piece_len + 2 >= len) {
+                return TRIMORPH_ERR_INVALID;
+            }
+            if (piece != NULL) {
+                memcpy(out + used, piece, piece_len);
+            } else {
+                out[used] = *p;
+            }
+            used += piece_len;
+        }
+        out[used++] = '\'';
+        out[used] = '\0';
+    }
+    return TRIMORPH_OK;
+}
+
+int trimorph_resolve_install(trimorph_t* tm, const char* file, char* command, size_t len) {
+    const pkg_format_t* format = file != NULL ? find_pkg_format(file) : NULL;
+    if (format == NULL) {
+        return TRIMORPH_ERR_UNSUPPORTED;
+    }
+    char files[MAX_PATH * 2];
+    char cmd[MAX_PATH * 2 + 64];
+    int status = quote_files(&file, 1, files, sizeof(files));
+    if (status == TRIMORPH_OK) {
+        status = format->resolve(tm, format, files, cmd, sizeof(cmd));
+    }
+    if (status != TRIMORPH_OK) {
+        return status;
+    }
+    return trimorph_root_command(tm, cmd, command, len);
+}
+
+const char* trimorph_format_manager(const char* file) {
+    const pkg_format_t* format = file != NULL ? find_pkg_format(file) : NULL;
+    return format != NULL ? format->manager : NULL;
+}
+
+// Start an operation, directing timings and errors to its result
+static void begin_operation(trimorph_t* tm, const char* operation, trimorph_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    result->exit_code = -1;
+    tm->operation = operation;
+    tm->format = NULL;
+    tm->result = result;
+}
+
+static int end_operation(trimorph_t* tm, int status) {
+    tm->result->status = status;
+    tm->result = NULL;
+    tm->operation = NULL;
+    tm->format = NULL;
+    return status;
+}
+
+// Install local package files in one package manager transaction: check for
+// conflicts, resolve the install command, refresh the package lists and run it
+static int install_packages(trimorph_t* tm, const char* const files[], int count) {
+    if (count < 1) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "No package files given");
+        return TRIMORPH_ERR_INVALID;
+    }
+
+    const pkg_format_t* format = NULL;
+    for (int i = 0; i < count; i++) {
+        const char* problem;
+        if (trimorph_check_path(files[i], &problem) != TRIMORPH_OK) {
+            tm_message(tm, TRIMORPH_MSG_ERROR, "%s", problem);
+            return TRIMORPH_ERR_INVALID;
+        }
+
+        // A dry run may name packages that only exist once earlier steps have run
+        struct stat st;
+        if (!tm->dry_run && stat(files[i], &st) != 0) {
+            tm_message(tm, TRIMORPH_MSG_ERROR, "Package file does not exist: %s", files[i]);
+            return TRIMORPH_ERR_NOT_FOUND;
+        }
+
+        // Determine the package format from the longest matching extension
+        const pkg_format_t* file_format = find_pkg_format(files[i]);
+        if (file_format == NULL) {
+            const char* ext = strrchr(files[i], '.');
+            if (ext == NULL) {
+                tm_message(tm, TRIMORPH_MSG_ERROR, "Cannot determine package format for: %s", files[i]);
+            } else {
+                tm_message(tm, TRIMORPH_MSG_ERROR, "Unsupported package format: %s", ext);
+            }
+            return TRIMORPH_ERR_UNSUPPORTED;
+        }
+        if (format != NULL && strcmp(file_format->install_cmd, format->install_cmd) != 0) {
+            tm_message(tm, TRIMORPH_MSG_ERROR, "%s and %s packages cannot be installed in one transaction",
+                       format->ext, file_format->ext);
+            return TRIMORPH_ERR_INVALID;
+        }
+        if (format == NULL) {
+            format = file_format;
+        }
+    }
+    tm->format = tm->result->format = format->ext;
+
+    int status = check_conflicts(tm);
+    if (status != TRIMORPH_OK) {
+        return status;
+    }
+    char quoted[MAX_PATH * 8];
+    char cmd[MAX_PATH * 8 + 64];
+    if (quote_files(files, count, quoted, sizeof(quoted)) != TRIMORPH_OK) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Too many package files for one command");
+        return TRIMORPH_ERR_INVALID;
+    }
+    status = format->resolve(tm, format, quoted, cmd, sizeof(cmd));
+    if (status != TRIMORPH_OK) {
+        return status;
+    }
+
+    // A failed refresh is only a warning; the install may still succeed
+    if (refresh_package_lists(tm, format) != 0) {
+        tm_message(tm, TRIMORPH_MSG_WARNING, "Could not update %s dependencies", format->label);
+    }
+    if (format->note != NULL) {
+        tm_message(tm, TRIMORPH_MSG_NOTE, "%s", format->note);
+        tm_message(tm, TRIMORPH_MSG_NOTE, "Installing binary package%s: %s", count == 1 ? "" : "s", quoted);
+    }
+
+    int exit_code = run_shell_command(tm, cmd);
+    tm->result->exit_code = exit_code;
+    if (exit_code != 0) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Installation failed with exit code %d", exit_code);
+        format->tips(tm, format);
+        return TRIMORPH_ERR_FAILED;
+    }
+    return TRIMORPH_OK;
+}
+
+int trimorph_install(trimorph_t* tm, const char* file, trimorph_result_t* result) {
+    trimorph_result_t local;
+    begin_operation(tm, "install", result != NULL ? result : &local);
+    return end_operation(tm, install_packages(tm, &file, 1));
+}
+
+int trimorph_install_batch(trimorph_t* tm, const char* const files[], int count, trimorph_result_t* result) {
+    trimorph_result_t local;
+    begin_operation(tm, "install", result != NULL ? result : &local);
+    return end_operation(tm, install_packages(tm, files, count));
+}
+
+// Quote arguments the shell would split, for showing an argv as one line
+static void format_argv(char* line, size_t len, const char* root_env, char* const args[]) {
+    size_t used = 0;
+    line[0] = '\0';
+    if (root_env != NULL) {
+        used = snprintf(line, len, "ROOT='%s' ", root_env);
+    }
+    for (int i = 0; args[i] != NULL && used < len; i++) {
+        int quote = args[i][0] == '\0' || strpbrk(args[i], " \t'\"$*?;&|<>()\\") != NULL;
+        used += snprintf(line + used, len - used, "%s%s%s%s", i > 0 ? " " : "",
+                         quote ? "'" : "", args[i], quote ? "'" : "");
+    }
+}
+
+// Copy the environment with ROOT set, for managers that take the root from it
+static char** root_environment(const char* root, char* root_var, size_t root_var_len) {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char** envp = malloc((count + 2) * sizeof(char*));
+    if (envp == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "ROOT=", 5) != 0) {
+            envp[n++] = environ[i];
+        }
+    }
+    snprintf(root_var, root_var_len, "ROOT=%s", root);
+    envp[n++] = root_var;
+    envp[n] = NULL;
+    return envp;
+}
+
+// Execute a package manager command directly, searching PATH
+static int run_manager(trimorph_t* tm, const char* pm_name, int argc, char* const argv[]) {
+    // Validate command name to prevent injection
+    if (trimorph_check_command_name(pm_name) != TRIMORPH_OK || pm_name[0] == '\0') {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Invalid package manager name: %s", pm_name != NULL ? pm_name : "");
+        return TRIMORPH_ERR_INVALID;
+    }
+    snprintf(tm->result->manager, sizeof(tm->result->manager), "%s", pm_name);
+
+    int status = check_conflicts(tm);
+    if (status != TRIMORPH_OK) {
+        return status;
+    }
+    if (!trimorph_command_available(tm, pm_name)) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Package manager '%s' is not available", pm_name);
+        return TRIMORPH_ERR_UNAVAILABLE;
+    }
+
+    char** exec_args = malloc((argc + 6) * sizeof(char*));
+    if (exec_args == NULL) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Memory allocation failed");
+        return TRIMORPH_ERR_SYSTEM;
+    }
+    int n = 0;
+    exec_args[n++] = (char*)pm_name;
+
+    // Point the package manager at the target root before its own arguments
+    char joined_root[MAX_PATH + 32];
+    const pm_root_t* r = has_root(tm) ? find_pm_root(pm_name) : NULL;
+    int root_env = 0;
+    if (r != NULL && r->root_flag != NULL && r->joined) {
+        snprintf(joined_root, sizeof(joined_root), "%s=%s", r->root_flag, tm->root);
+        exec_args[n++] = joined_root;
+    } else if (r != NULL && r->root_flag != NULL) {
+        exec_args[n++] = (char*)r->root_flag;
+        exec_args[n++] = tm->root;
+    } else if (has_root(tm)) {
+        root_env = 1;
+    }
+    for (int i = 0; i < argc; i++) {
+        exec_args[n++] = argv[i];
+    }
+    exec_args[n] = NULL;
+
+    char line[MAX_PATH * 2];
+    format_argv(line, sizeof(line), root_env ? tm->root : NULL, exec_args);
+    snprintf(tm->result->command, sizeof(tm->result->command), "%.1023s", line);
+
+    // The status descriptor option is not part of the command as shown and recorded
+    progress_t progress_state;
+    progress_t* progress = progress_start(tm, &progress_state, pm_name);
+    const char* const* status_args = progress_status_args(progress);
+    if (status_args != NULL) {
+        memmove(exec_args + 3, exec_args + 1, n * sizeof(char*));
+        exec_args[1] = (char*)status_args[0];
+        exec_args[2] = (char*)status_args[1];
+    }
+
+    trimorph_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = TRIMORPH_EVENT_COMMAND_START;
+    event.operation = tm->operation;
+    event.manager = pm_name;
+    event.command = line;
+    event.dry_run = tm->dry_run;
+    tm_event(tm, &event);
+    if (tm->dry_run) {
+        free(exec_args);
+        return TRIMORPH_OK;
+    }
+
+    char root_var[MAX_PATH + 8];
+    char** envp = root_env ? root_environment(tm->root, root_var, sizeof(root_var)) : NULL;
+    if (root_env && envp == NULL) {
+        free(exec_args);
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Memory allocation failed");
+        return TRIMORPH_ERR_SYSTEM;
+    }
+
+    double start = now_seconds();
+    int exit_code;
+    status = spawn(tm, pm_name, exec_args, envp, progress, &exit_code);
+    double elapsed = now_seconds() - start;
+    free(envp);
+    free(exec_args);
+    if (status != TRIMORPH_OK) {
+        return status;
+    }
+
+    event.type = TRIMORPH_EVENT_COMMAND_DONE;
+    event.exit_code = exit_code;
+    event.seconds = elapsed;
+    tm_event(tm, &event);
+    tm->result->runtime_seconds += elapsed;
+    tm->result->exit_code = exit_code;
+
+    // Check if command failed and provide specific error information
+    if (exit_code < 0) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Command terminated abnormally");
+        return TRIMORPH_ERR_FAILED;
+    }
+    if (exit_code != 0) {
+        tm_message(tm, TRIMORPH_MSG_ERROR, "Command failed with exit code %d", exit_code);
+        tm_message(tm, TRIMORPH_MSG_TIP, "Make sure no other package managers are running, then try again");
+        return TRIMORPH_ERR_FAILED;
+    }
+    return TRIMORPH_OK;
+}
+
+int trimorph_run(trimorph_t* tm, const char* manager, int argc, char* const argv[], trimorph_result_t* result) {
+    trimorph_result_t local;
+    begin_operation(tm, "run", result != NULL ? result : &local);
+    return end_operation(tm, run_manager(tm, manager, argc, argv));
+}
@@ -0,0 +1,146 @@
+/*
+ * libtrimorph - the package management core of Trimorph as a reentrant library
+ *
+ * All state lives in a trimorph_t context: the target root, options, the package list
+ * refreshes already done and the command availability cache. Contexts share nothing,
+ * so any number of threads can each drive their own context concurrently. A single
+ * context must not be used by two threads at once, except for
+ * trimorph_command_available() and trimorph_root_command(), which may be called from
+ * worker threads while the owner is idle.
+ *
+ * The library prints no messages of its own: messages and progress events are passed
+ * to callbacks, and results are returned as error codes and a trimorph_result_t. With
+ * an output callback the package managers' stdout and stderr are captured and passed
+ * to it, and the caller's stdout is left alone. Without one the package managers
+ * inherit the caller's descriptors: the library fflush()es stdout before each spawn to
+ * keep the caller's buffered output in order, and with TRIMORPH_OPT_PROGRESS the
+ * stdout of pacman, dnf and rpm is read through a pipe, parsed and written on to
+ * STDOUT_FILENO as soon as it is read (apt and dpkg report progress on a separate
+ * status descriptor instead).
+ */
+
+#ifndef LIBTRIMORPH_H
+#define LIBTRIMORPH_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Error codes: functions return TRIMORPH_OK or one of these negative values
+#define TRIMORPH_OK 0
+#define TRIMORPH_ERR_INVALID -1         // Invalid argument, path or command name
+#define TRIMORPH_ERR_NOT_FOUND -2       // The package file does not exist
+#define TRIMORPH_ERR_UNSUPPORTED -3     // No known format matches the package file
+#define TRIMORPH_ERR_UNAVAILABLE -4     // The package manager is not installed
+#define TRIMORPH_ERR_CONFLICT -5        // Another package manager is running
+#define TRIMORPH_ERR_FAILED -6          // The package manager failed; see exit_code
+#define TRIMORPH_ERR_SYSTEM -7          // fork, pipe or memory allocation failed
+
+// Options for trimorph_set_option()
+#define TRIMORPH_OPT_DRY_RUN 1          // Report commands as planned instead of running them
+#define TRIMORPH_OPT_LOW_IMPACT 2       // Run package managers in a limited cgroup or at idle priority
+#define TRIMORPH_OPT_SKIP_CONFLICT_CHECK 3  // The caller has already checked for running managers
+#define TRIMORPH_OPT_PROGRESS 4         // Parse package manager status lines into PROGRESS events
+
+// Message levels
+#define TRIMORPH_MSG_ERROR 1
+#define TRIMORPH_MSG_WARNING 2
+#define TRIMORPH_MSG_TIP 3
+#define TRIMORPH_MSG_NOTE 4
+#define TRIMORPH_MSG_INFO 5
+
+// Progress event types
+#define TRIMORPH_EVENT_CONFLICT_CHECK 1 // Checked for running package managers
+#define TRIMORPH_EVENT_REFRESH_SKIPPED 2 // A package list refresh was not run
+#define TRIMORPH_EVENT_COMMAND_START 3  // A package manager command starts (or is planned)
+#define TRIMORPH_EVENT_COMMAND_DONE 4   // A package manager command finished
+#define TRIMORPH_EVENT_PROGRESS 5       // The running package manager reported progress
+
+// Refresh decisions reported in trimorph_result_t
+#define TRIMORPH_REFRESH_NONE 0         // No refresh (run, or no refresh command for the format)
+#define TRIMORPH_REFRESH_RAN 1
+#define TRIMORPH_REFRESH_COALESCED 2    // Already refreshed earlier by this context
+#define TRIMORPH_REFRESH_FAILED 3
+
+typedef struct trimorph trimorph_t;
+
+typedef struct {
+    int type;
+    const char* operation;      // "install" or "run"; NULL for a standalone conflict check
+    const char* format;         // Extension of the package being installed, NULL for run
+    const char* manager;        // Package manager the command runs
+    const char* command;        // Command line, with the root applied
+    const char* reason;         // REFRESH_SKIPPED: "coalesced" or "unsupported"
+    int refresh;                // The command refreshes package lists
+    int conflict;               // CONFLICT_CHECK: a package manager is running or holds a lock
+    int dry_run;                // COMMAND_START: planned only; no COMMAND_DONE follows
+    int exit_code;              // COMMAND_DONE: exit code, -1 if terminated abnormally
+    double seconds;             // CONFLICT_CHECK and COMMAND_DONE: time taken
+    const char* phase;          // PROGRESS: "download", "unpack", "configure", "install", ...
+    const char* package;        // PROGRESS: package or file the phase is working on, or NULL
+    double percent;             // PROGRESS: as reported by the manager, -1 if unknown
+    long long bytes;            // PROGRESS: size of a finished download, -1 if unknown
+} trimorph_event_t;
+
+typedef struct {
+    int status;                 // TRIMORPH_OK or an error code
+    int exit_code;              // Exit code of the package manager, -1 if it did not exit normally
+    const char* format;         // Extension of the installed package, NULL for run
+    char manager[16];           // Package manager that did the work (refreshes not counted)
+    char command[1024];         // Command line it ran
+    int refresh;                // TRIMORPH_REFRESH_* decision
+    double wait_seconds;        // Checking for other running package managers
+    double refresh_seconds;     // Refreshing package lists
+    double runtime_seconds;     // Running the package manager itself
+    char message[256];          // Last error message, empty on success
+} trimorph_result_t;
+
+// Callbacks; user is the pointer passed when setting them
+typedef void (*trimorph_message_cb)(int level, const char* text, void* user);
+typedef void (*trimorph_event_cb)(const trimorph_event_t* event, void* user);
+typedef void (*trimorph_output_cb)(int stream, const char* data, size_t len, void* user);
+
+// Contexts
+trimorph_t* trimorph_new(void);
+void trimorph_free(trimorph_t* tm);
+int trimorph_set_root(trimorph_t* tm, const char* root);   // NULL or "/" for the host system
+int trimorph_set_option(trimorph_t* tm, int option, int value);
+// Let the next install refresh package lists again; for long-running callers
+void trimorph_forget_refreshes(trimorph_t* tm);
+// Probe commands again, e.g. after an install or removal may have added or removed one
+void trimorph_forget_commands(trimorph_t* tm);
+void trimorph_set_message_callback(trimorph_t* tm, trimorph_message_cb cb, void* user);
+void trimorph_set_event_callback(trimorph_t* tm, trimorph_event_cb cb, void* user);
+// With an output callback the package managers' stdout (stream 1) and stderr (stream 2)
+// are captured and passed to it; without one they inherit the caller's descriptors
+void trimorph_set_output_callback(trimorph_t* tm, trimorph_output_cb cb, void* user);
+const char* trimorph_strerror(int error);
+
+// Formats and validation
+const char* trimorph_detect_format(const char* file);      // Extension, or NULL if unsupported
+const char* trimorph_format_manager(const char* file);     // Package manager family of the format
+const char* trimorph_format_at(size_t index);              // NULL past the last format
+int trimorph_check_path(const char* path, const char** problem);  // problem may be NULL
+int trimorph_check_command_name(const char* name);
+
+// Command resolution and conflict detection
+int trimorph_command_available(trimorph_t* tm, const char* command);
+int trimorph_resolve_install(trimorph_t* tm, const char* file, char* command, size_t len);
+int trimorph_root_command(trimorph_t* tm, const char* command, char* out, size_t len);
+int trimorph_conflict(trimorph_t* tm);                     // 1 if a package manager is running
+const char* trimorph_lock_file(size_t index);              // Lock files relative to a root
+int trimorph_is_manager_process(const char* name);
+
+// Operations; result may be NULL
+int trimorph_install(trimorph_t* tm, const char* file, trimorph_result_t* result);
+// Install several packages of one manager family in a single package manager command
+int trimorph_install_batch(trimorph_t* tm, const char* const files[], int count, trimorph_result_t* result);
+int trimorph_run(trimorph_t* tm, const char* manager, int argc, char* const argv[], trimorph_result_t* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,6 +8,10 @@
 #include <errno.h>
 #include <libgen.h>
 #include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "libtrimorph.h"
 
 // Define maximum path length
 #define MAX_PATH 1024
@@ -501,6 +505,510 @@ int test_check_command() {
     return result == 0; 
 }
 
+int test_root_option() {
+    // Test that a held lock in one image root fails only that root and sets the exit code
+    execute_command("rm -rf /tmp/trimorph_roots && mkdir -p /tmp/trimorph_roots/a/var/lib/pacman /tmp/trimorph_roots/b && "
+                    "touch /tmp/trimorph_roots/a/var/lib/pacman/db.lck");
+    int locked = execute_command("./final-pkgmgr --root /tmp/trimorph_roots/a status | grep -q 'currently running' && "
+                                 "./final-pkgmgr --root /tmp/trimorph_roots/b status | grep -q 'No active'");
+    int summary = execute_command("! ./final-pkgmgr --root /tmp/trimorph_roots/a --root /tmp/trimorph_roots/b run true x "
+                                  "> /tmp/trimorph_roots/out 2>&1 && "
+                                  "grep -q 'a: failed' /tmp/trimorph_roots/out && grep -q 'b: ok' /tmp/trimorph_roots/out");
+    // A root so long that its lock paths do not fit cannot be checked, so it counts as locked
+    int long_root = execute_command("p=/tmp/trimorph_roots\\$(printf '/%0200d' 1 2 3 4)\\$(printf '/%0191d' 5) && mkdir -p \\$p && "
+                                    "./final-pkgmgr --root \\$p status | grep -q 'currently running'");
+    execute_command("rm /tmp/trimorph_roots/a/var/lib/pacman/db.lck");
+    int unlocked = execute_command("./final-pkgmgr --root /tmp/trimorph_roots/a --root /tmp/trimorph_roots/b run true x >/dev/null");
+    execute_command("rm -rf /tmp/trimorph_roots");
+    return locked == 0 && summary == 0 && long_root == 0 && unlocked == 0;
+}
+
+int test_repo_index() {
+    // Test that a re-index reads only the new package and the index lists both
+    execute_command("rm -rf /tmp/trimorph_repo && mkdir -p /tmp/trimorph_repo/pkg /tmp/trimorph_repo/repo && "
+                    "for n in foo bar; do printf 'pkgname = %s\\npkgver = 1-1\\narch = any\\n' "
+                    "\\$n > /tmp/trimorph_repo/pkg/.PKGINFO && tar -C /tmp/trimorph_repo/pkg -czf "
+                    "/tmp/trimorph_repo/\\$n-1-1-any.pkg.tar.gz .PKGINFO; done && "
+                    "mv /tmp/trimorph_repo/foo-1-1-any.pkg.tar.gz /tmp/trimorph_repo/repo/");
+    int first = execute_command("./final-pkgmgr repo index /tmp/trimorph_repo/repo --format arch --name fx | "
+                                "grep -q 'Indexed 1 packages (1 read, 0 from cache'");
+    execute_command("mv /tmp/trimorph_repo/bar-1-1-any.pkg.tar.gz /tmp/trimorph_repo/repo/");
+    int second = execute_command("./final-pkgmgr repo index /tmp/trimorph_repo/repo --format arch --name fx | "
+                                 "grep -q 'Indexed 2 packages (1 read, 1 from cache, 0 failed)' && "
+                                 "tar tzf /tmp/trimorph_repo/repo/fx.db.tar.gz | grep -q foo-1-1/desc && "
+                                 "tar tzf /tmp/trimorph_repo/repo/fx.db.tar.gz | grep -q bar-1-1/desc");
+    execute_command("rm -rf /tmp/trimorph_repo");
+    return first == 0 && second == 0;
+}
+
+int test_delta_round_trip() {
+    // Test that a delta rebuilds the new package with the same SHA-256
+    execute_command("rm -rf /tmp/trimorph_delta && mkdir -p /tmp/trimorph_delta/p/usr/bin && cd /tmp/trimorph_delta && "
+                    "head -c 200000 /dev/urandom > p/usr/bin/demo && printf 'pkgname = demo\\npkgver = 1-1\\n' > p/.PKGINFO && "
+                    "tar -C p -czf demo-1-1-any.pkg.tar.gz .PKGINFO usr && head -c 1000 /dev/urandom >> p/usr/bin/demo && "
+                    "printf 'pkgname = demo\\npkgver = 2-1\\n' > p/.PKGINFO && tar -C p -czf demo-2-1-any.pkg.tar.gz .PKGINFO usr");
+    int result = execute_command("cd /tmp/trimorph_delta && "
+                                 "\\$OLDPWD/final-pkgmgr delta make demo-1-1-any.pkg.tar.gz demo-2-1-any.pkg.tar.gz >/dev/null && "
+                                 "\\$OLDPWD/final-pkgmgr delta apply demo-1-1-any.pkg.tar.gz demo-2-1-any.pkg.tar.gz.tmdelta "
+                                 "-o out.pkg.tar.gz >/dev/null && "
+                                 "sha256sum demo-2-1-any.pkg.tar.gz | sed s/demo-2-1-any/out/ | sha256sum -c --quiet");
+    execute_command("rm -rf /tmp/trimorph_delta");
+    return result == 0;
+}
+
+int test_delta_header_names() {
+    // Test that delta headers naming paths or unknown compressor levels are rejected
+    const char* header = "printf 'TRIMORPH-DELTA 1\\nbase demo-1-1-any.pkg.tar.gz\\ntarget %s\\n"
+                         "base-sha256 0\\ntarget-sha256 %064d\\n%b\\n' ";
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd), "rm -rf /tmp/trimorph_delta_hdr && mkdir /tmp/trimorph_delta_hdr && cd /tmp/trimorph_delta_hdr && "
+             "printf base > demo-1-1-any.pkg.tar.gz && %s ../evil.pkg.tar.gz 0 '' | gzip > escape.tmdelta && "
+             "%s x.pkg.tar.gz 0 'compressor gzip\\nlevel -c -9;id' | gzip > level.tmdelta && "
+             "%s x.pkg.tar.gz 0 '' | gzip > plain.tmdelta", header, header, header);
+    execute_command(cmd);
+    int escape = execute_command("cd /tmp/trimorph_delta_hdr && \\$OLDPWD/final-pkgmgr delta apply demo-1-1-any.pkg.tar.gz "
+                                 "escape.tmdelta 2>&1 | grep -q 'Not a valid trimorph delta'");
+    int level = execute_command("cd /tmp/trimorph_delta_hdr && \\$OLDPWD/final-pkgmgr delta apply demo-1-1-any.pkg.tar.gz "
+                                "level.tmdelta 2>&1 | grep -q 'Not a valid trimorph delta'");
+    int plain = execute_command("cd /tmp/trimorph_delta_hdr && \\$OLDPWD/final-pkgmgr delta apply demo-1-1-any.pkg.tar.gz "
+                                "plain.tmdelta 2>&1 | grep -q 'not the base package'");
+    execute_command("rm -rf /tmp/trimorph_delta_hdr");
+    return escape == 0 && level == 0 && plain == 0;
+}
+
+int test_install_url() {
+    // Test that an unreachable package URL fails cleanly instead of crashing
+    int result = execute_command("./final-pkgmgr install http://127.0.0.1:9/missing.deb 2>/dev/null || true");
+    return result == 0;
+}
+
+// Local HTTP stand-in for the fetch tests: serves a directory with Range support,
+// logs each request's Range header and writes its ephemeral port to a file
+static const char* http_server_script =
+    "import http.server, os, sys\n"
+    "class H(http.server.BaseHTTPRequestHandler):\n"
+    "    def do_GET(self):\n"
+    "        path = os.path.join(sys.argv[1], os.path.basename(self.path))\n"
+    "        rng = self.headers.get('Range')\n"
+    "        with open(sys.argv[3], 'a') as log:\n"
+    "            log.write('%s %s\\n' % (os.path.basename(self.path), rng))\n"
+    "        if not os.path.isfile(path):\n"
+    "            self.send_error(404)\n"
+    "            return\n"
+    "        data = open(path, 'rb').read()\n"
+    "        start = int(rng[6:].split('-')[0]) if rng and rng.startswith('bytes=') else 0\n"
+    "        self.send_response(206 if start else 200)\n"
+    "        if start:\n"
+    "            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, len(data) - 1, len(data)))\n"
+    "        self.send_header('Content-Length', str(len(data) - start))\n"
+    "        self.end_headers()\n"
+    "        self.wfile.write(data[start:])\n"
+    "    def log_message(self, *args):\n"
+    "        pass\n"
+    "server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), H)\n"
+    "open(sys.argv[2] + '.tmp', 'w').write(str(server.server_port))\n"
+    "os.rename(sys.argv[2] + '.tmp', sys.argv[2])\n"
+    "server.serve_forever()\n";
+
+int test_fetch_packages() {
+    // Test parallel downloads, resuming a partial download, rejecting a bad checksum or two
+    // URLs with one file name, reusing a verified download over a stale partial one, and
+    // falling back to curl's exit status when it cannot report one per transfer
+    if (!is_cmd_available("python3") || !is_cmd_available("curl")) {
+        return 1;  // No stand-in server or no downloader on this machine
+    }
+    execute_command("rm -rf /tmp/trimorph_fetch && mkdir -p /tmp/trimorph_fetch/srv /tmp/trimorph_fetch/dl && "
+                    "head -c 300000 /dev/urandom > /tmp/trimorph_fetch/srv/a-1-1-any.pkg.tar.gz && "
+                    "head -c 300000 /dev/urandom > /tmp/trimorph_fetch/srv/b-1-1-any.pkg.tar.gz && "
+                    "head -c 100000 /tmp/trimorph_fetch/srv/b-1-1-any.pkg.tar.gz > /tmp/trimorph_fetch/dl/b-1-1-any.pkg.tar.gz.part");
+    FILE* script = fopen("/tmp/trimorph_fetch/server.py", "w");
+    if (script == NULL) {
+        return 0;
+    }
+    fputs(http_server_script, script);
+    fclose(script);
+    pid_t server = fork();
+    if (server == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execlp("python3", "python3", "/tmp/trimorph_fetch/server.py", "/tmp/trimorph_fetch/srv",
+               "/tmp/trimorph_fetch/port", "/tmp/trimorph_fetch/requests", (char*)NULL);
+        _exit(127);
+    }
+    int port = 0;
+    for (int i = 0; server > 0 && port == 0 && i < 100; i++) {
+        FILE* f = fopen("/tmp/trimorph_fetch/port", "r");
+        if (f == NULL || fscanf(f, "%d", &port) != 1) {
+            usleep(50000);
+        }
+        if (f != NULL) fclose(f);
+    }
+
+    // The payloads are not archives, so nothing is installed once they are downloaded
+    char cmd[MAX_PATH];
+    snprintf(cmd, sizeof(cmd), "TRIMORPH_DOWNLOAD_DIR=/tmp/trimorph_fetch/dl ./final-pkgmgr install "
+             "http://127.0.0.1:%d/a-1-1-any.pkg.tar.gz http://127.0.0.1:%d/b-1-1-any.pkg.tar.gz >/dev/null 2>&1; "
+             "cmp -s /tmp/trimorph_fetch/srv/a-1-1-any.pkg.tar.gz /tmp/trimorph_fetch/dl/a-1-1-any.pkg.tar.gz && "
+             "cmp -s /tmp/trimorph_fetch/srv/b-1-1-any.pkg.tar.gz /tmp/trimorph_fetch/dl/b-1-1-any.pkg.tar.gz && "
+             "grep -q '^b-1-1-any.pkg.tar.gz bytes=100000-' /tmp/trimorph_fetch/requests", port, port);
+    int downloaded = port != 0 ? execute_command(cmd) : -1;
+    snprintf(cmd, sizeof(cmd), "TRIMORPH_DOWNLOAD_DIR=/tmp/trimorph_fetch/dl ./final-pkgmgr install "
+             "'http://127.0.0.1:%d/c-1-1-any.pkg.tar.gz#sha256=%064d' 2>&1 | grep -q 'Checksum mismatch' && "
+             "test ! -e /tmp/trimorph_fetch/dl/c-1-1-any.pkg.tar.gz", port, 0);
+    execute_command("cp /tmp/trimorph_fetch/srv/a-1-1-any.pkg.tar.gz /tmp/trimorph_fetch/srv/c-1-1-any.pkg.tar.gz");
+    int rejected = port != 0 ? execute_command(cmd) : -1;
+    snprintf(cmd, sizeof(cmd), "TRIMORPH_DOWNLOAD_DIR=/tmp/trimorph_fetch/dl ./final-pkgmgr install "
+             "http://127.0.0.1:%d/a-1-1-any.pkg.tar.gz http://127.0.0.1:%d/mirror/a-1-1-any.pkg.tar.gz 2>&1 | "
+             "grep -q 'download to the same file name'", port, port);
+    int duplicate = port != 0 ? execute_command(cmd) : -1;
+    snprintf(cmd, sizeof(cmd), "echo stale > /tmp/trimorph_fetch/dl/a-1-1-any.pkg.tar.gz.part && "
+             "s=\\$(sha256sum /tmp/trimorph_fetch/dl/a-1-1-any.pkg.tar.gz | cut -c1-64) && "
+             "r=\\$(TRIMORPH_DOWNLOAD_DIR=/tmp/trimorph_fetch/dl ./final-pkgmgr install "
+             "http://127.0.0.1:%d/a-1-1-any.pkg.tar.gz#sha256=\\$s 2>&1); "
+             "echo \\$r | grep -q 'Using cached' && ! echo \\$r | grep -q 'Checksum mismatch' && "
+             "test ! -e /tmp/trimorph_fetch/dl/a-1-1-any.pkg.tar.gz.part", port);
+    int cached = port != 0 ? execute_command(cmd) : -1;
+
+    // A curl too old for %{exitcode} fetches one URL per process and reports its exit status
+    script = fopen("/tmp/trimorph_fetch/curl", "w");
+    if (script != NULL) {
+        fputs("#!/bin/sh\n[ \"$1\" = --version ] && { echo 'curl 7.68.0 (x86_64-pc-linux-gnu)'; exit 0; }\n"
+              "PATH=${PATH#*:} exec curl \"$@\"\n", script);
+        fclose(script);
+    }
+    snprintf(cmd, sizeof(cmd), "mkdir -p /tmp/trimorph_fetch/bin && mv /tmp/trimorph_fetch/curl /tmp/trimorph_fetch/bin && "
+             "chmod +x /tmp/trimorph_fetch/bin/curl && rm -f /tmp/trimorph_fetch/dl/a-1-1-any.pkg.tar.gz && "
+             "r=\\$(PATH=/tmp/trimorph_fetch/bin:\\$PATH TRIMORPH_DOWNLOAD_DIR=/tmp/trimorph_fetch/dl ./final-pkgmgr install "
+             "http://127.0.0.1:%d/a-1-1-any.pkg.tar.gz http://127.0.0.1:%d/d-1-1-any.pkg.tar.gz 2>&1); "
+             "echo \\$r | grep -q 'd-1-1-any.pkg.tar.gz (curl exit code 22)' && "
+             "cmp -s /tmp/trimorph_fetch/srv/a-1-1-any.pkg.tar.gz /tmp/trimorph_fetch/dl/a-1-1-any.pkg.tar.gz",
+             port, port);
+    int old_curl = port != 0 ? execute_command(cmd) : -1;
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    execute_command("rm -rf /tmp/trimorph_fetch");
+    return downloaded == 0 && rejected == 0 && duplicate == 0 && cached == 0 && old_curl == 0;
+}
+
+int test_archive_check() {
+    // Test that an intact zstd archive passes and a truncated copy of it is flagged as damaged
+    execute_command("rm -rf /tmp/trimorph_test_archive && mkdir /tmp/trimorph_test_archive && "
+                    "seq 1 20000 > /tmp/trimorph_test_archive/data && "
+                    "tar -C /tmp/trimorph_test_archive -cf - data | zstd -q > /tmp/trimorph_test_good.pkg.tar.zst && "
+                    "head -c 1000 /tmp/trimorph_test_good.pkg.tar.zst > /tmp/trimorph_test_bad.pkg.tar.zst");
+    int good = execute_command("./final-pkgmgr test-archive /tmp/trimorph_test_good.pkg.tar.zst 2>&1 | grep -q '1 ok, 0 damaged'");
+    int bad = execute_command("! ./final-pkgmgr test-archive /tmp/trimorph_test_bad.pkg.tar.zst > /tmp/trimorph_test_archive/out 2>&1 && "
+                              "grep -q 'Damaged zstd payload' /tmp/trimorph_test_archive/out && "
+                              "grep -q '0 ok, 1 damaged' /tmp/trimorph_test_archive/out");
+    execute_command("rm -rf /tmp/trimorph_test_archive /tmp/trimorph_test_good.pkg.tar.zst /tmp/trimorph_test_bad.pkg.tar.zst");
+    return good == 0 && bad == 0;
+}
+
+int test_cache_gc() {
+    // Test that with three cached versions and --keep 2 only the oldest is removed, and
+    // that a dry run removes nothing
+    const char* archives = "/tmp/trimorph_test_gc/var/cache/apt/archives";
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf /tmp/trimorph_test_gc && mkdir -p %s /tmp/trimorph_test_gc/var/lib/dpkg && "
+             ": > /tmp/trimorph_test_gc/var/lib/dpkg/status && for v in 1 2 3; do "
+             "echo \\$v > %s/foo_1.\\${v}_amd64.deb && touch -d 2024-01-0\\$v %s/foo_1.\\${v}_amd64.deb; done",
+             archives, archives, archives);
+    execute_command(cmd);
+    int planned = execute_command("./final-pkgmgr --root /tmp/trimorph_test_gc cache gc --keep 2 --dry-run 2>&1 | "
+                                  "grep -q 'Would remove .*foo_1.1_amd64.deb'");
+    int untouched = access("/tmp/trimorph_test_gc/var/cache/apt/archives/foo_1.1_amd64.deb", F_OK);
+    int gc = execute_command("./final-pkgmgr --root /tmp/trimorph_test_gc cache gc --keep 2 >/dev/null 2>&1");
+    int removed = access("/tmp/trimorph_test_gc/var/cache/apt/archives/foo_1.1_amd64.deb", F_OK) != 0;
+    int kept = access("/tmp/trimorph_test_gc/var/cache/apt/archives/foo_1.2_amd64.deb", F_OK) == 0 &&
+               access("/tmp/trimorph_test_gc/var/cache/apt/archives/foo_1.3_amd64.deb", F_OK) == 0;
+    execute_command("rm -rf /tmp/trimorph_test_gc");
+    return planned == 0 && untouched == 0 && gc == 0 && removed && kept;
+}
+
+int test_history() {
+    // Test that the history ring wraps: with the sequence counter moved up to the last slot,
+    // the next appends overwrite the oldest record and are listed in order
+    execute_command("rm -f /tmp/trimorph_test_history");
+    execute_command("TRIMORPH_HISTORY_FILE=/tmp/trimorph_test_history ./final-pkgmgr run echo first >/dev/null 2>&1");
+    execute_command("printf '\\377\\017\\0\\0\\0\\0\\0\\0' | dd of=/tmp/trimorph_test_history bs=1 seek=16 conv=notrunc status=none");
+    execute_command("for w in second third fourth; do TRIMORPH_HISTORY_FILE=/tmp/trimorph_test_history ./final-pkgmgr run echo \\$w; done >/dev/null 2>&1");
+    execute_command("TRIMORPH_HISTORY_FILE=/tmp/trimorph_test_history ./final-pkgmgr run sh -c false >/dev/null 2>&1");
+    int wrapped = execute_command("TRIMORPH_HISTORY_FILE=/tmp/trimorph_test_history ./final-pkgmgr history --manager echo | "
+                                  "grep -o 'echo [a-z]*\\$' | paste -sd, - | grep -qx 'echo second,echo third,echo fourth'");
+    int failed = execute_command("TRIMORPH_HISTORY_FILE=/tmp/trimorph_test_history ./final-pkgmgr history --outcome failed | "
+                                 "grep -q '1 of 4 recorded operations shown'");
+    unlink("/tmp/trimorph_test_history");
+    return wrapped == 0 && failed == 0;
+}
+
+int test_metrics_labels() {
+    // Test that unknown subcommands are counted as "other" instead of echoed into labels
+    execute_command("rm -f /tmp/trimorph_test.prom");
+    execute_command("./final-pkgmgr --metrics-file /tmp/trimorph_test.prom 'bo\\gus' >/dev/null 2>&1 || true");
+    execute_command("./final-pkgmgr --metrics-file /tmp/trimorph_test.prom supported-formats >/dev/null 2>&1");
+    int result = execute_command("grep -q 'subcommand=.other.,format=.none.} 1' /tmp/trimorph_test.prom && "
+                                 "grep -q 'subcommand=.supported-formats.' /tmp/trimorph_test.prom && "
+                                 "! grep -q bo /tmp/trimorph_test.prom");
+    unlink("/tmp/trimorph_test.prom");
+    return result == 0;
+}
+
+int test_dry_run() {
+    // Test that a dry run plans a command without executing it, and estimates its
+    // duration from the runs recorded in the history ring
+    unlink("/tmp/trimorph_dry_run");
+    int planned = execute_command("./final-pkgmgr --dry-run run touch /tmp/trimorph_dry_run > /tmp/trimorph_test_plan 2>&1 && "
+                                  "grep -q 'Would run: touch /tmp/trimorph_dry_run' /tmp/trimorph_test_plan && "
+                                  "grep -q '^Plan: 1 step, estimated [0-9.]*s' /tmp/trimorph_test_plan");
+    int not_run = access("/tmp/trimorph_dry_run", F_OK) != 0;
+    int estimated = execute_command("rm -f /tmp/trimorph_test_history && export TRIMORPH_HISTORY_FILE=/tmp/trimorph_test_history && "
+                                    "for i in 1 2 3; do ./final-pkgmgr run echo x >/dev/null 2>&1 || exit 1; done && "
+                                    "./final-pkgmgr --dry-run run echo x > /tmp/trimorph_test_plan 2>&1 && "
+                                    "grep -q 'Estimated [0-9.]*s (median of 3 past runs)' /tmp/trimorph_test_plan && "
+                                    "grep -q '^Plan: 1 step, estimated [0-9.]*s\\$' /tmp/trimorph_test_plan");
+    unlink("/tmp/trimorph_test_plan");
+    unlink("/tmp/trimorph_test_history");
+    unlink("/tmp/trimorph_dry_run");
+    return planned == 0 && not_run && estimated == 0;
+}
+
+int test_batch_mode() {
+    // Test that a failing step stops the batch with a nonzero exit unless --keep-going is given
+    int ok = execute_command("printf 'check sh\\nsupported-formats\\n' | ./final-pkgmgr batch - >/dev/null 2>&1");
+    int stopped = execute_command("! printf 'run sh -c exit\\\\ 3\\nrun echo later\\n' | ./final-pkgmgr batch - > /tmp/trimorph_test_batch 2>&1 && "
+                                  "grep -q '1 failed, 1 skipped' /tmp/trimorph_test_batch && ! grep -q '^later' /tmp/trimorph_test_batch");
+    int kept = execute_command("! printf 'run sh -c exit\\\\ 3\\nrun echo later\\n' | ./final-pkgmgr batch --keep-going - > /tmp/trimorph_test_batch 2>&1 && "
+                               "grep -q '1 ok, 1 failed, 0 skipped' /tmp/trimorph_test_batch && grep -q '^later' /tmp/trimorph_test_batch");
+    unlink("/tmp/trimorph_test_batch");
+    return ok == 0 && stopped == 0 && kept == 0;
+}
+
+int test_batch_command_cache() {
+    // Test that a tool installed by one batch step is found by the next
+    execute_command("rm -rf /tmp/trimorph_test_bin && mkdir /tmp/trimorph_test_bin");
+    FILE* f = fopen("/tmp/trimorph_test_batch_script", "w");
+    if (f == NULL) {
+        return 0;
+    }
+    fprintf(f, "run trimorph_test_tool go\n");
+    fprintf(f, "run sh -c 'printf \"#!/bin/sh\\necho made\\n\" > /tmp/trimorph_test_bin/trimorph_test_tool'\n");
+    fprintf(f, "run chmod +x /tmp/trimorph_test_bin/trimorph_test_tool\n");
+    fprintf(f, "run trimorph_test_tool go\n");
+    fclose(f);
+    int result = execute_command("PATH=/tmp/trimorph_test_bin:\\$PATH ./final-pkgmgr batch --keep-going /tmp/trimorph_test_batch_script 2>&1 | "
+                                 "grep -q '3 ok, 1 failed'");
+    execute_command("rm -rf /tmp/trimorph_test_bin /tmp/trimorph_test_batch_script");
+    return result == 0;
+}
+
+int test_watch_drop_dir() {
+    // Test that a missing drop directory is an error, that damaged packages present at
+    // startup, dropped later or beyond one full batch all land in failed/, and that a batch held back by a
+    // package manager lock is retried at most once a second even with no debounce
+    int missing = execute_command("! ./final-pkgmgr watch /tmp/trimorph_missing_drop_dir >/dev/null 2>&1");
+    execute_command("rm -rf /tmp/trimorph_test_drop /tmp/trimorph_test_drop_root && "
+                    "mkdir -p /tmp/trimorph_test_drop /tmp/trimorph_test_drop_root/var/lib/pacman && "
+                    "printf '\\050\\265\\057\\375\\044' > /tmp/trimorph_test_drop/old.pkg.tar.zst");
+    execute_command("(timeout 3 ./final-pkgmgr --root /tmp/trimorph_test_drop_root watch --debounce 0.2 /tmp/trimorph_test_drop "
+                    ">/dev/null 2>&1 &); sleep 1; "
+                    "printf '\\050\\265\\057\\375\\044' > /tmp/trimorph_test_drop/new.pkg.tar.zst; sleep 3");
+    execute_command("for i in \\$(seq 300); do cp /tmp/trimorph_test_drop/failed/old.pkg.tar.zst /tmp/trimorph_test_drop/many\\$i.pkg.tar.zst; done && "
+                    "timeout 3 ./final-pkgmgr --root /tmp/trimorph_test_drop_root watch --debounce 0.2 /tmp/trimorph_test_drop >/dev/null 2>&1");
+    int failed = access("/tmp/trimorph_test_drop/failed/many300.pkg.tar.zst", F_OK) == 0 &&
+                 execute_command("ls /tmp/trimorph_test_drop/failed | grep -c many | grep -qx 300") == 0 &&
+                 access("/tmp/trimorph_test_drop/failed/old.pkg.tar.zst", F_OK) == 0 &&
+                 access("/tmp/trimorph_test_drop/failed/new.pkg.tar.zst", F_OK) == 0 &&
+                 access("/tmp/trimorph_test_drop/new.pkg.tar.zst", F_OK) != 0;
+    execute_command("touch /tmp/trimorph_test_drop_root/var/lib/pacman/db.lck && "
+                    "printf '\\050\\265\\057\\375\\044' > /tmp/trimorph_test_drop/held.pkg.tar.zst");
+    int retried = execute_command("timeout 2.5 ./final-pkgmgr --root /tmp/trimorph_test_drop_root watch --debounce 0 /tmp/trimorph_test_drop "
+                                  "2>&1 | grep -c retrying | grep -qx '[1-3]'");
+    int held = access("/tmp/trimorph_test_drop/held.pkg.tar.zst", F_OK) == 0;
+    execute_command("rm -rf /tmp/trimorph_test_drop /tmp/trimorph_test_drop_root");
+    return missing == 0 && failed && retried == 0 && held;
+}
+
+int test_owns() {
+    // Test ownership queries against dpkg file lists in a fixture root, from arguments and
+    // stdin, and that a package added later is found once the index is rebuilt
+    execute_command("rm -rf /tmp/trimorph_test_owns && mkdir -p /tmp/trimorph_test_owns/var/lib/dpkg/info && "
+                    "printf '/.\\n/usr\\n/usr/bin\\n/usr/bin/foo\\n' > /tmp/trimorph_test_owns/var/lib/dpkg/info/foo.list && "
+                    "printf '/usr/bin\\n/usr/bin/bar\\n' > /tmp/trimorph_test_owns/var/lib/dpkg/info/bar:amd64.list");
+    int found = execute_command("./final-pkgmgr --root /tmp/trimorph_test_owns owns /usr/bin/foo /usr/bin > /tmp/trimorph_test_owns/out && "
+                                "grep -qx 'foo: /usr/bin/foo' /tmp/trimorph_test_owns/out && "
+                                "grep -qx 'bar:amd64, foo: /usr/bin' /tmp/trimorph_test_owns/out");
+    int unowned = execute_command("printf '/usr/bin/bar\\n/nonexistent\\n' | ./final-pkgmgr --root /tmp/trimorph_test_owns owns - "
+                                  "> /tmp/trimorph_test_owns/out 2>/dev/null; test \\$? = 1 && "
+                                  "grep -qx 'bar:amd64: /usr/bin/bar' /tmp/trimorph_test_owns/out");
+    execute_command("sleep 1 && printf '/usr/bin/baz\\n' > /tmp/trimorph_test_owns/var/lib/dpkg/info/baz.list");
+    int rebuilt = execute_command("./final-pkgmgr --root /tmp/trimorph_test_owns owns /usr/bin/baz | grep -qx 'baz: /usr/bin/baz'");
+    execute_command("rm -rf /tmp/trimorph_test_owns");
+    return found == 0 && unowned == 0 && rebuilt == 0;
+}
+
+int test_search() {
+    // Test that search finds a package in fixture apt metadata
+    execute_command("mkdir -p /tmp/trimorph_search_root/var/lib/apt/lists /tmp/trimorph_search_root/var/lib/trimorph && "
+                    "printf 'Package: trimorph-demo\\nVersion: 1.0\\nDescription: fixture package\\n\\n' "
+                    "> /tmp/trimorph_search_root/var/lib/apt/lists/fixture_Packages");
+    int result = execute_command("./final-pkgmgr --root /tmp/trimorph_search_root search fixture 2>/dev/null | grep -q trimorph-demo");
+    execute_command("rm -rf /tmp/trimorph_search_root");
+    return result == 0;
+}
+
+int test_outdated() {
+    // Test that an installed dpkg version older than the fixture apt metadata is reported
+    execute_command("mkdir -p /tmp/trimorph_outdated_root/var/lib/apt/lists /tmp/trimorph_outdated_root/var/lib/dpkg && "
+                    "printf 'Package: demo\\nVersion: 1.0~rc1-1\\n\\n' > /tmp/trimorph_outdated_root/var/lib/apt/lists/fixture_Packages && "
+                    "printf 'Package: demo\\nStatus: install ok installed\\nVersion: 0.9-1\\n' > /tmp/trimorph_outdated_root/var/lib/dpkg/status");
+    int result = execute_command("./final-pkgmgr --root /tmp/trimorph_outdated_root outdated 2>/dev/null | grep -q 'available.:.1.0~rc1-1'");
+    execute_command("rm -rf /tmp/trimorph_outdated_root");
+    return result == 0;
+}
+
+int test_space_preflight() {
+    // Test that a plan reports the disk space a package needs per filesystem
+    execute_command("mkdir -p /tmp/trimorph_space/pkg/usr/bin /tmp/trimorph_space/root && "
+                    "head -c 100000 /dev/zero > /tmp/trimorph_space/pkg/usr/bin/demo && "
+                    "tar -C /tmp/trimorph_space/pkg -czf /tmp/trimorph_space/demo-1-1-any.pkg.tar.gz usr");
+    int result = execute_command("./final-pkgmgr --root /tmp/trimorph_space/root --dry-run install "
+                                 "/tmp/trimorph_space/demo-1-1-any.pkg.tar.gz 2>/dev/null | grep -q 'Disk space: .* needs'");
+    execute_command("rm -rf /tmp/trimorph_space");
+    return result == 0;
+}
+
+int test_group_commit_window() {
+    // Test that the group commit window is validated before anything is installed
+    int zero = execute_command("./final-pkgmgr --group-commit 0 install /tmp/none.deb 2>&1 | "
+                               "grep -q 'group-commit must be a window'");
+    int large = execute_command("./final-pkgmgr --group-commit 60001 install /tmp/none.deb 2>&1 | "
+                                "grep -q 'group-commit must be a window'");
+    return zero == 0 && large == 0;
+}
+
+int test_group_commit_merge() {
+    // Test that two installs started together are planned as one transaction by the first,
+    // and that an install made with other options is left to lead its own group
+    execute_command("rm -rf /tmp/trimorph_test_group && mkdir -p /tmp/trimorph_test_group/spool && "
+                    "echo a > /tmp/trimorph_test_group/a.deb && echo b > /tmp/trimorph_test_group/b.deb");
+    const char* run = "export TRIMORPH_SPOOL_DIR=/tmp/trimorph_test_group/spool; "
+                      "./final-pkgmgr --group-commit 500 --dry-run install /tmp/trimorph_test_group/a.deb "
+                      "> /tmp/trimorph_test_group/lead 2>&1 & sleep 0.2; "
+                      "./final-pkgmgr --group-commit 500 --dry-run %s install /tmp/trimorph_test_group/b.deb "
+                      "> /tmp/trimorph_test_group/follow 2>&1; wait";
+    char cmd[640];
+    snprintf(cmd, sizeof(cmd), run, "");
+    execute_command(cmd);
+    int merged = execute_command("grep -q 'Group commit: 2 requests, 2 packages in 1 transaction' /tmp/trimorph_test_group/lead && "
+                                 "grep -q 'Would run: .*a.deb.*b.deb' /tmp/trimorph_test_group/lead && "
+                                 "grep -q 'Group commit: queued 1 package' /tmp/trimorph_test_group/follow");
+    snprintf(cmd, sizeof(cmd), run, "--low-impact");
+    execute_command(cmd);
+    int refused = execute_command("grep -q 'not merging request' /tmp/trimorph_test_group/lead && "
+                                  "grep -q 'Group commit: 1 request, 1 package' /tmp/trimorph_test_group/lead && "
+                                  "grep -q 'Would run: .*b.deb' /tmp/trimorph_test_group/follow");
+    execute_command("rm -rf /tmp/trimorph_test_group");
+    return merged == 0 && refused == 0;
+}
+
+int test_scan_bench() {
+    // Test that the scan benchmark hashes a tree with the pread backend and reports it
+    execute_command("mkdir -p /tmp/trimorph_scan/sub && printf abc > /tmp/trimorph_scan/a && "
+                    "head -c 300000 /dev/zero > /tmp/trimorph_scan/sub/b");
+    int result = execute_command("./final-pkgmgr scan-bench --depth 2 /tmp/trimorph_scan 2>/dev/null | "
+                                 "grep -q 'pread .*MiB/s'");
+    execute_command("rm -rf /tmp/trimorph_scan");
+    return result == 0;
+}
+
+int test_events_fd() {
+    // Test that a run reports start and finish events as JSON lines on the events descriptor
+    int result = execute_command("./final-pkgmgr --events-fd 3 run true x 3>&1 >/dev/null 2>&1 | "
+                                 "grep -q 'event.:.finish.*exit_code.:0'");
+    // Events on stdout must leave the package manager's stdout usable
+    int shared = execute_command("./final-pkgmgr --events-fd 1 run echo trimorph-events > /tmp/trimorph_test_events 2>&1 && "
+                                 "grep -qx trimorph-events /tmp/trimorph_test_events && "
+                                 "grep -q 'event.:.finish.*exit_code.:0' /tmp/trimorph_test_events");
+    unlink("/tmp/trimorph_test_events");
+    return result == 0 && shared == 0;
+}
+
+// One thread's view of its own library context
+typedef struct {
+    const char* word;       // What its package manager command prints
+    char output[256];       // What the output callback received
+    size_t output_len;
+    int events;
+    int errors;
+} library_thread_t;
+
+static void library_output(int stream, const char* data, size_t len, void* user) {
+    library_thread_t* t = user;
+    if (stream == 1 && t->output_len + len < sizeof(t->output)) {
+        memcpy(t->output + t->output_len, data, len);
+        t->output_len += len;
+    }
+}
+
+static void library_event(const trimorph_event_t* event, void* user) {
+    library_thread_t* t = user;
+    if (event->type == TRIMORPH_EVENT_COMMAND_DONE && event->exit_code == 0) {
+        t->events++;
+    }
+}
+
+static void* library_thread(void* arg) {
+    library_thread_t* t = arg;
+    trimorph_t* tm = trimorph_new();
+    if (tm == NULL) {
+        t->errors++;
+        return NULL;
+    }
+    trimorph_set_option(tm, TRIMORPH_OPT_SKIP_CONFLICT_CHECK, 1);
+    trimorph_set_output_callback(tm, library_output, t);
+    trimorph_set_event_callback(tm, library_event, t);
+    for (int i = 0; i < 2000; i++) {
+        const char* format = trimorph_detect_format(i % 2 ? "/tmp/foo.pkg.tar.zst" : "/tmp/foo.deb");
+        const char* expected = i % 2 ? ".pkg.tar.zst" : ".deb";
+        const char* problem = NULL;
+        if (format == NULL || strcmp(format, expected) != 0 || trimorph_detect_format("/tmp/foo.txt") != NULL ||
+            trimorph_check_path("/tmp/foo.deb", NULL) != TRIMORPH_OK ||
+            trimorph_check_path("/tmp/../etc/foo.deb", &problem) != TRIMORPH_ERR_INVALID || problem == NULL) {
+            t->errors++;
+        }
+    }
+    char* args[] = {(char*)t->word, NULL};
+    for (int i = 0; i < 5; i++) {
+        if (trimorph_run(tm, "echo", 1, args, NULL) != TRIMORPH_OK) {
+            t->errors++;
+        }
+    }
+    trimorph_free(tm);
+    return NULL;
+}
+
+int test_library_contexts() {
+    // Test that two library contexts used on separate threads keep their callbacks apart
+    library_thread_t threads[2] = {{.word = "alpha"}, {.word = "beta"}};
+    pthread_t ids[2];
+    for (int i = 0; i < 2; i++) {
+        if (pthread_create(&ids[i], NULL, library_thread, &threads[i]) != 0) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    return threads[0].errors == 0 && threads[1].errors == 0 &&
+           threads[0].events == 5 && threads[1].events == 5 &&
+           strcmp(threads[0].output, "alpha\nalpha\nalpha\nalpha\nalpha\n") == 0 &&
+           strcmp(threads[1].output, "beta\nbeta\nbeta\nbeta\nbeta\n") == 0;
+}
+
 int test_buffer_overflow_protection() {
     // Test that long paths are handled properly
     char long_path[512];
@@ -546,6 +1054,29 @@ int main(int argc, char *argv[]) {
     run_test("Supported Formats Command", test_supported_formats);
     run_test("Status Command", test_status);
     run_test("Check Command", test_check_command);
+    run_test("Root Option", test_root_option);
+    run_test("Repository Index", test_repo_index);
+    run_test("Delta Round Trip", test_delta_round_trip);
+    run_test("Delta Header Names", test_delta_header_names);
+    run_test("Install From URL", test_install_url);
+    run_test("Fetch Packages", test_fetch_packages);
+    run_test("Archive Check", test_archive_check);
+    run_test("Cache GC", test_cache_gc);
+    run_test("Operation History", test_history);
+    run_test("Metrics Labels", test_metrics_labels);
+    run_test("Dry Run", test_dry_run);
+    run_test("Batch Mode", test_batch_mode);
+    run_test("Batch Command Cache", test_batch_command_cache);
+    run_test("Drop Directory Watch", test_watch_drop_dir);
+    run_test("Package Ownership", test_owns);
+    run_test("Package Search", test_search);
+    run_test("Pending Upgrades", test_outdated);
+    run_test("Disk Space Preflight", test_space_preflight);
+    run_test("Progress Events", test_events_fd);
+    run_test("Group Commit Window", test_group_commit_window);
+    run_test("Group Commit Merge", test_group_commit_merge);
+    run_test("Scan Benchmark", test_scan_bench);
+    run_test("Library Contexts on Threads", test_library_contexts);
     run_test("Buffer Overflow Protection", test_buffer_overflow_protection);
     run_test("Function Signatures", test_function_signatures);
 